@@ -0,0 +1,346 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+/*
+ * Hot backup: a copy of the environment taken while it is being written
+ * to, done the way the Berkeley DB reference guide lays out. First a
+ * checkpoint, so that no page copied is older than it; then the database
+ * files, BACKUP_CHUNK bytes at a time, a multiple of any page size; then
+ * every log file there is by the time those are done. Catastrophic
+ * recovery on the copy (db_recover -c) brings the databases up to the end
+ * of the copied log. A replica started on it catches up from there
+ * through the log, instead of a full internal initialization that has
+ * the master send it every page.
+ *
+ * The copy goes into a directory on this host, or as a tar stream to a
+ * host:port, for "nc -l <port> | tar xf -" in the new site's env home. It
+ * reads no more than job_stats.rate pages a second, see "bdb_job throttle".
+ */
+
+#define BACKUP_CHUNK (64 * 1024)
+
+#define TAR_BLOCK 512
+
+/* a stalled receiver fails the backup after this many seconds */
+#define BACKUP_SEND_TIMEOUT 60
+
+static const char zeros[TAR_BLOCK];
+
+struct backup_out {
+    int sock;          /* the tar stream, or -1 to write into dir */
+    const char *dir;
+    int fd;            /* the file being written into dir */
+    uint64_t begin;    /* when the copy started, for the throttle */
+    uint64_t bytes;    /* read so far */
+};
+
+static int write_all(const int fd, const char *buf, size_t len) {
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* connects to host:port, returns the socket or -1 with errno set */
+static int backup_connect(const char *target) {
+    struct addrinfo hints, *ai, *next;
+    struct timeval tv;
+    char host[BACKUP_TARGET_MAX];
+    char *port;
+    int sfd = -1, error;
+
+    snprintf(host, sizeof(host), "%s", target);
+    if ((port = strrchr(host, ':')) == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    *port++ = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((error = getaddrinfo(host, port, &hints, &ai)) != 0) {
+        errno = (error == EAI_SYSTEM) ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    for (next = ai; next != NULL; next = next->ai_next) {
+        if ((sfd = socket(next->ai_family, next->ai_socktype, next->ai_protocol)) == -1)
+            continue;
+        if (connect(sfd, next->ai_addr, next->ai_addrlen) == 0)
+            break;
+        close(sfd);
+        sfd = -1;
+    }
+    freeaddrinfo(ai);
+    if (sfd != -1) {
+        tv.tv_sec = BACKUP_SEND_TIMEOUT;
+        tv.tv_usec = 0;
+        setsockopt(sfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    return sfd;
+}
+
+/* creates the directories leading up to the file at path */
+static int backup_mkdirs(const char *path) {
+    char dir[PATH_MAX];
+    char *p;
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (mkdir(dir, 0750) != 0 && errno != EEXIST)
+            return errno;
+        *p = '/';
+    }
+    return 0;
+}
+
+/*
+ * Sends the ustar header of a regular file. A name longer than the 100
+ * bytes of its field is split at a '/' into the 155 bytes of prefix.
+ */
+static int tar_header(const int sock, const char *name, const uint64_t size) {
+    char h[TAR_BLOCK];
+    size_t n = strlen(name), split = 0;
+    unsigned int sum = 0;
+    int i;
+
+    if (n > 100) {
+        for (split = n - 1; split > 0 && !(name[split] == '/' && n - split - 1 <= 100); split--)
+            ;
+        if (split == 0 || split > 155)
+            return ENAMETOOLONG;
+    }
+
+    memset(h, 0, sizeof(h));
+    if (split > 0) {
+        memcpy(h + 345, name, split);
+        memcpy(h, name + split + 1, n - split - 1);
+    } else {
+        memcpy(h, name, n);
+    }
+    snprintf(h + 100, 8, "%07o", 0640);
+    snprintf(h + 108, 8, "%07o", 0);
+    snprintf(h + 116, 8, "%07o", 0);
+    snprintf(h + 124, 12, "%011llo", (unsigned long long)size);
+    snprintf(h + 136, 12, "%011lo", (unsigned long)time(NULL));
+    memset(h + 148, ' ', 8);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    for (i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)h[i];
+    snprintf(h + 148, 8, "%06o", sum);
+    h[155] = ' ';
+    return write_all(sock, h, sizeof(h));
+}
+
+/* starts a file of size bytes in out, under name */
+static int backup_begin(struct backup_out *out, const char *name, const uint64_t size) {
+    char path[PATH_MAX];
+    int ret;
+
+    if (out->sock != -1)
+        return tar_header(out->sock, name, size);
+
+    snprintf(path, sizeof(path), "%s/%s", out->dir, name);
+    if ((ret = backup_mkdirs(path)) != 0)
+        return ret;
+    if ((out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0640)) == -1)
+        return errno;
+    return 0;
+}
+
+static int backup_end(struct backup_out *out, const uint64_t size) {
+    int ret = 0;
+
+    if (out->sock != -1) {
+        if (size % TAR_BLOCK != 0)
+            ret = write_all(out->sock, zeros, TAR_BLOCK - size % TAR_BLOCK);
+        return ret;
+    }
+    if (fsync(out->fd) != 0)
+        ret = errno;
+    if (close(out->fd) != 0 && ret == 0)
+        ret = errno;
+    out->fd = -1;
+    return ret;
+}
+
+/*
+ * Copies the file at path into out as name, as much of it as there was
+ * when it was opened. Returns 0, also when cancelled, or an errno.
+ */
+static int backup_file(struct backup_out *out, const char *path, const char *name,
+                       volatile int *cancel) {
+    struct stat st;
+    uint64_t left;
+    int64_t ahead;
+    char *buf;
+    ssize_t n;
+    int fd, ret;
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+        return errno;
+    if (fstat(fd, &st) != 0 || (buf = malloc(BACKUP_CHUNK)) == NULL) {
+        ret = errno;
+        close(fd);
+        return ret;
+    }
+
+    ret = backup_begin(out, name, st.st_size);
+    for (left = st.st_size; ret == 0 && left > 0 && !*cancel && !daemon_quit; left -= n) {
+        n = read(fd, buf, left < BACKUP_CHUNK ? left : BACKUP_CHUNK);
+        if (n == -1) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            ret = errno;
+            break;
+        }
+        if (n == 0) {
+            /* it got shorter, keep to the size the tar header has */
+            n = left < BACKUP_CHUNK ? left : BACKUP_CHUNK;
+            memset(buf, 0, n);
+        }
+        ret = write_all(out->sock != -1 ? out->sock : out->fd, buf, n);
+
+        out->bytes += n;
+        job_stats.backup_bytes += n;
+        if (job_stats.rate > 0) {
+            ahead = (int64_t)(out->bytes * 1000000 / ((uint64_t)job_stats.rate * bdb_settings.page_size))
+                    - (int64_t)(latency_now() - out->begin);
+            if (ahead > 0)
+                usleep(ahead < 1000000 ? ahead : 1000000);
+        }
+    }
+    if (ret == 0 && !*cancel && !daemon_quit) {
+        ret = backup_end(out, st.st_size);
+        job_stats.backup_files++;
+    }
+    if (out->sock == -1 && out->fd != -1) {
+        close(out->fd);
+        out->fd = -1;
+    }
+    free(buf);
+    close(fd);
+    return ret;
+}
+
+/* the path of a file of the environment, and the name it gets in the copy */
+static void backup_paths(const char *file, char *path, const size_t len, const char **name) {
+    if (file[0] == '/') {
+        snprintf(path, len, "%s", file);
+        for (*name = file; **name == '/'; (*name)++)
+            ;
+    } else {
+        snprintf(path, len, "%s/%s", bdb_settings.env_home, file);
+        *name = file;
+    }
+}
+
+/*
+ * Runs a db_backup to target, an absolute directory or host:port. Runs on
+ * the job thread, stopping early once *cancel is set. Returns 0 or the
+ * errno or Berkeley DB error it failed with.
+ */
+int backup_run(DB_ENV *dbenv, const char *target, volatile int *cancel) {
+    struct backup_out out;
+    char path[PATH_MAX], real_target[PATH_MAX], real_home[PATH_MAX];
+    char file[DB_PART_NAME_MAX];
+    const char *name;
+    char **list = NULL, **p;
+    int i, ret;
+
+    memset(&out, 0, sizeof(out));
+    out.sock = -1;
+    out.fd = -1;
+    out.begin = latency_now();
+
+    if (target[0] == '/') {
+        if (mkdir(target, 0750) != 0 && errno != EEXIST)
+            return errno;
+        /* a copy over the files it is made of would ruin them */
+        if (realpath(target, real_target) == NULL || realpath(bdb_settings.env_home, real_home) == NULL)
+            return errno;
+        if (strcmp(real_target, real_home) == 0)
+            return EEXIST;
+        out.dir = target;
+    } else if ((out.sock = backup_connect(target)) == -1) {
+        return errno;
+    }
+
+    if ((ret = dbenv->txn_checkpoint(dbenv, 0, 0, 0)) != 0)
+        goto done;
+
+    for (i = 0; i < bdb_settings.db_parts + 1 && ret == 0 && !*cancel; i++) {
+        if (i < bdb_settings.db_parts) {
+            bdb_part_file(i, file, sizeof(file));
+        } else if (bdb_settings.is_replicated) {
+            snprintf(file, sizeof(file), "%s", REP_META_FILE);
+        } else {
+            break;
+        }
+        backup_paths(file, path, sizeof(path), &name);
+        ret = backup_file(&out, path, name, cancel);
+    }
+
+    /* the logs last, so they cover every change to the pages copied */
+    if (ret == 0 && !*cancel && (ret = dbenv->log_archive(dbenv, &list, DB_ARCH_LOG)) == 0) {
+        for (p = list; p != NULL && *p != NULL && ret == 0 && !*cancel; p++) {
+            backup_paths(*p, path, sizeof(path), &name);
+            ret = backup_file(&out, path, name, cancel);
+        }
+        free(list);
+    }
+
+    /* the end of archive, only for a whole copy, so a cut short one shows */
+    if (ret == 0 && !*cancel && !daemon_quit && out.sock != -1) {
+        if ((ret = write_all(out.sock, zeros, TAR_BLOCK)) == 0)
+            ret = write_all(out.sock, zeros, TAR_BLOCK);
+    }
+    if (ret == 0 && settings.verbose > 0)
+        dbenv->errx(dbenv, "db_backup to %s: %llu files, %llu bytes", target,
+                    (unsigned long long)job_stats.backup_files,
+                    (unsigned long long)job_stats.backup_bytes);
+
+done:
+    if (out.sock != -1)
+        close(out.sock);
+    return ret;
+}
@@ -21,23 +21,72 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <sys/time.h>
 #include <db.h>
 
-static void *bdb_chkpoint_thread __P((void *));
-static void *bdb_memp_trickle_thread __P((void *));
+static void *bdb_maint_thread __P((void *));
 static void *bdb_dl_detect_thread __P((void *));
+static void *bdb_convert_thread __P((void *));
+static void *bdb_expire_thread __P((void *));
+static void *bdb_job_thread __P((void *));
+static void *bdb_heartbeat_thread __P((void *));
+#ifdef USE_THREADS
+static void *bdb_gcommit_thread __P((void *));
+#endif
 static void bdb_event_callback __P((DB_ENV *, u_int32_t, void *));
 static void bdb_err_callback(const DB_ENV *dbenv, const char *errpfx, const char *msg);
 static void bdb_msg_callback(const DB_ENV *dbenv, const char *msg);
 
 
-static pthread_t chk_ptid;
-static pthread_t mtri_ptid;
+static pthread_t mnt_ptid;
 static pthread_t dld_ptid;
+static pthread_t cvt_ptid;
+static pthread_t exp_ptid;
+static pthread_t job_ptid;
+static pthread_t hbt_ptid;
+
+struct gcommit_stats gcommit_stats;
+struct convert_stats convert_stats;
+struct expire_stats expire_stats;
+struct maint_stats maint_stats;
+struct job_stats job_stats;
+static pthread_mutex_t convert_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the jobs waiting for the job thread, a ring of JOB_QUEUE_MAX */
+struct bdb_job {
+    int kind;
+    int part;
+    uint64_t id;
+    char target[BACKUP_TARGET_MAX]; /* of a backup */
+};
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct bdb_job job_queue[JOB_QUEUE_MAX];
+static int job_head = 0;
+static uint64_t job_next_id = 1;
+static volatile int job_cancel = 0;
+
+/* the last heartbeat, written by this site as a master or applied as a replica */
+static DB *dbmeta = NULL;
+static pthread_mutex_t heartbeat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rep_heartbeat heartbeat;
+
+#ifdef USE_THREADS
+static pthread_t gcm_ptid;
+
+/* connections waiting for the next log flush, linked through conn->next */
+static pthread_mutex_t gcommit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gcommit_cond = PTHREAD_COND_INITIALIZER;
+static conn *gcommit_head = NULL;
+static int gcommit_count = 0;
+#endif
 
 void bdb_settings_init(void)
 {
     bdb_settings.db_file = DBFILE;
+    bdb_settings.db_parts = 1;
+    bdb_settings.db_part_ndirs = 0;
     bdb_settings.env_home = DBHOME;
     bdb_settings.cache_size = 64 * 1024 * 1024; /* default is 64MB */ 
     bdb_settings.txn_lg_bsize = 32 * 1024; /* default is 32KB */ 
@@ -46,7 +95,8 @@ void bdb_settings_init(void)
     bdb_settings.txn_nosync = 0; /* default DB_TXN_NOSYNC is off */
     bdb_settings.dldetect_val = 100 * 1000; /* default is 100 millisecond */
     bdb_settings.chkpoint_val = 60 * 5;
-    bdb_settings.memp_trickle_val = 30;
+    bdb_settings.chkpoint_kbyte = 32 * 1024; /* 32MB of log */
+    bdb_settings.memp_trickle_val = 1;
     bdb_settings.memp_trickle_percent = 60; 
     bdb_settings.db_flags = DB_CREATE | DB_AUTO_COMMIT;
     bdb_settings.env_flags = DB_CREATE
@@ -90,6 +140,15 @@ void bdb_settings_init(void)
 
     bdb_settings.rep_limit_gbytes = 0;  
     bdb_settings.rep_limit_bytes = 10 * 1024 * 1024; /* 10MB */
+
+    bdb_settings.rep_max_lag = 0; /* default is to serve reads however stale */
+
+    bdb_settings.gcommit_ops = 0; /* default group commit is off */
+    bdb_settings.gcommit_wait = 2 * 1000; /* 2ms */
+
+    bdb_settings.expire_rate = 1000; /* records per second */
+
+    bdb_settings.io_budget = 0; /* default is no limit */
 }
 
 void bdb_env_init(void){
@@ -132,6 +191,14 @@ void bdb_env_init(void){
     /* set DB_TXN_NOSYNC flag */
     if (bdb_settings.txn_nosync){
         env->set_flags(env, DB_TXN_NOSYNC, 1);
+        /* nothing left to make durable in batches */
+        bdb_settings.gcommit_ops = 0;
+    }
+
+    /* with group commit, commits only go to the log buffer, and the group
+       committer flushes the log once per batch before any reply is sent */
+    if (bdb_settings.gcommit_ops > 0){
+        env->set_flags(env, DB_TXN_NOSYNC, 1);
     }
 
     /* set locking */
@@ -246,9 +313,118 @@ void bdb_env_init(void){
 }
 
 
-void bdb_db_open(void){
+/* the partition a key lives in */
+int db_part_index(const char *key, const size_t nkey)
+{
+    if (bdb_settings.db_parts == 1)
+        return 0;
+    return (int)(hash(key, nkey, 0) % (uint32_t)bdb_settings.db_parts);
+}
+
+/*
+ * Names the file of a partition: db_file when there is just one,
+ * db_file.<part> otherwise, in the next of the partition directories if
+ * any were given.
+ */
+void bdb_part_file(const int part, char *name, const size_t len)
+{
+    if (bdb_settings.db_parts == 1) {
+        snprintf(name, len, "%s", bdb_settings.db_file);
+    } else if (bdb_settings.db_part_ndirs > 0) {
+        snprintf(name, len, "%s/%s.%d",
+                 bdb_settings.db_part_dirs[part % bdb_settings.db_part_ndirs],
+                 bdb_settings.db_file, part);
+    } else {
+        snprintf(name, len, "%s.%d", bdb_settings.db_file, part);
+    }
+}
+
+/* does the file of a partition exist, or would with parts partitions */
+static int bdb_part_exists(const int part, const int parts)
+{
+    char name[DB_PART_NAME_MAX], path[DB_PART_NAME_MAX * 2];
+    int saved = bdb_settings.db_parts;
+    struct stat st;
+
+    bdb_settings.db_parts = parts;
+    bdb_part_file(part, name, sizeof(name));
+    bdb_settings.db_parts = saved;
+    if (name[0] == '/')
+        snprintf(path, sizeof(path), "%s", name);
+    else
+        snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, name);
+    return stat(path, &st) == 0;
+}
+
+/*
+ * Keys are found through db_parts, so a changed number of partitions
+ * would lose them; refuse to start on files laid out for another number,
+ * and make the partition directories.
+ */
+void bdb_check_parts(void)
+{
+    int i, parts = bdb_settings.db_parts;
+    char path[DB_PART_NAME_MAX * 2];
+
+    /* a replica takes the files from its master as they are */
+    if ((bdb_settings.db_flags & DB_CREATE)
+        && ((parts == 1 && bdb_part_exists(0, 2))
+            || (parts > 1 && (bdb_part_exists(0, 1) || bdb_part_exists(parts, parts + 1)
+                              || (bdb_part_exists(0, parts) && !bdb_part_exists(parts - 1, parts)))))) {
+        fprintf(stderr, "the database was created with another number of partitions than %d\n", parts);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < bdb_settings.db_part_ndirs; i++) {
+        if (bdb_settings.db_part_dirs[i][0] == '/')
+            snprintf(path, sizeof(path), "%s", bdb_settings.db_part_dirs[i]);
+        else
+            snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, bdb_settings.db_part_dirs[i]);
+        if (mkdir(path, 0750) != 0 && errno != EEXIST) {
+            fprintf(stderr, "mkdir %s: %s\n", path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Opens one database of the environment. Returns 1, or 0 after a pause if
+ * it can't be opened yet, as on a replica the master hasn't sent it to.
+ */
+static int bdb_open_one(DB **dbp, const char *name, const DBTYPE type)
+{
     int ret;
+
+    if ((ret = db_create(dbp, env, 0)) != 0) {
+        fprintf(stderr, "db_create: %s\n", db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    /* set page size */
+    if((ret = (*dbp)->set_pagesize(*dbp, bdb_settings.page_size)) != 0){
+        fprintf(stderr, "dbp->set_pagesize: %s\n", db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
+    /* try to open db*/
+    ret = (*dbp)->open(*dbp, NULL, name, NULL, type, bdb_settings.db_flags, 0664);
+    switch (ret){
+    case 0:
+        return 1;
+    case ENOENT:
+    case DB_LOCK_DEADLOCK:
+    case DB_REP_LOCKOUT:
+        fprintf(stderr, "db_open %s: %s\n", name, db_strerror(ret));
+        sleep(3);
+        return 0;
+    default:
+        fprintf(stderr, "db_open %s: %s\n", name, db_strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+}
+
+void bdb_db_open(void){
+    int i;
     int db_open = 0;
+    char name[DB_PART_NAME_MAX];
     /* for replicas to get a full master copy, then open db */
     while(!db_open) {
         /* if replica, just scratch the db file from a master */
@@ -263,109 +439,636 @@ void bdb_db_open(void){
         }
 
         bdb_db_close();
+        bdb_check_parts();
 
-        if ((ret = db_create(&dbp, env, 0)) != 0) {
-            fprintf(stderr, "db_create: %s\n", db_strerror(ret));
-            exit(EXIT_FAILURE);
+        db_open = 1;
+        for (i = 0; i < bdb_settings.db_parts && db_open; i++) {
+            bdb_part_file(i, name, sizeof(name));
+            db_open = bdb_open_one(&dbps[i], name, bdb_settings.db_type);
         }
-        /* set page size */
-        if((ret = dbp->set_pagesize(dbp, bdb_settings.page_size)) != 0){
-            fprintf(stderr, "dbp->set_pagesize: %s\n", db_strerror(ret));
+        if (db_open && bdb_settings.is_replicated)
+            db_open = bdb_open_one(&dbmeta, REP_META_FILE, DB_BTREE);
+    }
+
+}
+
+/*
+ * Writes the dirty pages of one partition, or of all of them one after
+ * another for part -1, to its file. Returns 0 or the Berkeley DB error.
+ */
+int bdb_part_sync(const int part)
+{
+    int i, ret;
+
+    for (i = (part < 0 ? 0 : part); i < (part < 0 ? bdb_settings.db_parts : part + 1); i++) {
+        if ((ret = dbps[i]->sync(dbps[i], 0)) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+void start_maint_thread(void){
+    if (bdb_settings.chkpoint_val > 0 || bdb_settings.chkpoint_kbyte > 0
+        || bdb_settings.memp_trickle_val > 0){
+        /* Start a checkpoint and memp_trickle thread. */
+        if ((errno = pthread_create(
+            &mnt_ptid, NULL, bdb_maint_thread, (void *)env)) != 0) {
+            fprintf(stderr,
+                "failed spawning maintenance thread: %s\n",
+                strerror(errno));
             exit(EXIT_FAILURE);
         }
+    }
+}
 
-        /* try to open db*/
-        ret = dbp->open(dbp, NULL, bdb_settings.db_file, NULL, bdb_settings.db_type, bdb_settings.db_flags, 0664);         
-        switch (ret){
-        case 0:
-            db_open = 1;
-            break;
-        case ENOENT:
-        case DB_LOCK_DEADLOCK:
-        case DB_REP_LOCKOUT:
-            fprintf(stderr, "db_open: %s\n", db_strerror(ret));
-            sleep(3);
-            break;
-        default:
-            fprintf(stderr, "db_open: %s\n", db_strerror(ret));
+void start_dl_detect_thread(void){
+    if (bdb_settings.dldetect_val > 0){
+        /* Start a deadlock detecting thread. */
+        if ((errno = pthread_create(
+            &dld_ptid, NULL, bdb_dl_detect_thread, (void *)env)) != 0) {
+            fprintf(stderr,
+                "failed spawning deadlock thread: %s\n",
+                strerror(errno));
             exit(EXIT_FAILURE);
         }
     }
-
 }
 
-void start_chkpoint_thread(void){
-    if (bdb_settings.chkpoint_val > 0){
-        /* Start a checkpoint thread. */
+void start_gcommit_thread(void){
+#ifdef USE_THREADS
+    if (bdb_settings.gcommit_ops > 0){
+        /* Start a group commit thread. */
         if ((errno = pthread_create(
-            &chk_ptid, NULL, bdb_chkpoint_thread, (void *)env)) != 0) {
+            &gcm_ptid, NULL, bdb_gcommit_thread, (void *)env)) != 0) {
             fprintf(stderr,
-                "failed spawning checkpoint thread: %s\n",
+                "failed spawning group commit thread: %s\n",
                 strerror(errno));
             exit(EXIT_FAILURE);
         }
     }
+#endif
 }
 
-void start_memp_trickle_thread(void){
-    if (bdb_settings.memp_trickle_val > 0){
-        /* Start a memp_trickle thread. */
+void start_heartbeat_thread(void){
+    if (bdb_settings.is_replicated){
+        /* Start a replication heartbeat thread. */
         if ((errno = pthread_create(
-            &mtri_ptid, NULL, bdb_memp_trickle_thread, (void *)env)) != 0) {
+            &hbt_ptid, NULL, bdb_heartbeat_thread, (void *)env)) != 0) {
             fprintf(stderr,
-                "failed spawning memp_trickle thread: %s\n",
+                "failed spawning heartbeat thread: %s\n",
                 strerror(errno));
             exit(EXIT_FAILURE);
         }
     }
 }
 
-void start_dl_detect_thread(void){
-    if (bdb_settings.dldetect_val > 0){
-        /* Start a deadlock detecting thread. */
+void start_expire_thread(void){
+    if (bdb_settings.expire_rate > 0){
+        /* Start an expiry sweeper thread. */
         if ((errno = pthread_create(
-            &dld_ptid, NULL, bdb_dl_detect_thread, (void *)env)) != 0) {
+            &exp_ptid, NULL, bdb_expire_thread, (void *)env)) != 0) {
             fprintf(stderr,
-                "failed spawning deadlock thread: %s\n",
+                "failed spawning expire thread: %s\n",
                 strerror(errno));
             exit(EXIT_FAILURE);
         }
     }
 }
 
-static void *bdb_chkpoint_thread(void *arg)
+#ifdef USE_THREADS
+/*
+ * Queues a connection whose write has been committed to the log buffer
+ * but not flushed yet. The connection is handed back to its thread by
+ * dispatch_commit_done() once the flush is done.
+ */
+void gcommit_enqueue(conn *c)
+{
+    pthread_mutex_lock(&gcommit_lock);
+    c->next = gcommit_head;
+    gcommit_head = c;
+    gcommit_count++;
+    /* wake the committer for the first waiter, and once a batch is full */
+    if (gcommit_count == 1 || gcommit_count >= bdb_settings.gcommit_ops) {
+        pthread_cond_signal(&gcommit_cond);
+    }
+    pthread_mutex_unlock(&gcommit_lock);
+}
+
+static void *bdb_gcommit_thread(void *arg)
+{
+    DB_ENV *dbenv;
+    conn *batch, *next;
+    struct timeval now;
+    struct timespec deadline;
+    int ret, count;
+    dbenv = arg;
+    if (settings.verbose > 1) {
+        dbenv->errx(dbenv, "group commit thread created: %lu, %d writes or %d microseconds per log flush",
+                           (u_long)pthread_self(), bdb_settings.gcommit_ops, bdb_settings.gcommit_wait);
+    }
+    while (!daemon_quit) {
+        pthread_mutex_lock(&gcommit_lock);
+        while (gcommit_head == NULL) {
+            pthread_cond_wait(&gcommit_cond, &gcommit_lock);
+        }
+
+        /* the first write of a batch waits at most gcommit_wait for others */
+        gettimeofday(&now, NULL);
+        deadline.tv_sec = now.tv_sec + (now.tv_usec + bdb_settings.gcommit_wait) / 1000000;
+        deadline.tv_nsec = ((now.tv_usec + bdb_settings.gcommit_wait) % 1000000) * 1000;
+        while (gcommit_count < bdb_settings.gcommit_ops) {
+            if (pthread_cond_timedwait(&gcommit_cond, &gcommit_lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        batch = gcommit_head;
+        count = gcommit_count;
+        gcommit_head = NULL;
+        gcommit_count = 0;
+        pthread_mutex_unlock(&gcommit_lock);
+
+        /* every write in the batch was committed before it was queued, so
+           one flush of the whole log makes all of them durable */
+        if ((ret = dbenv->log_flush(dbenv, NULL)) != 0) {
+            dbenv->err(dbenv, ret, "group commit thread");
+        }
+        gcommit_stats.batches++;
+        gcommit_stats.writes += count;
+
+        for (; batch != NULL; batch = next) {
+            next = batch->next;
+            batch->commit_failed = (ret != 0);
+            dispatch_commit_done(batch);
+        }
+    }
+    return (NULL);
+}
+#endif
+
+/*
+ * Starts a db_convert pass in the background. Returns 0 if started, 1 if
+ * one is running already, -1 on failure.
+ */
+int start_convert_thread(void){
+    pthread_attr_t attr;
+
+    pthread_mutex_lock(&convert_lock);
+    if (convert_stats.running) {
+        pthread_mutex_unlock(&convert_lock);
+        return 1;
+    }
+    convert_stats.running = 1;
+    convert_stats.scanned = 0;
+    convert_stats.converted = 0;
+    pthread_mutex_unlock(&convert_lock);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((errno = pthread_create(
+        &cvt_ptid, &attr, bdb_convert_thread, (void *)env)) != 0) {
+        fprintf(stderr,
+            "failed spawning convert thread: %s\n",
+            strerror(errno));
+        pthread_mutex_lock(&convert_lock);
+        convert_stats.running = 0;
+        pthread_mutex_unlock(&convert_lock);
+        pthread_attr_destroy(&attr);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+static void *bdb_convert_thread(void *arg)
+{
+    char kbuf[KEY_MAX_LENGTH];
+    u_int32_t nkbuf = 0;
+    int ret, scanned, converted, part = 0;
+    if (settings.verbose > 1) {
+        engine_err(0, "convert thread created: %lu, %d records per transaction",
+                   (u_long)pthread_self(), CONVERT_BATCH);
+    }
+    do {
+        ret = item_convert(part, kbuf, &nkbuf, CONVERT_BATCH, &scanned, &converted);
+        if (ret == DB_LOCK_DEADLOCK) {
+            scanned = 1;
+            continue;
+        }
+        if (ret != 0) {
+            engine_err(ret, "convert thread");
+            break;
+        }
+        convert_stats.scanned += scanned;
+        convert_stats.converted += converted;
+        /* one partition after the other */
+        if (scanned == 0 && ++part < bdb_settings.db_parts) {
+            nkbuf = 0;
+            scanned = 1;
+        }
+    } while (scanned > 0 && !daemon_quit);
+
+    if (ret == 0) {
+        engine_err(0, "convert thread: %llu of %llu records converted",
+                   (unsigned long long)convert_stats.converted,
+                   (unsigned long long)convert_stats.scanned);
+    }
+    pthread_mutex_lock(&convert_lock);
+    convert_stats.running = 0;
+    pthread_mutex_unlock(&convert_lock);
+    return (NULL);
+}
+
+void start_job_thread(void){
+    job_stats.running = JOB_NONE;
+    job_stats.part = -1;
+    if ((errno = pthread_create(
+        &job_ptid, NULL, bdb_job_thread, (void *)env)) != 0) {
+        fprintf(stderr,
+            "failed spawning job thread: %s\n",
+            strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Queues a db_compact, db_archive, db_checkpoint, db_backup or bulk_load
+ * for the job thread; part is the partition to work on, -1 for all, and
+ * target where a backup goes or the file a load reads, NULL for the
+ * others. Returns 0 if queued, -1 if the queue is full.
+ */
+int bdb_job_submit(const int kind, const int part, const char *target){
+    struct bdb_job *job;
+
+    pthread_mutex_lock(&job_lock);
+    if (job_stats.queued == JOB_QUEUE_MAX) {
+        pthread_mutex_unlock(&job_lock);
+        return -1;
+    }
+    job = &job_queue[(job_head + job_stats.queued++) % JOB_QUEUE_MAX];
+    job->kind = kind;
+    job->part = part;
+    job->id = job_next_id++;
+    snprintf(job->target, sizeof(job->target), "%s", target != NULL ? target : "");
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+    return 0;
+}
+
+/*
+ * Drops the queued jobs and stops the running one at its next step.
+ * Returns how many jobs were cancelled.
+ */
+int bdb_job_cancel(void){
+    int n;
+
+    pthread_mutex_lock(&job_lock);
+    n = job_stats.queued;
+    job_stats.cancelled += n;
+    job_stats.queued = 0;
+    if (job_stats.running != JOB_NONE) {
+        job_cancel = 1;
+        n++;
+    }
+    pthread_mutex_unlock(&job_lock);
+    return n;
+}
+
+/*
+ * Compacts the partitions one DB->compact call at a time, each freeing at
+ * most JOB_COMPACT_PAGES pages and going on from the key the last one
+ * stopped at, so no lock or transaction is held for long. Between calls
+ * it sleeps to look at no more than job_stats.rate pages a second.
+ */
+static int bdb_job_compact(const int part)
+{
+    DB_COMPACT c_data;
+    DBT start, end;
+    uint64_t begin, examined;
+    int64_t ahead;
+    int i, ret = 0;
+
+    memset(&start, 0, sizeof(start));
+    memset(&end, 0, sizeof(end));
+    end.flags = DB_DBT_REALLOC;
+    for (i = (part < 0 ? 0 : part); i < (part < 0 ? bdb_settings.db_parts : part + 1); i++) {
+        start.size = 0;
+        begin = latency_now();
+        examined = 0;
+        while (!job_cancel && !daemon_quit) {
+            memset(&c_data, 0, sizeof(c_data));
+            c_data.compact_pages = JOB_COMPACT_PAGES;
+            ret = dbps[i]->compact(dbps[i], NULL, start.size > 0 ? &start : NULL, NULL,
+                                   &c_data, DB_FREE_SPACE, &end);
+            if (ret == DB_LOCK_DEADLOCK)
+                continue;
+            if (ret != 0)
+                break;
+            job_stats.pages_examined += c_data.compact_pages_examine;
+            job_stats.pages_freed += c_data.compact_pages_free;
+            job_stats.pages_truncated += c_data.compact_pages_truncated;
+            /* no end key, the whole partition has been gone through */
+            if (end.size == 0 || c_data.compact_pages_examine == 0)
+                break;
+            if ((start.data = realloc(start.data, end.size)) == NULL) {
+                ret = ENOMEM;
+                break;
+            }
+            memcpy(start.data, end.data, end.size);
+            start.size = end.size;
+
+            examined += c_data.compact_pages_examine;
+            if (job_stats.rate > 0) {
+                ahead = (int64_t)(examined * 1000000 / job_stats.rate) - (int64_t)(latency_now() - begin);
+                if (ahead > 0)
+                    usleep(ahead < 1000000 ? ahead : 1000000);
+            }
+        }
+        if (ret != 0 || job_cancel || daemon_quit)
+            break;
+    }
+    free(start.data);
+    free(end.data);
+    return ret;
+}
+
+/*
+ * The checkpoint of the bdb engine: a partition at a time, then the
+ * environment wide checkpoint.
+ */
+static int bdb_checkpoint(const int part)
+{
+    int i, ret;
+
+    if (bdb_settings.db_parts == 1)
+        return env->txn_checkpoint(env, 0, 0, 0);
+    for (i = (part < 0 ? 0 : part); i < (part < 0 ? bdb_settings.db_parts : part + 1); i++) {
+        if (job_cancel)
+            return 0;
+        if ((ret = bdb_part_sync(i)) != 0)
+            return ret;
+    }
+    return part < 0 ? env->txn_checkpoint(env, 0, 0, 0) : 0;
+}
+
+/*
+ * Runs the queued admin jobs one after another, so that a long compact
+ * over a big database holds up no worker thread.
+ */
+static void *bdb_job_thread(void *arg)
 {
     DB_ENV *dbenv;
+    struct bdb_job job;
+    struct timespec ts;
     int ret;
     dbenv = arg;
     if (settings.verbose > 1) {
-        dbenv->errx(dbenv, "checkpoint thread created: %lu, every %d seconds", 
-                           (u_long)pthread_self(), bdb_settings.chkpoint_val);
+        engine_err(0, "job thread created: %lu", (u_long)pthread_self());
     }
-    for (;; sleep(bdb_settings.chkpoint_val)) {
-        if ((ret = dbenv->txn_checkpoint(dbenv, 0, 0, 0)) != 0) {
-            dbenv->err(dbenv, ret, "checkpoint thread");
+
+    while (!daemon_quit) {
+        pthread_mutex_lock(&job_lock);
+        if (job_stats.queued == 0) {
+            /* wake up now and then to see daemon_quit */
+            ts.tv_sec = time(NULL) + MAINT_TICK;
+            ts.tv_nsec = 0;
+            pthread_cond_timedwait(&job_cond, &job_lock, &ts);
+            pthread_mutex_unlock(&job_lock);
+            continue;
+        }
+        job = job_queue[job_head];
+        job_head = (job_head + 1) % JOB_QUEUE_MAX;
+        job_stats.queued--;
+        job_stats.running = job.kind;
+        job_stats.part = job.part;
+        job_stats.id = job.id;
+        if (job.kind == JOB_COMPACT) {
+            job_stats.pages_examined = 0;
+            job_stats.pages_freed = 0;
+            job_stats.pages_truncated = 0;
+        } else if (job.kind == JOB_BACKUP) {
+            job_stats.backup_files = 0;
+            job_stats.backup_bytes = 0;
+        } else if (job.kind == JOB_LOAD) {
+            job_stats.load_records = 0;
+            job_stats.load_bytes = 0;
+        }
+        job_cancel = 0;
+        pthread_mutex_unlock(&job_lock);
+
+        switch (job.kind) {
+        case JOB_COMPACT:
+            ret = bdb_job_compact(job.part);
+            break;
+        case JOB_ARCHIVE:
+            ret = dbenv->log_archive(dbenv, NULL, DB_ARCH_REMOVE);
+            break;
+        case JOB_CHECKPOINT:
+            ret = engine->checkpoint(job.part);
+            break;
+        case JOB_BACKUP:
+            ret = backup_run(dbenv, job.target, &job_cancel);
+            break;
+        case JOB_LOAD:
+            ret = load_run(job.target, &job_cancel);
+            break;
+        default:
+            ret = EINVAL;
+            break;
         }
-        dbenv->errx(dbenv, "checkpoint thread: a txn_checkpoint is done");
+        if (ret != 0)
+            engine_err(ret, "job thread: job %llu", (unsigned long long)job.id);
+        else if (settings.verbose > 1)
+            engine_err(0, "job thread: job %llu is done", (unsigned long long)job.id);
+
+        pthread_mutex_lock(&job_lock);
+        if (job_cancel)
+            job_stats.cancelled++;
+        else if (ret != 0) {
+            job_stats.failed++;
+            job_stats.last_error = ret;
+        } else
+            job_stats.done++;
+        job_stats.running = JOB_NONE;
+        job_cancel = 0;
+        pthread_mutex_unlock(&job_lock);
     }
     return (NULL);
 }
 
-static void *bdb_memp_trickle_thread(void *arg)
+/*
+ * Walks the database over and over, deleting expired records a small
+ * transaction at a time, and sleeps between batches so that it looks at
+ * no more than expire_rate records per second. Only a master deletes,
+ * the deletes reach the replicas through replication.
+ */
+static void *bdb_expire_thread(void *arg)
+{
+    char kbuf[KEY_MAX_LENGTH];
+    u_int32_t nkbuf = 0;
+    uint64_t bytes;
+    int ret, scanned, expired, batch, part = 0;
+    batch = bdb_settings.expire_rate < EXPIRE_BATCH ? bdb_settings.expire_rate : EXPIRE_BATCH;
+    if (settings.verbose > 1) {
+        engine_err(0, "expire thread created: %lu, %d records per second",
+                   (u_long)pthread_self(), bdb_settings.expire_rate);
+    }
+    while (!daemon_quit) {
+        if (bdb_settings.is_replicated && bdb_settings.rep_whoami != MDB_MASTER) {
+            sleep(1);
+            continue;
+        }
+        ret = item_expire(part, kbuf, &nkbuf, batch, &scanned, &expired, &bytes);
+        if (ret == DB_LOCK_DEADLOCK)
+            continue;
+        if (ret != 0) {
+            engine_err(ret, "expire thread");
+            sleep(1);
+            continue;
+        }
+        if (scanned == 0) {
+            nkbuf = 0;
+            if (++part < bdb_settings.db_parts)
+                continue;
+            /* the end of a pass, rest a while before the next one */
+            expire_stats.passes++;
+            part = 0;
+            sleep(EXPIRE_PASS_PAUSE);
+            continue;
+        }
+        expire_stats.scanned += scanned;
+        expire_stats.items += expired;
+        expire_stats.bytes += bytes;
+        usleep((useconds_t)((uint64_t)scanned * 1000000 / bdb_settings.expire_rate));
+    }
+    return (NULL);
+}
+
+/* bytes written to the log since the environment was opened */
+static uint64_t bdb_log_written(DB_ENV *dbenv)
+{
+    DB_LOG_STAT *lsp = NULL;
+    uint64_t written = 0;
+
+    if (dbenv->log_stat(dbenv, &lsp, 0) == 0) {
+        written = (uint64_t)lsp->st_w_mbytes * 1024 * 1024 + lsp->st_w_bytes;
+    }
+    if (lsp != NULL)
+        free(lsp);
+    return written;
+}
+
+/* pages written out of the cache so far, and the share of dirty pages */
+static u_int32_t bdb_cache_state(DB_ENV *dbenv, int *dirty_percent)
+{
+    DB_MPOOL_STAT *gsp = NULL;
+    u_int32_t page_out = 0;
+
+    if (dbenv->memp_stat(dbenv, &gsp, NULL, 0) == 0) {
+        page_out = gsp->st_page_out;
+        if (dirty_percent != NULL && gsp->st_pages > 0)
+            *dirty_percent = (int)((uint64_t)gsp->st_page_dirty * 100 / gsp->st_pages);
+    }
+    if (gsp != NULL)
+        free(gsp);
+    return page_out;
+}
+
+/*
+ * Spreads the writes of checkpoints and trickles over the second: after
+ * every slice of the budget the cache waits for the rest of its slot.
+ */
+static void bdb_set_io_budget(DB_ENV *dbenv)
+{
+    int ret, pages;
+
+    if (bdb_settings.io_budget <= 0)
+        return;
+    pages = (int)((uint64_t)bdb_settings.io_budget * 1024
+                  / bdb_settings.page_size / MAINT_IO_SLICES);
+    if (pages < 1)
+        pages = 1;
+    if ((ret = dbenv->set_mp_max_write(dbenv, pages, 1000000 / MAINT_IO_SLICES)) != 0) {
+        dbenv->err(dbenv, ret, "set_mp_max_write");
+    }
+}
+
+/*
+ * Checkpoints once chkpoint_kbyte of log has been written since the last
+ * one, or chkpoint_val seconds have passed and anything was written at
+ * all; small frequent checkpoints instead of a burst every few minutes.
+ * Trickles whenever the share of dirty pages in the cache is above what
+ * memp_trickle_percent allows, rather than on a fixed clock.
+ */
+static void *bdb_maint_thread(void *arg)
 {
     DB_ENV *dbenv;
-    int ret, nwrotep;
+    int ret, nwrotep, dirty;
+    time_t now, last_ckp, last_trickle;
+    uint64_t written, ckp_written, start;
+    u_int32_t page_out;
     dbenv = arg;
     if (settings.verbose > 1) {
-        dbenv->errx(dbenv, "memp_trickle thread created: %lu, every %d seconds, %d%% pages should be clean.", 
-                           (u_long)pthread_self(), bdb_settings.memp_trickle_val,
-                           bdb_settings.memp_trickle_percent);
+        dbenv->errx(dbenv, "maintenance thread created: %lu, checkpoint every %d seconds or %d kbytes of log, "
+                           "dirty pages looked at every %d seconds, %d%% pages should be clean.",
+                           (u_long)pthread_self(), bdb_settings.chkpoint_val, bdb_settings.chkpoint_kbyte,
+                           bdb_settings.memp_trickle_val, bdb_settings.memp_trickle_percent);
     }
-    for (;; sleep(bdb_settings.memp_trickle_val)) {
-        if ((ret = dbenv->memp_trickle(dbenv, bdb_settings.memp_trickle_percent, &nwrotep)) != 0) {
-            dbenv->err(dbenv, ret, "memp_trickle thread");
+    bdb_set_io_budget(dbenv);
+    last_ckp = last_trickle = time(NULL);
+    ckp_written = bdb_log_written(dbenv);
+
+    while (!daemon_quit) {
+        sleep(MAINT_TICK);
+        now = time(NULL);
+
+        if (bdb_settings.memp_trickle_val > 0
+            && now - last_trickle >= bdb_settings.memp_trickle_val) {
+            last_trickle = now;
+            dirty = 0;
+            (void)bdb_cache_state(dbenv, &dirty);
+            maint_stats.dirty_percent = dirty;
+            if (dirty > 100 - bdb_settings.memp_trickle_percent) {
+                if ((ret = dbenv->memp_trickle(dbenv, bdb_settings.memp_trickle_percent, &nwrotep)) != 0) {
+                    dbenv->err(dbenv, ret, "memp_trickle thread");
+                } else {
+                    maint_stats.trickles++;
+                    maint_stats.trickle_pages += nwrotep;
+                    if (settings.verbose > 1)
+                        dbenv->errx(dbenv, "maintenance thread: %d%% dirty, wrote %d pages", dirty, nwrotep);
+                }
+            }
         }
-        dbenv->errx(dbenv, "memp_trickle thread: writing %d dirty pages", nwrotep);
+
+        written = bdb_log_written(dbenv);
+        if (written == ckp_written)
+            continue;
+        if (!(bdb_settings.chkpoint_kbyte > 0
+              && (written - ckp_written) / 1024 >= (uint64_t)bdb_settings.chkpoint_kbyte)
+            && !(bdb_settings.chkpoint_val > 0 && now - last_ckp >= bdb_settings.chkpoint_val))
+            continue;
+
+        page_out = bdb_cache_state(dbenv, NULL);
+        start = latency_now();
+        /* a partition at a time, the checkpoint then finds little to write */
+        if (bdb_settings.db_parts > 1 && (ret = bdb_part_sync(-1)) != 0) {
+            dbenv->err(dbenv, ret, "checkpoint thread");
+            continue;
+        }
+        if ((ret = dbenv->txn_checkpoint(dbenv, 0, 0, 0)) != 0) {
+            dbenv->err(dbenv, ret, "checkpoint thread");
+            continue;
+        }
+        maint_stats.last_ckp_usec = latency_now() - start;
+        maint_stats.last_ckp_bytes = (uint64_t)(bdb_cache_state(dbenv, NULL) - page_out)
+                                     * bdb_settings.page_size;
+        maint_stats.checkpoints++;
+        dbenv->errx(dbenv, "checkpoint thread: a txn_checkpoint is done, %llu kbytes of log, %llu ms",
+                    (unsigned long long)((written - ckp_written) / 1024),
+                    (unsigned long long)(maint_stats.last_ckp_usec / 1000));
+        /* the checkpoint writes log records too, start counting after it */
+        ckp_written = bdb_log_written(dbenv);
+        last_ckp = time(NULL);
     }
     return (NULL);
 }
@@ -389,6 +1092,135 @@ static void *bdb_dl_detect_thread(void *arg)
     return (NULL);
 }
 
+/*
+ * The position a "read your writes" token is made of. On a master it is
+ * the end of the log, past the commit of every write answered so far; on
+ * a replica it is the next record it expects from the master, everything
+ * before which it has applied. Returns 0 or the Berkeley DB error.
+ */
+int bdb_rep_lsn(DB_LSN *lsn)
+{
+    DB_LOG_STAT *lsp = NULL;
+    DB_REP_STAT *rsp = NULL;
+    int ret;
+
+    /* the mmap engine has no log */
+    if (env == NULL)
+        return EINVAL;
+    if (!bdb_settings.is_replicated || bdb_settings.rep_whoami == MDB_MASTER) {
+        if ((ret = env->log_stat(env, &lsp, 0)) == 0) {
+            lsn->file = lsp->st_cur_file;
+            lsn->offset = lsp->st_cur_offset;
+            free(lsp);
+        }
+    } else {
+        if ((ret = env->rep_stat(env, &rsp, 0)) == 0) {
+            *lsn = rsp->st_next_lsn;
+            free(rsp);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Seconds a replica is behind its master, by the age of the last heartbeat
+ * it applied, so up to REP_HEARTBEAT_TICK more than the real lag and only
+ * as good as the clocks of the two agree. 0 on a master, -1 on a replica
+ * that hasn't seen a heartbeat yet.
+ */
+int bdb_rep_lag(void)
+{
+    time_t when, now = time(NULL);
+
+    if (!bdb_settings.is_replicated || bdb_settings.rep_whoami == MDB_MASTER)
+        return 0;
+    pthread_mutex_lock(&heartbeat_lock);
+    when = heartbeat.time;
+    pthread_mutex_unlock(&heartbeat_lock);
+    if (when == 0)
+        return -1;
+    return now > when ? (int)(now - when) : 0;
+}
+
+/* copies out the last heartbeat, with no master while there is none */
+void bdb_rep_heartbeat(struct rep_heartbeat *hb)
+{
+    pthread_mutex_lock(&heartbeat_lock);
+    *hb = heartbeat;
+    pthread_mutex_unlock(&heartbeat_lock);
+    if (bdb_settings.rep_master_eid == DB_EID_INVALID)
+        hb->master[0] = '\0';
+}
+
+/*
+ * Every REP_HEARTBEAT_TICK a master writes its clock, the end of its log
+ * and the address its clients connect to into REP_META_FILE, and
+ * replication carries it to the replicas. A replica reads it back: how old
+ * it is tells how far behind the replica is, and where the master is tells
+ * the clients it turns away where to go.
+ */
+static void *bdb_heartbeat_thread(void *arg)
+{
+    DB_ENV *dbenv;
+    struct rep_heartbeat hb;
+    char buf[64 + REP_ADDR_MAX];
+    DBT dbkey, dbdata;
+    long when;
+    int ret;
+    dbenv = arg;
+    if (settings.verbose > 1) {
+        dbenv->errx(dbenv, "heartbeat thread created: %lu", (u_long)pthread_self());
+    }
+    while (!daemon_quit) {
+        sleep(REP_HEARTBEAT_TICK);
+
+        memset(&dbkey, 0, sizeof(dbkey));
+        memset(&dbdata, 0, sizeof(dbdata));
+        dbkey.data = REP_HEARTBEAT_KEY;
+        dbkey.size = strlen(REP_HEARTBEAT_KEY);
+        memset(&hb, 0, sizeof(hb));
+
+        if (bdb_settings.rep_whoami == MDB_MASTER) {
+            hb.time = time(NULL);
+            if ((ret = bdb_rep_lsn(&hb.lsn)) == 0) {
+                snprintf(hb.master, sizeof(hb.master), "%s:%d",
+                         settings.inter != NULL ? settings.inter : bdb_settings.rep_localhost,
+                         settings.port);
+                dbdata.data = buf;
+                dbdata.size = snprintf(buf, sizeof(buf), "%ld %u/%u %s", (long)hb.time,
+                                       hb.lsn.file, hb.lsn.offset, hb.master);
+                ret = dbmeta->put(dbmeta, NULL, &dbkey, &dbdata, 0);
+            }
+        } else if (bdb_settings.rep_whoami == MDB_CLIENT) {
+            dbdata.data = buf;
+            dbdata.ulen = sizeof(buf) - 1;
+            dbdata.flags = DB_DBT_USERMEM;
+            if ((ret = dbmeta->get(dbmeta, NULL, &dbkey, &dbdata, 0)) == 0) {
+                buf[dbdata.size] = '\0';
+                /* the width is REP_ADDR_MAX - 1 */
+                if (sscanf(buf, "%ld %u/%u %127s", &when, &hb.lsn.file,
+                           &hb.lsn.offset, hb.master) == 4)
+                    hb.time = when;
+                else
+                    ret = EINVAL;
+            }
+        } else {
+            continue;
+        }
+
+        if (ret != 0) {
+            /* a replica finds none until the master's first one reaches it */
+            if (ret != DB_NOTFOUND || settings.verbose > 1)
+                dbenv->err(dbenv, ret, "heartbeat thread");
+            continue;
+        }
+        pthread_mutex_lock(&heartbeat_lock);
+        heartbeat = hb;
+        pthread_mutex_unlock(&heartbeat_lock);
+    }
+    return (NULL);
+}
+
 static void bdb_event_callback(DB_ENV *env, u_int32_t which, void *info)
 {
     switch (which) {
@@ -399,6 +1231,10 @@ static void bdb_event_callback(DB_ENV *env, u_int32_t which, void *info)
         env->errx(env, "event: DB_EVENT_REP_CLIENT, I<%s:%d> am now a replication client.", 
                        bdb_settings.rep_localhost, bdb_settings.rep_localport);
         bdb_settings.rep_whoami = MDB_CLIENT;
+        /* from now on the writes come in through replication */
+        hotcache_flush();
+        bloom_stop();
+        counter_clear();
         break;
     case DB_EVENT_REP_ELECTED:
         env->errx(env, "event: DB_EVENT_REP_ELECTED, I<%s:%d> has just won an election.", 
@@ -409,6 +1245,8 @@ static void bdb_event_callback(DB_ENV *env, u_int32_t which, void *info)
                        bdb_settings.rep_localhost, bdb_settings.rep_localport);
         bdb_settings.rep_whoami = MDB_MASTER;
         bdb_settings.rep_master_eid = BDB_EID_SELF;
+        hotcache_flush();
+        bloom_fill();
         break;
     case DB_EVENT_REP_NEWMASTER:
         bdb_settings.rep_master_eid = *(int*)info;
@@ -450,14 +1288,23 @@ static void bdb_msg_callback(const DB_ENV *dbenv, const char *msg){
 
 /* for atexit cleanup */
 void bdb_db_close(void){
-    int ret = 0;
+    int ret = 0, i;
 
-    if (dbp != NULL) {
-        ret = dbp->close(dbp, 0);
+    if (dbmeta != NULL) {
+        if ((ret = dbmeta->close(dbmeta, 0)) != 0)
+            fprintf(stderr, "dbp->close: %s\n", db_strerror(ret));
+        else
+            dbmeta = NULL;
+    }
+
+    for (i = 0; i < MAX_DB_PARTS; i++) {
+        if (dbps[i] == NULL)
+            continue;
+        ret = dbps[i]->close(dbps[i], 0);
         if (0 != ret){
             fprintf(stderr, "dbp->close: %s\n", db_strerror(ret));
         }else{
-            dbp = NULL;
+            dbps[i] = NULL;
             fprintf(stderr, "dbp->close: OK\n");
         }
     }
@@ -482,6 +1329,9 @@ void bdb_chkpoint(void)
 {
     int ret = 0;
     if (env != NULL){
+        /* no IO budget on the way out */
+        if (bdb_settings.io_budget > 0)
+            (void)env->set_mp_max_write(env, 0, 0);
         ret = env->txn_checkpoint(env, 0, 0, 0); 
         if (0 != ret){
             fprintf(stderr, "env->txn_checkpoint: %s\n", db_strerror(ret));
@@ -490,3 +1340,301 @@ void bdb_chkpoint(void)
         }
     }
 }
+
+/*
+ * Logs like env->err() does, or env->errx() for ret 0, for the threads
+ * that run with either engine; the mmap engine has no environment.
+ */
+void engine_err(const int ret, const char *fmt, ...)
+{
+    char msg[1024];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    if (ret != 0 && n >= 0 && n < sizeof(msg))
+        snprintf(msg + n, sizeof(msg) - n, ": %s", db_strerror(ret));
+    bdb_err_callback(env, PACKAGE, msg);
+}
+
+/*
+ * The bdb engine. A cursor outside a transaction reads ahead with
+ * DB_MULTIPLE_KEY, bulk bytes at a time; inside one it reads a record at a
+ * time with DB_RMW, as a walk that writes needs.
+ */
+struct engine_cursor {
+    DBC *dbc;
+    u_int32_t rmw;
+    DBT dbkey, dbdata;      /* a record read on its own */
+    char kbuf[KEY_MAX_LENGTH + 2];
+    DBT bulk;               /* the read ahead, data NULL for none */
+    void *p;                /* the next record in it */
+    void *cur;              /* the record the cursor is on, if from it */
+    void *rkey, *rdata;
+    u_int32_t rnkey, rndata;
+};
+
+static void bdb_engine_open(void)
+{
+    bdb_env_init();
+    bdb_db_open();
+
+    /* start checkpoint and deadlock detect thread */
+    start_maint_thread();
+    start_dl_detect_thread();
+    start_gcommit_thread();
+    start_heartbeat_thread();
+}
+
+static void bdb_engine_close(void)
+{
+    bdb_chkpoint();
+    bdb_db_close();
+    bdb_env_close();
+}
+
+static int bdb_txn_begin(const int part, engine_txn **txnp)
+{
+    return env->txn_begin(env, NULL, (DB_TXN **)txnp, 0);
+}
+
+static int bdb_txn_begin_nosync(const int part, engine_txn **txnp)
+{
+    return env->txn_begin(env, NULL, (DB_TXN **)txnp, DB_TXN_NOSYNC);
+}
+
+static int bdb_txn_commit(engine_txn *txn)
+{
+    return ((DB_TXN *)txn)->commit((DB_TXN *)txn, 0);
+}
+
+static void bdb_txn_abort(engine_txn *txn)
+{
+    ((DB_TXN *)txn)->abort((DB_TXN *)txn);
+}
+
+static int bdb_get(const int part, engine_txn *txn, const void *key, const u_int32_t nkey,
+                   void *buf, const u_int32_t ulen, u_int32_t *size, const int flags)
+{
+    DBT dbkey, dbdata;
+    int ret;
+
+    BDB_CLEANUP_DBT();
+    dbkey.data = (void *)key;
+    dbkey.size = nkey;
+    dbdata.data = buf;
+    dbdata.ulen = ulen;
+    dbdata.flags = DB_DBT_USERMEM;
+    if (flags & ENGINE_PARTIAL) {
+        dbdata.dlen = ulen;
+        dbdata.doff = 0;
+        dbdata.flags |= DB_DBT_PARTIAL;
+    }
+    ret = dbps[part]->get(dbps[part], (DB_TXN *)txn, &dbkey, &dbdata,
+                          (flags & ENGINE_RMW) ? DB_RMW : 0);
+    *size = dbdata.size;
+    return ret;
+}
+
+static int bdb_put(const int part, engine_txn *txn, const void *key, const u_int32_t nkey,
+                   const void *data, const u_int32_t size)
+{
+    DBT dbkey, dbdata;
+
+    BDB_CLEANUP_DBT();
+    dbkey.data = (void *)key;
+    dbkey.size = nkey;
+    dbdata.data = (void *)data;
+    dbdata.size = size;
+    return dbps[part]->put(dbps[part], (DB_TXN *)txn, &dbkey, &dbdata, 0);
+}
+
+static int bdb_del(const int part, engine_txn *txn, const void *key, const u_int32_t nkey)
+{
+    DBT dbkey;
+
+    memset(&dbkey, 0, sizeof(dbkey));
+    dbkey.data = (void *)key;
+    dbkey.size = nkey;
+    return dbps[part]->del(dbps[part], (DB_TXN *)txn, &dbkey, 0);
+}
+
+static int bdb_cursor(const int part, engine_txn *txn, const u_int32_t bulk, engine_cursor **cp)
+{
+    engine_cursor *c;
+    int ret;
+
+    if ((c = calloc(1, sizeof(engine_cursor))) == NULL)
+        return ENOMEM;
+    if ((ret = dbps[part]->cursor(dbps[part], (DB_TXN *)txn, &c->dbc, 0)) != 0) {
+        free(c);
+        return ret;
+    }
+    c->dbdata.flags = DB_DBT_REALLOC;
+    if (txn != NULL) {
+        c->rmw = DB_RMW;
+    } else if (bulk > 0 && (c->bulk.data = slabs_alloc(bulk)) != NULL) {
+        /* without a buffer it just reads a record at a time */
+        c->bulk.ulen = bulk;
+        c->bulk.flags = DB_DBT_USERMEM;
+    }
+    *cp = c;
+    return 0;
+}
+
+/* moves c to the next record of the read ahead, DB_NOTFOUND at its end */
+static int bdb_c_take(engine_cursor *c)
+{
+    void *q = c->p;
+
+    c->cur = NULL;
+    if (q == NULL)
+        return DB_NOTFOUND;
+    DB_MULTIPLE_KEY_NEXT(c->p, &c->bulk, c->rkey, c->rnkey, c->rdata, c->rndata);
+    if (c->p == NULL)
+        return DB_NOTFOUND;
+    c->cur = q;
+    return 0;
+}
+
+static int bdb_c_get(engine_cursor *c, const int move, const void *key, const u_int32_t nkey,
+                     const void **rkey, u_int32_t *rnkey, const void **rdata, u_int32_t *rndata)
+{
+    static const u_int32_t flags[] = { DB_FIRST, DB_NEXT, DB_SET, DB_SET_RANGE };
+    int ret;
+
+    if (nkey > sizeof(c->kbuf))
+        return EINVAL;
+    memset(&c->dbkey, 0, sizeof(DBT));
+    c->dbkey.data = c->kbuf;
+    c->dbkey.ulen = sizeof(c->kbuf);
+    c->dbkey.flags = DB_DBT_USERMEM;
+    if (move == ENGINE_SET || move == ENGINE_SET_RANGE) {
+        memcpy(c->kbuf, key, nkey);
+        c->dbkey.size = nkey;
+    }
+
+    if (c->bulk.data != NULL && move != ENGINE_SET) {
+        if (move == ENGINE_NEXT && bdb_c_take(c) == 0)
+            goto found;
+        /* a key at or after the record the cursor is on may have been read ahead */
+        if (move == ENGINE_SET_RANGE && c->cur != NULL
+            && item_key_cmp(key, nkey, c->rkey, c->rnkey) >= 0) {
+            c->p = c->cur;
+            while (bdb_c_take(c) == 0) {
+                if (item_key_cmp(c->rkey, c->rnkey, key, nkey) >= 0)
+                    goto found;
+            }
+        }
+        ret = c->dbc->get(c->dbc, &c->dbkey, &c->bulk, flags[move] | DB_MULTIPLE_KEY);
+        c->p = c->cur = NULL;
+        if (ret == 0) {
+            DB_MULTIPLE_INIT(c->p, &c->bulk);
+            if (bdb_c_take(c) == 0)
+                goto found;
+            return DB_NOTFOUND;
+        }
+        if (ret != DB_BUFFER_SMALL)
+            return ret;
+        /* a record bigger than the whole read ahead, read it on its own */
+        if (move == ENGINE_SET_RANGE) {
+            memcpy(c->kbuf, key, nkey);
+            c->dbkey.size = nkey;
+        }
+    }
+
+    if ((ret = c->dbc->get(c->dbc, &c->dbkey, &c->dbdata, flags[move] | c->rmw)) != 0)
+        return ret;
+    c->rkey = c->dbkey.data;
+    c->rnkey = c->dbkey.size;
+    c->rdata = c->dbdata.data;
+    c->rndata = c->dbdata.size;
+
+found:
+    *rkey = c->rkey;
+    *rnkey = c->rnkey;
+    *rdata = c->rdata;
+    *rndata = c->rndata;
+    return 0;
+}
+
+static int bdb_c_put(engine_cursor *c, const void *data, const u_int32_t size)
+{
+    DBT dbkey, dbdata;
+
+    BDB_CLEANUP_DBT();
+    dbkey.data = c->rkey;
+    dbkey.size = c->rnkey;
+    dbdata.data = (void *)data;
+    dbdata.size = size;
+    return c->dbc->put(c->dbc, &dbkey, &dbdata, DB_CURRENT);
+}
+
+static int bdb_c_del(engine_cursor *c)
+{
+    return c->dbc->del(c->dbc, 0);
+}
+
+static void bdb_c_close(engine_cursor *c)
+{
+    c->dbc->close(c->dbc);
+    if (c->bulk.data != NULL)
+        slabs_free(c->bulk.data);
+    free(c->dbdata.data);
+    free(c);
+}
+
+/* the key count of the partition and its share of the cache */
+static int bdb_stats(const int part, char *buf)
+{
+    DB_MPOOL_FSTAT **fsp = NULL, **f;
+    char name[DB_PART_NAME_MAX];
+    char *pos = buf;
+    void *sp;
+    u_int32_t nkeys;
+
+    if (dbps[part]->stat(dbps[part], NULL, &sp, DB_FAST_STAT) == 0) {
+        if (bdb_settings.db_type == DB_BTREE)
+            nkeys = ((DB_BTREE_STAT *)sp)->bt_nkeys;
+        else
+            nkeys = ((DB_HASH_STAT *)sp)->hash_nkeys;
+        free(sp);
+        pos += sprintf(pos, "STAT part%d_keys %u\r\n", part, nkeys);
+    }
+    bdb_part_file(part, name, sizeof(name));
+    if (env->memp_stat(env, NULL, &fsp, 0) != 0)
+        fsp = NULL;
+    for (f = fsp; f != NULL && *f != NULL; f++) {
+        if (strcmp((*f)->file_name, name) != 0)
+            continue;
+        pos += sprintf(pos, "STAT part%d_cache_hit %u\r\n", part, (*f)->st_cache_hit);
+        pos += sprintf(pos, "STAT part%d_cache_miss %u\r\n", part, (*f)->st_cache_miss);
+        pos += sprintf(pos, "STAT part%d_page_in %u\r\n", part, (*f)->st_page_in);
+        pos += sprintf(pos, "STAT part%d_page_out %u\r\n", part, (*f)->st_page_out);
+        break;
+    }
+    free(fsp);
+    return pos - buf;
+}
+
+const struct engine bdb_engine = {
+    "bdb",
+    bdb_engine_open,
+    bdb_engine_close,
+    bdb_txn_begin,
+    bdb_txn_begin_nosync,
+    bdb_txn_commit,
+    bdb_txn_abort,
+    bdb_get,
+    bdb_put,
+    bdb_del,
+    bdb_cursor,
+    bdb_c_get,
+    bdb_c_put,
+    bdb_c_del,
+    bdb_c_close,
+    bdb_checkpoint,
+    bdb_stats
+};
@@ -0,0 +1,323 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+/*
+ * Counting Bloom filter over the keys in the database, so that a get or an
+ * add for a key that is not there is answered without a database lookup.
+ * Each key sets BLOOM_HASHES 4-bit counters, two to a byte, of the
+ * settings.bloom_size bytes; a key is surely missing if any of them is 0.
+ * A counter that reaches 15 stays there, as it no longer knows how many
+ * keys it counts.
+ *
+ * The counts are only good if every key is counted at least once for as
+ * long as it is in the database, and a delete only takes back a count a
+ * write made. So a write that may add a key (item_put()) and a delete
+ * each hold the key's lock stripe here across the database call and the
+ * count: a write counts its key unless the database has it already, and
+ * a delete uncounts the key it removed. Expired records the sweeper
+ * deletes are not uncounted, which only costs the odd false positive.
+ *
+ * The filter is filled at startup by a thread that walks the database and
+ * counts every key, while the server already runs; until it is done the
+ * filter answers "maybe" for every key and deletes leave the counts alone.
+ * Writes that come in through replication don't pass through here, so a
+ * replica doesn't use the filter either, and a site filters again once it
+ * has become master and refilled it.
+ */
+
+#define BLOOM_HASHES 4
+
+#define BLOOM_LOCKS 1024
+
+/* records a filling walk counts per transaction */
+#define BLOOM_FILL_BATCH 1000
+
+#define BLOOM_COUNTER_MAX 15
+
+enum bloom_state { BLOOM_STOPPED, BLOOM_FILLING, BLOOM_READY };
+
+static uint8_t *counters = NULL;
+static uint64_t ncounters;
+static pthread_mutex_t locks[BLOOM_LOCKS];
+
+/* guards the fields below, only the filling thread writes the counters
+   with every stripe in locks held */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int state = BLOOM_STOPPED;
+static bool started = false;    /* the databases are open */
+static bool wanted = false;     /* fill once they are */
+static bool filling = false;    /* the filling thread runs */
+static volatile bool refill = false; /* it should start over */
+static uint64_t filled;         /* keys counted by the last fill */
+
+static void *bloom_fill_thread(void *arg);
+
+void bloom_init(void) {
+    int i;
+
+    if (settings.bloom_size == 0)
+        return;
+
+    ncounters = (uint64_t)settings.bloom_size * 2;
+    counters = calloc(settings.bloom_size, 1);
+    if (counters == NULL) {
+        fprintf(stderr, "Failed to allocate the bloom filter\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < BLOOM_LOCKS; i++)
+        pthread_mutex_init(&locks[i], NULL);
+}
+
+bool bloom_enabled(void) {
+    return counters != NULL;
+}
+
+/* the filter counts every key in the database */
+bool bloom_ready(void) {
+    return counters != NULL && state == BLOOM_READY;
+}
+
+/*
+ * The counters of key, two 32-bit hashes combined into the first and
+ * the step of a sequence of BLOOM_HASHES.
+ */
+static void bloom_slots(const char *key, const size_t nkey, uint64_t *slots) {
+    uint32_t h1 = hash(key, nkey, 0x9e3779b9);
+    uint32_t h2 = hash(key, nkey, 0x7f4a7c15);
+    uint64_t a = ((uint64_t)h1 << 32) | h2;
+    uint64_t b = (((uint64_t)h2 << 32) | h1) | 1;
+    int i;
+
+    for (i = 0; i < BLOOM_HASHES; i++)
+        slots[i] = (a + i * b) % ncounters;
+}
+
+static inline int bloom_get(const uint64_t slot) {
+    return (counters[slot >> 1] >> ((slot & 1) * 4)) & 0xf;
+}
+
+/* adds delta, 1 or -1, to a counter, unless it is stuck at the maximum */
+static void bloom_bump(const uint64_t slot, const int delta) {
+    uint8_t *p = &counters[slot >> 1];
+    int shift = (slot & 1) * 4;
+    uint8_t old, new;
+    int n;
+
+    do {
+        old = *p;
+        n = (old >> shift) & 0xf;
+        if (n == BLOOM_COUNTER_MAX || (delta < 0 && n == 0))
+            return;
+        new = (old & ~(0xf << shift)) | ((n + delta) << shift);
+    } while (!__sync_bool_compare_and_swap(p, old, new));
+}
+
+/*
+ * False only if key is surely not in the database; always true while
+ * the filter is off or not filled.
+ */
+bool bloom_maybe(const char *key, const size_t nkey) {
+    uint64_t slots[BLOOM_HASHES];
+    int i;
+
+    if (!bloom_ready())
+        return true;
+    bloom_slots(key, nkey, slots);
+    for (i = 0; i < BLOOM_HASHES; i++) {
+        if (bloom_get(slots[i]) == 0)
+            return false;
+    }
+    return true;
+}
+
+void bloom_add(const char *key, const size_t nkey) {
+    uint64_t slots[BLOOM_HASHES];
+    int i;
+
+    if (counters == NULL)
+        return;
+    bloom_slots(key, nkey, slots);
+    for (i = 0; i < BLOOM_HASHES; i++)
+        bloom_bump(slots[i], 1);
+}
+
+/* takes back the count of a key just deleted, with its lock held */
+void bloom_remove(const char *key, const size_t nkey) {
+    uint64_t slots[BLOOM_HASHES];
+    int i;
+
+    /* while filling, the key may not have been counted yet */
+    if (!bloom_ready())
+        return;
+    bloom_slots(key, nkey, slots);
+    for (i = 0; i < BLOOM_HASHES; i++)
+        bloom_bump(slots[i], -1);
+}
+
+static pthread_mutex_t *bloom_lock_of(const char *key, const size_t nkey) {
+    return &locks[hash(key, nkey, 0) & (BLOOM_LOCKS - 1)];
+}
+
+/* the lock a write that may add or remove key holds, if the filter is on */
+void bloom_lock(const char *key, const size_t nkey) {
+    if (counters != NULL)
+        pthread_mutex_lock(bloom_lock_of(key, nkey));
+}
+
+void bloom_unlock(const char *key, const size_t nkey) {
+    if (counters != NULL)
+        pthread_mutex_unlock(bloom_lock_of(key, nkey));
+}
+
+/*
+ * (Re)fills the filter in the background. Before bloom_start() only
+ * remembers to do so.
+ */
+void bloom_fill(void) {
+    pthread_attr_t attr;
+    pthread_t tid;
+
+    if (counters == NULL)
+        return;
+
+    pthread_mutex_lock(&state_lock);
+    if (!started) {
+        wanted = true;
+        pthread_mutex_unlock(&state_lock);
+        return;
+    }
+    state = BLOOM_FILLING;
+    refill = true;
+    if (!filling) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if ((errno = pthread_create(&tid, &attr, bloom_fill_thread, NULL)) != 0) {
+            fprintf(stderr, "failed spawning bloom filter thread: %s\n", strerror(errno));
+            state = BLOOM_STOPPED;
+        } else {
+            filling = true;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&state_lock);
+}
+
+/* stops using the filter, as writes no longer pass through this site */
+void bloom_stop(void) {
+    pthread_mutex_lock(&state_lock);
+    state = BLOOM_STOPPED;
+    wanted = false;
+    refill = false;
+    pthread_mutex_unlock(&state_lock);
+}
+
+/*
+ * Called once the databases are open: fills the filter, unless this is a
+ * replica or a site whose role is not settled yet.
+ */
+void bloom_start(void) {
+    bool fill;
+
+    pthread_mutex_lock(&state_lock);
+    started = true;
+    fill = wanted || !bdb_settings.is_replicated || bdb_settings.rep_whoami == MDB_MASTER;
+    pthread_mutex_unlock(&state_lock);
+    if (fill)
+        bloom_fill();
+}
+
+/* counts the keys of every partition, false if told to stop or start over */
+static bool bloom_fill_all(void) {
+    char kbuf[KEY_MAX_LENGTH];
+    u_int32_t nkbuf;
+    int part, scanned, ret;
+
+    for (part = 0; part < bdb_settings.db_parts; part++) {
+        nkbuf = 0;
+        do {
+            if (refill || state != BLOOM_FILLING || daemon_quit)
+                return false;
+            ret = item_bloom_fill(part, kbuf, &nkbuf, BLOOM_FILL_BATCH, &scanned);
+            if (ret == DB_LOCK_DEADLOCK) {
+                /* the batch is counted again, which is only too many */
+                scanned = 1;
+                continue;
+            }
+            if (ret != 0) {
+                engine_err(ret, "bloom filter fill");
+                return false;
+            }
+            pthread_mutex_lock(&state_lock);
+            filled += scanned;
+            pthread_mutex_unlock(&state_lock);
+        } while (scanned > 0);
+    }
+    return true;
+}
+
+static void *bloom_fill_thread(void *arg) {
+    bool done;
+    int i;
+
+    pthread_mutex_lock(&state_lock);
+    while (refill && state == BLOOM_FILLING) {
+        refill = false;
+        filled = 0;
+        pthread_mutex_unlock(&state_lock);
+
+        /* no write is between its check and its count while we clear */
+        for (i = 0; i < BLOOM_LOCKS; i++)
+            pthread_mutex_lock(&locks[i]);
+        memset(counters, 0, settings.bloom_size);
+        for (i = 0; i < BLOOM_LOCKS; i++)
+            pthread_mutex_unlock(&locks[i]);
+
+        done = bloom_fill_all();
+        pthread_mutex_lock(&state_lock);
+        if (done && !refill && state == BLOOM_FILLING) {
+            state = BLOOM_READY;
+            if (settings.verbose > 0)
+                fprintf(stderr, "bloom filter: %llu keys counted\n", (unsigned long long)filled);
+        }
+    }
+    filling = false;
+    pthread_mutex_unlock(&state_lock);
+    return NULL;
+}
+
+/* the state of the filter and how many keys the last fill counted */
+const char *bloom_stats(uint64_t *keys) {
+    const char *name;
+
+    pthread_mutex_lock(&state_lock);
+    *keys = filled;
+    if (counters == NULL)
+        name = "off";
+    else if (state == BLOOM_READY)
+        name = "ready";
+    else if (state == BLOOM_FILLING)
+        name = "filling";
+    else
+        name = "stopped";
+    pthread_mutex_unlock(&state_lock);
+    return name;
+}
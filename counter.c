@@ -0,0 +1,339 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+/*
+ * Write-behind counters. With -k, an incr or decr doesn't rewrite the
+ * record of its key: the value is read from the database once, kept here
+ * as a number, and the deltas add up in memory. A thread writes each
+ * counter that changed every settings.counter_interval milliseconds, and
+ * with -o a counter that took settings.counter_ops deltas since it
+ * was written is written by the incr that makes it so. A crash loses the
+ * deltas not written yet, up to one interval of them; a shutdown writes
+ * them all. A counter that saw no delta for a whole interval is let go.
+ *
+ * Reads see the value here (item_get() and item_get_multi() look first),
+ * rget sees the written one. Any other write of a key, and a delete,
+ * holds the key's lock stripe here across the database call and lets go
+ * of its counter first, so that the writer thread never writes over it.
+ */
+
+#define COUNTER_BUCKETS 16384
+
+#define COUNTER_LOCKS 256
+
+typedef struct _counter {
+    struct _counter *next;
+    uint64_t value;
+    uint64_t cas;         /* of the last record written */
+    uint32_t flags;
+    uint32_t exptime;
+    uint32_t ops;         /* deltas since it was written */
+    bool dirty;           /* has deltas not written yet */
+    bool touched;         /* took a delta this interval */
+    uint8_t nkey;
+    char key[1];
+} counter;
+
+static counter **buckets = NULL;
+static pthread_mutex_t locks[COUNTER_LOCKS];
+static pthread_t counter_ptid;
+
+static struct counter_stats {
+    uint64_t keys;        /* counters held */
+    uint64_t deltas;      /* incrs and decrs added up here */
+    uint64_t writes;      /* records written for them */
+} counter_stats;
+
+void counter_init(void) {
+    int i;
+
+    if (settings.counter_interval == 0)
+        return;
+    buckets = calloc(COUNTER_BUCKETS, sizeof(counter *));
+    if (buckets == NULL) {
+        fprintf(stderr, "Failed to allocate the counter table\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < COUNTER_LOCKS; i++)
+        pthread_mutex_init(&locks[i], NULL);
+}
+
+bool counter_enabled(void) {
+    return buckets != NULL;
+}
+
+static inline uint32_t counter_bucket(const char *key, const size_t nkey) {
+    return hash(key, nkey, 0x51ed270b) & (COUNTER_BUCKETS - 1);
+}
+
+/* the lock a write or delete of key holds, if counters are on */
+void counter_lock(const char *key, const size_t nkey) {
+    if (buckets != NULL)
+        pthread_mutex_lock(&locks[counter_bucket(key, nkey) & (COUNTER_LOCKS - 1)]);
+}
+
+void counter_unlock(const char *key, const size_t nkey) {
+    if (buckets != NULL)
+        pthread_mutex_unlock(&locks[counter_bucket(key, nkey) & (COUNTER_LOCKS - 1)]);
+}
+
+/* the counter of key, with its lock held; *prevp is what points to it */
+static counter *counter_find(const char *key, const size_t nkey, counter ***prevp) {
+    counter **prev = &buckets[counter_bucket(key, nkey)];
+    counter *c;
+
+    for (c = *prev; c != NULL; prev = &c->next, c = c->next) {
+        if (c->nkey == nkey && memcmp(c->key, key, nkey) == 0)
+            break;
+    }
+    *prevp = prev;
+    return c;
+}
+
+static void counter_unlink(counter **prev) {
+    counter *c = *prev;
+
+    *prev = c->next;
+    free(c);
+    __sync_sub_and_fetch(&counter_stats.keys, 1);
+}
+
+/* writes the record of a counter, with its lock held */
+static int counter_write(counter *c) {
+    char buf[sizeof("18446744073709551615")];
+    int vlen = sprintf(buf, "%llu", (unsigned long long)c->value);
+    item *it;
+    int ret;
+
+    if ((it = item_alloc1(c->key, c->nkey, c->flags, vlen + 2)) == NULL)
+        return -1;
+    it->exptime = c->exptime;
+    memcpy(ITEM_data(it), buf, vlen);
+    memcpy(ITEM_data(it) + vlen, "\r\n", 2);
+    if ((ret = item_counter_put(c->key, c->nkey, it)) == 0) {
+        c->cas = it->cas;
+        c->dirty = false;
+        c->ops = 0;
+        __sync_add_and_fetch(&counter_stats.writes, 1);
+    }
+    item_free(it);
+    return ret;
+}
+
+/*
+ * Lets go of the counter of key, if there is one, writing its deltas
+ * first if write is true; called by the writers of key with its lock held.
+ */
+void counter_drop(const char *key, const size_t nkey, const bool write) {
+    counter **prev, *c;
+
+    if (buckets == NULL || counter_stats.keys == 0)
+        return;
+    if ((c = counter_find(key, nkey, &prev)) == NULL)
+        return;
+    if (write && c->dirty && !ITEM_expired(c->exptime, time(NULL)))
+        (void)counter_write(c);
+    counter_unlink(prev);
+}
+
+/* an item of the value of key's counter, NULL if it has none */
+item *counter_get(const char *key, const size_t nkey) {
+    char buf[sizeof("18446744073709551615")];
+    counter **prev, *c;
+    item *it = NULL;
+    int vlen;
+
+    if (buckets == NULL || counter_stats.keys == 0)
+        return NULL;
+    counter_lock(key, nkey);
+    if ((c = counter_find(key, nkey, &prev)) != NULL && !ITEM_expired(c->exptime, time(NULL))) {
+        vlen = sprintf(buf, "%llu", (unsigned long long)c->value);
+        if ((it = item_alloc1(c->key, c->nkey, c->flags, vlen + 2)) != NULL) {
+            it->exptime = c->exptime;
+            it->cas = c->cas;
+            memcpy(ITEM_data(it), buf, vlen);
+            memcpy(ITEM_data(it) + vlen, "\r\n", 2);
+        }
+    }
+    counter_unlock(key, nkey);
+    return it;
+}
+
+/*
+ * Adds delta to the counter of key, reading it from the database first if
+ * it isn't here: the same answers as an incr or decr that writes it.
+ */
+char *counter_delta(const bool incr, const int64_t delta, char *buf, char *key, size_t nkey) {
+    counter **prev, *c;
+    item *it;
+    char *ret = buf;
+
+    counter_lock(key, nkey);
+    if ((c = counter_find(key, nkey, &prev)) != NULL && ITEM_expired(c->exptime, time(NULL))) {
+        counter_unlink(prev);
+        c = NULL;
+    }
+    if (c == NULL) {
+        if ((it = item_get_stored(key, nkey)) == NULL) {
+            counter_unlock(key, nkey);
+            return "NOT_FOUND";
+        }
+        if ((c = malloc(sizeof(counter) + nkey)) == NULL) {
+            item_free(it);
+            counter_unlock(key, nkey);
+            return "SERVER_ERROR out of memory processing arithmetic";
+        }
+        /* non-digit will cause strtoull stop, as for a written incr */
+        errno = 0;
+        c->value = strtoull(ITEM_data(it), NULL, 10);
+        if (errno == ERANGE) {
+            free(c);
+            item_free(it);
+            counter_unlock(key, nkey);
+            return "CLIENT_ERROR cannot increment or decrement non-numeric value";
+        }
+        c->cas = it->cas;
+        c->flags = it->flags;
+        c->exptime = it->exptime;
+        c->ops = 0;
+        c->dirty = false;
+        c->nkey = nkey;
+        memcpy(c->key, key, nkey);
+        c->next = *prev;
+        *prev = c;
+        __sync_add_and_fetch(&counter_stats.keys, 1);
+        item_free(it);
+    }
+
+    if (incr)
+        c->value += delta;
+    else if ((uint64_t)delta >= c->value)
+        c->value = 0;
+    else
+        c->value -= delta;
+    c->dirty = true;
+    c->touched = true;
+    c->ops++;
+    __sync_add_and_fetch(&counter_stats.deltas, 1);
+    sprintf(buf, "%llu", (unsigned long long)c->value);
+
+    if (settings.counter_ops > 0 && c->ops >= settings.counter_ops && counter_write(c) != 0)
+        ret = "SERVER_ERROR while put a item";
+    counter_unlock(key, nkey);
+    return ret;
+}
+
+/*
+ * Writes the counters that changed and lets go of the ones that didn't
+ * since the last pass, and of every one if drop is true.
+ */
+static void counter_flush(const bool drop) {
+    counter **prev, *c;
+    time_t now = time(NULL);
+    int l, b;
+
+    for (l = 0; l < COUNTER_LOCKS && counter_stats.keys > 0; l++) {
+        pthread_mutex_lock(&locks[l]);
+        for (b = l; b < COUNTER_BUCKETS; b += COUNTER_LOCKS) {
+            for (prev = &buckets[b]; (c = *prev) != NULL; ) {
+                if (ITEM_expired(c->exptime, now)) {
+                    counter_unlink(prev);
+                    continue;
+                }
+                /* one that fails to be written is tried again next time */
+                if (c->dirty && counter_write(c) != 0 && !drop) {
+                    prev = &c->next;
+                    continue;
+                }
+                if (drop || !c->touched) {
+                    counter_unlink(prev);
+                    continue;
+                }
+                c->touched = false;
+                prev = &c->next;
+            }
+        }
+        pthread_mutex_unlock(&locks[l]);
+    }
+}
+
+/* writes every counter, for atexit */
+void counter_flush_all(void) {
+    if (buckets != NULL)
+        counter_flush(true);
+}
+
+/*
+ * Lets go of every counter without writing it, once this site is a
+ * replica whose writes come in through replication.
+ */
+void counter_clear(void) {
+    counter **prev;
+    int l, b;
+
+    if (buckets == NULL)
+        return;
+    for (l = 0; l < COUNTER_LOCKS; l++) {
+        pthread_mutex_lock(&locks[l]);
+        for (b = l; b < COUNTER_BUCKETS; b += COUNTER_LOCKS) {
+            for (prev = &buckets[b]; *prev != NULL; )
+                counter_unlink(prev);
+        }
+        pthread_mutex_unlock(&locks[l]);
+    }
+}
+
+static void *counter_thread(void *arg) {
+    struct timespec ts;
+
+    ts.tv_sec = settings.counter_interval / 1000;
+    ts.tv_nsec = (settings.counter_interval % 1000) * 1000000L;
+    if (settings.verbose > 1)
+        engine_err(0, "counter thread created: %lu, a write every %d ms", (u_long)pthread_self(),
+                   settings.counter_interval);
+    while (!daemon_quit) {
+        nanosleep(&ts, NULL);
+        counter_flush(false);
+    }
+    return NULL;
+}
+
+/* called once the databases are open */
+void start_counter_thread(void) {
+    if (buckets == NULL)
+        return;
+    if ((errno = pthread_create(&counter_ptid, NULL, counter_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning counter thread: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (0 != atexit(counter_flush_all)) {
+        fprintf(stderr, "can not register the counter flush");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void counter_stats_get(uint64_t *keys, uint64_t *deltas, uint64_t *writes) {
+    *keys = counter_stats.keys;
+    *deltas = counter_stats.deltas;
+    *writes = counter_stats.writes;
+}
@@ -0,0 +1,39 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+#include "memcachedb.h"
+
+/*
+ * Bob Jenkins' one-at-a-time hash. It is cheap, needs no alignment and
+ * spreads short printable keys well enough for picking a lock stripe or
+ * a table slot. It also picks the partition a key is stored in, so keep
+ * it as it is now, or databases written with -x lose their keys.
+ */
+uint32_t hash(const void *key, size_t length, const uint32_t initval) {
+    const unsigned char *p = (const unsigned char *)key;
+    uint32_t h = initval;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        h += p[i];
+        h += (h << 10);
+        h ^= (h >> 6);
+    }
+    h += (h << 3);
+    h ^= (h >> 11);
+    h += (h << 15);
+
+    return h;
+}
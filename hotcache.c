@@ -0,0 +1,304 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Hot item cache: copies of recently read items, kept in front of Berkeley
+ * DB so that a get for a hot key needs no locker, mpool lookup or latch.
+ * It is split into HOTCACHE_SHARDS shards by key hash, each with its own
+ * lock, hash table and LRU list, and each holding at most its share of
+ * settings.hotcache_size bytes.
+ *
+ * Every write and delete of a key drops it from its shard and bumps the
+ * shard's generation once it has committed: right after the database call
+ * for one that commits by itself, after the commit for one that is part
+ * of a transaction. The mmap engine's readers don't wait for a commit, so
+ * one that took the generation in between could cache the old record for
+ * good. A reader takes the generation before it goes to the database and
+ * only fills the cache if nothing was dropped from the shard meanwhile,
+ * so a value read before a write never lands after it.
+ *
+ * Writes that come in through replication don't pass through here, so a
+ * replica doesn't use the cache, and it is flushed when the role changes.
+ */
+
+#define HOTCACHE_SHARDS 16
+
+/* entries per hash bucket we size the tables for, with small items */
+#define HOTCACHE_ITEM_GUESS 256
+
+typedef struct _hcentry {
+    struct _hcentry *hnext;      /* hash chain */
+    struct _hcentry *prev, *next; /* LRU list, most recently used first */
+    uint32_t hv;
+    size_t ntotal;               /* of the item that follows */
+} hcentry;
+
+#define HCENTRY_item(e) ((item *)((e) + 1))
+#define HCENTRY_size(e) (sizeof(hcentry) + (e)->ntotal)
+
+typedef struct {
+    pthread_mutex_t lock;
+    hcentry **table;
+    uint32_t mask;
+    hcentry *head, *tail;
+    size_t bytes, limit;
+    uint64_t items;
+    uint64_t evictions;
+    uint32_t gen;
+} __attribute__((aligned(CACHE_LINE_SIZE))) hcshard;
+
+static hcshard *shards = NULL;
+
+void hotcache_init(void) {
+    uint32_t nbuckets;
+    int i;
+
+    if (settings.hotcache_size == 0)
+        return;
+
+    shards = calloc(HOTCACHE_SHARDS, sizeof(hcshard));
+    if (shards == NULL) {
+        fprintf(stderr, "Failed to allocate the hot item cache\n");
+        exit(EXIT_FAILURE);
+    }
+    for (nbuckets = 1024; nbuckets < settings.hotcache_size / HOTCACHE_SHARDS / HOTCACHE_ITEM_GUESS; nbuckets <<= 1)
+        ;
+    for (i = 0; i < HOTCACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        shards[i].table = calloc(nbuckets, sizeof(hcentry *));
+        if (shards[i].table == NULL) {
+            fprintf(stderr, "Failed to allocate the hot item cache\n");
+            exit(EXIT_FAILURE);
+        }
+        shards[i].mask = nbuckets - 1;
+        shards[i].limit = settings.hotcache_size / HOTCACHE_SHARDS;
+    }
+}
+
+/* the cache holds only what was written through this site */
+static inline bool hotcache_usable(void) {
+    return shards != NULL
+        && (!bdb_settings.is_replicated || bdb_settings.rep_whoami == MDB_MASTER);
+}
+
+static inline hcshard *hotcache_shard(const uint32_t hv) {
+    return &shards[(hv >> 24) % HOTCACHE_SHARDS];
+}
+
+/* finds key in s, setting *pp to the link that points at it */
+static hcentry *hotcache_find(hcshard *s, const uint32_t hv, const char *key,
+                              const size_t nkey, hcentry ***pp) {
+    hcentry **p = &s->table[hv & s->mask];
+    hcentry *e;
+
+    for (e = *p; e != NULL; p = &e->hnext, e = *p) {
+        if (e->hv == hv && HCENTRY_item(e)->nkey == nkey
+            && memcmp(ITEM_key(HCENTRY_item(e)), key, nkey) == 0)
+            break;
+    }
+    *pp = p;
+    return e;
+}
+
+static void hotcache_lru_unlink(hcshard *s, hcentry *e) {
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        s->head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    else
+        s->tail = e->prev;
+}
+
+static void hotcache_lru_push(hcshard *s, hcentry *e) {
+    e->prev = NULL;
+    e->next = s->head;
+    if (s->head != NULL)
+        s->head->prev = e;
+    else
+        s->tail = e;
+    s->head = e;
+}
+
+/* takes e, found through link p, out of s and frees it */
+static void hotcache_remove(hcshard *s, hcentry *e, hcentry **p) {
+    *p = e->hnext;
+    hotcache_lru_unlink(s, e);
+    s->bytes -= HCENTRY_size(e);
+    s->items--;
+    free(e);
+}
+
+/* the same as hotcache_remove(), for an entry whose link isn't known */
+static void hotcache_drop(hcshard *s, hcentry *e) {
+    hcentry **p;
+
+    hotcache_find(s, e->hv, ITEM_key(HCENTRY_item(e)), HCENTRY_item(e)->nkey, &p);
+    hotcache_remove(s, e, p);
+}
+
+/*
+ * Returns the generation of the shard key is in, to be handed to
+ * hotcache_put() with the item read from the database afterwards.
+ */
+uint32_t hotcache_gen(const char *key, const size_t nkey) {
+    hcshard *s;
+    uint32_t gen;
+
+    if (!hotcache_usable())
+        return 0;
+    s = hotcache_shard(hash(key, nkey, 0));
+    pthread_mutex_lock(&s->lock);
+    gen = s->gen;
+    pthread_mutex_unlock(&s->lock);
+    return gen;
+}
+
+/*
+ * Returns a copy of the cached item for key, freed by the caller, or NULL
+ * if it isn't cached. An expired item is dropped and is a miss.
+ */
+item *hotcache_get(const char *key, const size_t nkey) {
+    hcshard *s;
+    hcentry *e, **p;
+    item *it = NULL;
+    uint32_t hv;
+
+    if (!hotcache_usable())
+        return NULL;
+    hv = hash(key, nkey, 0);
+    s = hotcache_shard(hv);
+    pthread_mutex_lock(&s->lock);
+    if ((e = hotcache_find(s, hv, key, nkey, &p)) != NULL) {
+        if (ITEM_expired(HCENTRY_item(e)->exptime, time(NULL))) {
+            hotcache_remove(s, e, p);
+        } else {
+            hotcache_lru_unlink(s, e);
+            hotcache_lru_push(s, e);
+            if ((it = item_alloc2(e->ntotal)) != NULL)
+                memcpy(it, HCENTRY_item(e), e->ntotal);
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    if (it != NULL)
+        thread_stats()->hotcache_hits++;
+    else
+        thread_stats()->hotcache_misses++;
+    return it;
+}
+
+/*
+ * Caches a copy of it, unless its shard has seen a write since gen was
+ * taken with hotcache_gen(). Items bigger than a sixteenth of a shard are
+ * not cached, so that one of them can't push out all the rest.
+ */
+void hotcache_put(const item *it, const uint32_t gen) {
+    hcshard *s;
+    hcentry *e, *old, **p;
+    size_t ntotal = ITEM_ntotal(it);
+    uint32_t hv;
+
+    if (!hotcache_usable())
+        return;
+    hv = hash(ITEM_key(it), it->nkey, 0);
+    s = hotcache_shard(hv);
+    if (sizeof(hcentry) + ntotal > s->limit / 16)
+        return;
+    if ((e = malloc(sizeof(hcentry) + ntotal)) == NULL)
+        return;
+    e->hv = hv;
+    e->ntotal = ntotal;
+    memcpy(HCENTRY_item(e), it, ntotal);
+    HCENTRY_item(e)->nsuffix = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->gen != gen) {
+        pthread_mutex_unlock(&s->lock);
+        free(e);
+        return;
+    }
+    if ((old = hotcache_find(s, hv, ITEM_key(it), it->nkey, &p)) != NULL)
+        hotcache_remove(s, old, p);
+    while (s->tail != NULL && s->bytes + HCENTRY_size(e) > s->limit) {
+        hotcache_drop(s, s->tail);
+        s->evictions++;
+    }
+    e->hnext = s->table[hv & s->mask];
+    s->table[hv & s->mask] = e;
+    hotcache_lru_push(s, e);
+    s->bytes += HCENTRY_size(e);
+    s->items++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* drops key, called for every write and delete of it */
+void hotcache_invalidate(const char *key, const size_t nkey) {
+    hcshard *s;
+    hcentry *e, **p;
+    uint32_t hv;
+
+    if (shards == NULL)
+        return;
+    hv = hash(key, nkey, 0);
+    s = hotcache_shard(hv);
+    pthread_mutex_lock(&s->lock);
+    s->gen++;
+    if ((e = hotcache_find(s, hv, key, nkey, &p)) != NULL)
+        hotcache_remove(s, e, p);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* drops everything, when the replication role changes */
+void hotcache_flush(void) {
+    hcshard *s;
+    int i;
+
+    if (shards == NULL)
+        return;
+    for (i = 0; i < HOTCACHE_SHARDS; i++) {
+        s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        s->gen++;
+        while (s->head != NULL)
+            hotcache_drop(s, s->head);
+        pthread_mutex_unlock(&s->lock);
+    }
+}
+
+/* sums up the shards for the stats command */
+void hotcache_stats(uint64_t *items, uint64_t *bytes, uint64_t *evictions) {
+    hcshard *s;
+    int i;
+
+    *items = *bytes = *evictions = 0;
+    if (shards == NULL)
+        return;
+    for (i = 0; i < HOTCACHE_SHARDS; i++) {
+        s = &shards[i];
+        pthread_mutex_lock(&s->lock);
+        *items += s->items;
+        *bytes += s->bytes;
+        *evictions += s->evictions;
+        pthread_mutex_unlock(&s->lock);
+    }
+}
@@ -0,0 +1,258 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/*
+ * Hot keys. With -I <num>, one in HOTKEY_SAMPLE of the gets, stores and
+ * incrs/decrs of each thread is sampled, picked by a hash of their count.
+ * Each sampled key is counted in a count-min sketch, HOTKEY_ROWS rows of
+ * HOTKEY_WIDTH counters. The sketch
+ * over-counts a key by what it shares its counters with, but never
+ * under-counts it. The <num> keys with the highest counts are kept in a
+ * min-heap, so that a key whose count passes the coolest one's takes its
+ * place. "stats hotkeys" lists them with their count, scaled up to
+ * operations, and how many of each kind the key took since it got in.
+ *
+ * It all sits behind one lock, taken by one operation in HOTKEY_SAMPLE.
+ */
+
+/* must stay 16, the top 4 bits of the hash pick the samples */
+#define HOTKEY_SAMPLE 16
+
+#define HOTKEY_ROWS 4
+
+#define HOTKEY_WIDTH 4096
+
+typedef struct {
+    uint64_t count;                 /* sketch estimate of the samples */
+    uint64_t kinds[HOTKEY_NKINDS];  /* samples by kind since it got in */
+    int next;                       /* in its index chain, -1 at the end */
+    int pos;                        /* in the heap */
+    uint8_t nkey;
+    char key[KEY_MAX_LENGTH];
+} hotkey;
+
+static const char *hotkey_kinds[HOTKEY_NKINDS] = { "get", "set", "incr" };
+
+static uint32_t (*sketch)[HOTKEY_WIDTH] = NULL;
+static hotkey *keys;        /* settings.hotkeys of them, nkeys in use */
+static int *heap;           /* into keys, the lowest count first */
+static int *index_heads;    /* chains of keys by key hash */
+static int nkeys, nheads;
+static uint64_t samples;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void hotkeys_clear(void) {
+    int i;
+
+    memset(sketch, 0, sizeof(uint32_t) * HOTKEY_ROWS * HOTKEY_WIDTH);
+    for (i = 0; i < nheads; i++)
+        index_heads[i] = -1;
+    nkeys = 0;
+    samples = 0;
+}
+
+void hotkeys_init(void) {
+    if (settings.hotkeys == 0)
+        return;
+    for (nheads = 1; nheads < settings.hotkeys * 2; nheads *= 2)
+        ;
+    sketch = malloc(sizeof(uint32_t) * HOTKEY_ROWS * HOTKEY_WIDTH);
+    keys = malloc(sizeof(hotkey) * settings.hotkeys);
+    heap = malloc(sizeof(int) * settings.hotkeys);
+    index_heads = malloc(sizeof(int) * nheads);
+    if (sketch == NULL || keys == NULL || heap == NULL || index_heads == NULL) {
+        fprintf(stderr, "Failed to allocate the hot key tracker\n");
+        exit(EXIT_FAILURE);
+    }
+    hotkeys_clear();
+}
+
+/* the sketch counters of a key, bumped, and the estimate they give */
+static uint64_t sketch_add(const char *key, const size_t nkey, uint32_t *hv) {
+    uint32_t h1 = hash(key, nkey, 0x7f4a7c15), h2 = hash(key, nkey, 0x2c1b3c6d) | 1;
+    uint32_t min = UINT32_MAX;
+    int r;
+
+    for (r = 0; r < HOTKEY_ROWS; r++) {
+        uint32_t *cnt = &sketch[r][(h1 + r * h2) & (HOTKEY_WIDTH - 1)];
+        if (*cnt < UINT32_MAX)
+            (*cnt)++;
+        if (*cnt < min)
+            min = *cnt;
+    }
+    *hv = h1;
+    return min;
+}
+
+static void heap_swap(const int a, const int b) {
+    int t = heap[a];
+
+    heap[a] = heap[b];
+    heap[b] = t;
+    keys[heap[a]].pos = a;
+    keys[heap[b]].pos = b;
+}
+
+/* moves the key at heap position i down, its count having grown */
+static void heap_down(int i) {
+    int l, m;
+
+    for (;;) {
+        l = 2 * i + 1;
+        m = i;
+        if (l < nkeys && keys[heap[l]].count < keys[heap[m]].count)
+            m = l;
+        if (l + 1 < nkeys && keys[heap[l + 1]].count < keys[heap[m]].count)
+            m = l + 1;
+        if (m == i)
+            return;
+        heap_swap(i, m);
+        i = m;
+    }
+}
+
+static void heap_up(int i) {
+    while (i > 0 && keys[heap[i]].count < keys[heap[(i - 1) / 2]].count) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void index_unlink(const int k) {
+    int *p = &index_heads[hash(keys[k].key, keys[k].nkey, 0x7f4a7c15) & (nheads - 1)];
+
+    while (*p != k)
+        p = &keys[*p].next;
+    *p = keys[k].next;
+}
+
+/* called for each get, store and incr or decr of a key */
+void hotkey_touch(const char *key, const size_t nkey, const int kind) {
+    struct thread_stats *ts;
+    uint64_t est;
+    uint32_t hv;
+    int k;
+
+    if (sketch == NULL || nkey == 0 || nkey > KEY_MAX_LENGTH)
+        return;
+    /* not every HOTKEY_SAMPLE-th in a row, which would never see the
+       sets of a client that sets a key and then gets it */
+    ts = thread_stats();
+    if ((ts->hotkey_ops++ * 0x9e3779b97f4a7c15ULL) >> 60 != 0)
+        return;
+
+    pthread_mutex_lock(&lock);
+    samples++;
+    est = sketch_add(key, nkey, &hv);
+    for (k = index_heads[hv & (nheads - 1)]; k != -1; k = keys[k].next) {
+        if (keys[k].nkey == nkey && memcmp(keys[k].key, key, nkey) == 0)
+            break;
+    }
+    if (k != -1) {
+        keys[k].count = est;
+        keys[k].kinds[kind]++;
+        heap_down(keys[k].pos);
+    } else if (nkeys < settings.hotkeys || est > keys[heap[0]].count) {
+        if (nkeys < settings.hotkeys) {
+            k = nkeys;
+            heap[nkeys] = k;
+            keys[k].pos = nkeys++;
+        } else {
+            /* the coolest key makes room */
+            k = heap[0];
+            index_unlink(k);
+        }
+        keys[k].count = est;
+        memset(keys[k].kinds, 0, sizeof(keys[k].kinds));
+        keys[k].kinds[kind] = 1;
+        keys[k].nkey = nkey;
+        memcpy(keys[k].key, key, nkey);
+        keys[k].next = index_heads[hv & (nheads - 1)];
+        index_heads[hv & (nheads - 1)] = k;
+        heap_up(keys[k].pos);
+        heap_down(keys[k].pos);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static int hotkey_cmp(const void *a, const void *b) {
+    const hotkey *ka = (const hotkey *)a;
+    const hotkey *kb = (const hotkey *)b;
+
+    if (ka->count != kb->count)
+        return ka->count > kb->count ? -1 : 1;
+    return item_key_cmp(ka->key, ka->nkey, kb->key, kb->nkey);
+}
+
+/*
+ * Writes the "stats hotkeys" report, hottest first, into a newly
+ * malloc()ed buffer. Returns NULL if out of memory; otherwise *buflen is
+ * the length of the report.
+ */
+char *hotkeys_stats(int *buflen) {
+    hotkey *copy = NULL;
+    uint64_t nsamples;
+    char *buf, *pos;
+    int i, j, n;
+
+    if (sketch != NULL && (copy = malloc(sizeof(hotkey) * settings.hotkeys)) == NULL)
+        return NULL;
+    if ((buf = malloc((size_t)settings.hotkeys * (KEY_MAX_LENGTH + 128) + 256)) == NULL) {
+        free(copy);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    n = nkeys;
+    nsamples = samples;
+    if (copy != NULL)
+        memcpy(copy, keys, sizeof(hotkey) * n);
+    pthread_mutex_unlock(&lock);
+    if (n > 0)
+        qsort(copy, n, sizeof(hotkey), hotkey_cmp);
+
+    pos = buf;
+    pos += sprintf(pos, "STAT hotkeys_tracked %d\r\n", settings.hotkeys);
+    pos += sprintf(pos, "STAT hotkeys_sample %d\r\n", HOTKEY_SAMPLE);
+    pos += sprintf(pos, "STAT hotkeys_samples %llu\r\n", (unsigned long long)nsamples);
+    for (i = 0; i < n; i++) {
+        pos += sprintf(pos, "STAT %.*s ops %llu", copy[i].nkey, copy[i].key,
+                       (unsigned long long)copy[i].count * HOTKEY_SAMPLE);
+        for (j = 0; j < HOTKEY_NKINDS; j++)
+            pos += sprintf(pos, " %s %llu", hotkey_kinds[j],
+                           (unsigned long long)copy[i].kinds[j] * HOTKEY_SAMPLE);
+        pos += sprintf(pos, "\r\n");
+    }
+    pos += sprintf(pos, "END\r\n");
+    free(copy);
+
+    *buflen = pos - buf;
+    return buf;
+}
+
+/* forgets every key and count, for "stats hotkeys reset" */
+void hotkeys_reset(void) {
+    if (sketch == NULL)
+        return;
+    pthread_mutex_lock(&lock);
+    hotkeys_clear();
+    pthread_mutex_unlock(&lock);
+}
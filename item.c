@@ -20,6 +20,7 @@
 #include "memcachedb.h"
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -27,263 +28,861 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <stdlib.h>
+#include <time.h>
+#include <netinet/in.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
 
-#define MAX_ITEM_FREELIST_LENGTH 4000
-#define INIT_ITEM_FREELIST_LENGTH 500
+/* a multiget bulk read asks for this many database pages at a time */
+#define MGET_BULK_PAGES 4
 
-static size_t item_make_header(const uint8_t nkey, const int flags, const int nbytes, char *suffix, uint8_t *nsuffix);
+/* Number of slots in the record size hint table, must be a power of two */
+#define SIZE_HINT_COUNT (64 * 1024)
 
-static item **freeitem;
-static int freeitemtotal;
-static int freeitemcurr;
+/* a cas that keeps running into deadlocks gives up after this many */
+#define CAS_MAX_TRIES 10
+
+/* the length of the data in front of an LZ4 block, see RECORD_LZ4 */
+#define LZ4_PREFIX 4
+
+/* a value is stored compressed only if that saves 1/COMPRESS_MIN_GAIN of it */
+#define COMPRESS_MIN_GAIN 8
+
+/* where item_get() reads a record into an item buffer, so that the data
+   lands at ITEM_data() and the record header just in front of it */
+#define ITEM_RECORD_OFFSET(nkey) (sizeof(item) + (nkey) + 1 + ITEM_SUFFIX_SIZE - sizeof(record_header))
+
+/* records as written before record_header, still read and converted */
+typedef struct {
+    int             nbytes;     /* size of data, w/terminating CRLF */
+    uint8_t         nsuffix;
+    uint8_t         nkey;
+    void * end[];
+    /* then null-terminated key, " flags length\r\n", data with CRLF */
+} legacy_item;
+
+/*
+ * Last seen record size for keys hashing to each slot. item_get() sizes
+ * its first buffer from it, so a hit larger than item_buf_size costs one
+ * allocation and one copy instead of a DB_BUFFER_SMALL round trip. Slots
+ * are plain words, read and written without locking: a stale or racy
+ * value only costs the retry we would have paid anyway.
+ */
+static uint32_t *size_hints;
+
+/* last cas handed out; seeded from the clock so it keeps growing across
+   restarts */
+static uint64_t cas_id;
+static pthread_mutex_t cas_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void item_init(void) {
-    freeitemtotal = INIT_ITEM_FREELIST_LENGTH;
-    freeitemcurr  = 0;
+    slabs_init();
+    cas_id = (uint64_t)time(NULL) << 20;
 
-    freeitem = (item **)malloc( sizeof(item *) * freeitemtotal );
-    if (freeitem == NULL) {
-        perror("malloc()");
+    size_hints = (uint32_t *)calloc(SIZE_HINT_COUNT, sizeof(uint32_t));
+    if (size_hints == NULL) {
+        perror("calloc()");
     }
     return;
 }
 
-/*
- * Returns a item buffer from the freelist, if any. Sholud call
- * item_from_freelist for thread safty.
- * */
-item *do_item_from_freelist(void) {
-    item *s;
-
-    if (freeitemcurr > 0) {
-        s = freeitem[--freeitemcurr];
-    } else {
-        /* If malloc fails, let the logic fall through without spamming
-         * STDERR on the server. */
-        s = (item *)malloc( settings.item_buf_size );
-        if (s != NULL){
-            memset(s, 0, settings.item_buf_size);
-        }
+static inline uint32_t *size_hint(char *key, size_t nkey) {
+    if (size_hints == NULL)
+        return NULL;
+    return &size_hints[hash(key, nkey, 0) & (SIZE_HINT_COUNT - 1)];
+}
+
+static inline void size_hint_update(uint32_t *hint, const uint32_t size) {
+    /* skip the store (and the cache line bounce) if nothing changed */
+    if (hint != NULL && *hint != size)
+        *hint = size;
+}
+
+static uint64_t item_next_cas(void) {
+    uint64_t cas;
+
+    pthread_mutex_lock(&cas_lock);
+    cas = ++cas_id;
+    pthread_mutex_unlock(&cas_lock);
+    return cas;
+}
+
+static uint64_t item_hton64(uint64_t v) {
+    unsigned char b[8];
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        b[i] = v & 0xff;
+        v >>= 8;
     }
+    memcpy(&v, b, 8);
+    return v;
+}
 
-    return s;
+static uint64_t item_ntoh64(const uint64_t v) {
+    unsigned char b[8];
+    uint64_t res = 0;
+    int i;
+
+    memcpy(b, &v, 8);
+    for (i = 0; i < 8; i++) {
+        res = (res << 8) | b[i];
+    }
+    return res;
 }
 
 /*
- * Adds a item to the freelist. Should call 
- * item_add_to_freelist for thread safty.
+ * Writes the record header describing hdr to rec, which need not be
+ * aligned.
  */
-int do_item_add_to_freelist(item *it) {
-    if (freeitemcurr < freeitemtotal) {
-        freeitem[freeitemcurr++] = it;
-        return 0;
-    } else {
-        if (freeitemtotal >= MAX_ITEM_FREELIST_LENGTH){
-            return 1;
-        }
-        /* try to enlarge free item buffer array */
-        item **new_freeitem = (item **)realloc(freeitem, sizeof(item *) * freeitemtotal * 2);
-        if (new_freeitem) {
-            freeitemtotal *= 2;
-            freeitem = new_freeitem;
-            freeitem[freeitemcurr++] = it;
+static void item_record_encode(void *rec, const item *hdr) {
+    record_header rh;
+
+    rh.magic = RECORD_MAGIC;
+    rh.version = RECORD_VERSION;
+    rh.iflags = htons(hdr->iflags);
+    rh.flags = htonl(hdr->flags);
+    rh.nbytes = htonl(hdr->nbytes - 2);
+    rh.exptime = htonl(hdr->exptime);
+    rh.cas = item_hton64(hdr->cas);
+    memcpy(rec, &rh, sizeof(rh));
+}
+
+/*
+ * Decodes a record read from the database into the nbytes, flags, cas,
+ * exptime and iflags of hdr, and points *data at its data, which has
+ * hdr->nbytes - 2 bytes and may not be followed by a CRLF.
+ *
+ * Returns 0 for a record in the current format, 1 for one in the legacy
+ * format, -1 if it is neither.
+ */
+int item_record_decode(const void *rec, const size_t nrec, item *hdr, const char **data) {
+    record_header rh;
+    legacy_item li;
+    const char *p;
+
+    if (nrec >= sizeof(rh)) {
+        memcpy(&rh, rec, sizeof(rh));
+        if (rh.magic == RECORD_MAGIC && rh.version == RECORD_VERSION
+            && ntohl(rh.nbytes) == nrec - sizeof(rh)) {
+            hdr->nbytes = ntohl(rh.nbytes) + 2;
+            hdr->iflags = ntohs(rh.iflags);
+            hdr->flags = ntohl(rh.flags);
+            hdr->exptime = ntohl(rh.exptime);
+            hdr->cas = item_ntoh64(rh.cas);
+            *data = (const char *)rec + sizeof(rh);
             return 0;
         }
     }
-    return 1;
+
+    if (nrec >= sizeof(li)) {
+        memcpy(&li, rec, sizeof(li));
+        p = (const char *)rec + sizeof(li);
+        if (li.nbytes >= 2 && li.nsuffix > 0
+            && sizeof(li) + li.nkey + 1 + li.nsuffix + li.nbytes == nrec
+            && p[li.nkey] == '\0' && p[li.nkey + 1] == ' '
+            && memcmp(p + nrec - sizeof(li) - 2, "\r\n", 2) == 0) {
+            hdr->nbytes = li.nbytes;
+            hdr->iflags = 0;
+            /* the suffix ends with CRLF, so strtoul stops in time */
+            hdr->flags = (uint32_t)strtoul(p + li.nkey + 1, NULL, 10);
+            hdr->exptime = 0;
+            hdr->cas = 0;
+            *data = p + li.nkey + 1 + li.nsuffix;
+            return 1;
+        }
+    }
+    return -1;
 }
 
-/**
- * Generates the variable-sized part of the header for an object.
- *
- * key     - The key
- * nkey    - The length of the key
- * flags   - key flags
- * nbytes  - Number of bytes to hold value and addition CRLF terminator
- * suffix  - Buffer for the "VALUE" line suffix (flags, size).
- * nsuffix - The length of the suffix is stored here.
- *
- * Returns the total size of the header.
+/*
+ * The length of the data of the record hdr and data were decoded from,
+ * once inflated, or -1 if it is compressed and broken, or compressed and
+ * this build has no LZ4.
  */
-static size_t item_make_header(const uint8_t nkey, const int flags, const int nbytes,
-                     char *suffix, uint8_t *nsuffix) {
-    /* suffix is defined at 40 chars elsewhere.. */
-    *nsuffix = (uint8_t) snprintf(suffix, 40, " %d %d\r\n", flags, nbytes - 2);
-    return sizeof(item) + nkey + *nsuffix + nbytes;
+int item_record_length(const item *hdr, const char *data) {
+    if (!(hdr->iflags & RECORD_LZ4))
+        return hdr->nbytes - 2;
+#ifdef HAVE_LZ4
+    if (hdr->nbytes - 2 > LZ4_PREFIX) {
+        uint32_t len;
+
+        memcpy(&len, data, LZ4_PREFIX);
+        len = ntohl(len);
+        if (len <= INT_MAX - 2)
+            return (int)len;
+    }
+#endif
+    return -1;
 }
 
 /*
- * alloc a item buffer, and init it.
+ * Inflates the data of a compressed record into dst, which has room for
+ * the ndst bytes item_record_length() gave. Returns 0, or -1 if it does
+ * not inflate to exactly that.
+ */
+int item_record_inflate(const item *hdr, const char *data, char *dst, const int ndst) {
+#ifdef HAVE_LZ4
+    struct thread_stats *ts = thread_stats();
+    uint64_t start = latency_now();
+    int n;
+
+    n = LZ4_decompress_safe(data + LZ4_PREFIX, dst, hdr->nbytes - 2 - LZ4_PREFIX, ndst);
+    ts->decompress_usec += latency_now() - start;
+    ts->decompressed_items++;
+    return n == ndst ? 0 : -1;
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Compresses the data of it, for a value of at least compress_min bytes.
+ * Returns the record to store instead of ITEM_record(it), with the header
+ * built, setting *nrec to its size; it is freed by the caller. NULL means
+ * store it as it is: compression is off, the value is too small, it did
+ * not shrink enough, or out of memory.
+ */
+static void *item_deflate(const item *it, u_int32_t *nrec) {
+#ifdef HAVE_LZ4
+    struct thread_stats *ts;
+    item hdr;
+    char *rec;
+    uint64_t start;
+    uint32_t len;
+    int n = it->nbytes - 2, bound, out;
+
+    if (settings.compress_min == 0 || n < settings.compress_min)
+        return NULL;
+    bound = LZ4_compressBound(n);
+    if (bound <= 0 || (rec = malloc(sizeof(record_header) + LZ4_PREFIX + bound)) == NULL)
+        return NULL;
+
+    ts = thread_stats();
+    start = latency_now();
+    out = LZ4_compress_default(ITEM_data(it), rec + sizeof(record_header) + LZ4_PREFIX, n, bound);
+    ts->compress_usec += latency_now() - start;
+    if (out <= 0 || LZ4_PREFIX + out > n - n / COMPRESS_MIN_GAIN) {
+        ts->compress_rejected++;
+        free(rec);
+        return NULL;
+    }
+
+    memcpy(&hdr, it, sizeof(hdr));
+    hdr.iflags |= RECORD_LZ4;
+    hdr.nbytes = LZ4_PREFIX + out + 2;
+    item_record_encode(rec, &hdr);
+    len = htonl((uint32_t)n);
+    memcpy(rec + sizeof(record_header), &len, LZ4_PREFIX);
+
+    ts->compressed_items++;
+    ts->compress_in_bytes += n;
+    ts->compress_out_bytes += LZ4_PREFIX + out;
+    *nrec = sizeof(record_header) + LZ4_PREFIX + out;
+    return rec;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * alloc a item buffer, and init it. The suffix is not built here, see
+ * item_make_suffix().
  */
 item *item_alloc1(char *key, const size_t nkey, const int flags, const int nbytes) {
-    uint8_t nsuffix;
     item *it;
-    char suffix[40];
-    size_t ntotal = item_make_header(nkey + 1, flags, nbytes, suffix, &nsuffix);
+    size_t ntotal = sizeof(item) + nkey + 1 + ITEM_SUFFIX_SIZE + nbytes;
 
-    if (ntotal > settings.item_buf_size){
-        it = (item *)malloc(ntotal);
-        if (it == NULL){
-            return NULL;
-        }
-        memset(it, 0, ntotal);
-        if (settings.verbose > 1) {
-            fprintf(stderr, "alloc a item buffer from malloc.\n");
-        }
-    }else{
-        it = item_from_freelist();
-        if (it == NULL){
-            return NULL;
-        }
-        if (settings.verbose > 1) {
-            fprintf(stderr, "alloc a item buffer from freelist.\n");
-        }
+    it = (item *)slabs_alloc(ntotal);
+    if (it == NULL){
+        return NULL;
     }
 
     it->nkey = nkey;
     it->nbytes = nbytes;
-    strcpy(ITEM_key(it), key);
-    memcpy(ITEM_suffix(it), suffix, (size_t)nsuffix);
-    it->nsuffix = nsuffix;
+    it->nsuffix = 0;
+    it->iflags = 0;
+    it->flags = (uint32_t)flags;
+    it->exptime = 0;
+    it->cas = 0;
+    memcpy(ITEM_key(it), key, nkey);
+    ITEM_key(it)[nkey] = '\0';
     return it;
 }
 
 /*
- * alloc a item buffer only.
+ * Builds the " flags length [cas]\r\n" suffix right in front of the data,
+ * for sending ITEM_suffix() and the data as one piece.
  */
-item *item_alloc2(size_t ntotal) {
-    item *it;
-    if (ntotal > settings.item_buf_size){
-        it = (item *)malloc(ntotal);
-        if (it == NULL){
-            return NULL;
-        }
-        memset(it, 0, ntotal);
+void item_make_suffix(item *it, const bool return_cas) {
+    char suffix[ITEM_SUFFIX_SIZE];
+    int n;
+
+    if (return_cas)
+        n = snprintf(suffix, sizeof(suffix), " %u %d %llu\r\n", it->flags, it->nbytes - 2,
+                     (unsigned long long)it->cas);
+    else
+        n = snprintf(suffix, sizeof(suffix), " %u %d\r\n", it->flags, it->nbytes - 2);
+
+    it->nsuffix = (uint8_t)n;
+    memcpy(ITEM_suffix(it), suffix, n);
+}
+
+/*
+ * Turns the exptime a client sent into the unix time the item expires:
+ * 0 is never, up to REALTIME_MAXDELTA seconds is relative to now, more is
+ * a unix time already. A negative exptime has expired already.
+ */
+uint32_t item_exptime(const int64_t exptime) {
+    if (exptime == 0)
+        return 0;
+    if (exptime < 0)
+        return 1;
+    if (exptime > REALTIME_MAXDELTA)
+        return exptime > UINT32_MAX ? UINT32_MAX : (uint32_t)exptime;
+    return (uint32_t)(time(NULL) + exptime);
+}
+
+/*
+ * Makes a new item from a record of either format, copying the data, or
+ * inflating it if it is compressed. Returns NULL if out of memory, or the
+ * record is not valid or expired.
+ */
+item *item_from_record(char *key, const size_t nkey, const void *rec, const size_t nrec) {
+    item hdr, *it;
+    const char *data;
+    int n = -1;
+
+    if (item_record_decode(rec, nrec, &hdr, &data) < 0
+        || (n = item_record_length(&hdr, data)) < 0) {
         if (settings.verbose > 1) {
-            fprintf(stderr, "alloc a item buffer from malloc.\n");
-        }
-    }else{
-        it = item_from_freelist();
-        if (it == NULL){
-            return NULL;
+            fprintf(stderr, "bad record for key %.*s\n", (int)nkey, key);
         }
+        return NULL;
+    }
+    if (ITEM_expired(hdr.exptime, time(NULL)))
+        return NULL;
+    it = item_alloc1(key, nkey, hdr.flags, n + 2);
+    if (it == NULL)
+        return NULL;
+    if (!(hdr.iflags & RECORD_LZ4)) {
+        memcpy(ITEM_data(it), data, n);
+    } else if (item_record_inflate(&hdr, data, ITEM_data(it), n) != 0) {
         if (settings.verbose > 1) {
-            fprintf(stderr, "alloc a item buffer from freelist.\n");
+            fprintf(stderr, "bad compressed record for key %.*s\n", (int)nkey, key);
         }
+        item_free(it);
+        return NULL;
     }
-
+    memcpy(ITEM_data(it) + n, "\r\n", 2);
+    /* the item holds the data as it is, whatever the record did */
+    it->iflags = hdr.iflags & ~RECORD_LZ4;
+    it->exptime = hdr.exptime;
+    it->cas = hdr.cas;
     return it;
 }
 
 /*
- * free a item buffer. here 'it' must be a full item.
+ * alloc a item buffer only.
  */
+item *item_alloc2(size_t ntotal) {
+    return (item *)slabs_alloc(ntotal);
+}
 
+/*
+ * free a item buffer. 'it' need not be a full item, the slab chunk knows
+ * its own size.
+ */
 int item_free(item *it) {
-    size_t ntotal = 0;
     if (NULL == it)
         return 0;
 
-    /* ntotal may be wrong, if 'it' is not a full item. */
-    ntotal = ITEM_ntotal(it);
-    if (ntotal > settings.item_buf_size){
-        if (settings.verbose > 1) {
-            fprintf(stderr, "ntotal: %d, use free() directly.\n", ntotal);
-        }
-        free(it);   
-    }else{
-        if (0 != item_add_to_freelist(it)) {
-            if (settings.verbose > 1) {
-                fprintf(stderr, "ntotal: %d, add a item buffer to freelist fail, use free() directly.\n", ntotal);
-            }
-            free(it);   
-        }else{
-            if (settings.verbose > 1) {
-                fprintf(stderr, "ntotal: %d, add a item buffer to freelist.\n", ntotal);
-            }
-        }
-    }
+    slabs_free(it);
     return 0;
 }
 
-/* if return item is not NULL, free by caller */
-item *item_get(char *key, size_t nkey){
-    item *it = NULL;
-    DBT dbkey, dbdata;
+/*
+ * If return item is not NULL, free by caller. The record is read straight
+ * into the item buffer, so that only records in the legacy format need a
+ * copy, and compressed ones inflating.
+ */
+static item *item_get_db(char *key, size_t nkey){
+    item *it = NULL, *old_it;
+    item hdr;
+    void *rec;
+    u_int32_t nrec;
+    const char *data;
     bool stop;
     int ret;
-    
-    /* first, alloc a fixed size */
-    it = item_alloc2(settings.item_buf_size);
+    uint32_t *hint = size_hint(key, nkey);
+    size_t offset = ITEM_RECORD_OFFSET(nkey);
+    size_t bufsize = settings.item_buf_size;
+    int part = db_part_index(key, nkey);
+
+    if (!bloom_maybe(key, nkey)) {
+        thread_stats()->bloom_negatives++;
+        return NULL;
+    }
+
+    /* first, alloc what this key needed last time, at least a fixed size */
+    if (hint != NULL && offset + *hint + 2 > bufsize) {
+        bufsize = offset + *hint + 2;
+    }
+    if (bufsize < offset + sizeof(record_header) + 2) {
+        bufsize = offset + sizeof(record_header) + 2;
+    }
+    it = item_alloc2(bufsize);
     if (it == 0) {
         return NULL;
     }
 
-    BDB_CLEANUP_DBT();
-    dbkey.data = key;
-    dbkey.size = nkey;
-    dbdata.ulen = settings.item_buf_size;
-    dbdata.data = it;
-    dbdata.flags = DB_DBT_USERMEM;
+    rec = (char *)it + offset;
 
+    thread_stats()->part_reads[part]++;
     stop = false;
-    /* try to get a item from bdb */
+    /* try to get a item from the engine, keeping room for the CRLF after the data */
     while (!stop) {
-        switch (ret = dbp->get(dbp, NULL, &dbkey, &dbdata, 0)) {
+        switch (ret = engine->get(part, NULL, key, nkey, rec, bufsize - offset - 2, &nrec, 0)) {
         case DB_BUFFER_SMALL:    /* user mem small */
-            /* free the original smaller buffer */
+            /* free the original smaller buffer, it holds nothing yet */
             item_free(it);
             /* alloc the correct size */
-            it = item_alloc2(dbdata.size);
+            bufsize = offset + nrec + 2;
+            it = item_alloc2(bufsize);
             if (it == NULL) {
                 return NULL;
             }
-            dbdata.ulen = dbdata.size;
-            dbdata.data = it;
+            rec = (char *)it + offset;
             break;
         case 0:                  /* Success. */
             stop = true;
+            size_hint_update(hint, nrec);
+            warm_touch(key, nkey);
             break;
         case DB_NOTFOUND:
             stop = true;
             item_free(it);
             it = NULL;
+            if (bloom_ready())
+                thread_stats()->bloom_false_positives++;
             break;
         default:
-            /* TODO: may cause bug here, if return DB_BUFFER_SMALL then retun non-zero again
-             * here 'it' may not a full one. a item buffer larger than item_buf_size may be added to freelist */
             stop = true;
             item_free(it);
             it = NULL;
             if (settings.verbose > 1) {
-                fprintf(stderr, "dbp->get: %s\n", db_strerror(ret));
+                fprintf(stderr, "engine->get: %s\n", db_strerror(ret));
             }
         }
     }
+    if (it == NULL)
+        return NULL;
+
+    if (item_record_decode(rec, nrec, &hdr, &data) == 0 && !(hdr.iflags & RECORD_LZ4)) {
+        /* an expired record is a miss, the sweeper deletes it later */
+        if (ITEM_expired(hdr.exptime, time(NULL))) {
+            item_free(it);
+            return NULL;
+        }
+        /* the record header is in front of the data already, fill in the rest */
+        it->nkey = nkey;
+        it->nbytes = hdr.nbytes;
+        it->nsuffix = 0;
+        it->iflags = hdr.iflags;
+        it->flags = hdr.flags;
+        it->exptime = hdr.exptime;
+        it->cas = hdr.cas;
+        memcpy(ITEM_key(it), key, nkey);
+        ITEM_key(it)[nkey] = '\0';
+        memcpy(ITEM_data(it) + it->nbytes - 2, "\r\n", 2);
+        return it;
+    }
+
+    /* a legacy or compressed record, or a bad one */
+    old_it = it;
+    it = item_from_record(key, nkey, rec, nrec);
+    item_free(old_it);
+    return it;
+}
+
+/*
+ * Looks in the hot item cache first, then in the database, caching what
+ * it finds there. If return item is not NULL, free by caller.
+ */
+item *item_get_stored(char *key, size_t nkey){
+    item *it;
+    uint32_t gen;
+
+    if ((it = hotcache_get(key, nkey)) != NULL)
+        return it;
+    gen = hotcache_gen(key, nkey);
+    if ((it = item_get_db(key, nkey)) != NULL)
+        hotcache_put(it, gen);
     return it;
 }
 
+/* the same, but a write-behind counter is read at its latest value */
+item *item_get(char *key, size_t nkey){
+    item *it;
+
+    if ((it = counter_get(key, nkey)) != NULL)
+        return it;
+    return item_get_stored(key, nkey);
+}
+
+/*
+ * Compares two keys the way the default btree comparison orders them:
+ * bytewise, with a key sorting before any longer key it is a prefix of.
+ */
+int item_key_cmp(const void *a, const size_t na, const void *b, const size_t nb) {
+    int res = memcmp(a, b, na < nb ? na : nb);
+
+    if (res != 0)
+        return res;
+    return na < nb ? -1 : (na > nb ? 1 : 0);
+}
+
+/* by partition, then by key */
+static int mget_key_cmp(const void *a, const void *b) {
+    const mget_key *ka = *(const mget_key **)a;
+    const mget_key *kb = *(const mget_key **)b;
+
+    if (ka->part != kb->part)
+        return ka->part < kb->part ? -1 : 1;
+    return item_key_cmp(ka->key, ka->nkey, kb->key, kb->nkey);
+}
+
+/*
+ * Walks the sorted keys with one cursor, moving it with ENGINE_SET_RANGE
+ * to the first unresolved key and matching the record it lands on against
+ * the keys that follow; keys sorting before it are not in the database.
+ * The bdb engine reads ahead in bulk, so most moves stay in the buffer it
+ * has. Returns the number of keys resolved; the caller falls back to
+ * point lookups for the rest.
+ */
+static int item_get_bulk(const int part, mget_key **sorted, const int nkeys) {
+    engine_cursor *cursor;
+    const void *rkey, *rdata;
+    u_int32_t rklen, rdlen;
+    int w = 0, missed = 0;
+    int ret;
+
+    if ((ret = engine->cursor(part, NULL, bdb_settings.page_size * MGET_BULK_PAGES, &cursor)) != 0) {
+        if (settings.verbose > 1) {
+            fprintf(stderr, "engine->cursor: %s\n", db_strerror(ret));
+        }
+        return 0;
+    }
+
+    while (w < nkeys) {
+        ret = engine->c_get(cursor, ENGINE_SET_RANGE, sorted[w]->key, sorted[w]->nkey,
+                            &rkey, &rklen, &rdata, &rdlen);
+        if (ret == DB_NOTFOUND) {
+            /* nothing at or after this key, all the rest are misses */
+            missed += nkeys - w;
+            w = nkeys;
+            break;
+        }
+        if (ret != 0) {
+            if (settings.verbose > 1) {
+                fprintf(stderr, "engine->c_get: %s\n", db_strerror(ret));
+            }
+            break;
+        }
+
+        /* keys sorting before this record are not in the database */
+        while (w < nkeys && item_key_cmp(sorted[w]->key, sorted[w]->nkey, rkey, rklen) < 0) {
+            missed++;
+            w++;
+        }
+        /* a key may be asked for more than once, each gets a copy */
+        while (w < nkeys && item_key_cmp(sorted[w]->key, sorted[w]->nkey, rkey, rklen) == 0) {
+            item *it = item_from_record(sorted[w]->key, sorted[w]->nkey, rdata, rdlen);
+            if (it != NULL) {
+                size_hint_update(size_hint(sorted[w]->key, sorted[w]->nkey), rdlen);
+                warm_touch(sorted[w]->key, sorted[w]->nkey);
+            }
+            sorted[w]->it = it;
+            w++;
+        }
+    }
+
+    engine->c_close(cursor);
+    if (w > 0)
+        thread_stats()->part_reads[sorted[0]->part] += w;
+    if (missed > 0 && bloom_ready())
+        thread_stats()->bloom_false_positives += missed;
+    return w;
+}
+
+/*
+ * Looks up all keys at once, setting keys[i].it to the hit or NULL. Items
+ * are freed by the caller. Keys in the hot item cache are answered from
+ * it, and keys the bloom filter rules out are misses outright. On btree
+ * databases the rest are sorted and read in bulk through a single cursor
+ * per partition; hash databases have no useful key order, so they get one
+ * point lookup per key.
+ */
+void item_get_multi(mget_key *keys, const int nkeys) {
+    mget_key **sorted;
+    int i, j, first, done = 0, nmiss = 0;
+
+    for (i = 0; i < nkeys; i++) {
+        keys[i].part = db_part_index(keys[i].key, keys[i].nkey);
+        keys[i].none = false;
+        if ((keys[i].it = counter_get(keys[i].key, keys[i].nkey)) != NULL)
+            continue;
+        if ((keys[i].it = hotcache_get(keys[i].key, keys[i].nkey)) != NULL)
+            continue;
+        if (!bloom_maybe(keys[i].key, keys[i].nkey)) {
+            keys[i].none = true;
+            thread_stats()->bloom_negatives++;
+            continue;
+        }
+        keys[i].gen = hotcache_gen(keys[i].key, keys[i].nkey);
+        nmiss++;
+    }
+
+    if (nmiss > 1 && bdb_settings.db_type == DB_BTREE
+        && (sorted = (mget_key **)malloc(sizeof(mget_key *) * nmiss)) != NULL) {
+        for (i = 0, j = 0; i < nkeys; i++) {
+            if (keys[i].it == NULL && !keys[i].none)
+                sorted[j++] = &keys[i];
+        }
+        qsort(sorted, nmiss, sizeof(mget_key *), mget_key_cmp);
+        for (first = 0; first < nmiss; first = j) {
+            for (j = first + 1; j < nmiss && sorted[j]->part == sorted[first]->part; j++)
+                ;
+            done = item_get_bulk(sorted[first]->part, sorted + first, j - first);
+            for (i = first + done; i < j; i++) {
+                sorted[i]->it = item_get_db(sorted[i]->key, sorted[i]->nkey);
+            }
+        }
+        for (i = 0; i < nmiss; i++) {
+            if (sorted[i]->it != NULL)
+                hotcache_put(sorted[i]->it, sorted[i]->gen);
+        }
+        free(sorted);
+        return;
+    }
+
+    for (i = 0; i < nkeys; i++) {
+        if (keys[i].it == NULL && !keys[i].none
+            && (keys[i].it = item_get_db(keys[i].key, keys[i].nkey)) != NULL)
+            hotcache_put(keys[i].it, keys[i].gen);
+    }
+}
+
+/*
+ * Reads only the header of the record for key into the cas and exptime of
+ * hdr; flags go to engine->get(). A legacy record has neither, they read
+ * as 0. Returns 0 or the engine's error.
+ */
+static int item_get_header(engine_txn *txn, char *key, size_t nkey, item *hdr, const int flags) {
+    record_header rh;
+    u_int32_t size;
+    int ret;
+
+    hdr->cas = 0;
+    hdr->exptime = 0;
+    ret = engine->get(db_part_index(key, nkey), txn, key, nkey, &rh, sizeof(rh), &size,
+                      flags | ENGINE_PARTIAL);
+    if (ret == 0 && size == sizeof(rh) && rh.magic == RECORD_MAGIC
+        && rh.version == RECORD_VERSION) {
+        hdr->cas = item_ntoh64(rh.cas);
+        hdr->exptime = ntohl(rh.exptime);
+    }
+    return ret;
+}
+
+/*
+ * Writes it as the record for key, giving it a new cas, compressed if it
+ * is large enough. Returns 0 or the engine's error. A write in txn must
+ * have key dropped from the hot cache by the caller, after the commit.
+ */
+static int do_item_put(engine_txn *txn, char *key, size_t nkey, item *it) {
+    int part = db_part_index(key, nkey);
+    void *packed;
+    u_int32_t nrec;
+    int ret;
+
+    it->cas = item_next_cas();
+    it->nsuffix = 0;
+    if ((packed = item_deflate(it, &nrec)) == NULL) {
+        /* the record header goes in front of the data, over the suffix */
+        item_record_encode(ITEM_record(it), it);
+        nrec = ITEM_nrecord(it);
+    }
+
+    thread_stats()->part_writes[part]++;
+    ret = engine->put(part, txn, key, nkey, packed != NULL ? packed : ITEM_record(it), nrec);
+    free(packed);
+    /* after the write, which has committed unless it is part of txn */
+    if (txn == NULL)
+        hotcache_invalidate(key, nkey);
+    if (ret == 0) {
+        size_hint_update(size_hint(key, nkey), nrec);
+    } else if (settings.verbose > 1) {
+        fprintf(stderr, "engine->put: %s\n", db_strerror(ret));
+    }
+    return ret;
+}
+
+/*
+ * Counts key in the bloom filter, unless the database has it already and
+ * the write about to be made won't add it. Called with the key's bloom
+ * lock held; a failed lookup counts the key, too many counts are safe.
+ */
+static void item_bloom_put(char *key, size_t nkey) {
+    item hdr;
+
+    if (!bloom_maybe(key, nkey) || item_get_header(NULL, key, nkey, &hdr, 0) != 0)
+        bloom_add(key, nkey);
+}
+
+static int item_store(char *key, size_t nkey, item *it){
+    int ret;
+
+    if (!bloom_enabled())
+        return do_item_put(NULL, key, nkey, it) == 0 ? 0 : -1;
+
+    bloom_lock(key, nkey);
+    item_bloom_put(key, nkey);
+    ret = do_item_put(NULL, key, nkey, it);
+    bloom_unlock(key, nkey);
+    return ret == 0 ? 0 : -1;
+}
+
 /* 0 for Success
    -1 for SERVER_ERROR
 */
 int item_put(char *key, size_t nkey, item *it){
     int ret;
-    DBT dbkey, dbdata;
-
-    BDB_CLEANUP_DBT();
-    dbkey.data = key;
-    dbkey.size = nkey;
-    dbdata.data = it;
-    dbdata.size = ITEM_ntotal(it);
-    ret = dbp->put(dbp, NULL, &dbkey, &dbdata, 0);
+
+    /* the new record replaces the counter's value, written or not */
+    counter_lock(key, nkey);
+    counter_drop(key, nkey, false);
+    ret = item_store(key, nkey, it);
+    counter_unlock(key, nkey);
+    return ret;
+}
+
+/* writes the record of a write-behind counter, with its counter lock held */
+int item_counter_put(char *key, size_t nkey, item *it){
+    return item_store(key, nkey, it);
+}
+
+/*
+ * Stores it only if the cas of the record for key still is it->cas. The
+ * record header is read write-locked and the new record written in the
+ * same transaction, so no other writer can slip in between; a deadlock
+ * just retries.
+ *
+ * 0 for Success
+ * 1 for EXISTS, the cas did not match
+ * 2 for NOT_FOUND
+ * -1 for SERVER_ERROR
+ */
+static int do_item_cas_put(char *key, size_t nkey, item *it){
+    uint64_t want = it->cas;
+    int part = db_part_index(key, nkey);
+    item hdr;
+    engine_txn *txn;
+    int tries, ret;
+
+    for (tries = 0; tries < CAS_MAX_TRIES; tries++) {
+        if ((ret = engine->txn_begin(part, &txn)) != 0)
+            break;
+
+        /* only the header is needed */
+        ret = item_get_header(txn, key, nkey, &hdr, ENGINE_RMW);
+        if (ret == DB_NOTFOUND
+            || (ret == 0 && ITEM_expired(hdr.exptime, time(NULL)))) {
+            engine->txn_abort(txn);
+            return 2;
+        }
+        if (ret == 0) {
+            /* legacy records have no cas, gets reports 0 for them */
+            if (hdr.cas != want) {
+                engine->txn_abort(txn);
+                return 1;
+            }
+            ret = do_item_put(txn, key, nkey, it);
+        }
+        if (ret == 0) {
+            if ((ret = engine->txn_commit(txn)) == 0) {
+                hotcache_invalidate(key, nkey);
+                return 0;
+            }
+            break;
+        }
+        engine->txn_abort(txn);
+        if (ret != DB_LOCK_DEADLOCK)
+            break;
+    }
+
+    if (settings.verbose > 1) {
+        fprintf(stderr, "item_cas_put: %s\n", db_strerror(ret));
+    }
+    return -1;
+}
+
+int item_cas_put(char *key, size_t nkey, item *it){
+    int ret;
+
+    /* the cas is checked against the record, with the counter's deltas in */
+    counter_lock(key, nkey);
+    counter_drop(key, nkey, true);
+    ret = do_item_cas_put(key, nkey, it);
+    counter_unlock(key, nkey);
+    return ret;
+}
+
+/*
+ * Writes the n items of a bulk load, all of partition part, in one
+ * transaction whose commit leaves the syncing to the checkpoint that ends
+ * the load. A deadlock writes them all again.
+ *
+ * The keys are counted in the bloom filter before the write, so that a
+ * get finds them once committed, and again after it, so that a fill that
+ * started in between does not lose them; they are counted too often, but
+ * never too little.
+ */
+int item_load(const int part, item **items, const int n){
+    engine_txn *txn;
+    int i, tries, ret = 0;
+
+    for (i = 0; i < n; i++) {
+        bloom_add(ITEM_key(items[i]), items[i]->nkey);
+        /* the loaded record replaces a write-behind counter; one that takes
+           a delta before the commit still writes over it */
+        counter_lock(ITEM_key(items[i]), items[i]->nkey);
+        counter_drop(ITEM_key(items[i]), items[i]->nkey, false);
+        counter_unlock(ITEM_key(items[i]), items[i]->nkey);
+    }
+
+    for (tries = 0; tries < CAS_MAX_TRIES; tries++) {
+        if ((ret = engine->txn_begin_nosync(part, &txn)) != 0)
+            return ret;
+        for (i = 0; i < n && ret == 0; i++)
+            ret = do_item_put(txn, ITEM_key(items[i]), items[i]->nkey, items[i]);
+        if (ret == 0) {
+            ret = engine->txn_commit(txn);
+            break;
+        }
+        engine->txn_abort(txn);
+        if (ret != DB_LOCK_DEADLOCK)
+            break;
+    }
+
     if (ret == 0) {
-        return 0;
-    } else {
-        if (settings.verbose > 1) {
-            fprintf(stderr, "dbp->put: %s\n", db_strerror(ret));
+        for (i = 0; i < n; i++) {
+            hotcache_invalidate(ITEM_key(items[i]), items[i]->nkey);
+            bloom_add(ITEM_key(items[i]), items[i]->nkey);
         }
-        return -1;
     }
+    return ret;
 }
 
 /* 0 for Success
@@ -291,20 +890,26 @@ int item_put(char *key, size_t nkey, item *it){
    -1 for SERVER_ERROR
 */
 int item_delete(char *key, size_t nkey){
+    int part = db_part_index(key, nkey);
     int ret;
-    DBT dbkey;
-    
-    memset(&dbkey, 0, sizeof(dbkey));
-    dbkey.data = key;
-    dbkey.size = nkey;
-    ret = dbp->del(dbp, NULL, &dbkey, 0);
+
+    thread_stats()->part_writes[part]++;
+    counter_lock(key, nkey);
+    counter_drop(key, nkey, false);
+    bloom_lock(key, nkey);
+    ret = engine->del(part, NULL, key, nkey);
+    if (ret == 0)
+        bloom_remove(key, nkey);
+    bloom_unlock(key, nkey);
+    counter_unlock(key, nkey);
+    hotcache_invalidate(key, nkey);
     if (ret == 0){
         return 0;
     }else if(ret == DB_NOTFOUND){
         return 1;
     }else{
         if (settings.verbose > 1) {
-            fprintf(stderr, "dbp->del: %s\n", db_strerror(ret));
+            fprintf(stderr, "engine->del: %s\n", db_strerror(ret));
         }
         return -1;
     }
@@ -312,18 +917,253 @@ int item_delete(char *key, size_t nkey){
 
 /*
 1 for exists
-0 for non-exist
+0 for non-exist, or expired
 */
 int item_exists(char *key, size_t nkey){
+    item hdr;
     int ret;
-    DBT dbkey;
-    
-    memset(&dbkey, 0, sizeof(dbkey));
-    dbkey.data = key;
-    dbkey.size = nkey;
-    ret = dbp->exists(dbp, NULL, &dbkey, 0);
-    if (ret == 0){
+
+    if (!bloom_maybe(key, nkey)) {
+        thread_stats()->bloom_negatives++;
+        return 0;
+    }
+    ret = item_get_header(NULL, key, nkey, &hdr, 0);
+    if (ret == DB_NOTFOUND && bloom_ready())
+        thread_stats()->bloom_false_positives++;
+    if (ret == 0
+        && !ITEM_expired(hdr.exptime, time(NULL))){
         return 1;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * Called by item_walk() for each record, with the cursor on it; the data
+ * is only good until the cursor writes. Sets *deleted if it deleted the
+ * record. Returns 0 or the engine's error.
+ */
+typedef int (*item_walk_fn)(engine_cursor *cursor, const char *key, const u_int32_t nkey,
+                            const void *data, const u_int32_t ndata, void *arg, bool *deleted);
+
+/*
+ * Runs fn on up to max records of a partition in one transaction. The
+ * walk starts just after the key in kbuf, or at the first record if
+ * *nkbuf is 0, and leaves where to go on from there; kbuf needs room for
+ * KEY_MAX_LENGTH bytes.
+ * *scanned is set to the number of records looked at, 0 once the walk is
+ * done.
+ *
+ * Returns 0 or the engine's error, after which the batch is undone and
+ * kbuf is unchanged; DB_LOCK_DEADLOCK just means try again.
+ */
+static int item_walk(const int part, char *kbuf, u_int32_t *nkbuf, const int max, int *scanned,
+                     item_walk_fn fn, void *arg) {
+    engine_txn *txn = NULL;
+    engine_cursor *cursor = NULL;
+    char lkey[KEY_MAX_LENGTH + 1];
+    char last[KEY_MAX_LENGTH];
+    u_int32_t nlkey = *nkbuf, nlast = *nkbuf;
+    const void *rkey, *rdata;
+    u_int32_t rklen, rdlen;
+    int move;
+    bool skip = false, deleted;
+    int ret;
+
+    *scanned = 0;
+    memcpy(lkey, kbuf, *nkbuf);
+    memcpy(last, kbuf, *nkbuf);
+
+    if ((ret = engine->txn_begin(part, &txn)) != 0)
+        return ret;
+    if ((ret = engine->cursor(part, txn, 0, &cursor)) != 0)
+        goto out;
+
+    if (*nkbuf == 0) {
+        move = ENGINE_FIRST;
+    } else if (bdb_settings.db_type == DB_BTREE) {
+        /* key + '\0' is the smallest key after key */
+        lkey[nlkey++] = '\0';
+        move = ENGINE_SET_RANGE;
+    } else {
+        /* no key order in a hash, find the last key again and go on */
+        move = ENGINE_SET;
+        skip = true;
+    }
+
+    while (*scanned < max) {
+        ret = engine->c_get(cursor, move, lkey, nlkey, &rkey, &rklen, &rdata, &rdlen);
+        if (ret == DB_NOTFOUND && move == ENGINE_SET) {
+            /* deleted meanwhile, start over */
+            move = ENGINE_FIRST;
+            skip = false;
+            continue;
+        }
+        if (ret == DB_NOTFOUND) {
+            ret = 0;
+            break;
+        }
+        if (ret != 0)
+            goto out;
+        move = ENGINE_NEXT;
+        if (skip) {
+            skip = false;
+            continue;
+        }
+        if (rklen > KEY_MAX_LENGTH) {
+            ret = EINVAL;
+            goto out;
+        }
+        (*scanned)++;
+
+        /* the key is kept, a write through the cursor may move the record */
+        memcpy(lkey, rkey, rklen);
+        nlkey = rklen;
+        deleted = false;
+        if ((ret = fn(cursor, lkey, nlkey, rdata, rdlen, arg, &deleted)) != 0)
+            goto out;
+        /* a hash walk can only go on from a key that is still there */
+        if (!deleted || bdb_settings.db_type == DB_BTREE) {
+            memcpy(last, lkey, nlkey);
+            nlast = nlkey;
+        }
+    }
+
+out:
+    if (cursor != NULL)
+        engine->c_close(cursor);
+    if (ret == 0) {
+        ret = engine->txn_commit(txn);
+    } else {
+        engine->txn_abort(txn);
+    }
+    if (ret == 0) {
+        memcpy(kbuf, last, nlast);
+        *nkbuf = nlast;
+    } else {
+        *scanned = 0;
+    }
+    return ret;
+}
+
+struct convert_walk {
+    int converted;
+    char *keys;     /* of the records rewritten, each after its length */
+    size_t used;
+};
+
+/* rewrites a legacy record in the current format, noting it in *arg */
+static int convert_record(engine_cursor *cursor, const char *key, const u_int32_t nkey,
+                          const void *rdata, const u_int32_t ndata, void *arg, bool *deleted) {
+    struct convert_walk *w = (struct convert_walk *)arg;
+    item hdr;
+    const char *data;
+    void *rec;
+    int ret;
+
+    if (item_record_decode(rdata, ndata, &hdr, &data) != 1)
+        return 0;
+    if ((rec = malloc(sizeof(record_header) + hdr.nbytes - 2)) == NULL)
+        return ENOMEM;
+    hdr.cas = item_next_cas();
+    item_record_encode(rec, &hdr);
+    memcpy((char *)rec + sizeof(record_header), data, hdr.nbytes - 2);
+
+    ret = engine->c_put(cursor, rec, sizeof(record_header) + hdr.nbytes - 2);
+    free(rec);
+    if (ret == 0) {
+        w->converted++;
+        w->keys[w->used] = (char)nkey;
+        memcpy(w->keys + w->used + 1, key, nkey);
+        w->used += 1 + nkey;
+    }
+    return ret;
+}
+
+/*
+ * Rewrites legacy records in the current format, one transaction for up
+ * to max records; see item_walk() for kbuf, *nkbuf, *scanned and the
+ * return value. *converted is set to the number of records rewritten.
+ */
+int item_convert(const int part, char *kbuf, u_int32_t *nkbuf, const int max, int *scanned, int *converted) {
+    struct convert_walk w;
+    size_t pos;
+    int ret;
+
+    w.converted = 0;
+    w.used = 0;
+    if ((w.keys = malloc((size_t)max * (KEY_MAX_LENGTH + 1))) == NULL)
+        return ENOMEM;
+    ret = item_walk(part, kbuf, nkbuf, max, scanned, convert_record, &w);
+    /* the cas changed, a cached copy has the old one; it is dropped once
+       the batch has committed, so that no reader can cache the old record
+       again, and dropping it after an abort does no harm */
+    for (pos = 0; pos < w.used; pos += 1 + (unsigned char)w.keys[pos])
+        hotcache_invalidate(w.keys + pos + 1, (unsigned char)w.keys[pos]);
+    free(w.keys);
+    *converted = (ret == 0) ? w.converted : 0;
+    return ret;
+}
+
+/* counts a key in the bloom filter */
+static int bloom_record(engine_cursor *cursor, const char *key, const u_int32_t nkey,
+                        const void *rdata, const u_int32_t ndata, void *arg, bool *deleted) {
+    bloom_add(key, nkey);
+    return 0;
+}
+
+/*
+ * Counts the keys of a partition in the bloom filter, one transaction for
+ * up to max records; see item_walk() for kbuf, *nkbuf, *scanned and the
+ * return value. A batch that fails has been counted in part.
+ */
+int item_bloom_fill(const int part, char *kbuf, u_int32_t *nkbuf, const int max, int *scanned) {
+    return item_walk(part, kbuf, nkbuf, max, scanned, bloom_record, NULL);
+}
+
+struct expire_walk {
+    time_t now;
+    int items;
+    uint64_t bytes;
+};
+
+/* deletes a record that has expired, counting it in *arg */
+static int expire_record(engine_cursor *cursor, const char *key, const u_int32_t nkey,
+                         const void *rdata, const u_int32_t ndata, void *arg, bool *deleted) {
+    struct expire_walk *w = (struct expire_walk *)arg;
+    item hdr;
+    const char *data;
+    int ret;
+
+    /* legacy and bad records never expire */
+    if (item_record_decode(rdata, ndata, &hdr, &data) != 0
+        || !ITEM_expired(hdr.exptime, w->now))
+        return 0;
+    ret = engine->c_del(cursor);
+    /* before the commit is enough, an expired record is never cached */
+    hotcache_invalidate(key, nkey);
+    if (ret != 0)
+        return ret;
+    *deleted = true;
+    w->items++;
+    w->bytes += nkey + ndata;
+    return 0;
+}
+
+/*
+ * Deletes expired records, one transaction for up to max records; see
+ * item_walk() for kbuf, *nkbuf, *scanned and the return value. *expired
+ * is set to the number of records deleted and *bytes to their size,
+ * keys included.
+ */
+int item_expire(const int part, char *kbuf, u_int32_t *nkbuf, const int max, int *scanned, int *expired, uint64_t *bytes) {
+    struct expire_walk w;
+    int ret;
+
+    w.now = time(NULL);
+    w.items = 0;
+    w.bytes = 0;
+    ret = item_walk(part, kbuf, nkbuf, max, scanned, expire_record, &w);
+    *expired = (ret == 0) ? w.items : 0;
+    *bytes = (ret == 0) ? w.bytes : 0;
+    return ret;
+}
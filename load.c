@@ -0,0 +1,211 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+/*
+ * Bulk load: the records of a file on this host written straight into
+ * the databases, for an initial import that would take days as one set
+ * after another, each a transaction of its own synced to the log. The
+ * file holds the records the way a set sends them, without the "set":
+ *
+ *   <key> <flags> <exptime> <bytes>\r\n
+ *   <data block>\r\n
+ *
+ * Up to LOAD_BATCH_BYTES of records are read at a time, sorted by
+ * partition and key, and written LOAD_TXN_ITEMS to a transaction whose
+ * commit does not wait for the disk; a btree then takes keys that come in
+ * order at its right edge, one page after the other. A checkpoint at the
+ * end makes the load durable. Keys that are in the file already sorted
+ * load fastest, but any order loads.
+ *
+ * A load cancelled or stopped by a bad record keeps what it wrote so far.
+ */
+
+/* records read and sorted before they are written */
+#define LOAD_BATCH_BYTES (4 * 1024 * 1024)
+
+/* records written in one transaction, well within the lock table */
+#define LOAD_TXN_ITEMS 1000
+
+/* room for a record line, the key and three numbers */
+#define LOAD_LINE_MAX (KEY_MAX_LENGTH + 64)
+
+typedef struct {
+    int part;
+    item *it;
+} load_item;
+
+static int load_item_cmp(const void *a, const void *b) {
+    const load_item *ia = (const load_item *)a;
+    const load_item *ib = (const load_item *)b;
+
+    if (ia->part != ib->part)
+        return ia->part < ib->part ? -1 : 1;
+    return item_key_cmp(ITEM_key(ia->it), ia->it->nkey, ITEM_key(ib->it), ib->it->nkey);
+}
+
+/*
+ * Reads the next record of fp into *itp: 0 with the item, DB_NOTFOUND at
+ * the end of the file, EINVAL for a record not like the above, ENOMEM.
+ */
+static int load_read(FILE *fp, item **itp) {
+    char line[LOAD_LINE_MAX];
+    char *key, *p, *endptr;
+    size_t nkey, len;
+    unsigned long flags;
+    long exptime, vlen;
+    item *it;
+
+    *itp = NULL;
+    if (fgets(line, sizeof(line), fp) == NULL)
+        return ferror(fp) ? errno : DB_NOTFOUND;
+    len = strlen(line);
+    if (len == 0 || line[len - 1] != '\n')
+        return EINVAL;
+    line[--len] = '\0';
+    if (len > 0 && line[len - 1] == '\r')
+        line[--len] = '\0';
+
+    key = line;
+    if ((p = strchr(key, ' ')) == NULL)
+        return EINVAL;
+    nkey = p - key;
+    if (nkey == 0 || nkey > KEY_MAX_LENGTH)
+        return EINVAL;
+    errno = 0;
+    flags = strtoul(p + 1, &endptr, 10);
+    if (*endptr != ' ' || flags > UINT32_MAX)
+        return EINVAL;
+    exptime = strtol(endptr + 1, &endptr, 10);
+    if (*endptr != ' ')
+        return EINVAL;
+    vlen = strtol(endptr + 1, &endptr, 10);
+    if (*endptr != '\0' || errno == ERANGE || vlen < 0 || vlen > INT_MAX - 2)
+        return EINVAL;
+
+    if ((it = item_alloc1(key, nkey, flags, vlen + 2)) == NULL)
+        return ENOMEM;
+    it->exptime = item_exptime(exptime);
+    if (fread(ITEM_data(it), 1, it->nbytes, fp) != (size_t)it->nbytes
+        || memcmp(ITEM_data(it) + vlen, "\r\n", 2) != 0) {
+        item_free(it);
+        return EINVAL;
+    }
+    *itp = it;
+    return 0;
+}
+
+/* writes the n records of a batch, freeing them */
+static int load_write(load_item *batch, const int n, volatile int *cancel) {
+    item *items[LOAD_TXN_ITEMS];
+    uint64_t bytes;
+    int i, j, k, ret = 0;
+
+    qsort(batch, n, sizeof(load_item), load_item_cmp);
+    for (i = 0; i < n && ret == 0 && !*cancel && !daemon_quit; i = j) {
+        bytes = 0;
+        for (j = i; j < n && j - i < LOAD_TXN_ITEMS && batch[j].part == batch[i].part; j++) {
+            items[j - i] = batch[j].it;
+            bytes += batch[j].it->nbytes - 2;
+        }
+        if ((ret = item_load(batch[i].part, items, j - i)) == 0) {
+            job_stats.load_records += j - i;
+            job_stats.load_bytes += bytes;
+        }
+    }
+    for (k = 0; k < n; k++)
+        item_free(batch[k].it);
+    return ret;
+}
+
+int load_run(const char *path, volatile int *cancel) {
+    load_item *batch;
+    size_t max = LOAD_BATCH_BYTES / 64, nbatch = 0, bytes = 0;
+    uint64_t lines = 0, begin = latency_now();
+    FILE *fp;
+    item *it;
+    void *p;
+    int ret = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return errno;
+    if ((batch = malloc(sizeof(load_item) * max)) == NULL) {
+        fclose(fp);
+        return ENOMEM;
+    }
+
+    while (ret == 0 && !*cancel && !daemon_quit) {
+        ret = load_read(fp, &it);
+        /* the memory of the batch may be what it takes */
+        if (ret == ENOMEM && nbatch > 0) {
+            ret = load_write(batch, nbatch, cancel);
+            nbatch = bytes = 0;
+            if (ret == 0)
+                ret = load_read(fp, &it);
+        }
+        if (ret != 0)
+            break;
+        lines++;
+        if (nbatch == max) {
+            if ((p = realloc(batch, sizeof(load_item) * max * 2)) == NULL) {
+                item_free(it);
+                ret = ENOMEM;
+                break;
+            }
+            batch = p;
+            max *= 2;
+        }
+        batch[nbatch].part = db_part_index(ITEM_key(it), it->nkey);
+        batch[nbatch++].it = it;
+        bytes += sizeof(item) + it->nkey + it->nbytes;
+        if (bytes >= LOAD_BATCH_BYTES) {
+            ret = load_write(batch, nbatch, cancel);
+            nbatch = bytes = 0;
+        }
+    }
+    if (ret == DB_NOTFOUND)
+        ret = 0;
+    if (ret == EINVAL)
+        engine_err(0, "bulk_load %s: bad record %llu", path, (unsigned long long)lines + 1);
+
+    /* what was read is written, also of a load that stops here */
+    if (nbatch > 0) {
+        if (ret == 0)
+            ret = load_write(batch, nbatch, cancel);
+        else
+            (void)load_write(batch, nbatch, cancel);
+    }
+    free(batch);
+    fclose(fp);
+
+    /* one checkpoint, instead of a sync for every transaction */
+    if (job_stats.load_records > 0) {
+        int cret = engine->checkpoint(-1);
+        if (ret == 0)
+            ret = cret;
+    }
+    if (ret == 0 && settings.verbose > 0)
+        engine_err(0, "bulk_load %s: %llu records, %llu bytes in %llu ms", path,
+                   (unsigned long long)job_stats.load_records,
+                   (unsigned long long)job_stats.load_bytes,
+                   (unsigned long long)(latency_now() - begin) / 1000);
+    return ret;
+}
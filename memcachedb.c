@@ -17,6 +17,11 @@
  *
  */
 
+/* recvmmsg() and sendmmsg() are GNU extensions to sys/socket.h */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "memcachedb.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -90,12 +95,15 @@ static void accept_new_conns(const bool do_accept);
 static bool update_event(conn *c, const int new_flags);
 static void complete_nread(conn *c);
 static void process_command(conn *c, char *command);
+static void complete_bin_nread(conn *c);
+static void batch_flush(conn *c);
 static int transmit(conn *c);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
 static int add_msghdr(conn *c);
 
 static void conn_free(conn *c);
+static bool rep_redirect(conn *c, const bool write);
 
 /** exported globals **/
 struct stats stats;
@@ -104,7 +112,9 @@ struct settings settings;
 struct bdb_settings bdb_settings;
 struct bdb_version bdb_version;
 DB_ENV *env;
-DB *dbp;
+DB *dbps[MAX_DB_PARTS];
+/* the storage engine, chosen with -B */
+const struct engine *engine = &bdb_engine;
 
 int daemon_quit = 0;
 
@@ -117,11 +127,11 @@ static struct event_base *main_base;
 #define TRANSMIT_SOFT_ERROR 2
 #define TRANSMIT_HARD_ERROR 3
 
-static void stats_init(void) {
-    stats.curr_conns = stats.total_conns = stats.conn_structs = 0;
-    stats.get_cmds = stats.set_cmds = stats.get_hits = stats.get_misses = 0;
-    stats.bytes_read = stats.bytes_written = 0;
+#ifndef USE_THREADS
+struct thread_stats main_thread_stats;
+#endif
 
+static void stats_init(void) {
     /* make the time we started always be 2 seconds before we really
        did, so time(0) - time.started is never zero.  if so, things
        like 'settings.oldest_live' which act as booleans as well as
@@ -129,12 +139,22 @@ static void stats_init(void) {
     stats.started = time(0) - 2;
 }
 
+/*
+ * Clears the counters of a block that stats reset clears; the number of
+ * connections and connection structures stays.
+ */
+void thread_stats_clear(struct thread_stats *ts) {
+    int64_t curr_conns = ts->curr_conns;
+    uint64_t conn_structs = ts->conn_structs;
+
+    memset(ts, 0, sizeof(*ts));
+    ts->curr_conns = curr_conns;
+    ts->conn_structs = conn_structs;
+}
+
 static void stats_reset(void) {
-    STATS_LOCK();
-    stats.total_conns = 0;
-    stats.get_cmds = stats.set_cmds = stats.get_hits = stats.get_misses = 0;
-    stats.bytes_read = stats.bytes_written = 0;
-    STATS_UNLOCK();
+    thread_stats_reset(thread_stats_clear);
+    hotkeys_reset();
 }
 
 static void settings_init(void) {
@@ -144,11 +164,19 @@ static void settings_init(void) {
     /* By default this string should be NULL for getaddrinfo() */
     settings.inter = NULL;
     settings.item_buf_size = 512;     /* default is 512B */
+    settings.hotcache_size = 0;       /* no hot item cache */
+    settings.compress_min = 0;        /* store values as they are */
+    settings.bloom_size = 0;          /* no bloom filter */
+    settings.warm_keys = 0;           /* start with a cold cache */
+    settings.counter_interval = 0;    /* every incr and decr is written */
+    settings.counter_ops = 0;
+    settings.hotkeys = 0;             /* no hot key sampling */
     settings.maxconns = 1024;         /* to limit connections-related memory to about 5MB */
     settings.verbose = 0;
     settings.socketpath = NULL;       /* by default, not using a unix socket */
 #ifdef USE_THREADS
     settings.num_threads = 4;
+    settings.reuseport = false;
 #else
     settings.num_threads = 1;
 #endif
@@ -256,6 +284,7 @@ bool do_conn_add_to_freelist(conn *c) {
 conn *conn_new(const int sfd, const int init_state, const int event_flags,
                 const int read_buffer_size, const bool is_udp, struct event_base *base) {
     conn *c = conn_from_freelist();
+    struct thread_stats *ts = thread_stats();
 
     if (NULL == c) {
         if (!(c = (conn *)calloc(1, sizeof(conn)))) {
@@ -267,6 +296,7 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
         c->iov = 0;
         c->msglist = 0;
         c->hdrbuf = 0;
+        c->ubatch = 0;
 
         c->rsize = read_buffer_size;
         c->wsize = DATA_BUFFER_SIZE;
@@ -288,9 +318,7 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
             return NULL;
         }
 
-        STATS_LOCK();
-        stats.conn_structs++;
-        STATS_UNLOCK();
+        ts->conn_structs++;
     }
 
     if (settings.verbose > 1) {
@@ -319,6 +347,16 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
     c->write_and_go = conn_read;
     c->write_and_free = 0;
     c->item = 0;
+    c->thread = NULL;
+    c->stats = ts;
+    c->lat_cmd = LAT_NONE;
+    c->send_start = 0;
+    c->commit_failed = false;
+    c->protocol = is_udp ? ascii_prot : negotiating_prot;
+    c->batch = false;
+    c->batch_dirty = false;
+    /* what a conn off the freelist grew to shrinks right away */
+    c->rsmall = BUFFER_SHRINK_READS;
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
@@ -332,10 +370,8 @@ conn *conn_new(const int sfd, const int init_state, const int event_flags,
         return NULL;
     }
 
-    STATS_LOCK();
-    stats.curr_conns++;
-    stats.total_conns++;
-    STATS_UNLOCK();
+    ts->curr_conns++;
+    ts->total_conns++;
 
     return c;
 }
@@ -367,6 +403,8 @@ void conn_free(conn *c) {
     if (c) {
         if (c->hdrbuf)
             free(c->hdrbuf);
+        if (c->ubatch)
+            free(c->ubatch);
         if (c->msglist)
             free(c->msglist);
         if (c->rbuf)
@@ -391,6 +429,7 @@ static void conn_close(conn *c) {
         fprintf(stderr, "<%d connection closed.\n", c->sfd);
 
     close(c->sfd);
+    dispatch_conn_closed(c);
     accept_new_conns(true);
     conn_cleanup(c);
 
@@ -399,9 +438,7 @@ static void conn_close(conn *c) {
         conn_free(c);
     }
 
-    STATS_LOCK();
-    stats.curr_conns--;
-    STATS_UNLOCK();
+    c->stats->curr_conns--;
 
     return;
 }
@@ -410,7 +447,9 @@ static void conn_close(conn *c) {
 /*
  * Shrinks a connection's buffers if they're too big.  This prevents
  * periodic large "get" requests from permanently chewing lots of server
- * memory.
+ * memory. A client that keeps needing them, pipelining a lot at a time,
+ * keeps them: they shrink after BUFFER_SHRINK_READS reads in a row that
+ * fit in DATA_BUFFER_SIZE, rather than being reallocated for every burst.
  *
  * This should only be called in between requests since it can wipe output
  * buffers!
@@ -418,7 +457,8 @@ static void conn_close(conn *c) {
 static void conn_shrink(conn *c) {
     assert(c != NULL);
 
-    if (c->udp)
+    /* queued responses still point into ilist and iov */
+    if (c->udp || c->batch || c->rsmall < BUFFER_SHRINK_READS)
         return;
 
     if (c->rsize > READ_BUFFER_HIGHWAT && c->rbytes < DATA_BUFFER_SIZE) {
@@ -633,6 +673,80 @@ static void out_string(conn *c, const char *str) {
     return;
 }
 
+/*
+ * Holds back the reply about to be sent, or the batch of them, until the
+ * group committer has flushed the transaction log, so that a write is
+ * only acknowledged once it is durable. Does nothing if group commit is
+ * off. The commands mark c->batch_dirty and the reply is held back once
+ * it goes out, see ascii_reply_done() and batch_flush().
+ */
+static void conn_wait_commit(conn *c) {
+    assert(c != NULL);
+
+#ifdef USE_THREADS
+    if (bdb_settings.gcommit_ops == 0)
+        return;
+
+    /* nothing to do for this connection until the committer wakes us up */
+    if (!update_event(c, 0)) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Couldn't update event\n");
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    conn_set_state(c, conn_commit);
+    gcommit_enqueue(c);
+#endif
+}
+
+/*
+ * Called in the connection's own thread once the log flush covering its
+ * write is done; sends the held back reply.
+ */
+void conn_commit_done(conn *c) {
+    assert(c != NULL && c->state == conn_commit);
+
+    /* a lone ASCII reply is still in wbuf, a batch is queued in iov */
+    if (c->protocol == binary_prot || c->iovused > 0) {
+        /* part of the batch may already claim success, so drop the client */
+        if (c->commit_failed) {
+            c->commit_failed = false;
+            conn_set_state(c, conn_closing);
+        } else {
+            conn_set_state(c, conn_mwrite);
+        }
+    } else if (c->commit_failed) {
+        c->commit_failed = false;
+        out_string(c, "SERVER_ERROR failed to flush transaction log");
+    } else {
+        conn_set_state(c, conn_write);
+    }
+    drive_machine(c);
+}
+
+/*
+ * Counts a store in the stats of the connection's thread, ret being what
+ * store_item() returned.
+ */
+static void count_store(conn *c, item *it, const int comm, const int ret) {
+    struct thread_stats *ts = c->stats;
+
+    if (comm == NREAD_APPEND)
+        ts->append_cmds++;
+    else if (comm == NREAD_PREPEND)
+        ts->prepend_cmds++;
+    else if (comm == NREAD_CAS) {
+        if (ret == 1)
+            ts->cas_hits++;
+        else if (ret == 2)
+            ts->cas_badval++;
+        else if (ret == 3)
+            ts->cas_misses++;
+    }
+    if (ret == 1)
+        ts->bytes_stored += it->nbytes - 2;
+}
+
 /*
  * we get here after reading the value in set/add/replace commands. The command
  * has been stored in c->item_comm, and the item is ready in c->item.
@@ -645,19 +759,25 @@ static void complete_nread(conn *c) {
     int comm = c->item_comm;
     int ret;
 
-    STATS_LOCK();
-    stats.set_cmds++;
-    STATS_UNLOCK();
+    if (c->protocol == binary_prot) {
+        complete_bin_nread(c);
+        return;
+    }
+
+    c->stats->set_cmds++;
 
     if (strncmp(ITEM_data(it) + it->nbytes - 2, "\r\n", 2) != 0) {
         out_string(c, "CLIENT_ERROR bad data chunk");
     } else {
       ret = store_item(it, comm);
-      if (ret == 1)
+      c->lat_cmd = LAT_SET;
+      count_store(c, it, comm, ret);
+      if (ret == 1) {
           out_string(c, "STORED");
-      else if(ret == 2)
+          c->batch_dirty = true;
+      } else if(ret == 2 && comm == NREAD_CAS)
           out_string(c, "EXISTS");
-      else if(ret == 3)
+      else if(ret == 3 && comm == NREAD_CAS)
           out_string(c, "NOT_FOUND");
       else
           out_string(c, "NOT_STORED");
@@ -671,22 +791,23 @@ static void complete_nread(conn *c) {
  * Stores an item in the cache according to the semantics of one of the set
  * commands. In threaded mode, this is protected by the cache lock.
  *
- * Returns true if the item was stored.
+ * Returns 1 if the item was stored, 2 if an add found the key there or a
+ * cas found another value, 3 if a replace or a cas found no key, and 0 if
+ * an append or prepend found no key or the store failed.
  */
-int do_store_item(item *it, int comm) {
+static int db_store_item(item *it, int comm) {
     char *key = ITEM_key(it);
     int ret;
     item *old_it = NULL;
     item *new_it = NULL;
     int stored = 0;
-    int flags;
 
     if (comm == NREAD_ADD || comm == NREAD_REPLACE) {
         ret = item_exists(key, strlen(key));
-        if ((ret == 0 && comm == NREAD_REPLACE) ||
-            (ret == 1 && comm == NREAD_ADD) ){
-               return 0;
-        }
+        if (ret == 1 && comm == NREAD_ADD)
+            return 2;
+        if (ret == 0 && comm == NREAD_REPLACE)
+            return 3;
     } else if (comm == NREAD_APPEND || comm == NREAD_PREPEND){
         /* get orignal item */
         old_it = item_get(key, strlen(key));
@@ -695,15 +816,14 @@ int do_store_item(item *it, int comm) {
         }
         
         /* we have it and old_it here - alloc memory to hold both */
-        /* flags was already lost - so recover them from ITEM_suffix(it) */
-        flags = (int) strtol(ITEM_suffix(old_it), (char **) NULL, 10);        
-        new_it = item_alloc1(key, it->nkey, flags, it->nbytes + old_it->nbytes - 2 /* CRLF */);
+        new_it = item_alloc1(key, it->nkey, old_it->flags, it->nbytes + old_it->nbytes - 2 /* CRLF */);
         if (new_it == NULL) {
             /* SERVER_ERROR out of memory */
             if (old_it != NULL)
                 item_free(old_it);
             return 0;
         }
+        new_it->exptime = old_it->exptime;
         
         /* copy data from it and old_it to new_it */        
         if (comm == NREAD_APPEND) {
@@ -716,6 +836,18 @@ int do_store_item(item *it, int comm) {
         }
         
         it = new_it;
+    } else if (comm == NREAD_CAS) {
+        ret = item_cas_put(key, strlen(key), it);
+        switch (ret) {
+        case 0:
+            return 1;
+        case 1:
+            return 2;
+        case 2:
+            return 3;
+        default:
+            return 0;
+        }
     }
         
     ret = item_put(key, strlen(key), it);
@@ -732,6 +864,19 @@ int do_store_item(item *it, int comm) {
     }
 }
 
+/* times the storage calls of a store, the lock is timed by mt_store_item() */
+int do_store_item(item *it, int comm) {
+    struct thread_stats *ts = thread_stats();
+    uint64_t start = latency_now();
+    int ret = db_store_item(it, comm);
+
+    latency_record(ts, LAT_SET, LAT_STORAGE, start);
+    hotkey_touch(ITEM_key(it), it->nkey, HOTKEY_SET);
+    if (ret == 1)
+        size_record(ts->size_stored, it->nbytes - 2);
+    return ret;
+}
+
 typedef struct token_s {
     char *value;
     size_t length;
@@ -740,7 +885,6 @@ typedef struct token_s {
 #define COMMAND_TOKEN 0
 #define SUBCOMMAND_TOKEN 1
 #define KEY_TOKEN 1
-#define KEY_MAX_LENGTH 250
 
 #define MAX_TOKENS 8
 
@@ -827,16 +971,26 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
     command = tokens[COMMAND_TOKEN].value;
 
     if (ntokens == 2 && strcmp(command, "stats") == 0) {
-        char temp[1024];
+        char temp[4096];
+        uint64_t hc_items, hc_bytes, hc_evictions, bloom_keys;
+        uint64_t warm_total, warm_loaded, warm_saved;
+        uint64_t counter_keys, counter_deltas, counter_writes;
+        time_t warm_last_save;
+        const char *bloom_name, *warm_name;
         pid_t pid = getpid();
         char *pos = temp;
+        struct thread_stats ts;
 
 #ifndef WIN32
         struct rusage usage;
         getrusage(RUSAGE_SELF, &usage);
 #endif /* !WIN32 */
 
-        STATS_LOCK();
+        stats_aggregate(&ts);
+        hotcache_stats(&hc_items, &hc_bytes, &hc_evictions);
+        bloom_name = bloom_stats(&bloom_keys);
+        warm_name = warm_state(&warm_total, &warm_loaded, &warm_saved, &warm_last_save);
+        counter_stats_get(&counter_keys, &counter_deltas, &counter_writes);
         pos += sprintf(pos, "STAT pid %u\r\n", pid);
         pos += sprintf(pos, "STAT uptime %ld\r\n", now - stats.started);
         pos += sprintf(pos, "STAT time %ld\r\n", now);
@@ -847,18 +1001,65 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         pos += sprintf(pos, "STAT rusage_system %ld.%06ld\r\n", usage.ru_stime.tv_sec, usage.ru_stime.tv_usec);
 #endif /* !WIN32 */
         pos += sprintf(pos, "STAT ibuffer_size %u\r\n", settings.item_buf_size);
-        pos += sprintf(pos, "STAT curr_connections %u\r\n", stats.curr_conns - 1); /* ignore listening conn */
-        pos += sprintf(pos, "STAT total_connections %u\r\n", stats.total_conns);
-        pos += sprintf(pos, "STAT connection_structures %u\r\n", stats.conn_structs);
-        pos += sprintf(pos, "STAT cmd_get %llu\r\n", stats.get_cmds);
-        pos += sprintf(pos, "STAT cmd_set %llu\r\n", stats.set_cmds);
-        pos += sprintf(pos, "STAT get_hits %llu\r\n", stats.get_hits);
-        pos += sprintf(pos, "STAT get_misses %llu\r\n", stats.get_misses);
-        pos += sprintf(pos, "STAT bytes_read %llu\r\n", stats.bytes_read);
-        pos += sprintf(pos, "STAT bytes_written %llu\r\n", stats.bytes_written);
+        pos += sprintf(pos, "STAT curr_connections %u\r\n", (unsigned int)ts.curr_conns - 1); /* ignore listening conn */
+        pos += sprintf(pos, "STAT total_connections %u\r\n", (unsigned int)ts.total_conns);
+        pos += sprintf(pos, "STAT connection_structures %u\r\n", (unsigned int)ts.conn_structs);
+        pos += sprintf(pos, "STAT cmd_get %llu\r\n", ts.get_cmds);
+        pos += sprintf(pos, "STAT cmd_set %llu\r\n", ts.set_cmds);
+        pos += sprintf(pos, "STAT get_hits %llu\r\n", ts.get_hits);
+        pos += sprintf(pos, "STAT get_misses %llu\r\n", ts.get_misses);
+        pos += sprintf(pos, "STAT cmd_rget %llu\r\n", ts.rget_cmds);
+        pos += sprintf(pos, "STAT rget_items %llu\r\n", ts.rget_items);
+        pos += sprintf(pos, "STAT cas_misses %llu\r\n", ts.cas_misses);
+        pos += sprintf(pos, "STAT cas_hits %llu\r\n", ts.cas_hits);
+        pos += sprintf(pos, "STAT cas_badval %llu\r\n", ts.cas_badval);
+        pos += sprintf(pos, "STAT delete_misses %llu\r\n", ts.delete_misses);
+        pos += sprintf(pos, "STAT delete_hits %llu\r\n", ts.delete_hits);
+        pos += sprintf(pos, "STAT incr_misses %llu\r\n", ts.incr_misses);
+        pos += sprintf(pos, "STAT incr_hits %llu\r\n", ts.incr_hits);
+        pos += sprintf(pos, "STAT decr_misses %llu\r\n", ts.decr_misses);
+        pos += sprintf(pos, "STAT decr_hits %llu\r\n", ts.decr_hits);
+        pos += sprintf(pos, "STAT cmd_append %llu\r\n", ts.append_cmds);
+        pos += sprintf(pos, "STAT cmd_prepend %llu\r\n", ts.prepend_cmds);
+        pos += sprintf(pos, "STAT bytes_stored %llu\r\n", ts.bytes_stored);
+        pos += sprintf(pos, "STAT bytes_read %llu\r\n", ts.bytes_read);
+        pos += sprintf(pos, "STAT bytes_written %llu\r\n", ts.bytes_written);
+        pos += sprintf(pos, "STAT hotcache_limit_bytes %llu\r\n", (unsigned long long)settings.hotcache_size);
+        pos += sprintf(pos, "STAT hotcache_bytes %llu\r\n", hc_bytes);
+        pos += sprintf(pos, "STAT hotcache_items %llu\r\n", hc_items);
+        pos += sprintf(pos, "STAT hotcache_evictions %llu\r\n", hc_evictions);
+        pos += sprintf(pos, "STAT hotcache_hits %llu\r\n", ts.hotcache_hits);
+        pos += sprintf(pos, "STAT hotcache_misses %llu\r\n", ts.hotcache_misses);
+        pos += sprintf(pos, "STAT bloom_bytes %llu\r\n", (unsigned long long)settings.bloom_size);
+        pos += sprintf(pos, "STAT bloom_state %s\r\n", bloom_name);
+        pos += sprintf(pos, "STAT bloom_filled_keys %llu\r\n", bloom_keys);
+        pos += sprintf(pos, "STAT bloom_negatives %llu\r\n", ts.bloom_negatives);
+        pos += sprintf(pos, "STAT bloom_false_positives %llu\r\n", ts.bloom_false_positives);
+        pos += sprintf(pos, "STAT bloom_false_positive_rate %.4f\r\n",
+                       ts.bloom_negatives + ts.bloom_false_positives > 0
+                       ? (double)ts.bloom_false_positives / (ts.bloom_negatives + ts.bloom_false_positives) : 0.0);
+        pos += sprintf(pos, "STAT warm_keys %d\r\n", settings.warm_keys);
+        pos += sprintf(pos, "STAT warm_state %s\r\n", warm_name);
+        pos += sprintf(pos, "STAT warm_load_keys %llu\r\n", warm_total);
+        pos += sprintf(pos, "STAT warm_loaded_keys %llu\r\n", warm_loaded);
+        pos += sprintf(pos, "STAT warm_saved_keys %llu\r\n", warm_saved);
+        pos += sprintf(pos, "STAT warm_last_save %ld\r\n", (long)warm_last_save);
+        pos += sprintf(pos, "STAT counter_interval %d\r\n", settings.counter_interval);
+        pos += sprintf(pos, "STAT counter_keys %llu\r\n", counter_keys);
+        pos += sprintf(pos, "STAT counter_deltas %llu\r\n", counter_deltas);
+        pos += sprintf(pos, "STAT counter_writes %llu\r\n", counter_writes);
+        pos += sprintf(pos, "STAT compress_min_bytes %d\r\n", settings.compress_min);
+        pos += sprintf(pos, "STAT compressed_items %llu\r\n", ts.compressed_items);
+        pos += sprintf(pos, "STAT compress_rejected %llu\r\n", ts.compress_rejected);
+        pos += sprintf(pos, "STAT compress_in_bytes %llu\r\n", ts.compress_in_bytes);
+        pos += sprintf(pos, "STAT compress_out_bytes %llu\r\n", ts.compress_out_bytes);
+        pos += sprintf(pos, "STAT compress_ratio %.2f\r\n", ts.compress_out_bytes > 0
+                       ? (double)ts.compress_in_bytes / ts.compress_out_bytes : 0.0);
+        pos += sprintf(pos, "STAT compress_usec %llu\r\n", ts.compress_usec);
+        pos += sprintf(pos, "STAT decompressed_items %llu\r\n", ts.decompressed_items);
+        pos += sprintf(pos, "STAT decompress_usec %llu\r\n", ts.decompress_usec);
         pos += sprintf(pos, "STAT threads %u\r\n", settings.num_threads);
         pos += sprintf(pos, "END");
-        STATS_UNLOCK();
         out_string(c, temp);
         return;
     }
@@ -871,20 +1072,104 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         return;
     }
 
+    /* for the latency histograms */
+    if (strcmp(subcommand, "latency") == 0) {
+        int bytes = 0;
+        char *buf;
+
+        if (ntokens == 4 && strcmp(tokens[2].value, "reset") == 0) {
+            thread_stats_reset(latency_clear);
+            out_string(c, "RESET");
+            return;
+        }
+        if ((buf = stats_latency(&bytes)) == NULL) {
+            out_string(c, "SERVER_ERROR out of memory writing stats latency");
+            return;
+        }
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
+    /* for the value size histograms */
+    if (strcmp(subcommand, "sizes") == 0) {
+        int bytes = 0;
+        char *buf;
+
+        if (ntokens == 4 && strcmp(tokens[2].value, "reset") == 0) {
+            thread_stats_reset(sizes_clear);
+            out_string(c, "RESET");
+            return;
+        }
+        if ((buf = stats_sizes(&bytes)) == NULL) {
+            out_string(c, "SERVER_ERROR out of memory writing stats sizes");
+            return;
+        }
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
+    /* for the hottest keys */
+    if (strcmp(subcommand, "hotkeys") == 0) {
+        int bytes = 0;
+        char *buf;
+
+        if (ntokens == 4 && strcmp(tokens[2].value, "reset") == 0) {
+            hotkeys_reset();
+            out_string(c, "RESET");
+            return;
+        }
+        if ((buf = hotkeys_stats(&bytes)) == NULL) {
+            out_string(c, "SERVER_ERROR out of memory writing stats hotkeys");
+            return;
+        }
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
+    /* for the per partition counters */
+    if (strcmp(subcommand, "partitions") == 0) {
+        int bytes = 0;
+        char *buf;
+
+        if ((buf = stats_partitions(&bytes)) == NULL) {
+            out_string(c, "SERVER_ERROR out of memory writing stats partitions");
+            return;
+        }
+        write_and_free(c, buf, bytes);
+        return;
+    }
+
     /* for bdb stats */
     if (strcmp(subcommand, "bdb") == 0) {
-        char temp[512];
+        char temp[2048];
         stats_bdb(temp);
         out_string(c, temp);
         return;
     }
+
+    /* for item buffer allocator stats */
+    if (strcmp(subcommand, "slabs") == 0) {
+        int bytes = 0;
+        char *buf = slabs_stats(&bytes);
+        if (buf == NULL) {
+            out_string(c, "SERVER_ERROR out of memory writing stats slabs");
+            return;
+        }
+        write_and_free(c, buf, bytes);
+        return;
+    }
     
     /* for replication stats */
     if (bdb_settings.is_replicated){
         if (strcmp(subcommand, "rep") == 0) {
-            char temp[2048];
-            stats_rep(temp);
-            out_string(c, temp);
+            int bytes = 0;
+            char *buf;
+
+            if ((buf = stats_rep(&bytes)) == NULL) {
+                out_string(c, "SERVER_ERROR out of memory writing stats rep");
+                return;
+            }
+            write_and_free(c, buf, bytes);
             return;
         }
         if (strcmp(subcommand, "repmgr") == 0) {
@@ -972,77 +1257,55 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
 }
 
 /* ntokens is overwritten here... shrug.. */
-static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens) {
-    char *key;
-    size_t nkey;
-    int i = 0;
+static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool return_cas) {
+    int i, nkeys = 0;
+    int nitems = 0;
+    int ibase = c->batch ? c->ileft : 0;
+    bool oom = false;
     item *it = NULL;
     token_t *key_token = &tokens[KEY_TOKEN];
+    mget_key kfixed[MGET_KEYS_INITIAL];
+    mget_key *keys = kfixed;
+    int ksize = MGET_KEYS_INITIAL;
     int stats_get_cmds   = 0;
     int stats_get_hits   = 0;
     int stats_get_misses = 0;
+    uint64_t start;
     assert(c != NULL);
 
+    if (rep_redirect(c, false))
+        return;
+
+    /*
+     * Collect every key first, so the lookups can be done in one go. The
+     * tokens point into the read buffer, which stays put until we return.
+     */
     do {
         while(key_token->length != 0) {
-
-            key = key_token->value;
-            nkey = key_token->length;
-
-            if(nkey > KEY_MAX_LENGTH) {
-                STATS_LOCK();
-                stats.get_cmds   += stats_get_cmds;
-                stats.get_hits   += stats_get_hits;
-                stats.get_misses += stats_get_misses;
-                STATS_UNLOCK();
+            if(key_token->length > KEY_MAX_LENGTH) {
+                if (keys != kfixed)
+                    free(keys);
                 out_string(c, "CLIENT_ERROR bad command line format");
                 return;
             }
 
-            stats_get_cmds++;
-            
-            it = item_get(key, nkey);
-
-            if (it) {
-                if (i >= c->isize) {
-                    item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
-                    if (new_list) {
-                        c->isize *= 2;
-                        c->ilist = new_list;
-                    } else { 
-                        item_free(it);
-                        it = NULL;
-                        break;
-                    }
+            if (nkeys >= ksize) {
+                mget_key *new_keys = (mget_key *)malloc(sizeof(mget_key) * ksize * 2);
+                if (new_keys == NULL) {
+                    if (keys != kfixed)
+                        free(keys);
+                    out_string(c, "SERVER_ERROR out of memory reading get keys");
+                    return;
                 }
-
-                /*
-                 * Construct the response. Each hit adds three elements to the
-                 * outgoing data list:
-                 *   "VALUE "
-                 *   key
-                 *   " " + flags + " " + data length + "\r\n" + data (with \r\n)
-                 */
-
-                if (add_iov(c, "VALUE ", 6) != 0 ||
-                   add_iov(c, ITEM_key(it), it->nkey) != 0 ||
-                   add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
-                   {
-                       item_free(it);
-                       it = NULL;
-                       break;
-                   }
-
-                if (settings.verbose > 1)
-                    fprintf(stderr, ">%d sending key %s\n", c->sfd, ITEM_key(it));
-
-                stats_get_hits++;
-                *(c->ilist + i) = it;
-                i++;
-
-            } else {
-                stats_get_misses++;
+                memcpy(new_keys, keys, sizeof(mget_key) * nkeys);
+                if (keys != kfixed)
+                    free(keys);
+                keys = new_keys;
+                ksize *= 2;
             }
+            keys[nkeys].key = key_token->value;
+            keys[nkeys].nkey = key_token->length;
+            nkeys++;
 
             key_token++;
         }
@@ -1058,8 +1321,64 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
 
     } while(key_token->value != NULL);
 
+    start = latency_now();
+    item_get_multi(keys, nkeys);
+    latency_record(c->stats, LAT_GET, LAT_STORAGE, start);
+    c->lat_cmd = LAT_GET;
+    stats_get_cmds = nkeys;
+
+    /* make room for all the hits at once, after a batch's buffers */
+    if (ibase + nkeys > c->isize) {
+        item **new_list = realloc(c->ilist, sizeof(item *) * (ibase + nkeys));
+        if (new_list) {
+            c->isize = ibase + nkeys;
+            c->ilist = new_list;
+        } else {
+            oom = true;
+        }
+    }
+
+    /* answer in the order the keys were asked for */
+    for (i = 0; i < nkeys; i++) {
+        it = keys[i].it;
+        hotkey_touch(keys[i].key, keys[i].nkey, HOTKEY_GET);
+        if (it == NULL) {
+            stats_get_misses++;
+            continue;
+        }
+        stats_get_hits++;
+        size_record(c->stats->size_read, it->nbytes - 2);
+
+        /*
+         * Construct the response. Each hit adds three elements to the
+         * outgoing data list:
+         *   "VALUE "
+         *   key
+         *   " " + flags + " " + data length [+ " " + cas] + "\r\n" + data (with \r\n)
+         */
+        item_make_suffix(it, return_cas);
+        if (oom ||
+            add_iov(c, "VALUE ", 6) != 0 ||
+            add_iov(c, ITEM_key(it), it->nkey) != 0 ||
+            add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
+        {
+            oom = true;
+            item_free(it);
+            continue;
+        }
+
+        if (settings.verbose > 1)
+            fprintf(stderr, ">%d sending key %s\n", c->sfd, ITEM_key(it));
+
+        *(c->ilist + ibase + nitems) = it;
+        nitems++;
+    }
+
+    if (keys != kfixed)
+        free(keys);
+
     c->icurr = c->ilist;
-    c->ileft = i;
+    c->ileft = ibase + nitems;
 
     if (settings.verbose > 1)
         fprintf(stderr, ">%d END\n", c->sfd);
@@ -1069,7 +1388,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
         reliable to add END\r\n to the buffer, because it might not end
         in \r\n. So we send SERVER_ERROR instead.
     */
-    if (key_token->value != NULL || add_iov(c, "END\r\n", 5) != 0
+    if (oom || add_iov(c, "END\r\n", 5) != 0
         || (c->udp && build_udp_headers(c) != 0)) {
         out_string(c, "SERVER_ERROR out of memory writing get response");
     }
@@ -1078,21 +1397,286 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens)
         c->msgcurr = 0;
     }
 
-    STATS_LOCK();
-    stats.get_cmds   += stats_get_cmds;
-    stats.get_hits   += stats_get_hits;
-    stats.get_misses += stats_get_misses;
-    STATS_UNLOCK();
+    c->stats->get_cmds   += stats_get_cmds;
+    c->stats->get_hits   += stats_get_hits;
+    c->stats->get_misses += stats_get_misses;
 
     return;
 }
 
-static void process_update_command(conn *c, token_t *tokens, const size_t ntokens, int comm) {
+/* the buffers an rget copies what it sends into, kept in ilist */
+struct rget_out {
+    char *p;
+    size_t left;
+};
+
+/*
+ * Takes n bytes from the end of out, starting a new buffer of at least
+ * chunk bytes when it runs out. Returns them, or NULL (with nothing kept)
+ * if out of memory.
+ */
+static char *rget_reserve(conn *c, struct rget_out *out, const size_t n,
+                          const size_t chunk, int *nbufs) {
+    char *dst;
+
+    if (n > out->left) {
+        out->left = n > chunk ? n : chunk;
+        if ((out->p = slabs_alloc(out->left)) == NULL) {
+            out->left = 0;
+            return NULL;
+        }
+        if (*nbufs >= c->isize) {
+            item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+            if (new_list == NULL) {
+                slabs_free(out->p);
+                out->p = NULL;
+                out->left = 0;
+                return NULL;
+            }
+            c->isize *= 2;
+            c->ilist = new_list;
+        }
+        c->ilist[(*nbufs)++] = (item *)out->p;
+    }
+    dst = out->p;
+    out->p += n;
+    out->left -= n;
+    return dst;
+}
+
+/* copies n bytes from src to the end of out, see rget_reserve() */
+static char *rget_copy(conn *c, struct rget_out *out, const void *src, const size_t n,
+                       const size_t chunk, int *nbufs) {
+    char *dst = rget_reserve(c, out, n, chunk, nbufs);
+
+    if (dst != NULL)
+        memcpy(dst, src, n);
+    return dst;
+}
+
+/*
+ * Queues one record an rget cursor is on for sending. The key and data
+ * are copied to out, as the cursor moves on before the response goes
+ * out, the data inflated if it is compressed; the suffix is built at
+ * suffix. Returns the length of the suffix, 0 if the record has expired
+ * and is left out, or -1 if out of memory or the record is not valid.
+ */
+static int rget_add_record(conn *c, const void *rkey, const u_int32_t rklen,
+                           const void *rdata, const u_int32_t rdlen, char *suffix,
+                           struct rget_out *out, const size_t chunk, int *nbufs, const time_t now) {
+    item hdr;
+    const char *data;
+    char *key, *copy;
+    int nsuffix, n;
+
+    if (item_record_decode(rdata, rdlen, &hdr, &data) < 0
+        || (n = item_record_length(&hdr, data)) < 0)
+        return -1;
+    if (ITEM_expired(hdr.exptime, now))
+        return 0;
+    nsuffix = sprintf(suffix, " %u %d\r\n", hdr.flags, n);
+
+    if ((key = rget_copy(c, out, rkey, rklen, chunk, nbufs)) == NULL)
+        return -1;
+    if (!(hdr.iflags & RECORD_LZ4)) {
+        if ((copy = rget_copy(c, out, data, n, chunk, nbufs)) == NULL)
+            return -1;
+    } else if ((copy = rget_reserve(c, out, n, chunk, nbufs)) == NULL
+               || item_record_inflate(&hdr, data, copy, n) != 0) {
+        return -1;
+    }
+    if (add_iov(c, "VALUE ", 6) != 0 ||
+        add_iov(c, key, rklen) != 0 ||
+        add_iov(c, suffix, nsuffix) != 0 ||
+        add_iov(c, copy, n) != 0 ||
+        add_iov(c, "\r\n", 2) != 0)
+        return -1;
+
+    if (settings.verbose > 1)
+        fprintf(stderr, ">%d sending key %.*s\n", c->sfd, (int)rklen, key);
+    return nsuffix;
+}
+
+/* one cursor of an rget, over a single partition */
+struct rget_stream {
+    engine_cursor *cursor;
+    /* the record at the head of the stream */
+    const void *rkey;
+    u_int32_t rklen;
+    const void *rdata;
+    u_int32_t rdlen;
+};
+
+/*
+ * rget <start> <end> <left_open> <right_open> <max>
+ *
+ * Sends, in key order, up to <max> items whose keys lie between <start>
+ * and <end>; an open end leaves out the key at that end. Each partition
+ * is read from its own cursor, which the bdb engine fills a bulk buffer at
+ * a time, and the partitions are merged by key.
+ */
+static inline void process_rget_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *start = tokens[1].value, *end = tokens[2].value;
+    size_t nstart = tokens[1].length, nend = tokens[2].length;
+    unsigned long left_open, right_open, max;
+    char *endptr;
+    struct rget_stream *streams, *s;
+    struct rget_out out = { NULL, 0 };
+    int nstreams = 0, nparts = bdb_settings.db_parts;
+    char kbuf[KEY_MAX_LENGTH + 1];
+    u_int32_t bufsize;
+    char *suffix;
+    int i, nitems = 0, nbufs = 0;
+    bool failed = false;
+    time_t now = time(NULL);
+    uint64_t started;
+    int ret;
+
+    assert(c != NULL);
+
+    if (rep_redirect(c, false))
+        return;
+
+    if (bdb_settings.db_type != DB_BTREE) {
+        out_string(c, "CLIENT_ERROR rget needs a btree database");
+        return;
+    }
+
+    left_open = strtoul(tokens[3].value, &endptr, 10);
+    if (*endptr != '\0' || left_open > 1) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    right_open = strtoul(tokens[4].value, &endptr, 10);
+    if (*endptr != '\0' || right_open > 1) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    max = strtoul(tokens[5].value, &endptr, 10);
+    if (*endptr != '\0' || max == 0 || max > RGET_MAX_ITEMS
+        || nstart > KEY_MAX_LENGTH || nend > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    /* the partitions share the bulk pages, every cursor holds a buffer */
+    bufsize = bdb_settings.page_size * (nparts < RGET_BULK_PAGES ? RGET_BULK_PAGES / nparts : 1);
+
+    if ((streams = calloc(nparts, sizeof(struct rget_stream))) == NULL) {
+        out_string(c, "SERVER_ERROR out of memory");
+        return;
+    }
+    /* the suffixes of all items, kept in ilist like the copies */
+    if ((suffix = slabs_alloc(max * ITEM_SUFFIX_SIZE)) == NULL) {
+        free(streams);
+        out_string(c, "SERVER_ERROR out of memory");
+        return;
+    }
+    c->ilist[nbufs++] = (item *)suffix;
+
+    /* key + '\0' is the smallest key after key */
+    memcpy(kbuf, start, nstart);
+    if (left_open)
+        kbuf[nstart++] = '\0';
+
+    started = latency_now();
+    for (i = 0; i < nparts; i++) {
+        s = &streams[nstreams];
+        if ((ret = engine->cursor(i, NULL, bufsize, &s->cursor)) != 0) {
+            if (settings.verbose > 1)
+                fprintf(stderr, "engine->cursor: %s\n", db_strerror(ret));
+            failed = true;
+            break;
+        }
+        ret = engine->c_get(s->cursor, ENGINE_SET_RANGE, kbuf, nstart,
+                            &s->rkey, &s->rklen, &s->rdata, &s->rdlen);
+        if (ret != 0) {
+            engine->c_close(s->cursor);
+            if (ret == DB_NOTFOUND)
+                continue;
+            if (settings.verbose > 1)
+                fprintf(stderr, "engine->c_get: %s\n", db_strerror(ret));
+            failed = true;
+            break;
+        }
+        /* the live streams are kept at the front */
+        nstreams++;
+    }
+
+    while (!failed && nstreams > 0 && nitems < max) {
+        /* the stream with the smallest head */
+        s = &streams[0];
+        for (i = 1; i < nstreams; i++) {
+            if (item_key_cmp(streams[i].rkey, streams[i].rklen, s->rkey, s->rklen) < 0)
+                s = &streams[i];
+        }
+
+        ret = item_key_cmp(s->rkey, s->rklen, end, nend);
+        if (ret > 0 || (ret == 0 && right_open))
+            break;
+        if (s->rklen > KEY_MAX_LENGTH
+            || (ret = rget_add_record(c, s->rkey, s->rklen, s->rdata, s->rdlen, suffix,
+                                      &out, bufsize, &nbufs, now)) < 0) {
+            failed = true;
+            break;
+        }
+        suffix += ret;
+        if (ret > 0)
+            nitems++;
+        if (nitems >= max)
+            break;
+
+        ret = engine->c_get(s->cursor, ENGINE_NEXT, NULL, 0, &s->rkey, &s->rklen, &s->rdata, &s->rdlen);
+        if (ret == DB_NOTFOUND) {
+            engine->c_close(s->cursor);
+            *s = streams[--nstreams];
+        } else if (ret != 0) {
+            if (settings.verbose > 1)
+                fprintf(stderr, "engine->c_get: %s\n", db_strerror(ret));
+            failed = true;
+        }
+    }
+
+    for (i = 0; i < nstreams; i++)
+        engine->c_close(streams[i].cursor);
+    free(streams);
+    latency_record(c->stats, LAT_RGET, LAT_STORAGE, started);
+    c->lat_cmd = LAT_RGET;
+
+    c->stats->rget_cmds++;
+    c->stats->rget_items += nitems;
+
+    if (failed || add_iov(c, "END\r\n", 5) != 0
+        || (c->udp && build_udp_headers(c) != 0)) {
+        /* drop whatever was queued, an error line goes out alone */
+        for (i = 0; i < nbufs; i++)
+            slabs_free(c->ilist[i]);
+        c->msgused = 0;
+        c->iovused = 0;
+        if (add_msghdr(c) != 0) {
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        out_string(c, "SERVER_ERROR rget failed");
+        return;
+    }
+
+    if (settings.verbose > 1)
+        fprintf(stderr, ">%d END\n", c->sfd);
+
+    c->icurr = c->ilist;
+    c->ileft = nbufs;
+    conn_set_state(c, conn_mwrite);
+    c->msgcurr = 0;
+}
+
+static void process_update_command(conn *c, token_t *tokens, const size_t ntokens, int comm, bool handle_cas) {
     char *key;
     size_t nkey;
     int flags;
     time_t exptime;
     int vlen;
+    uint64_t req_cas_id = 0;
     item *it = NULL;
 
     assert(c != NULL);
@@ -1109,11 +1693,23 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     exptime = strtol(tokens[3].value, NULL, 10);
     vlen = strtol(tokens[4].value, NULL, 10);
 
+    /* does cas value exist? */
+    if (handle_cas) {
+        req_cas_id = strtoull(tokens[5].value, NULL, 10);
+    }
+
     if(errno == ERANGE || ((flags == 0 || exptime == 0) && errno == EINVAL)) {
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
 
+    if (rep_redirect(c, true)) {
+        /* swallow the data line */
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen + 2;
+        return;
+    }
+
     it = item_alloc1(key, nkey, flags, vlen+2);
 
     if (it == NULL) {
@@ -1124,6 +1720,9 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
         return;
     }
 
+    it->exptime = item_exptime(exptime);
+    it->cas = req_cas_id;
+
     c->item = it;
     c->ritem = ITEM_data(it);
     c->rlbytes = it->nbytes;
@@ -1131,11 +1730,29 @@ static void process_update_command(conn *c, token_t *tokens, const size_t ntoken
     conn_set_state(c, conn_nread);
 }
 
+/*
+ * Counts an incr or decr in the stats of the connection's thread.
+ */
+static void count_delta(conn *c, const bool incr, const bool hit, const bool miss) {
+    if (hit) {
+        if (incr)
+            c->stats->incr_hits++;
+        else
+            c->stats->decr_hits++;
+    } else if (miss) {
+        if (incr)
+            c->stats->incr_misses++;
+        else
+            c->stats->decr_misses++;
+    }
+}
+
 static void process_arithmetic_command(conn *c, token_t *tokens, const size_t ntokens, const bool incr) {
     char temp[sizeof("18446744073709551615")];
     int64_t delta;
     char *key;
     size_t nkey;
+    char *ret;
 
     assert(c != NULL);
 
@@ -1144,6 +1761,9 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
         return;
     }
 
+    if (rep_redirect(c, true))
+        return;
+
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
 
@@ -1154,7 +1774,14 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
         return;
     }
 
-    out_string(c, add_delta(incr, delta, temp, key, nkey));
+    ret = add_delta(incr, delta, temp, key, nkey);
+    c->lat_cmd = LAT_INCR;
+    count_delta(c, incr, ret == temp, strcmp(ret, "NOT_FOUND") == 0);
+    out_string(c, ret);
+    /* add_delta() only hands back our buffer if it stored the new value,
+       a write-behind counter is written later */
+    if (ret == temp && !counter_enabled())
+        c->batch_dirty = true;
 }
 
 /*
@@ -1167,10 +1794,10 @@ static void process_arithmetic_command(conn *c, token_t *tokens, const size_t nt
  *
  * returns a response string to send back to the client.
  */
-char *do_add_delta(const bool incr, const int64_t delta, char *buf, char *key, size_t nkey) {
+static char *db_add_delta(const bool incr, const int64_t delta, char *buf, char *key, size_t nkey) {
     char *ptr;
     int64_t value;
-    int vlen, flags, ret;
+    int vlen, ret;
     item *old_it = NULL;
     item *new_it = NULL;
 
@@ -1198,17 +1825,15 @@ char *do_add_delta(const bool incr, const int64_t delta, char *buf, char *key, s
     }
     vlen = sprintf(buf, "%llu", value);
 
-    /* flags was already lost - so recover them from ITEM_suffix(it) */
-    flags = (int) strtol(ITEM_suffix(old_it), (char **) NULL, 10);
-            
     /* construct new item */
-    new_it = item_alloc1(key, nkey, flags, vlen + 2);
+    new_it = item_alloc1(key, nkey, old_it->flags, vlen + 2);
     if (new_it == NULL) {
         /* SERVER_ERROR out of memory */
         if (old_it != NULL)
             item_free(old_it);
         return "SERVER_ERROR out of memory processing arithmetic";
     }
+    new_it->exptime = old_it->exptime;
     memcpy(ITEM_data(new_it), buf, vlen);
     memcpy(ITEM_data(new_it) + vlen, "\r\n", 2);
     
@@ -1226,10 +1851,22 @@ char *do_add_delta(const bool incr, const int64_t delta, char *buf, char *key, s
     return buf;
 }
 
+/* times the storage calls of an incr or decr, like do_store_item() */
+char *do_add_delta(const bool incr, const int64_t delta, char *buf, char *key, size_t nkey) {
+    uint64_t start = latency_now();
+    char *ret = counter_enabled() ? counter_delta(incr, delta, buf, key, nkey)
+                                  : db_add_delta(incr, delta, buf, key, nkey);
+
+    latency_record(thread_stats(), LAT_INCR, LAT_STORAGE, start);
+    hotkey_touch(key, nkey, HOTKEY_INCR);
+    return ret;
+}
+
 static void process_delete_command(conn *c, token_t *tokens, const size_t ntokens) {
     char *key;
     size_t nkey;
     int ret;
+    uint64_t start;
     assert(c != NULL);
     key = tokens[KEY_TOKEN].value;
     nkey = tokens[KEY_TOKEN].length;
@@ -1237,9 +1874,20 @@ static void process_delete_command(conn *c, token_t *tokens, const size_t ntoken
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
-    switch (ret = item_delete(key, nkey)) {
+    if (rep_redirect(c, true))
+        return;
+    start = latency_now();
+    ret = item_delete(key, nkey);
+    latency_record(c->stats, LAT_DELETE, LAT_STORAGE, start);
+    c->lat_cmd = LAT_DELETE;
+    if (ret == 0)
+        c->stats->delete_hits++;
+    else if (ret == 1)
+        c->stats->delete_misses++;
+    switch (ret) {
     case 0:
         out_string(c, "DELETED");
+        c->batch_dirty = true;
         break;
     case 1:
         out_string(c, "NOT_FOUND");
@@ -1303,6 +1951,38 @@ static void process_rep_command(conn *c, token_t *tokens, const size_t ntokens)
             out_string(c, "OK");
             return;
 
+        } else if (ntokens == 2 && strcmp(tokens[COMMAND_TOKEN].value, "rep_lsn") == 0){
+            /* the token for "read your writes": ask the master after a write */
+            DB_LSN lsn;
+            char temp[64];
+            if (bdb_rep_lsn(&lsn) != 0){
+                out_string(c, "SERVER_ERROR env->log_stat");
+                return;
+            }
+            sprintf(temp, "LSN %u/%u", lsn.file, lsn.offset);
+            out_string(c, temp);
+            return;
+
+        } else if (ntokens == 3 && strcmp(tokens[COMMAND_TOKEN].value, "rep_check_lsn") == 0){
+            /* a replica that has applied the token sees the write of it */
+            DB_LSN want, lsn;
+            char temp[64];
+            if (sscanf(tokens[1].value, "%u/%u", &want.file, &want.offset) != 2){
+                out_string(c, "CLIENT_ERROR bad command line format");
+                return;
+            }
+            if (bdb_rep_lsn(&lsn) != 0){
+                out_string(c, "SERVER_ERROR env->rep_stat");
+                return;
+            }
+            if (log_compare(&lsn, &want) >= 0){
+                out_string(c, "OK");
+            } else {
+                sprintf(temp, "BEHIND %u/%u", lsn.file, lsn.offset);
+                out_string(c, temp);
+            }
+            return;
+
         }else {
             out_string(c, "ERROR");
         }
@@ -1314,47 +1994,118 @@ static void process_rep_command(conn *c, token_t *tokens, const size_t ntokens)
 
 static void process_bdb_command(conn *c, token_t *tokens, const size_t ntokens) {
 	int ret;
+    /* db_checkpoint and db_compact take an optional partition, -1 is all */
+    int part = -1;
+    char *endptr;
+    char *target = NULL;
     assert(c != NULL);
 
-    if (strcmp(tokens[COMMAND_TOKEN].value, "db_archive") == 0){
-        if(0 != (ret = env->log_archive(env, NULL, DB_ARCH_REMOVE))){
-            if (settings.verbose > 1) {
-                fprintf(stderr, "env->log_archive: %s\n", db_strerror(ret));
-			}
-            out_string(c, "ERROR");
-        }else{
-            out_string(c, "OK");
+    /* db_backup takes where to, a directory or host:port, see backup.c */
+    if (strcmp(tokens[COMMAND_TOKEN].value, "db_backup") == 0) {
+        if (ntokens != 3 || tokens[1].length >= BACKUP_TARGET_MAX
+            || (tokens[1].value[0] != '/' && strchr(tokens[1].value, ':') == NULL)) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
         }
-        return;
-    
-    }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_checkpoint") == 0){
-        if(0 != (ret = env->txn_checkpoint(env, 0, 0, 0))){
-            if (settings.verbose > 1) {
-                fprintf(stderr, "env->txn_checkpoint: %s\n", db_strerror(ret));
-			}
-            out_string(c, "ERROR");
-        }else{
-            out_string(c, "OK");
+        target = tokens[1].value;
+    } else if (strcmp(tokens[COMMAND_TOKEN].value, "bulk_load") == 0) {
+        /* bulk_load takes the file to read, see load.c */
+        if (ntokens != 3 || tokens[1].length >= BACKUP_TARGET_MAX || tokens[1].value[0] != '/') {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
         }
+        target = tokens[1].value;
+    } else if (ntokens == 3) {
+        part = strtol(tokens[1].value, &endptr, 10);
+        if (*endptr != '\0' || part < 0 || part >= bdb_settings.db_parts
+            || (strcmp(tokens[COMMAND_TOKEN].value, "db_checkpoint") != 0
+                && strcmp(tokens[COMMAND_TOKEN].value, "db_compact") != 0)) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+    }
+
+    /* the mmap engine has no log and its files need no compacting */
+    if (engine != &bdb_engine && strcmp(tokens[COMMAND_TOKEN].value, "db_checkpoint") != 0
+        && strcmp(tokens[COMMAND_TOKEN].value, "db_convert") != 0
+        && strcmp(tokens[COMMAND_TOKEN].value, "bulk_load") != 0) {
+        out_string(c, "SERVER_ERROR not supported by the mmap engine");
         return;
-    
+    }
+
+    /* these run on the job thread, see "bdb_job status" */
+    if (strcmp(tokens[COMMAND_TOKEN].value, "db_archive") == 0){
+        ret = bdb_job_submit(JOB_ARCHIVE, -1, NULL);
+    }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_checkpoint") == 0){
+        ret = bdb_job_submit(JOB_CHECKPOINT, part, NULL);
     }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_compact") == 0){
-		DB_COMPACT c_data;
-        if(0 != (ret = dbp->compact(dbp, NULL, NULL, NULL, &c_data, DB_FREE_SPACE, NULL))){
-            if (settings.verbose > 1) {
-                fprintf(stderr, "dbp->compact: %s\n", db_strerror(ret));
-			}
+        ret = bdb_job_submit(JOB_COMPACT, part, NULL);
+    }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_backup") == 0){
+        ret = bdb_job_submit(JOB_BACKUP, -1, target);
+    }else if (strcmp(tokens[COMMAND_TOKEN].value, "bulk_load") == 0){
+        /* a replica gets the records from its master */
+        if (bdb_settings.is_replicated && bdb_settings.rep_whoami != MDB_MASTER) {
+            out_string(c, "ERROR");
+            return;
+        }
+        ret = bdb_job_submit(JOB_LOAD, -1, target);
+    }else if (strcmp(tokens[COMMAND_TOKEN].value, "db_convert") == 0){
+        /* replicas get the converted records from their master */
+        if (bdb_settings.is_replicated && bdb_settings.rep_whoami != MDB_MASTER) {
+            out_string(c, "ERROR");
+        } else if (start_convert_thread() != 0) {
             out_string(c, "ERROR");
-        }else{
+        } else {
             out_string(c, "OK");
         }
         return;
     }else {
         out_string(c, "ERROR");
+        return;
+    }
+
+    if (ret != 0) {
+        out_string(c, "SERVER_ERROR job queue full");
+    } else {
+        out_string(c, "OK");
     }
     return;
 }
 
+/*
+ * bdb_job status
+ * bdb_job cancel
+ * bdb_job throttle <pages per second>
+ */
+static void process_bdb_job_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *subcommand = tokens[1].value;
+    char *endptr;
+    long rate;
+
+    assert(c != NULL);
+
+    if (ntokens == 3 && strcmp(subcommand, "status") == 0) {
+        char temp[1024];
+        stats_bdb_job(temp);
+        out_string(c, temp);
+    } else if (ntokens == 3 && strcmp(subcommand, "cancel") == 0) {
+        if (bdb_job_cancel() > 0)
+            out_string(c, "OK");
+        else
+            out_string(c, "NOT_FOUND");
+    } else if (ntokens == 4 && strcmp(subcommand, "throttle") == 0) {
+        rate = strtol(tokens[2].value, &endptr, 10);
+        if (*endptr != '\0' || rate < 0 || rate > INT_MAX) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        job_stats.rate = rate;
+        out_string(c, "OK");
+    } else {
+        out_string(c, "ERROR");
+    }
+}
+
 
 static void process_command(conn *c, char *command) {
 
@@ -1372,83 +2123,843 @@ static void process_command(conn *c, char *command) {
      * directly into it, then continue in nread_complete().
      */
 
+    /* the reply of a pipelined command goes after the ones queued */
+    c->write_and_go = conn_read;
+    if (!c->batch) {
+        c->msgcurr = 0;
+        c->msgused = 0;
+        c->iovused = 0;
+        if (add_msghdr(c) != 0) {
+            out_string(c, "SERVER_ERROR out of memory preparing response");
+            return;
+        }
+    }
+
+    ntokens = tokenize_command(command, tokens, MAX_TOKENS);
+    if (ntokens >= 3 &&
+        (strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ) {
+
+        process_get_command(c, tokens, ntokens, false);
+
+    } else if (ntokens >= 3 && (strcmp(tokens[COMMAND_TOKEN].value, "gets") == 0)) {
+
+        process_get_command(c, tokens, ntokens, true);
+
+    } else if (ntokens == 7 && (strcmp(tokens[COMMAND_TOKEN].value, "rget") == 0)) {
+
+        process_rget_command(c, tokens, ntokens);
+
+    } else if ((ntokens == 6 || ntokens == 7) &&
+               ((strcmp(tokens[COMMAND_TOKEN].value, "add") == 0 && (comm = NREAD_ADD)) ||
+                (strcmp(tokens[COMMAND_TOKEN].value, "set") == 0 && (comm = NREAD_SET)) ||
+                (strcmp(tokens[COMMAND_TOKEN].value, "replace") == 0 && (comm = NREAD_REPLACE)) ||
+                (strcmp(tokens[COMMAND_TOKEN].value, "prepend") == 0 && (comm = NREAD_PREPEND)) ||
+                (strcmp(tokens[COMMAND_TOKEN].value, "append") == 0 && (comm = NREAD_APPEND)) )) {
+
+        process_update_command(c, tokens, ntokens, comm, false);
+
+    } else if ((ntokens == 7 || ntokens == 8) && (strcmp(tokens[COMMAND_TOKEN].value, "cas") == 0 && (comm = NREAD_CAS))) {
+
+        process_update_command(c, tokens, ntokens, comm, true);
+
+    } else if (ntokens == 4 && (strcmp(tokens[COMMAND_TOKEN].value, "incr") == 0)) {
+
+        process_arithmetic_command(c, tokens, ntokens, 1);
+
+    } else if (ntokens == 4 && (strcmp(tokens[COMMAND_TOKEN].value, "decr") == 0)) {
+
+        process_arithmetic_command(c, tokens, ntokens, 0);
+
+    } else if (ntokens >= 3 && ntokens <= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "delete") == 0)) {
+
+        process_delete_command(c, tokens, ntokens);
+
+    } else if (ntokens >= 2 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
+
+        process_stat(c, tokens, ntokens);
+
+    } else if (ntokens >= 2 && ntokens <= 3 && (strcmp(tokens[COMMAND_TOKEN].value, "flush_all") == 0)) {
+        out_string(c, "OK");
+        return;
+
+    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "version") == 0)) {
+
+        out_string(c, "VERSION " VERSION);
+
+    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "quit") == 0)) {
+
+        conn_set_state(c, conn_closing);
+
+    } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "verbosity") == 0)) {
+
+        process_verbosity_command(c, tokens, ntokens);
+
+    } else if ((ntokens == 3 && ((strcmp(tokens[COMMAND_TOKEN].value, "rep_set_ack_policy") == 0) ||
+                                 (strcmp(tokens[COMMAND_TOKEN].value, "rep_set_priority") == 0) ||
+                                 (strcmp(tokens[COMMAND_TOKEN].value, "rep_check_lsn") == 0))) ||
+               (ntokens == 2 && strcmp(tokens[COMMAND_TOKEN].value, "rep_lsn") == 0)) {
+
+        process_rep_command(c, tokens, ntokens);
+
+    } else if ((ntokens == 2 || ntokens == 3) &&
+              ((strcmp(tokens[COMMAND_TOKEN].value, "db_archive") == 0 ) ||
+               (strcmp(tokens[COMMAND_TOKEN].value, "db_checkpoint") == 0 ) ||
+               (strcmp(tokens[COMMAND_TOKEN].value, "db_compact") == 0 ) ||
+               (strcmp(tokens[COMMAND_TOKEN].value, "db_backup") == 0 ) ||
+               (strcmp(tokens[COMMAND_TOKEN].value, "bulk_load") == 0 ) ||
+               (strcmp(tokens[COMMAND_TOKEN].value, "db_convert") == 0 ))) {
+
+        process_bdb_command(c, tokens, ntokens);
+
+    } else if ((ntokens == 3 || ntokens == 4) && strcmp(tokens[COMMAND_TOKEN].value, "bdb_job") == 0) {
+
+        process_bdb_job_command(c, tokens, ntokens);
+
+    } else {
+        out_string(c, "ERROR");
+    }
+    return;
+}
+
+/*
+ * Binary protocol.
+ *
+ * A connection speaks it when its first byte is the request magic. Every
+ * response gets its own small slab buffer holding the header and any
+ * extras, key or short value; the buffers go into ilist next to the items
+ * whose data is sent in place, and are freed together once written.
+ *
+ * Responses are not written one by one. While more requests are waiting
+ * in the read buffer they keep being queued into one batch, which goes
+ * out in a single pass through conn_mwrite when the pipeline runs dry or
+ * the batch gets big. Quiet commands only answer on failure (or, for the
+ * quiet gets, on a hit), so a client can stream thousands of them and end
+ * with a noop to learn when they are all done.
+ */
+
+/* requests without a value must fit in this much body */
+#define BIN_MAX_BODY 1024
+
+/* nor may a value be so big that it and its CRLF overflow an item's nbytes */
+#define BIN_MAX_VALUE (INT_MAX - 2)
+
+/* flush a batch once this many responses are queued */
+#define BATCH_MAX 1000
+
+static inline uint32_t bin_get32(const char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static inline uint64_t bin_get64(const char *p) {
+    return ((uint64_t)bin_get32(p) << 32) | bin_get32(p + 4);
+}
+
+static inline void bin_put32(char *p, const uint32_t v) {
+    uint32_t n = htonl(v);
+    memcpy(p, &n, sizeof(n));
+}
+
+static inline void bin_put64(char *p, const uint64_t v) {
+    bin_put32(p, (uint32_t)(v >> 32));
+    bin_put32(p + 4, (uint32_t)v);
+}
+
+/*
+ * Starts a batch of responses, unless one is already being queued.
+ */
+static int bin_start_batch(conn *c) {
+    if (c->batch)
+        return 0;
+
     c->msgcurr = 0;
     c->msgused = 0;
     c->iovused = 0;
-    if (add_msghdr(c) != 0) {
-        out_string(c, "SERVER_ERROR out of memory preparing response");
+    c->icurr = c->ilist;
+    c->ileft = 0;
+    c->write_and_go = conn_read;
+    if (add_msghdr(c) != 0)
+        return -1;
+    c->batch = true;
+    return 0;
+}
+
+/*
+ * Keeps a buffer until the batch has been written.
+ */
+static int batch_keep(conn *c, void *buf) {
+    if (c->ileft >= c->isize) {
+        item **new_list = realloc(c->ilist, sizeof(item *) * c->isize * 2);
+        if (new_list == NULL)
+            return -1;
+        c->ilist = new_list;
+        c->icurr = c->ilist;
+        c->isize *= 2;
+    }
+    c->ilist[c->ileft++] = buf;
+    return 0;
+}
+
+/*
+ * Queues a response header for the request being handled. copylen bytes
+ * of room are left right after it, where the caller puts whatever part
+ * of the body (extras, key, short value) it has no stable memory for;
+ * the rest of bodylen has to be queued with add_iov().
+ *
+ * Returns the room after the header, or NULL if out of memory.
+ */
+static char *bin_add_header(conn *c, const uint16_t status, const uint8_t extlen,
+                            const uint16_t keylen, const uint32_t bodylen,
+                            const uint32_t copylen) {
+    protocol_binary_response_header *hdr;
+    char *buf;
+
+    buf = slabs_alloc(sizeof(hdr->bytes) + copylen);
+    if (buf == NULL)
+        return NULL;
+    if (batch_keep(c, buf) != 0) {
+        slabs_free(buf);
+        return NULL;
+    }
+
+    hdr = (protocol_binary_response_header *)buf;
+    hdr->response.magic = PROTOCOL_BINARY_RES;
+    hdr->response.opcode = c->binary_header.request.opcode;
+    hdr->response.keylen = htons(keylen);
+    hdr->response.extlen = extlen;
+    hdr->response.datatype = 0;
+    hdr->response.status = htons(status);
+    hdr->response.bodylen = htonl(bodylen);
+    hdr->response.opaque = c->binary_header.request.opaque;
+    hdr->response.cas = 0;
+
+    if (add_iov(c, buf, sizeof(hdr->bytes) + copylen) != 0)
+        return NULL;
+    return buf + sizeof(hdr->bytes);
+}
+
+/*
+ * Fills in the cas of the response whose body bin_add_header() returned.
+ */
+static void bin_set_cas(char *body, const uint64_t cas) {
+    protocol_binary_response_header *hdr;
+
+    hdr = (protocol_binary_response_header *)(body - sizeof(hdr->bytes));
+    bin_put64((char *)&hdr->response.cas, cas);
+}
+
+/*
+ * Queues a response with no body. A quiet command that succeeded gets
+ * none at all.
+ */
+static void bin_write_status(conn *c, const uint16_t status, const bool quiet) {
+    if (quiet && status == PROTOCOL_BINARY_RESPONSE_SUCCESS)
+        return;
+    if (bin_add_header(c, status, 0, 0, 0, 0) == NULL) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Couldn't queue binary response\n");
+        conn_set_state(c, conn_closing);
+    }
+}
+
+/*
+ * A replica takes no writes, and with -Q serves no reads while it is more
+ * than rep_max_lag seconds behind. Either way the client is told where the
+ * master is, "SERVER_ERROR not master <host:port>" for a write and
+ * "SERVER_ERROR replica behind <host:port>" for a read, with "unknown"
+ * while there is no master. A binary client gets the same text, less the
+ * SERVER_ERROR, as the body of a not supported error.
+ *
+ * Returns true if c was answered and the command should go no further.
+ */
+static bool rep_redirect(conn *c, const bool write) {
+    struct rep_heartbeat hb;
+    char temp[64 + REP_ADDR_MAX];
+    char *word, *body;
+    int lag, len;
+
+    if (!bdb_settings.is_replicated || bdb_settings.rep_whoami == MDB_MASTER)
+        return false;
+    if (!write) {
+        if (bdb_settings.rep_max_lag == 0)
+            return false;
+        lag = bdb_rep_lag();
+        if (lag >= 0 && lag <= bdb_settings.rep_max_lag)
+            return false;
+    }
+
+    c->stats->rep_redirects++;
+    bdb_rep_heartbeat(&hb);
+    len = snprintf(temp, sizeof(temp), "SERVER_ERROR %s %s", write ? "not master" : "replica behind",
+                   hb.master[0] != '\0' ? hb.master : "unknown");
+    if (c->protocol != binary_prot) {
+        out_string(c, temp);
+        return true;
+    }
+    word = temp + strlen("SERVER_ERROR ");
+    len -= word - temp;
+    body = bin_add_header(c, PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED, 0, 0, len, len);
+    if (body != NULL)
+        memcpy(body, word, len);
+    else
+        conn_set_state(c, conn_closing);
+    return true;
+}
+
+/*
+ * Sends the queued batch. With group commit on, a batch that follows a
+ * write waits for the log flush first, just like an ASCII reply.
+ */
+static void batch_flush(conn *c) {
+    assert(c->batch);
+
+    c->batch = false;
+    if (c->iovused == 0) {
+        /* only quiet successes, nothing to say. */
+        conn_set_state(c, c->write_and_go);
+        return;
+    }
+
+    c->msgcurr = 0;
+    conn_set_state(c, conn_mwrite);
+    if (c->batch_dirty) {
+        c->batch_dirty = false;
+        conn_wait_commit(c);
+    }
+}
+
+static void process_bin_get(conn *c, char *key, size_t nkey) {
+    uint8_t opcode = c->binary_header.request.opcode;
+    bool quiet = (opcode == PROTOCOL_BINARY_CMD_GETQ || opcode == PROTOCOL_BINARY_CMD_GETKQ);
+    bool withkey = (opcode == PROTOCOL_BINARY_CMD_GETK || opcode == PROTOCOL_BINARY_CMD_GETKQ);
+    item *it;
+    char *ext;
+    uint64_t start = latency_now();
+
+    it = item_get(key, nkey);
+    latency_record(c->stats, LAT_GET, LAT_STORAGE, start);
+    c->lat_cmd = LAT_GET;
+
+    c->stats->get_cmds++;
+    hotkey_touch(key, nkey, HOTKEY_GET);
+    if (it) {
+        c->stats->get_hits++;
+        size_record(c->stats->size_read, it->nbytes - 2);
+    } else {
+        c->stats->get_misses++;
+    }
+
+    if (it == NULL) {
+        if (quiet)
+            return;
+        /* a getk miss still tells which key it was */
+        if (withkey) {
+            ext = bin_add_header(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, nkey, nkey, nkey);
+            if (ext != NULL)
+                memcpy(ext, key, nkey);
+        } else {
+            ext = bin_add_header(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, 0, 0, 0, 0);
+        }
+        if (ext == NULL)
+            conn_set_state(c, conn_closing);
+        return;
+    }
+
+    if (batch_keep(c, it) != 0) {
+        item_free(it);
+        conn_set_state(c, conn_closing);
+        return;
+    }
+
+    /* extras are the flags, then maybe the key, then the value without CRLF */
+    if (!withkey)
+        nkey = 0;
+    ext = bin_add_header(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 4, nkey,
+                         4 + nkey + it->nbytes - 2, 4 + nkey);
+    if (ext == NULL || add_iov(c, ITEM_data(it), it->nbytes - 2) != 0) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    bin_put32(ext, it->flags);
+    bin_set_cas(ext, it->cas);
+    memcpy(ext + 4, ITEM_key(it), nkey);
+
+    if (settings.verbose > 1)
+        fprintf(stderr, ">%d sending key %s\n", c->sfd, ITEM_key(it));
+}
+
+/*
+ * Starts reading the value of set/add/replace/append/prepend straight into
+ * a new item, continuing in complete_bin_nread().
+ */
+static void process_bin_update(conn *c, char *key, const size_t nkey, char *extras) {
+    protocol_binary_request_header *req = &c->binary_header;
+    uint8_t opcode = req->request.opcode;
+    uint32_t vlen = req->request.bodylen - req->request.extlen - nkey;
+    uint32_t flags = 0;
+    uint32_t exptime = 0;
+    char kbuf[KEY_MAX_LENGTH + 1];
+    uint8_t want_extlen;
+    item *it;
+
+    if (rep_redirect(c, true)) {
+        /* swallow the value */
+        if (c->state != conn_closing) {
+            c->sbytes = vlen;
+            conn_set_state(c, conn_swallow);
+        }
+        return;
+    }
+
+    switch (opcode) {
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+        c->item_comm = NREAD_SET;
+        want_extlen = 8;
+        break;
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+        c->item_comm = NREAD_ADD;
+        want_extlen = 8;
+        break;
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+        c->item_comm = NREAD_REPLACE;
+        want_extlen = 8;
+        break;
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+        c->item_comm = NREAD_APPEND;
+        want_extlen = 0;
+        break;
+    default:
+        c->item_comm = NREAD_PREPEND;
+        want_extlen = 0;
+        break;
+    }
+
+    /* a cas turns set and replace into a compare and swap */
+    if (req->request.cas != 0) {
+        if (c->item_comm == NREAD_SET || c->item_comm == NREAD_REPLACE)
+            c->item_comm = NREAD_CAS;
+        else
+            want_extlen = 0xff;
+    }
+
+    if (req->request.extlen != want_extlen || nkey == 0) {
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_EINVAL, false);
+    } else {
+        if (want_extlen) {
+            flags = bin_get32(extras);
+            exptime = bin_get32(extras + 4);
+        }
+        memcpy(kbuf, key, nkey);
+        kbuf[nkey] = '\0';
+
+        it = item_alloc1(kbuf, nkey, flags, vlen + 2);
+        if (it != NULL) {
+            it->exptime = item_exptime(exptime);
+            it->cas = req->request.cas;
+            c->item = it;
+            c->ritem = ITEM_data(it);
+            c->rlbytes = vlen;
+            conn_set_state(c, conn_nread);
+            return;
+        }
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, false);
+    }
+
+    /* swallow the value */
+    if (c->state != conn_closing) {
+        c->sbytes = vlen;
+        conn_set_state(c, conn_swallow);
+    }
+}
+
+/*
+ * we get here after reading the value of a binary update command.
+ */
+static void complete_bin_nread(conn *c) {
+    item *it = c->item;
+    uint8_t opcode = c->binary_header.request.opcode;
+    bool quiet = (opcode >= PROTOCOL_BINARY_CMD_SETQ);
+    uint16_t status;
+    int ret;
+
+    c->stats->set_cmds++;
+
+    /* the ASCII code paths expect the stored value to end in CRLF */
+    memcpy(ITEM_data(it) + it->nbytes - 2, "\r\n", 2);
+
+    ret = store_item(it, c->item_comm);
+    c->lat_cmd = LAT_SET;
+    count_store(c, it, c->item_comm, ret);
+    if (ret == 1) {
+        status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+        c->batch_dirty = true;
+    } else if (ret == 2) {
+        status = PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS;
+    } else if (ret == 3) {
+        status = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
+    } else if (c->item_comm == NREAD_APPEND || c->item_comm == NREAD_PREPEND) {
+        /* most likely there was nothing to add to */
+        status = PROTOCOL_BINARY_RESPONSE_NOT_STORED;
+    } else {
+        status = PROTOCOL_BINARY_RESPONSE_EINTERNAL;
+    }
+
+    conn_set_state(c, conn_read);
+    if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS && !quiet) {
+        /* tell the client the cas of what it just stored */
+        char *body = bin_add_header(c, status, 0, 0, 0, 0);
+        if (body != NULL)
+            bin_set_cas(body, it->cas);
+        else
+            conn_set_state(c, conn_closing);
+    } else {
+        bin_write_status(c, status, quiet);
+    }
+
+    item_free(c->item);
+    c->item = 0;
+    if (c->state == conn_read && c->ileft >= BATCH_MAX)
+        batch_flush(c);
+}
+
+static void process_bin_arithmetic(conn *c, char *key, const size_t nkey, char *extras) {
+    uint8_t opcode = c->binary_header.request.opcode;
+    bool incr = (opcode == PROTOCOL_BINARY_CMD_INCREMENT || opcode == PROTOCOL_BINARY_CMD_INCREMENTQ);
+    bool quiet = (opcode == PROTOCOL_BINARY_CMD_INCREMENTQ || opcode == PROTOCOL_BINARY_CMD_DECREMENTQ);
+    char temp[sizeof("18446744073709551615")];
+    char kbuf[KEY_MAX_LENGTH + 1];
+    uint64_t delta, initial;
+    uint32_t exptime;
+    char *ret;
+    char *body;
+    item *it;
+
+    if (c->binary_header.request.extlen != 20 || nkey == 0) {
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_EINVAL, false);
+        return;
+    }
+    delta = bin_get64(extras);
+    initial = bin_get64(extras + 8);
+    exptime = bin_get32(extras + 16);
+
+    memcpy(kbuf, key, nkey);
+    kbuf[nkey] = '\0';
+
+    ret = add_delta(incr, (int64_t)delta, temp, kbuf, nkey);
+    c->lat_cmd = LAT_INCR;
+    count_delta(c, incr, ret == temp, strcmp(ret, "NOT_FOUND") == 0);
+    if (ret != temp && strcmp(ret, "NOT_FOUND") == 0 && exptime != 0xffffffff) {
+        /* create the counter, unless someone beats us to it */
+        int vlen = sprintf(temp, "%llu", (unsigned long long)initial);
+        it = item_alloc1(kbuf, nkey, 0, vlen + 2);
+        if (it == NULL) {
+            bin_write_status(c, PROTOCOL_BINARY_RESPONSE_ENOMEM, false);
+            return;
+        }
+        it->exptime = item_exptime(exptime);
+        memcpy(ITEM_data(it), temp, vlen);
+        memcpy(ITEM_data(it) + vlen, "\r\n", 2);
+        if (store_item(it, NREAD_ADD) == 1) {
+            ret = temp;
+            c->batch_dirty = true;
+        } else
+            ret = add_delta(incr, (int64_t)delta, temp, kbuf, nkey);
+        item_free(it);
+    }
+
+    if (ret != temp) {
+        if (strcmp(ret, "NOT_FOUND") == 0)
+            bin_write_status(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, false);
+        else if (strncmp(ret, "CLIENT_ERROR", 12) == 0)
+            bin_write_status(c, PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL, false);
+        else
+            bin_write_status(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, false);
         return;
     }
 
-    ntokens = tokenize_command(command, tokens, MAX_TOKENS);
-    if (ntokens >= 3 &&
-        (strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ) {
-
-        process_get_command(c, tokens, ntokens);
-
-    } else if ((ntokens == 6 || ntokens == 7) &&
-               ((strcmp(tokens[COMMAND_TOKEN].value, "add") == 0 && (comm = NREAD_ADD)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "set") == 0 && (comm = NREAD_SET)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "replace") == 0 && (comm = NREAD_REPLACE)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "prepend") == 0 && (comm = NREAD_PREPEND)) ||
-                (strcmp(tokens[COMMAND_TOKEN].value, "append") == 0 && (comm = NREAD_APPEND)) )) {
-
-        process_update_command(c, tokens, ntokens, comm);
+    if (!counter_enabled())
+        c->batch_dirty = true;
+    if (quiet)
+        return;
+    body = bin_add_header(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, 0, 8, 8);
+    if (body == NULL) {
+        conn_set_state(c, conn_closing);
+        return;
+    }
+    bin_put64(body, (uint64_t)strtoull(temp, NULL, 10));
+}
 
-    } else if (ntokens == 4 && (strcmp(tokens[COMMAND_TOKEN].value, "incr") == 0)) {
+static void process_bin_delete(conn *c, char *key, const size_t nkey) {
+    bool quiet = (c->binary_header.request.opcode == PROTOCOL_BINARY_CMD_DELETEQ);
 
-        process_arithmetic_command(c, tokens, ntokens, 1);
+    uint64_t start = latency_now();
+    int ret = item_delete(key, nkey);
 
-    } else if (ntokens == 4 && (strcmp(tokens[COMMAND_TOKEN].value, "decr") == 0)) {
+    latency_record(c->stats, LAT_DELETE, LAT_STORAGE, start);
+    c->lat_cmd = LAT_DELETE;
+    if (ret == 0)
+        c->stats->delete_hits++;
+    else if (ret == 1)
+        c->stats->delete_misses++;
+    switch (ret) {
+    case 0:
+        c->batch_dirty = true;
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, quiet);
+        break;
+    case 1:
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, false);
+        break;
+    default:
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_EINTERNAL, false);
+    }
+}
 
-        process_arithmetic_command(c, tokens, ntokens, 0);
+/*
+ * Handles one request whose header is in c->binary_header. For update
+ * commands body holds the extras and key, for all others the whole body.
+ */
+static void process_bin_command(conn *c, char *body) {
+    protocol_binary_request_header *req = &c->binary_header;
+    char *extras = body;
+    char *key = body + req->request.extlen;
+    size_t nkey = req->request.keylen;
+    char *ver;
 
-    } else if (ntokens >= 3 && ntokens <= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "delete") == 0)) {
+    if (settings.verbose > 1)
+        fprintf(stderr, "<%d binary opcode 0x%02x, key %.*s\n", c->sfd,
+                req->request.opcode, (int)nkey, key);
+
+    switch (req->request.opcode) {
+    case PROTOCOL_BINARY_CMD_GET:
+    case PROTOCOL_BINARY_CMD_GETQ:
+    case PROTOCOL_BINARY_CMD_GETK:
+    case PROTOCOL_BINARY_CMD_GETKQ:
+        if (req->request.extlen != 0 || nkey == 0)
+            bin_write_status(c, PROTOCOL_BINARY_RESPONSE_EINVAL, false);
+        else if (!rep_redirect(c, false))
+            process_bin_get(c, key, nkey);
+        break;
+    case PROTOCOL_BINARY_CMD_SET:
+    case PROTOCOL_BINARY_CMD_SETQ:
+    case PROTOCOL_BINARY_CMD_ADD:
+    case PROTOCOL_BINARY_CMD_ADDQ:
+    case PROTOCOL_BINARY_CMD_REPLACE:
+    case PROTOCOL_BINARY_CMD_REPLACEQ:
+    case PROTOCOL_BINARY_CMD_APPEND:
+    case PROTOCOL_BINARY_CMD_APPENDQ:
+    case PROTOCOL_BINARY_CMD_PREPEND:
+    case PROTOCOL_BINARY_CMD_PREPENDQ:
+        process_bin_update(c, key, nkey, extras);
+        break;
+    case PROTOCOL_BINARY_CMD_DELETE:
+    case PROTOCOL_BINARY_CMD_DELETEQ:
+        if (req->request.extlen != 0 || nkey == 0)
+            bin_write_status(c, PROTOCOL_BINARY_RESPONSE_EINVAL, false);
+        else if (!rep_redirect(c, true))
+            process_bin_delete(c, key, nkey);
+        break;
+    case PROTOCOL_BINARY_CMD_INCREMENT:
+    case PROTOCOL_BINARY_CMD_INCREMENTQ:
+    case PROTOCOL_BINARY_CMD_DECREMENT:
+    case PROTOCOL_BINARY_CMD_DECREMENTQ:
+        if (!rep_redirect(c, true))
+            process_bin_arithmetic(c, key, nkey, extras);
+        break;
+    case PROTOCOL_BINARY_CMD_NOOP:
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, false);
+        break;
+    case PROTOCOL_BINARY_CMD_FLUSH:
+    case PROTOCOL_BINARY_CMD_FLUSHQ:
+        /* like flush_all, there is nothing to flush in a database */
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_SUCCESS,
+                         req->request.opcode == PROTOCOL_BINARY_CMD_FLUSHQ);
+        break;
+    case PROTOCOL_BINARY_CMD_VERSION:
+        ver = bin_add_header(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, 0, 0,
+                             strlen(VERSION), strlen(VERSION));
+        if (ver == NULL)
+            conn_set_state(c, conn_closing);
+        else
+            memcpy(ver, VERSION, strlen(VERSION));
+        break;
+    case PROTOCOL_BINARY_CMD_QUIT:
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_SUCCESS, false);
+        c->write_and_go = conn_closing;
+        if (c->state != conn_closing)
+            batch_flush(c);
+        break;
+    case PROTOCOL_BINARY_CMD_QUITQ:
+        conn_set_state(c, conn_closing);
+        break;
+    default:
+        bin_write_status(c, PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND, false);
+    }
+}
 
-        process_delete_command(c, tokens, ntokens);
+/*
+ * If a complete binary request is in the buffer, process it. For update
+ * commands only the header, extras and key need to be there; the value is
+ * read in conn_nread.
+ */
+static int try_read_command_binary(conn *c) {
+    protocol_binary_request_header *req = &c->binary_header;
+    uint8_t opcode;
+    uint32_t need;
+    uint16_t status;
+    bool update;
+    char *body;
+
+    if (c->rbytes < sizeof(req->bytes))
+        return 0;
 
-    } else if (ntokens >= 2 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
+    memcpy(req->bytes, c->rcurr, sizeof(req->bytes));
+    if (req->request.magic != PROTOCOL_BINARY_REQ) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Invalid magic: %x\n", req->request.magic);
+        conn_set_state(c, conn_closing);
+        return 1;
+    }
+    req->request.keylen = ntohs(req->request.keylen);
+    req->request.bodylen = ntohl(req->request.bodylen);
+    req->request.cas = bin_get64(c->rcurr + 16);
 
-        process_stat(c, tokens, ntokens);
+    opcode = req->request.opcode;
+    update = (opcode >= PROTOCOL_BINARY_CMD_SET && opcode <= PROTOCOL_BINARY_CMD_REPLACE) ||
+             opcode == PROTOCOL_BINARY_CMD_APPEND || opcode == PROTOCOL_BINARY_CMD_PREPEND ||
+             (opcode >= PROTOCOL_BINARY_CMD_SETQ && opcode <= PROTOCOL_BINARY_CMD_REPLACEQ) ||
+             opcode == PROTOCOL_BINARY_CMD_APPENDQ || opcode == PROTOCOL_BINARY_CMD_PREPENDQ;
 
-    } else if (ntokens >= 2 && ntokens <= 3 && (strcmp(tokens[COMMAND_TOKEN].value, "flush_all") == 0)) {
-        out_string(c, "OK");
-        return;
+    if (bin_start_batch(c) != 0) {
+        conn_set_state(c, conn_closing);
+        return 1;
+    }
 
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "version") == 0)) {
+    if (req->request.keylen > KEY_MAX_LENGTH ||
+        req->request.extlen + req->request.keylen > req->request.bodylen ||
+        (!update && req->request.bodylen > BIN_MAX_BODY))
+        status = PROTOCOL_BINARY_RESPONSE_EINVAL;
+    else if (update &&
+             req->request.bodylen - req->request.extlen - req->request.keylen > BIN_MAX_VALUE)
+        status = PROTOCOL_BINARY_RESPONSE_E2BIG;
+    else
+        status = PROTOCOL_BINARY_RESPONSE_SUCCESS;
+    if (status != PROTOCOL_BINARY_RESPONSE_SUCCESS) {
+        /* answer, then skip the body */
+        bin_write_status(c, status, false);
+        c->rcurr += sizeof(req->bytes);
+        c->rbytes -= sizeof(req->bytes);
+        if (c->state != conn_closing) {
+            c->sbytes = req->request.bodylen;
+            conn_set_state(c, conn_swallow);
+        }
+        return 1;
+    }
 
-        out_string(c, "VERSION " VERSION);
+    need = sizeof(req->bytes) + (update ? req->request.extlen + req->request.keylen
+                                        : req->request.bodylen);
+    if (c->rbytes < need)
+        return 0;
 
-    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "quit") == 0)) {
+    body = c->rcurr + sizeof(req->bytes);
+    c->rcurr += need;
+    c->rbytes -= need;
 
-        conn_set_state(c, conn_closing);
+    process_bin_command(c, body);
 
-    } else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "verbosity") == 0)) {
+    if (c->state == conn_read && c->batch && c->ileft >= BATCH_MAX)
+        batch_flush(c);
+    return 1;
+}
 
-        process_verbosity_command(c, tokens, ntokens);
+/* the ASCII commands whose replies are queued into a batch */
+static const char *const ascii_batch_cmds[] = {
+    "get", "gets", "set", "add", "replace", "append", "prepend", "cas",
+    "incr", "decr", "delete", "version", NULL
+};
 
-    } else if (ntokens == 3 && ((strcmp(tokens[COMMAND_TOKEN].value, "rep_set_ack_policy") == 0) ||
-                                (strcmp(tokens[COMMAND_TOKEN].value, "rep_set_priority") == 0) )) {
+/* whether the command line at line, len bytes, is one of them */
+static bool ascii_batchable(const char *line, const size_t len) {
+    const char *end = memchr(line, ' ', len);
+    size_t n = end != NULL ? (size_t)(end - line) : len;
+    int i;
 
-        process_rep_command(c, tokens, ntokens);
+    for (i = 0; ascii_batch_cmds[i] != NULL; i++) {
+        if (strlen(ascii_batch_cmds[i]) == n && memcmp(ascii_batch_cmds[i], line, n) == 0)
+            return true;
+    }
+    return false;
+}
 
-    } else if (ntokens == 2 && 
-              ((strcmp(tokens[COMMAND_TOKEN].value, "db_archive") == 0 ) ||
-               (strcmp(tokens[COMMAND_TOKEN].value, "db_checkpoint") == 0 ) ||
-               (strcmp(tokens[COMMAND_TOKEN].value, "db_compact") == 0 ))) {
+/*
+ * Called after each ASCII command, batchable telling whether it was one
+ * of ascii_batch_cmds. Like a run of binary requests, a pipelining client
+ * gets its replies queued into one batch while the next command line is
+ * already in the read buffer and is batchable too; wbuf replies are
+ * copied into buffers of their own, kept in ilist with the items of the
+ * gets. The batch goes out through conn_mwrite in one pass when the
+ * pipeline runs dry, the batch gets big or a reply has to be followed by
+ * something else (a swallow, closing). A lone reply is sent as before.
+ * Either waits for group commit if a write of it asked to.
+ */
+static void ascii_reply_done(conn *c, const bool batchable) {
+    bool more;
+    char *buf;
+
+    if (c->state != conn_write && c->state != conn_mwrite) {
+        /* a command that closes the connection sends what was queued */
+        if (c->batch && c->state == conn_closing) {
+            c->write_and_go = conn_closing;
+            batch_flush(c);
+        }
+        return;
+    }
 
-        process_bdb_command(c, tokens, ntokens);
+    more = batchable && !c->udp && c->write_and_go == conn_read && c->write_and_free == 0
+        && c->ileft < BATCH_MAX && c->rbytes > 0
+        && (buf = memchr(c->rcurr, '\n', c->rbytes)) != NULL
+        && ascii_batchable(c->rcurr, buf - c->rcurr);
+    if (!c->batch && !more) {
+        if (c->batch_dirty) {
+            c->batch_dirty = false;
+            conn_wait_commit(c);
+        }
+        return;
+    }
 
-    } else {
-        out_string(c, "ERROR");
+    if (!c->batch) {
+        c->batch = true;
+        if (c->ileft == 0)
+            c->icurr = c->ilist;
     }
-    return;
+    if (c->state == conn_write) {
+        if ((buf = slabs_alloc(c->wbytes)) == NULL || batch_keep(c, buf) != 0) {
+            if (buf != NULL)
+                slabs_free(buf);
+            conn_set_state(c, conn_closing);
+            return;
+        }
+        memcpy(buf, c->wcurr, c->wbytes);
+        if (add_iov(c, buf, c->wbytes) != 0) {
+            conn_set_state(c, conn_closing);
+            return;
+        }
+    }
+    if (more)
+        conn_set_state(c, conn_read);
+    else
+        batch_flush(c);
 }
 
 /*
  * if we have a complete line in the buffer, process it.
  */
 static int try_read_command(conn *c) {
+    bool batchable;
     char *el, *cont;
 
     assert(c != NULL);
@@ -1456,6 +2967,16 @@ static int try_read_command(conn *c) {
 
     if (c->rbytes == 0)
         return 0;
+
+    if (c->protocol == negotiating_prot) {
+        c->protocol = ((unsigned char)c->rcurr[0] == PROTOCOL_BINARY_REQ) ? binary_prot : ascii_prot;
+        if (settings.verbose > 1)
+            fprintf(stderr, "<%d %s protocol\n", c->sfd,
+                    c->protocol == binary_prot ? "binary" : "ascii");
+    }
+    if (c->protocol == binary_prot)
+        return try_read_command_binary(c);
+
     el = memchr(c->rcurr, '\n', c->rbytes);
     if (!el)
         return 0;
@@ -1467,6 +2988,7 @@ static int try_read_command(conn *c) {
 
     assert(cont <= (c->rcurr + c->rbytes));
 
+    batchable = ascii_batchable(c->rcurr, el - c->rcurr);
     process_command(c, c->rcurr);
 
     c->rbytes -= (cont - c->rcurr);
@@ -1474,39 +2996,109 @@ static int try_read_command(conn *c) {
 
     assert(c->rcurr <= (c->rbuf + c->rsize));
 
+    ascii_reply_done(c, batchable);
+
     return 1;
 }
 
+#ifdef HAVE_RECVMMSG
+/* the datagrams of a UDP "connection" read ahead with one recvmmsg() */
+struct udp_batch {
+    int n;                      /* read */
+    int next;                   /* the next one to hand out */
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr addrs[UDP_BATCH];
+    char slots[UDP_BATCH][UDP_BATCH_SLOT_SIZE];
+};
+
+/*
+ * Hands out the next datagram read ahead, reading up to UDP_BATCH more
+ * once they are all gone: returns its size, with *buf pointing to it and
+ * its sender in c->request_addr, or 0 if there is none; -1 if there is
+ * no room for a batch, to read a datagram at a time.
+ */
+static int udp_batch_next(conn *c, unsigned char **buf, bool *truncated) {
+    struct udp_batch *b = c->ubatch;
+    struct mmsghdr *m;
+    int i, res;
+
+    if (b == NULL) {
+        if ((b = c->ubatch = malloc(sizeof(struct udp_batch))) == NULL)
+            return -1;
+        b->n = b->next = 0;
+    }
+    for (;;) {
+        /* a datagram too short for a request is dropped here, as with
+           recvfrom(), so that the ones after it don't wait for an event */
+        while (b->next < b->n && b->msgs[b->next].msg_len <= UDP_HEADER_SIZE)
+            b->next++;
+        if (b->next < b->n)
+            break;
+        for (i = 0; i < UDP_BATCH; i++) {
+            b->iov[i].iov_base = b->slots[i];
+            b->iov[i].iov_len = UDP_BATCH_SLOT_SIZE;
+            memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+            b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+            b->msgs[i].msg_hdr.msg_iovlen = 1;
+            b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+            b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr);
+        }
+        b->n = b->next = 0;
+        if ((res = recvmmsg(c->sfd, b->msgs, UDP_BATCH, 0, NULL)) <= 0)
+            return 0;
+        b->n = res;
+    }
+    m = &b->msgs[b->next];
+    *buf = (unsigned char *)b->slots[b->next++];
+    *truncated = (m->msg_hdr.msg_flags & MSG_TRUNC) != 0;
+    memcpy(&c->request_addr, m->msg_hdr.msg_name, m->msg_hdr.msg_namelen);
+    c->request_addr_size = m->msg_hdr.msg_namelen;
+    return m->msg_len;
+}
+#endif
+
 /*
  * read a UDP request.
  * return 0 if there's nothing to read.
  */
 static int try_read_udp(conn *c) {
+    unsigned char *buf = (unsigned char *)c->rbuf;
+    bool truncated = false;
     int res;
 
     assert(c != NULL);
 
-    c->request_addr_size = sizeof(c->request_addr);
-    res = recvfrom(c->sfd, c->rbuf, c->rsize,
-                   0, &c->request_addr, &c->request_addr_size);
+#ifdef HAVE_RECVMMSG
+    if ((res = udp_batch_next(c, &buf, &truncated)) < 0)
+#endif
+    {
+        c->request_addr_size = sizeof(c->request_addr);
+        res = recvfrom(c->sfd, c->rbuf, c->rsize,
+                       0, &c->request_addr, &c->request_addr_size);
+    }
     if (res > 8) {
-        unsigned char *buf = (unsigned char *)c->rbuf;
-        STATS_LOCK();
-        stats.bytes_read += res;
-        STATS_UNLOCK();
+        c->stats->bytes_read += res;
 
         /* Beginning of UDP packet is the request ID; save it. */
         c->request_id = buf[0] * 256 + buf[1];
 
-        /* If this is a multi-packet request, drop it. */
-        if (buf[4] != 0 || buf[5] != 1) {
-            out_string(c, "SERVER_ERROR multi-packet request not supported");
-            return 0;
+        /* If this is a multi-packet request, drop it; the answer goes out
+           before the next datagram is read */
+        if (buf[4] != 0 || buf[5] != 1 || truncated) {
+            c->msgcurr = 0;
+            c->msgused = 0;
+            c->iovused = 0;
+            if (add_msghdr(c) != 0)
+                return 0;
+            out_string(c, truncated ? "SERVER_ERROR request too large for UDP"
+                                    : "SERVER_ERROR multi-packet request not supported");
+            return 1;
         }
 
         /* Don't care about any of the rest of the header. */
         res -= 8;
-        memmove(c->rbuf, c->rbuf + 8, res);
+        memmove(c->rbuf, buf + 8, res);
 
         c->rbytes += res;
         c->rcurr = c->rbuf;
@@ -1561,9 +3153,7 @@ static int try_read_network(conn *c) {
         int avail = c->rsize - c->rbytes;
         res = read(c->sfd, c->rbuf + c->rbytes, avail);
         if (res > 0) {
-            STATS_LOCK();
-            stats.bytes_read += res;
-            STATS_UNLOCK();
+            c->stats->bytes_read += res;
             gotdata = 1;
             c->rbytes += res;
             if (res == avail) {
@@ -1584,6 +3174,12 @@ static int try_read_network(conn *c) {
             return 1;
         }
     }
+
+    /* a buffer that was needed lately stays, see conn_shrink() */
+    if (c->rbytes > DATA_BUFFER_SIZE)
+        c->rsmall = 0;
+    else if (gotdata && c->rsmall < BUFFER_SHRINK_READS)
+        c->rsmall++;
     return gotdata;
 }
 
@@ -1602,15 +3198,10 @@ static bool update_event(conn *c, const int new_flags) {
 }
 
 /*
- * Sets whether we are listening for new connections or not.
+ * Sets whether the listeners in the list are accepting or not.
  */
-void accept_new_conns(const bool do_accept) {
-    conn *next;
-
-    if (! is_listen_thread())
-        return;
-
-    for (next = listen_conn; next; next = next->next) {
+static void accept_new_conns_on(conn *next, const bool do_accept) {
+    for (; next; next = next->next) {
         if (do_accept) {
             update_event(next, EV_READ | EV_PERSIST);
             if (listen(next->sfd, 1024) != 0) {
@@ -1626,6 +3217,45 @@ void accept_new_conns(const bool do_accept) {
     }
 }
 
+/*
+ * Sets whether we are listening for new connections or not. With one
+ * listener per thread, only the calling thread's own are changed.
+ */
+void accept_new_conns(const bool do_accept) {
+    if (is_listen_thread())
+        accept_new_conns_on(listen_conn, do_accept);
+    accept_new_conns_on(thread_listen_conn(), do_accept);
+}
+
+
+#ifdef HAVE_SENDMMSG
+/*
+ * Sends the datagrams from c->msgcurr on, up to UDP_BATCH of them, with
+ * one sendmmsg(); a datagram goes out whole or not at all. Returns the
+ * bytes sent, leaving c->msgcurr at the last datagram sent, or -1.
+ */
+static ssize_t transmit_udp(conn *c) {
+    struct mmsghdr msgs[UDP_BATCH];
+    ssize_t bytes = 0;
+    int i, n = c->msgused - c->msgcurr;
+
+    if (n > UDP_BATCH)
+        n = UDP_BATCH;
+    for (i = 0; i < n; i++) {
+        msgs[i].msg_hdr = c->msglist[c->msgcurr + i];
+        msgs[i].msg_len = 0;
+    }
+    if ((n = sendmmsg(c->sfd, msgs, n, 0)) <= 0)
+        return n;
+    for (i = 0; i < n; i++) {
+        bytes += msgs[i].msg_len;
+        c->msglist[c->msgcurr + i].msg_iovlen = 0;
+    }
+    c->msgcurr += n - 1;
+    c->stats->bytes_written += bytes;
+    return bytes;
+}
+#endif
 
 /*
  * Transmit the next chunk of data from our list of msgbuf structures.
@@ -1637,6 +3267,8 @@ void accept_new_conns(const bool do_accept) {
  *   TRANSMIT_HARD_ERROR Can't write (c->state is set to conn_closing)
  */
 static int transmit(conn *c) {
+    int flags = 0;
+
     assert(c != NULL);
 
     if (c->msgcurr < c->msgused &&
@@ -1648,11 +3280,23 @@ static int transmit(conn *c) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
 
-        res = sendmsg(c->sfd, m, 0);
-        if (res > 0) {
-            STATS_LOCK();
-            stats.bytes_written += res;
-            STATS_UNLOCK();
+        if (c->send_start == 0 && c->lat_cmd != LAT_NONE)
+            c->send_start = latency_now();
+#ifdef MSG_MORE
+        /* more of the reply follows, the kernel need not push a short
+           segment out before it */
+        if (!c->udp && c->msgcurr < c->msgused - 1)
+            flags = MSG_MORE;
+#endif
+#ifdef HAVE_SENDMMSG
+        /* the datagrams of a UDP reply go out with one call */
+        if (c->udp && c->msgused - c->msgcurr > 1) {
+            if ((res = transmit_udp(c)) > 0)
+                return TRANSMIT_INCOMPLETE;
+        } else
+#endif
+        if ((res = sendmsg(c->sfd, m, flags)) > 0) {
+            c->stats->bytes_written += res;
 
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
@@ -1684,12 +3328,19 @@ static int transmit(conn *c) {
         if (settings.verbose > 0)
             perror("Failed to write, and not due to blocking");
 
+        c->send_start = 0;
         if (c->udp)
             conn_set_state(c, conn_read);
         else
             conn_set_state(c, conn_closing);
         return TRANSMIT_HARD_ERROR;
     } else {
+        /* the time from the first write to the last, waiting included */
+        if (c->send_start != 0) {
+            latency_record(c->stats, c->lat_cmd, LAT_SEND, c->send_start);
+            c->send_start = 0;
+        }
+        c->lat_cmd = LAT_NONE;
         return TRANSMIT_COMPLETE;
     }
 }
@@ -1740,6 +3391,11 @@ static void drive_machine(conn *c) {
             if ((c->udp ? try_read_udp(c) : try_read_network(c)) != 0) {
                 continue;
             }
+            /* the pipeline has run dry, send what it queued before waiting */
+            if (c->batch) {
+                batch_flush(c);
+                continue;
+            }
             /* we have no command line and no data to read from network */
             if (!update_event(c, EV_READ | EV_PERSIST)) {
                 if (settings.verbose > 0)
@@ -1754,6 +3410,8 @@ static void drive_machine(conn *c) {
             /* we are reading rlbytes into ritem; */
             if (c->rlbytes == 0) {
                 complete_nread(c);
+                if (c->protocol != binary_prot)
+                    ascii_reply_done(c, true);
                 break;
             }
             /* first check if we have leftovers in the conn_read buffer */
@@ -1770,9 +3428,7 @@ static void drive_machine(conn *c) {
             /*  now try reading from the socket */
             res = read(c->sfd, c->ritem, c->rlbytes);
             if (res > 0) {
-                STATS_LOCK();
-                stats.bytes_read += res;
-                STATS_UNLOCK();
+                c->stats->bytes_read += res;
                 c->ritem += res;
                 c->rlbytes -= res;
                 break;
@@ -1806,7 +3462,7 @@ static void drive_machine(conn *c) {
 
             /* first check if we have leftovers in the conn_read buffer */
             if (c->rbytes > 0) {
-                int tocopy = c->rbytes > c->sbytes ? c->sbytes : c->rbytes;
+                int tocopy = (size_t)c->rbytes > c->sbytes ? (int)c->sbytes : c->rbytes;
                 c->sbytes -= tocopy;
                 c->rcurr += tocopy;
                 c->rbytes -= tocopy;
@@ -1814,11 +3470,9 @@ static void drive_machine(conn *c) {
             }
 
             /*  now try reading from the socket */
-            res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
+            res = read(c->sfd, c->rbuf, (size_t)c->rsize > c->sbytes ? c->sbytes : (size_t)c->rsize);
             if (res > 0) {
-                STATS_LOCK();
-                stats.bytes_read += res;
-                STATS_UNLOCK();
+                c->stats->bytes_read += res;
                 c->sbytes -= res;
                 break;
             }
@@ -1827,6 +3481,12 @@ static void drive_machine(conn *c) {
                 break;
             }
             if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                /* the client may hold back the rest until it hears the error */
+                if (c->batch) {
+                    c->write_and_go = conn_swallow;
+                    batch_flush(c);
+                    break;
+                }
                 if (!update_event(c, EV_READ | EV_PERSIST)) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Couldn't update event\n");
@@ -1870,7 +3530,9 @@ static void drive_machine(conn *c) {
                         c->icurr++;
                         c->ileft--;
                     }
-                    conn_set_state(c, conn_read);
+                    /* a quit sends its batch before closing, a swallow
+                       follows the error that starts it */
+                    conn_set_state(c, c->write_and_go);
                 } else if (c->state == conn_write) {
                     if (c->write_and_free) {
                         free(c->write_and_free);
@@ -1901,6 +3563,11 @@ static void drive_machine(conn *c) {
                 conn_close(c);
             stop = true;
             break;
+
+        case conn_commit:
+            /* conn_commit_done() gets us going again */
+            stop = true;
+            break;
         }
     }
 
@@ -1982,6 +3649,43 @@ static void maximize_sndbuf(const int sfd) {
         fprintf(stderr, "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
 }
 
+#if defined(USE_THREADS) && defined(SO_REUSEPORT)
+/*
+ * Opens one more TCP listener, or UDP socket, on the address of the
+ * first, for a thread of its own. Returns the socket, or -1.
+ */
+static int reuseport_socket(struct addrinfo *ai, const bool is_udp) {
+    struct linger ling = {0, 0};
+    int flags = 1;
+    int sfd;
+
+    if ((sfd = new_socket(ai)) == -1)
+        return -1;
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+    if (is_udp) {
+        maximize_sndbuf(sfd);
+    } else {
+        setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+        setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+        setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+    }
+
+    if (bind(sfd, ai->ai_addr, ai->ai_addrlen) == -1) {
+        perror("bind()");
+        close(sfd);
+        return -1;
+    }
+    if (!is_udp && listen(sfd, 1024) == -1) {
+        perror("listen()");
+        close(sfd);
+        return -1;
+    }
+    return sfd;
+}
+#endif
+
 static int server_socket(const int port, const bool is_udp) {
     int sfd;
     struct linger ling = {0, 0};
@@ -2030,6 +3734,10 @@ static int server_socket(const int port, const bool is_udp) {
         }
 
         setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+#if defined(USE_THREADS) && defined(SO_REUSEPORT)
+        if (settings.reuseport)
+            setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+#endif
         if (is_udp) {
             maximize_sndbuf(sfd);
         } else {
@@ -2062,10 +3770,31 @@ static int server_socket(const int port, const bool is_udp) {
         int c;
 
         for (c = 0; c < settings.num_threads; c++) {
-            /* this is guaranteed to hit all threads because we round-robin */
-            dispatch_conn_new(sfd, conn_read, EV_READ | EV_PERSIST,
-                              UDP_READ_BUFFER_SIZE, 1);
+#if defined(USE_THREADS) && defined(SO_REUSEPORT)
+            /* with -j a socket per thread, else they all read the first */
+            if (c > 0 && settings.reuseport && (sfd = reuseport_socket(next, true)) == -1) {
+                freeaddrinfo(ai);
+                return 1;
+            }
+#endif
+            dispatch_conn_to(c, sfd, conn_read, EV_READ | EV_PERSIST,
+                             UDP_READ_BUFFER_SIZE, 1);
+        }
+#if defined(USE_THREADS) && defined(SO_REUSEPORT)
+      } else if (settings.reuseport) {
+        int c;
+
+        /* a listener per thread, the kernel spreads new connections over
+           them and each thread keeps what it accepts */
+        dispatch_conn_to(0, sfd, conn_listening, EV_READ | EV_PERSIST, 1, false);
+        for (c = 1; c < settings.num_threads; c++) {
+            if ((sfd = reuseport_socket(next, false)) == -1) {
+                freeaddrinfo(ai);
+                return 1;
+            }
+            dispatch_conn_to(c, sfd, conn_listening, EV_READ | EV_PERSIST, 1, false);
         }
+#endif
       } else {
         if (!(listen_conn_add = conn_new(sfd, conn_listening,
                                          EV_READ | EV_PERSIST, 1, false, main_base))) {
@@ -2171,7 +3900,7 @@ static void usage(void) {
            "-r            maximize core file limit\n"
            "-u <username> assume identity of <username> (only when run as root)\n"
            "-c <num>      max simultaneous connections, default is 1024\n"
-           "-b <num>      item size smaller than <num> will use fast memory alloc, default is 512B\n"
+           "-b <num>      size of the first buffer tried for a get, default is 512B\n"
            "-v            verbose (print errors/warnings while in event loop)\n"
            "-vv           very verbose (also print client commands/reponses)\n"
            "-h            print this help and exit\n"
@@ -2180,24 +3909,56 @@ static void usage(void) {
            );
 #ifdef USE_THREADS
     printf("-t <num>      number of threads to use, default 4\n");
+#ifdef SO_REUSEPORT
+    printf("-j            one SO_REUSEPORT listener and UDP socket per thread, instead\n"
+           "              of handing out connections from the first\n");
+#endif
 #endif
     printf("--------------------BerkeleyDB Options-------------------------------\n");
     printf("-m <num>      in-memmory cache size of BerkeleyDB in megabytes, default is 64MB\n");
     printf("-A <num>      underlying page size in bytes, default is 4096, (512B ~ 64KB, power-of-two)\n");
     printf("-f <file>     filename of database, default is 'data.db'\n");
     printf("-H <dir>      env home of database, default is '/data1/memcachedb'\n");
-    printf("-B <db_type>  type of database, 'btree' or 'hash'. default is 'btree'\n");
+    printf("-B <db_type>  type of database, 'btree' or 'hash', or 'mmap' for the memory-mapped\n"
+           "              B+tree engine. default is 'btree'\n");
+    printf("-y <num>      keep up to <num> megabytes of hot items in memory in front of BerkeleyDB,\n"
+           "              0 for disable, default is 0\n");
+    printf("-F <num>      keep a bloom filter of <num> megabytes over the keys, to answer misses\n"
+           "              without a database lookup, 0 for disable, default is 0\n");
+    printf("-w <num>      remember up to <num> keys read, to warm the cache with after a restart,\n"
+           "              0 for disable, default is 0\n");
+    printf("-k <ms>       add up incrs and decrs in memory and write the counters every <ms>\n"
+           "              milliseconds, a crash loses up to that much, 0 for disable, default is 0\n");
+    printf("-o <num>      with -k, also write a counter once it has taken <num> incrs or decrs,\n"
+           "              default is 0, only every -k milliseconds\n");
+    printf("-I <num>      sample the gets, stores and incrs for the <num> hottest keys, for\n"
+           "              \"stats hotkeys\", 0 for disable, default is 0\n");
+    printf("-z <num>      store values of <num> bytes or more LZ4 compressed, when that saves\n"
+           "              at least 1/8 of them, 0 for disable, default is 0\n");
+    printf("-x <num>      split the keys over <num> database files by hash, default is 1\n");
+    printf("-X <dirs>     comma separated directories the partitions are spread over, in turn\n");
     printf("-L <num>      log buffer size in kbytes, default is 32KB\n");
     printf("-C <num>      do checkpoint every <num> seconds, 0 for disable, default is 5 minutes\n");
-    printf("-T <num>      do memp_trickle every <num> seconds, 0 for disable, default is 30 seconds\n");
+    printf("-K <num>      also checkpoint after <num> kbytes of log, 0 for disable, default is 32MB\n");
+    printf("-T <num>      look at the dirty pages every <num> seconds and memp_trickle if there are\n"
+           "              too many, 0 for disable, default is 1 second\n");
     printf("-e <num>      percent of the pages in the cache that should be clean, default is 60%%\n");
+    printf("-W <num>      kbytes per second checkpoints and memp_trickle may write, 0 for no limit,\n"
+           "              default is 0\n");
     printf("-D <num>      do deadlock detecting every <num> millisecond, 0 for disable, default is 100ms\n");
     printf("-N            enable DB_TXN_NOSYNC to gain big performance improved, default is off\n");
+    printf("-E <num>      expire sweeper: look at <num> records per second, 0 for disable, default is 1000\n");
+#ifdef USE_THREADS
+    printf("-g <num>      group commit: flush the log once for up to <num> writes, 0 for disable, default is 0\n");
+    printf("-G <num>      group commit: max milliseconds a write waits for its batch, default is 2ms\n");
+#endif
     printf("--------------------Replication Options-------------------------------\n");
     printf("-R            identifies the host and port used by this site (required).\n");
     printf("-O            identifies another site participating in this replication group\n");
     printf("-M/-S         start as a master or slave\n");
     printf("-n            number of sites that participat in replication, default is 2\n");
+    printf("-Q <num>      as a replica, refuse reads when more than <num> seconds behind the master,\n"
+           "              0 for disable, default is 0\n");
     printf("-----------------------------------------------------------------------\n");
 
     return;
@@ -2399,7 +4160,7 @@ int main (int argc, char **argv) {
     setbuf(stderr, NULL);
 
     /* process arguments */
-    while ((c = getopt(argc, argv, "a:U:p:s:c:hivl:dru:P:t:b:f:H:B:m:A:L:C:T:e:D:NMSR:O:n:")) != -1) {
+    while ((c = getopt(argc, argv, "a:U:p:s:c:hivl:dru:P:t:jb:f:H:B:m:A:L:C:K:T:e:W:D:NE:g:G:MSR:O:n:Q:x:X:y:z:F:w:k:o:I:")) != -1) {
         switch (c) {
         case 'a':
             /* access for unix domain socket, as octal mask (like chmod)*/
@@ -2451,6 +4212,14 @@ int main (int argc, char **argv) {
             }
             break;
 #endif
+        case 'j':
+#if defined(USE_THREADS) && defined(SO_REUSEPORT)
+            settings.reuseport = true;
+#else
+            fprintf(stderr, "SO_REUSEPORT listeners are not supported in this build\n");
+            exit(EXIT_FAILURE);
+#endif
+            break;
         case 'b':
             settings.item_buf_size = atoi(optarg);
             if(settings.item_buf_size < 512){
@@ -2467,13 +4236,94 @@ int main (int argc, char **argv) {
         case 'H':
             bdb_settings.env_home = optarg;
             break;
+        case 'y':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "hot item cache size should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            settings.hotcache_size = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'F':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "bloom filter size should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            settings.bloom_size = (size_t)atoi(optarg) * 1024 * 1024;
+            break;
+        case 'w':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "number of warm keys should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            settings.warm_keys = atoi(optarg);
+            break;
+        case 'I':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "number of hot keys should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            settings.hotkeys = atoi(optarg);
+            break;
+        case 'k':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "counter write interval should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            settings.counter_interval = atoi(optarg);
+            break;
+        case 'o':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "counter deltas per write should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            settings.counter_ops = atoi(optarg);
+            break;
+        case 'z':
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "compression threshold should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+#ifndef HAVE_LZ4
+            if (atoi(optarg) > 0) {
+                fprintf(stderr, "compression needs LZ4, and this build has none.\n");
+                exit(EXIT_FAILURE);
+            }
+#endif
+            settings.compress_min = atoi(optarg);
+            break;
+        case 'x':
+            bdb_settings.db_parts = atoi(optarg);
+            if (bdb_settings.db_parts < 1 || bdb_settings.db_parts > MAX_DB_PARTS) {
+                fprintf(stderr, "number of partitions should be 1 ~ %d.\n", MAX_DB_PARTS);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'X': {
+            char *dirs = strdup(optarg), *dir;
+
+            bdb_settings.db_part_ndirs = 0;
+            for (dir = strtok(dirs, ","); dir != NULL; dir = strtok(NULL, ",")) {
+                if (bdb_settings.db_part_ndirs == MAX_DB_PARTS) {
+                    fprintf(stderr, "at most %d partition directories.\n", MAX_DB_PARTS);
+                    exit(EXIT_FAILURE);
+                }
+                bdb_settings.db_part_dirs[bdb_settings.db_part_ndirs++] = dir;
+            }
+            break;
+        }
         case 'B':
             if (0 == strcmp(optarg, "btree")){
+                engine = &bdb_engine;
                 bdb_settings.db_type = DB_BTREE;
             }else if (0 == strcmp(optarg, "hash")){
+                engine = &bdb_engine;
                 bdb_settings.db_type = DB_HASH;
+            }else if (0 == strcmp(optarg, "mmap")){
+                /* a btree too, for rget and the walks */
+                engine = &mmdb_engine;
+                bdb_settings.db_type = DB_BTREE;
             }else{
-                fprintf(stderr, "Unknown databasetype, only 'btree' or 'hash' is available.\n");
+                fprintf(stderr, "Unknown databasetype, only 'btree', 'hash' or 'mmap' is available.\n");
                 exit(EXIT_FAILURE);
             }
             break;
@@ -2489,9 +4339,19 @@ int main (int argc, char **argv) {
         case 'C':
             bdb_settings.chkpoint_val = atoi(optarg);
             break;
+        case 'K':
+            bdb_settings.chkpoint_kbyte = atoi(optarg);
+            break;
         case 'T':
             bdb_settings.memp_trickle_val = atoi(optarg);
             break;
+        case 'W':
+            bdb_settings.io_budget = atoi(optarg);
+            if (bdb_settings.io_budget < 0) {
+                fprintf(stderr, "io budget should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'e':
             bdb_settings.memp_trickle_percent = atoi(optarg);
             if (bdb_settings.memp_trickle_percent < 0 || 
@@ -2506,6 +4366,29 @@ int main (int argc, char **argv) {
         case 'N':
             bdb_settings.txn_nosync = 1;
             break;
+        case 'E':
+            bdb_settings.expire_rate = atoi(optarg);
+            if (bdb_settings.expire_rate < 0) {
+                fprintf(stderr, "expire sweeper rate should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+#ifdef USE_THREADS
+        case 'g':
+            bdb_settings.gcommit_ops = atoi(optarg);
+            if (bdb_settings.gcommit_ops < 0) {
+                fprintf(stderr, "group commit batch size should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'G':
+            bdb_settings.gcommit_wait = atoi(optarg) * 1000;
+            if (bdb_settings.gcommit_wait <= 0) {
+                fprintf(stderr, "group commit max wait should be larger than 0.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
+#endif
         case 'M':
             if (bdb_settings.rep_start_policy == DB_REP_CLIENT){
                 fprintf(stderr, "Can't not be a Master and Slave at same time.\n");
@@ -2542,6 +4425,13 @@ int main (int argc, char **argv) {
         case 'n':
             bdb_settings.rep_nsites = atoi(optarg);
             break;
+        case 'Q':
+            bdb_settings.rep_max_lag = atoi(optarg);
+            if (bdb_settings.rep_max_lag < 0) {
+                fprintf(stderr, "max replica lag should be 0 or more.\n");
+                exit(EXIT_FAILURE);
+            }
+            break;
 
         default:
             fprintf(stderr, "Illegal argument \"%c\"\n", c);
@@ -2549,6 +4439,12 @@ int main (int argc, char **argv) {
         }
     }
 
+    /* replication is Berkeley DB's, over its log */
+    if (engine != &bdb_engine && bdb_settings.is_replicated) {
+        fprintf(stderr, "replication needs the bdb engine, it can't be used with '-B mmap'.\n");
+        exit(EXIT_FAILURE);
+    }
+
     if (maxcore != 0) {
         struct rlimit rlim_new;
         /*
@@ -2627,6 +4523,11 @@ int main (int argc, char **argv) {
 
     /* initialize other stuff */
     item_init();
+    hotcache_init();
+    bloom_init();
+    warm_init();
+    counter_init();
+    hotkeys_init();
     stats_init();
     conn_init();
 
@@ -2680,27 +4581,19 @@ int main (int argc, char **argv) {
     }
     
     /* register atexit callback function */
-    if (0 != atexit(bdb_env_close)) {
-        fprintf(stderr, "can not register close_env"); 
-        exit(EXIT_FAILURE);
-    }
-    if (0 != atexit(bdb_db_close)) {
-        fprintf(stderr, "can not register close_db"); 
-        exit(EXIT_FAILURE);
-    }
-    if (0 != atexit(bdb_chkpoint)) {
-        fprintf(stderr, "can not register db_checkpoint"); 
+    if (0 != atexit(engine->close)) {
+        fprintf(stderr, "can not register the engine close");
         exit(EXIT_FAILURE);
     }
-    
-    /* here we init bdb env and open db */
-    bdb_env_init();
-    bdb_db_open();
-
-    /* start checkpoint and deadlock detect thread */
-    start_chkpoint_thread();
-    start_memp_trickle_thread();
-    start_dl_detect_thread();
+
+    /* here we open the engine, and start its threads */
+    engine->open();
+
+    start_expire_thread();
+    bloom_start();
+    start_warm_thread();
+    start_counter_thread();
+    start_job_thread();
 
     /* enter the event loop */
     event_base_loop(main_base, 0);
@@ -33,10 +33,33 @@
 #define UDP_READ_BUFFER_SIZE 65536
 #define UDP_MAX_PAYLOAD_SIZE 1400
 #define UDP_HEADER_SIZE 8
+
+/* datagrams a UDP "connection" reads with one recvmmsg(), and the room
+   for each; a bigger one is answered with an error */
+#define UDP_BATCH 16
+#define UDP_BATCH_SLOT_SIZE 8192
 #define MAX_SENDBUF_SIZE (256 * 1024 * 1024)
 /* I'm told the max legnth of a 64-bit num converted to string is 20 bytes.
  * Plus a few for spaces, \r\n, \0 */
 #define SUFFIX_SIZE 24
+#define KEY_MAX_LENGTH 250
+
+/** Number of "get" keys collected before going to the heap. */
+#define MGET_KEYS_INITIAL 32
+
+/** Most items a single "rget" may return. */
+#define RGET_MAX_ITEMS 100
+
+/** An "rget" bulk read asks for this many database pages at a time. */
+#define RGET_BULK_PAGES 16
+
+/*
+ * Keys can be spread over several databases, each its own file in the one
+ * environment; a key lives in partition hash(key) % db_parts. The number
+ * of partitions is fixed once the files exist.
+ */
+#define MAX_DB_PARTS 64
+#define DB_PART_NAME_MAX 512
 
 /** Initial size of list of items being returned by "get". */
 #define ITEM_LIST_INITIAL 200
@@ -53,6 +76,9 @@
 #define IOV_LIST_HIGHWAT 600
 #define MSG_LIST_HIGHWAT 100
 
+/** Reads in a row that fit in DATA_BUFFER_SIZE before buffers shrink */
+#define BUFFER_SHRINK_READS 64
+
 #define MAX_REP_PRIORITY 1000000
 #define MAX_REP_ACK_POLICY 6
 #define MAX_REP_NSITES 1000
@@ -81,18 +107,93 @@
 # include <unistd.h>
 #endif
 
+#include "protocol_binary.h"
+
 struct stats {
-    unsigned int  curr_conns;
-    unsigned int  total_conns;
-    unsigned int  conn_structs;
+    time_t        started;          /* when the process was started */
+};
+
+/* size of a cache line, so that threads updating counters next to each
+   other do not keep stealing the line from each other */
+#define CACHE_LINE_SIZE 64
+
+/*
+ * Latency histograms, HDR style: values below LAT_SUB_BUCKETS microseconds
+ * get a bucket each, after that every power of two is split into
+ * LAT_SUB_BUCKETS buckets, which keeps the error under 1/LAT_SUB_BUCKETS up
+ * to the last bucket (about a minute). See stats.c.
+ */
+enum latency_cmd { LAT_GET, LAT_SET, LAT_DELETE, LAT_INCR, LAT_RGET, LAT_NCMDS };
+enum latency_phase { LAT_LOCK, LAT_STORAGE, LAT_SEND, LAT_NPHASES };
+#define LAT_NONE -1                 /* command that isn't timed */
+#define LAT_SUB_BITS 3
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (LAT_SUB_BUCKETS * 24)
+
+/*
+ * Size histograms of the values stored and read: bucket 0 counts data of
+ * up to 16 bytes, bucket b of up to 16 << b, the last one anything
+ * bigger. See stats.c.
+ */
+#define SIZE_BUCKETS 20
+
+/* what a hot key was sampled for, see hotkeys.c */
+enum hotkey_kind { HOTKEY_GET, HOTKEY_SET, HOTKEY_INCR, HOTKEY_NKINDS };
+
+struct latency_hist {
+    uint64_t      count;
+    uint64_t      total_us;
+    uint64_t      buckets[LAT_BUCKETS];
+};
+
+/*
+ * Counters kept by each thread, without a lock; only the thread owning a
+ * block writes to it. The stats command sums up all blocks.
+ */
+struct thread_stats {
+    int64_t       curr_conns;
+    uint64_t      total_conns;
+    uint64_t      conn_structs;
     uint64_t      get_cmds;
     uint64_t      set_cmds;
     uint64_t      get_hits;
     uint64_t      get_misses;
-    time_t        started;          /* when the process was started */
+    uint64_t      rget_cmds;
+    uint64_t      rget_items;
+    uint64_t      cas_misses;       /* cas on a key that is not there */
+    uint64_t      cas_hits;         /* cas that stored */
+    uint64_t      cas_badval;       /* cas whose value did not match */
+    uint64_t      delete_misses;
+    uint64_t      delete_hits;
+    uint64_t      incr_misses;
+    uint64_t      incr_hits;
+    uint64_t      decr_misses;
+    uint64_t      decr_hits;
+    uint64_t      append_cmds;
+    uint64_t      prepend_cmds;
+    uint64_t      bytes_stored;     /* data bytes of successful stores */
     uint64_t      bytes_read;
     uint64_t      bytes_written;
-};
+    uint64_t      hotcache_hits;    /* gets answered by the hot item cache */
+    uint64_t      hotcache_misses;
+    uint64_t      bloom_negatives;  /* lookups the bloom filter answered as misses */
+    uint64_t      bloom_false_positives; /* misses it let through to the database */
+    uint64_t      rep_redirects;    /* commands a replica sent on to the master */
+    uint64_t      compressed_items; /* values stored compressed */
+    uint64_t      compress_rejected; /* values left raw, they did not shrink enough */
+    uint64_t      compress_in_bytes;  /* data bytes of the values stored compressed */
+    uint64_t      compress_out_bytes; /* and what they were stored in */
+    uint64_t      compress_usec;    /* time spent compressing, rejected ones too */
+    uint64_t      decompressed_items;
+    uint64_t      decompress_usec;
+    uint64_t      part_reads[MAX_DB_PARTS];  /* records read from each partition */
+    uint64_t      part_writes[MAX_DB_PARTS]; /* records written or deleted */
+    uint64_t      hotkey_ops;       /* operations seen by the hot key sampler */
+    uint64_t      size_stored[SIZE_BUCKETS]; /* data sizes of the values stored */
+    uint64_t      size_read[SIZE_BUCKETS];   /* and of the ones read */
+    /* lock wait, storage call and send time of each command */
+    struct latency_hist latency[LAT_NCMDS][LAT_NPHASES];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
 #define MAX_VERBOSITY_LEVEL 2
 
@@ -106,6 +207,14 @@ struct settings {
     char *socketpath;   /* path to unix socket if using local socket */
     int access;  /* access mask (a la chmod) for unix domain socket */
     int num_threads;        /* number of libevent threads to run */
+    bool reuseport;         /* one SO_REUSEPORT listener and UDP socket per thread */
+    size_t hotcache_size;   /* bytes of the hot item cache, 0 for none */
+    int compress_min;       /* compress values of at least this many bytes, 0 for never */
+    size_t bloom_size;      /* bytes of the bloom filter over the keys, 0 for none */
+    int warm_keys;          /* keys remembered for warming the cache after a restart, 0 for none */
+    int counter_interval;   /* ms between writes of the write-behind counters, 0 for none */
+    int counter_ops;        /* deltas a counter takes before it is written anyway, 0 for no limit */
+    int hotkeys;            /* hottest keys tracked for stats hotkeys, 0 for none */
 };
 
 extern struct stats stats;
@@ -121,6 +230,9 @@ enum mdb_rep_role { MDB_MASTER, MDB_CLIENT, MDB_UNKNOWN };
 
 struct bdb_settings {
     char *db_file;    /* db filename, where dbfile located. */
+    int db_parts;     /* number of databases the keys are spread over */
+    char *db_part_dirs[MAX_DB_PARTS]; /* directories the partitions go to in turn */
+    int db_part_ndirs;
     char *env_home;    /* db env home dir path */
     u_int32_t cache_size; /* cache size */
     u_int32_t txn_lg_bsize; /* transaction log buffer size */
@@ -129,7 +241,8 @@ struct bdb_settings {
     int txn_nosync;    /* DB_TXN_NOSYNC flag, if 1 will lose transaction's durability for performance */
     int dldetect_val; /* do deadlock detect every *db_lock_detect_val* millisecond, 0 for disable */
     int chkpoint_val;  /* do checkpoint every *db_chkpoint_val* second, 0 for disable */
-    int memp_trickle_val;  /* do memp_trickle every *memp_trickle_val* second, 0 for disable */
+    int chkpoint_kbyte; /* also checkpoint after this many kbytes of log, 0 for disable */
+    int memp_trickle_val;  /* look at the dirty pages every *memp_trickle_val* second, 0 for disable */
     int memp_trickle_percent; /* percent of the pages in the cache that should be clean.*/
     u_int32_t db_flags; /* database open flags */
     u_int32_t env_flags; /* env open flags */
@@ -171,27 +284,181 @@ struct bdb_settings {
 
     u_int32_t rep_limit_gbytes; 
     u_int32_t rep_limit_bytes; 
+
+    int rep_max_lag;   /* a replica refuses reads this many seconds behind, 0 for never */
+
+    int gcommit_ops;   /* group commit: writes per transaction log flush, 0 for disable */
+    int gcommit_wait;  /* group commit: max microseconds a write waits for its batch */
+
+    int expire_rate;   /* expiry sweeper: records looked at per second, 0 for disable */
+
+    int io_budget;     /* kbytes per second checkpoint and trickle may write, 0 for no limit */
+};
+
+struct gcommit_stats {
+    uint64_t      batches;   /* log flushes done by the group committer */
+    uint64_t      writes;    /* writes acknowledged through those flushes */
+};
+
+/* records rewritten per db_convert transaction */
+#define CONVERT_BATCH 100
+
+struct convert_stats {
+    int           running;   /* a db_convert pass is going on */
+    uint64_t      scanned;   /* records looked at by db_convert */
+    uint64_t      converted; /* records rewritten in the current format */
+};
+
+/* records looked at per expiry sweeper transaction, at most */
+#define EXPIRE_BATCH 100
+
+/* seconds the expiry sweeper rests after each pass over the database */
+#define EXPIRE_PASS_PAUSE 60
+
+struct expire_stats {
+    uint64_t      passes;    /* full passes over the database */
+    uint64_t      scanned;   /* records looked at by the sweeper */
+    uint64_t      items;     /* expired records deleted */
+    uint64_t      bytes;     /* keys and records deleted, in bytes */
+};
+
+/* seconds between two looks of the maintenance thread */
+#define MAINT_TICK 1
+
+/* the IO budget is spent in this many slices a second */
+#define MAINT_IO_SLICES 10
+
+struct maint_stats {
+    uint64_t      checkpoints;    /* checkpoints done by the maintenance thread */
+    uint64_t      last_ckp_usec;  /* how long the last checkpoint took */
+    uint64_t      last_ckp_bytes; /* bytes the last checkpoint wrote out of the cache */
+    uint64_t      trickles;       /* memp_trickle calls */
+    uint64_t      trickle_pages;  /* pages they wrote */
+    int           dirty_percent;  /* dirty pages in the cache when last looked at */
 };
 
+/* the database the master keeps its replication heartbeat in */
+#define REP_META_FILE "mdb_meta.db"
+#define REP_HEARTBEAT_KEY "heartbeat"
+
+/* seconds between two heartbeats of the master */
+#define REP_HEARTBEAT_TICK 1
+
+/* room for the host:port of the master's clients */
+#define REP_ADDR_MAX 128
+
+struct rep_heartbeat {
+    time_t        time;      /* master's clock when it wrote the heartbeat */
+    DB_LSN        lsn;       /* the end of its log then */
+    char          master[REP_ADDR_MAX]; /* where its clients connect to */
+};
+
+/* admin jobs run one at a time on the job thread, see bdb_job_submit() */
+enum job_kind {
+    JOB_NONE,
+    JOB_COMPACT,
+    JOB_ARCHIVE,
+    JOB_CHECKPOINT,
+    JOB_BACKUP,
+    JOB_LOAD,
+    JOB_NKINDS
+};
+
+/* jobs that may wait behind the one running */
+#define JOB_QUEUE_MAX 16
+
+/* pages a db_compact job frees per DB->compact call, at most */
+#define JOB_COMPACT_PAGES 64
+
+/* room for the directory or host:port a db_backup job writes to, or the
+   file a bulk_load job reads */
+#define BACKUP_TARGET_MAX 256
+
+struct job_stats {
+    int           running;         /* kind of the job in progress, JOB_NONE if idle */
+    int           part;            /* its partition, -1 for all of them */
+    int           queued;          /* jobs waiting behind it */
+    int           rate;            /* pages a second a compact may look at, 0 for no limit */
+    uint64_t      id;              /* of the job in progress, or the last one */
+    uint64_t      done;            /* jobs finished */
+    uint64_t      cancelled;       /* jobs cancelled, running or queued */
+    uint64_t      failed;          /* jobs stopped by an error */
+    int           last_error;      /* the error of the last failed job */
+    uint64_t      pages_examined;  /* by the compact in progress, or the last one */
+    uint64_t      pages_freed;
+    uint64_t      pages_truncated; /* given back to the file system */
+    uint64_t      backup_files;    /* copied by the backup in progress, or the last one */
+    uint64_t      backup_bytes;
+    uint64_t      load_records;    /* written by the bulk load in progress, or the last one */
+    uint64_t      load_bytes;
+};
+
+/* exptimes up to this many seconds are relative to now, larger ones are
+   unix times, as in memcached */
+#define REALTIME_MAXDELTA (60 * 60 * 24 * 30)
+
 extern struct bdb_settings bdb_settings;
 extern struct bdb_version bdb_version;
+extern struct gcommit_stats gcommit_stats;
+extern struct convert_stats convert_stats;
+extern struct expire_stats expire_stats;
+extern struct maint_stats maint_stats;
+extern struct job_stats job_stats;
+
+/*
+ * A record as stored in the database: this header, then the data without
+ * its CRLF. The key is the database key and is not repeated. Fields are in
+ * network byte order. Records written before the header existed are still
+ * read, see item_record_decode(), and rewritten by db_convert.
+ */
+#define RECORD_MAGIC    0xdb
+#define RECORD_VERSION  1
+
+typedef struct {
+    uint8_t         magic;      /* RECORD_MAGIC */
+    uint8_t         version;    /* RECORD_VERSION */
+    uint16_t        iflags;     /* for the server's own use, RECORD_* below */
+    uint32_t        flags;      /* client flags */
+    uint32_t        nbytes;     /* length of data */
+    uint32_t        exptime;    /* unix time the record expires, 0 for never */
+    uint64_t        cas;        /* unique per write */
+} record_header;
+
+/*
+ * The data is an LZ4 block, after the length of the data it inflates to
+ * as 4 bytes in network byte order; nbytes is the length stored.
+ */
+#define RECORD_LZ4      0x0001
 
 typedef struct _stritem {
-    int             nbytes;     /* size of data */
-    uint8_t         nsuffix;    /* length of flags-and-length string */
-    uint8_t         nkey;       /* key length, w/terminating null and padding */
+    int             nbytes;     /* size of data, w/terminating CRLF */
+    uint8_t         nsuffix;    /* length of the suffix, once built */
+    uint8_t         nkey;       /* key length, w/o terminating null */
+    uint16_t        iflags;
+    uint32_t        flags;
+    uint32_t        exptime;
+    uint64_t        cas;
     void * end[];
     /* then null-terminated key */
-    /* then " flags length\r\n" (no terminating null) */
+    /* then ITEM_SUFFIX_SIZE bytes, ending with the " flags length\r\n"
+       suffix when sending, or with the record header when storing */
     /* then data with terminating \r\n (no terminating null; it's binary!) */
 } item;
 
+/* room in front of the data: a suffix with flags, length and cas, or the
+   record header, whichever is bigger */
+#define ITEM_SUFFIX_SIZE 48
+
 #define ITEM_key(item) ((char*)&((item)->end[0]))
 
 /* warning: don't use these macros with a function, as it evals its arg twice */
-#define ITEM_suffix(item) ((char*) &((item)->end[0]) + (item)->nkey + 1)
-#define ITEM_data(item) ((char*) &((item)->end[0]) + (item)->nkey + 1 + (item)->nsuffix)
-#define ITEM_ntotal(item) (sizeof(struct _stritem) + (item)->nkey + 1 + (item)->nsuffix + (item)->nbytes)
+#define ITEM_data(item) ((char*) &((item)->end[0]) + (item)->nkey + 1 + ITEM_SUFFIX_SIZE)
+#define ITEM_suffix(item) (ITEM_data(item) - (item)->nsuffix)
+#define ITEM_record(item) (ITEM_data(item) - sizeof(record_header))
+#define ITEM_nrecord(item) (sizeof(record_header) + (item)->nbytes - 2)
+#define ITEM_ntotal(item) (sizeof(struct _stritem) + (item)->nkey + 1 + ITEM_SUFFIX_SIZE + (item)->nbytes)
+/* true if an item or record with this exptime is gone at unix time now */
+#define ITEM_expired(exptime, now) ((exptime) != 0 && (time_t)(exptime) <= (now))
 
 enum conn_states {
     conn_listening,  /** the socket which listens for connections */
@@ -201,6 +468,14 @@ enum conn_states {
     conn_swallow,    /** swallowing unnecessary bytes w/o storing */
     conn_closing,    /** closing this connection */
     conn_mwrite,     /** writing out many items sequentially */
+    conn_commit,     /** reply is ready, waiting for group commit to flush the log */
+};
+
+/* which protocol a connection speaks, decided by its first byte */
+enum protocol {
+    negotiating_prot,   /* nothing read yet */
+    ascii_prot,
+    binary_prot
 };
 
 #define NREAD_ADD 1
@@ -208,6 +483,7 @@ enum conn_states {
 #define NREAD_REPLACE 3
 #define NREAD_APPEND 4
 #define NREAD_PREPEND 5
+#define NREAD_CAS 6
 
 typedef struct conn conn;
 struct conn {
@@ -244,7 +520,7 @@ struct conn {
     int    item_comm; /* which one is it: set/add/replace */
 
     /* data for the swallow state */
-    int    sbytes;    /* how many bytes to swallow */
+    size_t sbytes;    /* how many bytes to swallow */
 
     /* data for the mwrite state */
     struct iovec *iov;
@@ -261,6 +537,9 @@ struct conn {
     int    isize;
     item   **icurr;
     int    ileft;
+    bool   batch;     /* responses of pipelined requests are being queued */
+    bool   batch_dirty; /* a write was done since the last reply waited for group commit */
+    int    rsmall;    /* reads in a row that fit in DATA_BUFFER_SIZE, see conn_shrink() */
 
     /* data for UDP clients */
     bool   udp;       /* is this is a UDP "connection" */
@@ -269,7 +548,19 @@ struct conn {
     socklen_t request_addr_size;
     unsigned char *hdrbuf; /* udp packet headers */
     int    hdrsize;   /* number of headers' worth of space is allocated */
+    struct udp_batch *ubatch; /* datagrams read ahead, see try_read_udp() */
     conn   *next;     /* Used for generating a list of conn structures */
+
+    /* data for the binary protocol */
+    int    protocol;  /* enum protocol */
+    protocol_binary_request_header binary_header; /* request being handled, lengths in host order */
+
+    /* data for group commit */
+    void   *thread;   /* worker thread owning this connection, set by thread.c */
+    struct thread_stats *stats; /* counters of the thread owning this connection */
+    int    lat_cmd;   /* latency_cmd the response being sent belongs to */
+    uint64_t send_start; /* when sending that response began, 0 if not yet */
+    bool   commit_failed; /* the log flush covering our write failed */
 };
 
 /*
@@ -280,28 +571,202 @@ struct conn {
 void bdb_settings_init(void);
 void bdb_env_init(void);
 void bdb_db_open(void);
-void start_chkpoint_thread(void);
-void start_memp_trickle_thread(void);
+void start_maint_thread(void);
 void start_dl_detect_thread(void);
 void bdb_db_close(void);
 void bdb_env_close(void);
 void bdb_chkpoint(void);
+int db_part_index(const char *key, const size_t nkey);
+void bdb_part_file(const int part, char *name, const size_t len);
+int bdb_part_sync(const int part);
+void start_gcommit_thread(void);
+int start_convert_thread(void);
+void start_job_thread(void);
+int bdb_job_submit(const int kind, const int part, const char *target);
+int bdb_job_cancel(void);
+void start_expire_thread(void);
+void start_heartbeat_thread(void);
+void bdb_check_parts(void);
+void engine_err(const int ret, const char *fmt, ...);
+
+/*
+ * A storage engine, picked with -B: bdb_engine keeps the partitions in
+ * Berkeley DB (bdb.c), mmdb_engine in B+trees of memory mapped files
+ * (mmdb.c). item.c, rget and the stats reach the data only through
+ * *engine. Errors are Berkeley DB's, DB_NOTFOUND, DB_BUFFER_SMALL,
+ * DB_LOCK_DEADLOCK and so on, or errno values.
+ */
+typedef struct engine_txn engine_txn;
+typedef struct engine_cursor engine_cursor;
+
+/* flags of engine->get() */
+#define ENGINE_RMW     0x01 /* write lock the record, in a transaction */
+#define ENGINE_PARTIAL 0x02 /* the first ulen bytes of a longer record are enough */
+
+/* where engine->c_get() moves the cursor to */
+enum engine_move { ENGINE_FIRST, ENGINE_NEXT, ENGINE_SET, ENGINE_SET_RANGE };
+
+struct engine {
+    const char *name;
+    /* opens every partition and starts the engine's threads, exits on failure */
+    void (*open)(void);
+    /* makes everything durable and closes it, for atexit */
+    void (*close)(void);
+    /* a transaction covers one partition; engine_txn NULL means on its own */
+    int (*txn_begin)(const int part, engine_txn **txnp);
+    /* one whose commit does not wait for the disk, the next checkpoint
+       makes it durable */
+    int (*txn_begin_nosync)(const int part, engine_txn **txnp);
+    int (*txn_commit)(engine_txn *txn);
+    void (*txn_abort)(engine_txn *txn);
+    /* reads the record for key into buf: 0 with its size in *size, or
+       DB_BUFFER_SMALL with the size it needs */
+    int (*get)(const int part, engine_txn *txn, const void *key, const u_int32_t nkey,
+               void *buf, const u_int32_t ulen, u_int32_t *size, const int flags);
+    int (*put)(const int part, engine_txn *txn, const void *key, const u_int32_t nkey,
+               const void *data, const u_int32_t size);
+    int (*del)(const int part, engine_txn *txn, const void *key, const u_int32_t nkey);
+    /* a cursor in key order; outside a transaction it reads up to bulk
+       bytes ahead, if the engine copies records at all */
+    int (*cursor)(const int part, engine_txn *txn, const u_int32_t bulk, engine_cursor **cp);
+    /* moves the cursor, to key for ENGINE_SET and ENGINE_SET_RANGE; the
+       record it is on stays readable until it moves again */
+    int (*c_get)(engine_cursor *c, const int move, const void *key, const u_int32_t nkey,
+                 const void **rkey, u_int32_t *rnkey, const void **rdata, u_int32_t *rndata);
+    /* replaces or deletes the record the cursor is on */
+    int (*c_put)(engine_cursor *c, const void *data, const u_int32_t size);
+    int (*c_del)(engine_cursor *c);
+    void (*c_close)(engine_cursor *c);
+    /* writes everything committed to disk, a partition or all for -1 */
+    int (*checkpoint)(const int part);
+    /* writes the "stats partitions" lines of the engine for a partition
+       into buf, at most ENGINE_STATS_MAX bytes; returns their length */
+    int (*stats)(const int part, char *buf);
+};
+
+#define ENGINE_STATS_MAX 512
+
+extern const struct engine bdb_engine;
+extern const struct engine mmdb_engine;
+extern const struct engine *engine;
+
+/* hot backup */
+int backup_run(DB_ENV *dbenv, const char *target, volatile int *cancel);
+
+/* bulk load */
+int load_run(const char *path, volatile int *cancel);
+int bdb_rep_lsn(DB_LSN *lsn);
+int bdb_rep_lag(void);
+void bdb_rep_heartbeat(struct rep_heartbeat *hb);
+void gcommit_enqueue(conn *c);
+
+/* one key of a multiget, see item_get_multi() */
+typedef struct {
+    char *key;
+    size_t nkey;
+    int part;       /* the partition it lives in */
+    uint32_t gen;   /* of its hot cache shard, before the read */
+    item *it;       /* the hit, or NULL */
+    bool none;      /* the bloom filter rules it out */
+} mget_key;
 
 /* item management */
 void item_init(void);
-item *do_item_from_freelist(void);
-int do_item_add_to_freelist(item *it);
 item *item_alloc1(char *key, const size_t nkey, const int flags, const int nbytes);
 item *item_alloc2(size_t ntotal);
 int item_free(item *it);
+void item_make_suffix(item *it, const bool return_cas);
+int item_record_decode(const void *rec, const size_t nrec, item *hdr, const char **data);
+item *item_from_record(char *key, const size_t nkey, const void *rec, const size_t nrec);
+int item_record_length(const item *hdr, const char *data);
+int item_record_inflate(const item *hdr, const char *data, char *dst, const int ndst);
 item *item_get(char *key, size_t nkey);
+item *item_get_stored(char *key, size_t nkey);
+void item_get_multi(mget_key *keys, const int nkeys);
+int item_key_cmp(const void *a, const size_t na, const void *b, const size_t nb);
 int item_put(char *key, size_t nkey, item *it);
+int item_cas_put(char *key, size_t nkey, item *it);
+int item_counter_put(char *key, size_t nkey, item *it);
+int item_load(const int part, item **items, const int n);
 int item_delete(char *key, size_t nkey);
 int item_exists(char *key, size_t nkey);
+int item_convert(const int part, char *kbuf, u_int32_t *nkbuf, const int max, int *scanned, int *converted);
+uint32_t item_exptime(const int64_t exptime);
+int item_expire(const int part, char *kbuf, u_int32_t *nkbuf, const int max, int *scanned, int *expired, uint64_t *bytes);
+int item_bloom_fill(const int part, char *kbuf, u_int32_t *nkbuf, const int max, int *scanned);
+
+/* slabs memory allocation */
+void slabs_init(void);
+void *slabs_alloc(const size_t size);
+void slabs_free(void *ptr);
+char *slabs_stats(int *buflen);
+
+/* hash */
+uint32_t hash(const void *key, size_t length, const uint32_t initval);
+
+/* hot item cache */
+void hotcache_init(void);
+uint32_t hotcache_gen(const char *key, const size_t nkey);
+item *hotcache_get(const char *key, const size_t nkey);
+void hotcache_put(const item *it, const uint32_t gen);
+void hotcache_invalidate(const char *key, const size_t nkey);
+void hotcache_flush(void);
+void hotcache_stats(uint64_t *items, uint64_t *bytes, uint64_t *evictions);
+
+/* bloom filter over the keys */
+void bloom_init(void);
+bool bloom_enabled(void);
+bool bloom_ready(void);
+bool bloom_maybe(const char *key, const size_t nkey);
+void bloom_add(const char *key, const size_t nkey);
+void bloom_remove(const char *key, const size_t nkey);
+void bloom_lock(const char *key, const size_t nkey);
+void bloom_unlock(const char *key, const size_t nkey);
+void bloom_fill(void);
+void bloom_stop(void);
+void bloom_start(void);
+const char *bloom_stats(uint64_t *keys);
+
+/* warm restart */
+void warm_init(void);
+void warm_touch(const char *key, const size_t nkey);
+void warm_save(void);
+void start_warm_thread(void);
+const char *warm_state(uint64_t *total, uint64_t *loaded, uint64_t *saved, time_t *last_save);
+
+/* write-behind counters */
+void counter_init(void);
+bool counter_enabled(void);
+void counter_lock(const char *key, const size_t nkey);
+void counter_unlock(const char *key, const size_t nkey);
+void counter_drop(const char *key, const size_t nkey, const bool write);
+item *counter_get(const char *key, const size_t nkey);
+char *counter_delta(const bool incr, const int64_t delta, char *buf, char *key, size_t nkey);
+void counter_flush_all(void);
+void counter_clear(void);
+void start_counter_thread(void);
+void counter_stats_get(uint64_t *keys, uint64_t *deltas, uint64_t *writes);
+
+/* hot key sampling */
+void hotkeys_init(void);
+void hotkey_touch(const char *key, const size_t nkey, const int kind);
+char *hotkeys_stats(int *buflen);
+void hotkeys_reset(void);
+
+void thread_stats_clear(struct thread_stats *ts);
+uint64_t latency_now(void);
+void latency_record(struct thread_stats *ts, const int cmd, const int phase, const uint64_t start);
+void latency_clear(struct thread_stats *ts);
+char *stats_latency(int *buflen);
+void size_record(uint64_t *hist, const size_t bytes);
+void sizes_clear(struct thread_stats *ts);
+char *stats_sizes(int *buflen);
+char *stats_partitions(int *buflen);
 
 /* bdb related stats */
 void stats_bdb(char *temp);
-void stats_rep(char *temp);
+void stats_bdb_job(char *temp);
+char *stats_rep(int *buflen);
 void stats_repmgr(char *temp);
 void stats_repcfg(char *temp);
 void stats_repms(char *temp);
@@ -310,6 +775,7 @@ void stats_repms(char *temp);
 conn *do_conn_from_freelist();
 bool do_conn_add_to_freelist(conn *c);
 conn *conn_new(const int sfd, const int init_state, const int event_flags, const int read_buffer_size, const bool is_udp, struct event_base *base);
+void conn_commit_done(conn *c);
 
 char *do_add_delta(const bool incr, const int64_t delta, char *buf, char *key, size_t nkey);
 int do_store_item(item *item, int comm);
@@ -332,28 +798,31 @@ int do_store_item(item *item, int comm);
 void thread_init(int nthreads, struct event_base *main_base);
 int  dispatch_event_add(int thread, conn *c);
 void dispatch_conn_new(int sfd, int init_state, int event_flags, int read_buffer_size, int is_udp);
+void dispatch_conn_to(int thread, int sfd, int init_state, int event_flags, int read_buffer_size, int is_udp);
+void dispatch_conn_closed(conn *c);
+void dispatch_commit_done(conn *c);
 
 /* Lock wrappers for cache functions that are called from main loop. */
 char *mt_add_delta(const int incr, const int64_t delta, char *buf, char *key, size_t nkey);
 conn *mt_conn_from_freelist(void);
 bool  mt_conn_add_to_freelist(conn *c);
 int   mt_is_listen_thread(void);
-item *mt_item_from_freelist(void);
-int mt_item_add_to_freelist(item *it);
-void  mt_stats_lock(void);
-void  mt_stats_unlock(void);
+conn *mt_thread_listen_conn(void);
+struct thread_stats *mt_thread_stats(void);
+void  mt_stats_aggregate(struct thread_stats *out);
+void  mt_stats_reset(void (*clear)(struct thread_stats *));
 int   mt_store_item(item *item, int comm);
 
 # define add_delta(x,y,z,a,b)        mt_add_delta(x,y,z,a,b)
 # define conn_from_freelist()        mt_conn_from_freelist()
 # define conn_add_to_freelist(x)     mt_conn_add_to_freelist(x)
 # define is_listen_thread()          mt_is_listen_thread()
-# define item_from_freelist()        mt_item_from_freelist()
-# define item_add_to_freelist(x)     mt_item_add_to_freelist(x)
+# define thread_listen_conn()        mt_thread_listen_conn()
 # define store_item(x,y)             mt_store_item(x,y)
 
-# define STATS_LOCK()                mt_stats_lock()
-# define STATS_UNLOCK()              mt_stats_unlock()
+# define thread_stats()              mt_thread_stats()
+# define stats_aggregate(x)          mt_stats_aggregate(x)
+# define thread_stats_reset(f)       mt_stats_reset(f)
 
 #else /* !USE_THREADS */
 
@@ -361,15 +830,18 @@ int   mt_store_item(item *item, int comm);
 # define conn_from_freelist()         do_conn_from_freelist()
 # define conn_add_to_freelist(x)      do_conn_add_to_freelist(x)
 # define dispatch_conn_new(x,y,z,a,b) conn_new(x,y,z,a,b,main_base)
+# define dispatch_conn_to(t,x,y,z,a,b) conn_new(x,y,z,a,b,main_base)
+# define dispatch_conn_closed(c)      /**/
 # define dispatch_event_add(t,c)      event_add(&(c)->event, 0)
 # define is_listen_thread()           1
-# define item_from_freelist()         do_item_from_freelist()
-# define item_add_to_freelist(x)      do_item_add_to_freelist(x)
+# define thread_listen_conn()         NULL
 # define store_item(x,y)              do_store_item(x,y)
 # define thread_init(x,y)             0
 
-# define STATS_LOCK()                /**/
-# define STATS_UNLOCK()              /**/
+extern struct thread_stats main_thread_stats;
+# define thread_stats()               (&main_thread_stats)
+# define stats_aggregate(x)           (*(x) = main_thread_stats)
+# define thread_stats_reset(f)        (f)(&main_thread_stats)
 
 #endif /* !USE_THREADS */
 
@@ -379,5 +851,8 @@ int   mt_store_item(item *item, int comm);
     memset(&dbdata, 0, sizeof(dbdata))
 
 extern DB_ENV *env;
-extern DB *dbp;
+extern DB *dbps[MAX_DB_PARTS];
+
+/* the database a key lives in */
+#define db_part(key, nkey) (dbps[db_part_index(key, nkey)])
 extern int daemon_quit;
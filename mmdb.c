@@ -0,0 +1,1629 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <db.h>
+
+/*
+ * The mmap engine, -B mmap: every partition is a B+tree in a file of its
+ * own, mapped into memory once and read in place. Pages are copy on
+ * write. A transaction never changes a page the last commit can reach, it
+ * writes a copy and the copies up to a new root, and the commit makes
+ * that root the one readers start from. A reader so takes a snapshot of
+ * the tree without any lock and reads its records where they lie in the
+ * map, also through a cursor; only writers of a partition wait for each
+ * other, there is one transaction at a time.
+ *
+ * Pages left behind by a commit are only used again once no reader can
+ * still be on the snapshot they belong to, nor either of the two meta
+ * pages at the start of the file. Each reader announces the snapshot it
+ * is on in a slot of its own, see mm_read_begin().
+ *
+ * A commit is durable once the pages it wrote and then its meta page are
+ * synced. With -N it is left to the page cache, and the checkpoint thread
+ * writes a meta page every chkpoint_val seconds; a crash goes back to the
+ * last of those. There is no log, so no replication, db_archive or
+ * db_backup; deletes free emptied pages but don't merge half empty ones,
+ * so db_compact has nothing to do either.
+ */
+
+#define MMDB_MAGIC 0x4d4d4442
+#define MMDB_VERSION 1
+
+/* the mapping is reserved at open and never moves */
+#if SIZE_MAX > 0xffffffffUL
+#define MMDB_MAP_SIZE ((size_t)1 << 38)
+#else
+#define MMDB_MAP_SIZE ((size_t)1 << 30)
+#endif
+
+/* the file grows by at least this many pages, or an eighth */
+#define MMDB_GROW_PAGES 256
+
+/* threads that read without a lock, the rest share one slot */
+#define MMDB_READERS 128
+
+#define MMDB_MAX_DEPTH 32
+
+/* keys come from the protocol, which keeps them to KEY_MAX_LENGTH */
+#define MMDB_MAX_KEY 255
+
+#define MMDB_MIN_PAGE 2048
+#define MMDB_MAX_PAGE 65536
+
+typedef uint32_t pgno_t;
+
+typedef struct {
+    uint64_t txnid;     /* of the transaction that wrote it */
+    pgno_t pgno;
+    uint16_t flags;
+    uint16_t nkeys;
+    uint32_t lower;     /* where the slots end */
+    uint32_t upper;     /* where the nodes start */
+    uint32_t npages;    /* of an overflow run */
+    uint32_t pad;
+} mmpage;
+
+#define P_BRANCH   0x01
+#define P_LEAF     0x02
+#define P_OVERFLOW 0x04
+#define P_META     0x08
+
+#define PAGEHDR sizeof(mmpage)
+
+/* the slots follow the header, the offsets of the nodes in key order */
+#define PAGE_slots(p) ((uint16_t *)((char *)(p) + PAGEHDR))
+#define PAGE_node(p, i) ((char *)(p) + PAGE_slots(p)[i])
+#define PAGE_room(p) ((p)->upper - (p)->lower)
+
+/* a leaf node: the key, then the data or the first page of its run */
+typedef struct {
+    uint16_t nkey;
+    uint16_t flags;
+    uint32_t ndata;
+} mmleaf;
+
+#define N_BIG 0x01
+
+/* a branch node: the key is ignored for the first one */
+typedef struct {
+    pgno_t child;
+    uint16_t nkey;
+    uint16_t pad;
+} mmbranch;
+
+#define NODE_ALIGN(n) (((n) + 3) & ~3)
+
+#define LEAF(p, i) ((mmleaf *)PAGE_node(p, i))
+#define LEAF_key(n) ((char *)(n) + sizeof(mmleaf))
+#define LEAF_data(n) (LEAF_key(n) + (n)->nkey)
+#define BRANCH(p, i) ((mmbranch *)PAGE_node(p, i))
+#define BRANCH_key(n) ((char *)(n) + sizeof(mmbranch))
+
+/* pages 0 and 1, written by turns; the valid one with the higher txnid counts */
+typedef struct {
+    mmpage h;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t psize;
+    pgno_t root;        /* 0 for an empty tree */
+    pgno_t npages;      /* in use, the file may be longer */
+    pgno_t freelist;    /* where the free pages were saved at close, 0 for none */
+    uint32_t nfree;
+    uint32_t depth;
+    uint64_t entries;
+    uint32_t sum;       /* hash() of all of the above */
+    uint32_t pad;
+} mmmeta;
+
+typedef struct {
+    pgno_t *p;
+    uint32_t n, size;
+} pglist;
+
+/* what a reader starts from */
+typedef struct {
+    pgno_t root;
+    uint32_t depth;
+    uint64_t txnid;
+    uint64_t entries;
+} mmsnap;
+
+typedef struct {
+    volatile uint64_t txnid;   /* of the snapshot being read, 0 for none */
+    int depth;                 /* of nested reads by the thread */
+} __attribute__((aligned(CACHE_LINE_SIZE))) mmreader;
+
+typedef struct mmdb mmdb;
+
+/* a page let go by a commit */
+typedef struct {
+    pgno_t pgno;
+    uint64_t written;   /* the txnid it was written by */
+    uint64_t txnid;     /* of the commit that let it go */
+} mmpending;
+
+typedef struct {
+    mmpending *p;
+    uint32_t n, size;
+} mmplist;
+
+struct engine_txn {
+    mmdb *db;
+    uint64_t txnid;
+    pgno_t root;
+    uint32_t depth;
+    uint64_t entries;
+    pglist alloc;       /* pages taken, given back by an abort */
+    mmplist freed;      /* pages let go, pending once committed */
+    uint64_t mods;      /* writes so far, for the cursors to find their place again */
+    bool nosync;        /* its commit leaves the syncing to the next checkpoint */
+};
+
+struct mmdb {
+    mmreader readers[MMDB_READERS];
+    int fd;
+    char *map;
+    uint32_t psize;
+    uint32_t maxnode;   /* bigger leaf nodes keep their data in a run */
+    pgno_t fpages;      /* the size of the file */
+    pgno_t npages;
+    pthread_mutex_t wlock;
+    struct engine_txn txn;
+    char *scratch;      /* a page for splits */
+    volatile uint32_t seq;
+    mmsnap snap;
+    /* the txnids of the meta pages, and of a checkpoint being written */
+    uint64_t metas[3];
+    pglist free;        /* sorted */
+    mmplist pending;    /* in txnid order */
+    uint32_t kept;      /* the first ones are still on disk, see mm_reclaim() */
+    bool rescan;        /* a meta page was written since */
+    pglist reclaim;
+    pgno_t dirty_lo, dirty_hi; /* written since the last checkpoint, with -N */
+    /* the readers without a slot of their own */
+    pthread_mutex_t ovf_lock;
+    int ovf_readers;
+    uint64_t ovf_txnid;
+};
+
+typedef struct {
+    mmpage *pages[MMDB_MAX_DEPTH];
+    unsigned int idx[MMDB_MAX_DEPTH];
+    int depth;
+} mmpath;
+
+struct engine_cursor {
+    mmdb *db;
+    engine_txn *txn;    /* NULL for a read of a snapshot */
+    int slot;
+    pgno_t root;
+    uint32_t depth;
+    mmpath path;
+    bool on;
+    uint64_t mods;
+    char key[MMDB_MAX_KEY];   /* with a txn, the key it is on */
+    uint32_t nkey;
+};
+
+static mmdb *mdbs[MAX_DB_PARTS];
+static pthread_key_t mm_slot_key;
+static int mm_nslots;
+static size_t mm_syspage;
+static pthread_t mmc_ptid;
+
+#define MM_page(db, pg) ((mmpage *)((db)->map + (size_t)(pg) * (db)->psize))
+
+static int pglist_reserve(pglist *l, const uint32_t more)
+{
+    uint32_t size = l->size > 0 ? l->size : 64;
+    pgno_t *p;
+
+    if (l->n + more <= l->size)
+        return 0;
+    while (size < l->n + more)
+        size *= 2;
+    if ((p = realloc(l->p, size * sizeof(pgno_t))) == NULL)
+        return ENOMEM;
+    l->p = p;
+    l->size = size;
+    return 0;
+}
+
+static int pglist_add(pglist *l, const pgno_t pg)
+{
+    if (pglist_reserve(l, 1) != 0)
+        return ENOMEM;
+    l->p[l->n++] = pg;
+    return 0;
+}
+
+static int mmplist_reserve(mmplist *l, const uint32_t more)
+{
+    uint32_t size = l->size > 0 ? l->size : 64;
+    mmpending *p;
+
+    if (l->n + more <= l->size)
+        return 0;
+    while (size < l->n + more)
+        size *= 2;
+    if ((p = realloc(l->p, size * sizeof(mmpending))) == NULL)
+        return ENOMEM;
+    l->p = p;
+    l->size = size;
+    return 0;
+}
+
+static int pgno_cmp(const void *a, const void *b)
+{
+    pgno_t x = *(const pgno_t *)a, y = *(const pgno_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* adds the n sorted pages of add to the sorted list l */
+static int pglist_merge(pglist *l, const pgno_t *add, const uint32_t n)
+{
+    int64_t i = (int64_t)l->n - 1, j = (int64_t)n - 1, k = (int64_t)l->n + n - 1;
+
+    if (pglist_reserve(l, n) != 0)
+        return ENOMEM;
+    while (j >= 0) {
+        if (i >= 0 && l->p[i] > add[j])
+            l->p[k--] = l->p[i--];
+        else
+            l->p[k--] = add[j--];
+    }
+    l->n += n;
+    return 0;
+}
+
+/* the reader slot of this thread, -1 once they are all taken */
+static int mm_slot(void)
+{
+    intptr_t s = (intptr_t)pthread_getspecific(mm_slot_key);
+
+    if (s == 0) {
+        s = __sync_add_and_fetch(&mm_nslots, 1);
+        pthread_setspecific(mm_slot_key, (void *)s);
+    }
+    return s <= MMDB_READERS ? s - 1 : -1;
+}
+
+static void mm_snapshot(mmdb *db, mmsnap *snap)
+{
+    uint32_t seq;
+
+    do {
+        while ((seq = db->seq) & 1)
+            ;
+        __sync_synchronize();
+        *snap = db->snap;
+        __sync_synchronize();
+    } while (seq != db->seq);
+}
+
+/* makes snap the one readers start from, under wlock */
+static void mm_publish(mmdb *db, const mmsnap *snap)
+{
+    db->seq++;
+    __sync_synchronize();
+    db->snap = *snap;
+    __sync_synchronize();
+    db->seq++;
+    /* against mm_read_begin(): either it sees snap or we see its slot */
+    __sync_synchronize();
+}
+
+/*
+ * Takes the latest snapshot of db for a read and keeps its pages from
+ * being used again until mm_read_end(). The slot is set before the
+ * snapshot is read again: a commit that came in between is started over
+ * with, and a writer that looks at the slots after that sees this one.
+ * Returns the slot, or -1 for the shared one.
+ */
+static int mm_read_begin(mmdb *db, mmsnap *snap)
+{
+    int slot = mm_slot();
+    mmreader *r;
+    mmsnap now;
+
+    if (slot < 0) {
+        pthread_mutex_lock(&db->ovf_lock);
+        mm_snapshot(db, snap);
+        if (db->ovf_readers++ == 0 || snap->txnid < db->ovf_txnid)
+            db->ovf_txnid = snap->txnid;
+        pthread_mutex_unlock(&db->ovf_lock);
+        return -1;
+    }
+
+    r = &db->readers[slot];
+    mm_snapshot(db, snap);
+    /* a nested read is covered by the older snapshot in the slot */
+    if (r->depth++ > 0)
+        return slot;
+    for (;;) {
+        r->txnid = snap->txnid;
+        __sync_synchronize();
+        mm_snapshot(db, &now);
+        if (now.txnid == snap->txnid)
+            break;
+        *snap = now;
+    }
+    return slot;
+}
+
+static void mm_read_end(mmdb *db, const int slot)
+{
+    if (slot < 0) {
+        pthread_mutex_lock(&db->ovf_lock);
+        if (--db->ovf_readers == 0)
+            db->ovf_txnid = 0;
+        pthread_mutex_unlock(&db->ovf_lock);
+        return;
+    }
+    if (--db->readers[slot].depth == 0) {
+        __sync_synchronize();
+        db->readers[slot].txnid = 0;
+    }
+}
+
+/* the oldest snapshot that is still read */
+static uint64_t mm_oldest(mmdb *db)
+{
+    uint64_t oldest = UINT64_MAX, t;
+    int i, n = mm_nslots < MMDB_READERS ? mm_nslots : MMDB_READERS;
+
+    __sync_synchronize();
+    for (i = 0; i < n; i++) {
+        if ((t = db->readers[i].txnid) != 0 && t < oldest)
+            oldest = t;
+    }
+    pthread_mutex_lock(&db->ovf_lock);
+    if (db->ovf_readers > 0 && db->ovf_txnid < oldest)
+        oldest = db->ovf_txnid;
+    pthread_mutex_unlock(&db->ovf_lock);
+    return oldest;
+}
+
+/* is e in the tree of a meta page, the one of a checkpoint too */
+static bool mm_on_disk(const mmdb *db, const mmpending *e)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (db->metas[i] >= e->written && db->metas[i] < e->txnid)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Frees the pages commits let go that no reader can still be on, and
+ * that no meta page leads to. With -N most pages are written and let go
+ * again between two checkpoints, and are used again right away; the
+ * ones left are kept at the front of pending and only looked at again
+ * once another meta page is written.
+ */
+static void mm_reclaim(mmdb *db)
+{
+    uint64_t oldest;
+    uint32_t i, w;
+    mmpending *e;
+
+    i = w = db->rescan ? 0 : db->kept;
+    if (i == db->pending.n)
+        return;
+    oldest = mm_oldest(db);
+    db->reclaim.n = 0;
+    if (pglist_reserve(&db->reclaim, db->pending.n - i) != 0
+        || pglist_reserve(&db->free, db->pending.n - i) != 0)
+        return;
+    for (; i < db->pending.n && db->pending.p[i].txnid <= oldest; i++) {
+        e = &db->pending.p[i];
+        if (mm_on_disk(db, e))
+            db->pending.p[w++] = *e;
+        else
+            db->reclaim.p[db->reclaim.n++] = e->pgno;
+    }
+    if (db->reclaim.n > 0) {
+        qsort(db->reclaim.p, db->reclaim.n, sizeof(pgno_t), pgno_cmp);
+        (void)pglist_merge(&db->free, db->reclaim.p, db->reclaim.n);
+        memmove(db->pending.p + w, db->pending.p + i, (db->pending.n - i) * sizeof(mmpending));
+        db->pending.n -= i - w;
+    }
+    db->kept = w;
+    db->rescan = false;
+}
+
+static int mm_msync(mmdb *db, const pgno_t pg, const pgno_t n)
+{
+    size_t start = (size_t)pg * db->psize, end = start + (size_t)n * db->psize;
+
+    start -= start % mm_syspage;
+    if (msync(db->map + start, end - start, MS_SYNC) != 0)
+        return errno;
+    return 0;
+}
+
+/* makes the file at least want pages long */
+static int mm_grow(mmdb *db, const pgno_t want)
+{
+    uint64_t size = db->fpages + (db->fpages / 8 > MMDB_GROW_PAGES ? db->fpages / 8 : MMDB_GROW_PAGES);
+
+    if (size < want)
+        size = want;
+    if (size * db->psize > MMDB_MAP_SIZE) {
+        if ((uint64_t)want * db->psize > MMDB_MAP_SIZE)
+            return ENOSPC;
+        size = MMDB_MAP_SIZE / db->psize;
+    }
+    if (ftruncate(db->fd, (off_t)size * db->psize) != 0)
+        return errno;
+    db->fpages = size;
+    return 0;
+}
+
+/* takes a run of n pages for txn, from the free list or the end of the file */
+static int mm_alloc(mmdb *db, engine_txn *txn, const uint32_t n, const uint16_t flags, mmpage **pp)
+{
+    pgno_t pg = 0;
+    uint32_t i, j;
+    mmpage *p;
+    int ret;
+
+    if (pglist_reserve(&txn->alloc, n) != 0)
+        return ENOMEM;
+    if (n == 1 && db->free.n > 0) {
+        pg = db->free.p[--db->free.n];
+    } else if (n > 1) {
+        for (i = 0; i + n <= db->free.n; i = j + 1) {
+            for (j = i; j + 1 < db->free.n && j - i + 1 < n && db->free.p[j + 1] == db->free.p[j] + 1; j++)
+                ;
+            if (j - i + 1 == n) {
+                pg = db->free.p[i];
+                memmove(db->free.p + i, db->free.p + j + 1, (db->free.n - j - 1) * sizeof(pgno_t));
+                db->free.n -= n;
+                break;
+            }
+        }
+    }
+    if (pg == 0) {
+        if (db->npages + n > db->fpages && (ret = mm_grow(db, db->npages + n)) != 0)
+            return ret;
+        pg = db->npages;
+        db->npages += n;
+    }
+    for (i = 0; i < n; i++)
+        txn->alloc.p[txn->alloc.n++] = pg + i;
+
+    p = MM_page(db, pg);
+    memset(p, 0, PAGEHDR);
+    p->txnid = txn->txnid;
+    p->pgno = pg;
+    p->flags = flags;
+    p->lower = PAGEHDR;
+    p->upper = db->psize;
+    p->npages = n;
+    *pp = p;
+    return 0;
+}
+
+static int mm_free(mmdb *db, engine_txn *txn, const pgno_t pg, const uint32_t n)
+{
+    uint64_t written = MM_page(db, pg)->txnid;
+    uint32_t i;
+
+    if (mmplist_reserve(&txn->freed, n) != 0)
+        return ENOMEM;
+    for (i = 0; i < n; i++) {
+        txn->freed.p[txn->freed.n].pgno = pg + i;
+        txn->freed.p[txn->freed.n++].written = written;
+    }
+    return 0;
+}
+
+/* the page to change in place of p: p itself if txn wrote it, or a copy */
+static int mm_touch(mmdb *db, engine_txn *txn, mmpage *p, mmpage **np)
+{
+    pgno_t old = p->pgno, pg;
+    mmpage *q;
+    int ret;
+
+    if (p->txnid == txn->txnid) {
+        *np = p;
+        return 0;
+    }
+    if ((ret = mm_alloc(db, txn, 1, p->flags, &q)) != 0)
+        return ret;
+    if ((ret = mm_free(db, txn, old, 1)) != 0)
+        return ret;
+    pg = q->pgno;
+    memcpy(q, p, db->psize);
+    q->txnid = txn->txnid;
+    q->pgno = pg;
+    *np = q;
+    return 0;
+}
+
+static void mm_node_key(const mmpage *p, const unsigned int i, const char **key, uint32_t *nkey)
+{
+    if (p->flags & P_LEAF) {
+        mmleaf *n = LEAF(p, i);
+        *key = LEAF_key(n);
+        *nkey = n->nkey;
+    } else {
+        mmbranch *n = BRANCH(p, i);
+        *key = BRANCH_key(n);
+        *nkey = n->nkey;
+    }
+}
+
+static uint32_t mm_node_size(const mmpage *p, const unsigned int i)
+{
+    if (p->flags & P_LEAF) {
+        mmleaf *n = LEAF(p, i);
+        return NODE_ALIGN(sizeof(mmleaf) + n->nkey + ((n->flags & N_BIG) ? sizeof(pgno_t) : n->ndata));
+    }
+    return NODE_ALIGN(sizeof(mmbranch) + BRANCH(p, i)->nkey);
+}
+
+static const void *mm_node_data(mmdb *db, const mmleaf *n)
+{
+    pgno_t pg;
+
+    if (!(n->flags & N_BIG))
+        return LEAF_data(n);
+    memcpy(&pg, LEAF_data(n), sizeof(pg));
+    return (char *)MM_page(db, pg) + PAGEHDR;
+}
+
+/* in a leaf the first node not below key; in a branch the child key is in */
+static unsigned int mm_search_page(const mmpage *p, const void *key, const uint32_t nkey, bool *exact)
+{
+    unsigned int lo, hi, mid;
+    const char *k;
+    uint32_t nk;
+    int cmp;
+
+    *exact = false;
+    if (p->flags & P_LEAF) {
+        lo = 0;
+        hi = p->nkeys;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            mm_node_key(p, mid, &k, &nk);
+            if ((cmp = item_key_cmp(k, nk, key, nkey)) < 0) {
+                lo = mid + 1;
+            } else {
+                *exact = (cmp == 0);
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    /* the first node above key, past the first one */
+    lo = 1;
+    hi = p->nkeys;
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        mm_node_key(p, mid, &k, &nk);
+        if (item_key_cmp(k, nk, key, nkey) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo - 1;
+}
+
+/*
+ * Fills in path from the page at level down to a leaf, through the child
+ * key falls in, or the first one for key NULL. With wtxn the pages on the
+ * way are copied for a write, the one at level already is. In the leaf
+ * idx is where key is or would go.
+ */
+static int mm_walk_down(mmdb *db, engine_txn *wtxn, mmpath *path, int level,
+                        const void *key, const uint32_t nkey, bool *exact)
+{
+    mmpage *p = path->pages[level], *child;
+    mmbranch *b;
+    unsigned int i;
+    int ret;
+
+    *exact = false;
+    while (p->flags & P_BRANCH) {
+        if (level + 1 >= MMDB_MAX_DEPTH || p->nkeys == 0)
+            return EINVAL;
+        i = key != NULL ? mm_search_page(p, key, nkey, exact) : 0;
+        path->idx[level] = i;
+        b = BRANCH(p, i);
+        child = MM_page(db, b->child);
+        if (wtxn != NULL) {
+            if ((ret = mm_touch(db, wtxn, child, &child)) != 0)
+                return ret;
+            b->child = child->pgno;
+        }
+        path->pages[++level] = p = child;
+    }
+    path->idx[level] = key != NULL ? mm_search_page(p, key, nkey, exact) : 0;
+    path->depth = level + 1;
+    return 0;
+}
+
+/* the leaf of key and its place there in the tree at root */
+static int mm_find(mmdb *db, const pgno_t root, const void *key, const uint32_t nkey,
+                   mmpath *path, bool *exact)
+{
+    *exact = false;
+    if (root == 0) {
+        path->depth = 0;
+        return 0;
+    }
+    path->pages[0] = MM_page(db, root);
+    return mm_walk_down(db, NULL, path, 0, key, nkey, exact);
+}
+
+/* the path to key in txn's tree, as a copy that can be changed */
+static int mm_write_path(mmdb *db, engine_txn *txn, const void *key, const uint32_t nkey,
+                         mmpath *path, bool *exact)
+{
+    mmpage *root;
+    int ret;
+
+    if ((ret = mm_touch(db, txn, MM_page(db, txn->root), &root)) != 0)
+        return ret;
+    txn->root = root->pgno;
+    path->pages[0] = root;
+    return mm_walk_down(db, txn, path, 0, key, nkey, exact);
+}
+
+/* takes node i out of p, moving up the nodes below it */
+static void mm_node_del(mmpage *p, const unsigned int i)
+{
+    uint16_t *slots = PAGE_slots(p);
+    uint32_t off = slots[i], sz = mm_node_size(p, i);
+    unsigned int j;
+
+    for (j = 0; j < p->nkeys; j++) {
+        if (slots[j] < off)
+            slots[j] += sz;
+    }
+    memmove((char *)p + p->upper + sz, (char *)p + p->upper, off - p->upper);
+    p->upper += sz;
+    memmove(slots + i, slots + i + 1, (p->nkeys - i - 1) * sizeof(uint16_t));
+    p->nkeys--;
+    p->lower -= sizeof(uint16_t);
+}
+
+/* puts node of sz bytes at i into p, which has room for it */
+static void mm_node_put(mmpage *p, const unsigned int i, const void *node, const uint32_t sz)
+{
+    uint16_t *slots = PAGE_slots(p);
+
+    p->upper -= sz;
+    memcpy((char *)p + p->upper, node, sz);
+    memmove(slots + i + 1, slots + i, (p->nkeys - i) * sizeof(uint16_t));
+    slots[i] = p->upper;
+    p->nkeys++;
+    p->lower += sizeof(uint16_t);
+}
+
+/*
+ * Puts node at i into the page at level of path, splitting the page when
+ * it is full: by bytes, about half of them on either side, the first key
+ * of the new right page going up to the parent, and a new root above the
+ * old one if it was the root that split.
+ */
+static int mm_insert(mmdb *db, engine_txn *txn, mmpath *path, const int level, const unsigned int i,
+                     const void *node, const uint32_t sz)
+{
+    mmpage *p = path->pages[level], *old = (mmpage *)db->scratch, *r, *root;
+    char bnode[NODE_ALIGN(sizeof(mmbranch) + MMDB_MAX_KEY)];
+    mmbranch *b = (mmbranch *)bnode;
+    const char *src, *sep;
+    uint32_t nsep, count, total, left, n, k, j;
+    int ret;
+
+    if (PAGE_room(p) >= sz + sizeof(uint16_t)) {
+        mm_node_put(p, i, node, sz);
+        return 0;
+    }
+
+    memcpy(old, p, db->psize);
+    count = old->nkeys + 1;
+    total = sz + sizeof(uint16_t);
+    for (j = 0; j < old->nkeys; j++)
+        total += mm_node_size(old, j) + sizeof(uint16_t);
+
+#define SPLIT_node(j) ((j) == i ? (const char *)node : PAGE_node(old, (j) < i ? (j) : (j) - 1))
+#define SPLIT_size(j) ((j) == i ? sz : mm_node_size(old, (j) < i ? (j) : (j) - 1))
+    left = 0;
+    for (k = 0; k < count; k++) {
+        n = SPLIT_size(k) + sizeof(uint16_t);
+        if (k > 0 && left + n > total / 2)
+            break;
+        left += n;
+    }
+    if (k >= count)
+        k = count - 1;
+
+    if ((ret = mm_alloc(db, txn, 1, old->flags, &r)) != 0)
+        return ret;
+    p->nkeys = 0;
+    p->lower = PAGEHDR;
+    p->upper = db->psize;
+    for (j = 0; j < count; j++) {
+        src = SPLIT_node(j);
+        if (j < k)
+            mm_node_put(p, p->nkeys, src, SPLIT_size(j));
+        else
+            mm_node_put(r, r->nkeys, src, SPLIT_size(j));
+    }
+#undef SPLIT_node
+#undef SPLIT_size
+
+    mm_node_key(r, 0, &sep, &nsep);
+    memset(bnode, 0, sizeof(bnode));
+    b->child = r->pgno;
+    b->nkey = nsep;
+    memcpy(BRANCH_key(b), sep, nsep);
+
+    if (level > 0)
+        return mm_insert(db, txn, path, level - 1, path->idx[level - 1] + 1,
+                         bnode, NODE_ALIGN(sizeof(mmbranch) + nsep));
+
+    if (txn->depth >= MMDB_MAX_DEPTH)
+        return EINVAL;
+    if ((ret = mm_alloc(db, txn, 1, P_BRANCH, &root)) != 0)
+        return ret;
+    memset(bnode, 0, sizeof(mmbranch));
+    b->child = p->pgno;
+    mm_node_put(root, 0, bnode, NODE_ALIGN(sizeof(mmbranch)));
+    b->child = r->pgno;
+    b->nkey = nsep;
+    mm_node_put(root, 1, bnode, NODE_ALIGN(sizeof(mmbranch) + nsep));
+    txn->root = root->pgno;
+    txn->depth++;
+    return 0;
+}
+
+/* lets go of the run the data of a big node is in */
+static int mm_free_big(mmdb *db, engine_txn *txn, const mmleaf *n)
+{
+    pgno_t pg;
+
+    if (!(n->flags & N_BIG))
+        return 0;
+    memcpy(&pg, LEAF_data(n), sizeof(pg));
+    return mm_free(db, txn, pg, MM_page(db, pg)->npages);
+}
+
+static int mm_put(mmdb *db, engine_txn *txn, const void *key, const uint32_t nkey,
+                  const void *data, const uint32_t ndata)
+{
+    char node[MMDB_MAX_PAGE / 4];
+    mmleaf *n = (mmleaf *)node;
+    mmpage *p, *ov;
+    mmpath path;
+    uint32_t sz;
+    bool exact;
+    int ret;
+
+    if (nkey == 0 || nkey > MMDB_MAX_KEY)
+        return EINVAL;
+
+    memset(n, 0, sizeof(mmleaf));
+    n->nkey = nkey;
+    n->ndata = ndata;
+    memcpy(LEAF_key(n), key, nkey);
+    if (NODE_ALIGN(sizeof(mmleaf) + nkey + (uint64_t)ndata) > db->maxnode) {
+        if ((ret = mm_alloc(db, txn, (PAGEHDR + ndata + db->psize - 1) / db->psize, P_OVERFLOW, &ov)) != 0)
+            return ret;
+        memcpy((char *)ov + PAGEHDR, data, ndata);
+        n->flags = N_BIG;
+        memcpy(LEAF_data(n), &ov->pgno, sizeof(pgno_t));
+        sz = NODE_ALIGN(sizeof(mmleaf) + nkey + sizeof(pgno_t));
+    } else {
+        memcpy(LEAF_data(n), data, ndata);
+        sz = NODE_ALIGN(sizeof(mmleaf) + nkey + ndata);
+    }
+
+    if (txn->root == 0) {
+        if ((ret = mm_alloc(db, txn, 1, P_LEAF, &p)) != 0)
+            return ret;
+        txn->root = p->pgno;
+        txn->depth = 1;
+    }
+    if ((ret = mm_write_path(db, txn, key, nkey, &path, &exact)) != 0)
+        return ret;
+
+    p = path.pages[path.depth - 1];
+    if (exact) {
+        if ((ret = mm_free_big(db, txn, LEAF(p, path.idx[path.depth - 1]))) != 0)
+            return ret;
+        mm_node_del(p, path.idx[path.depth - 1]);
+    } else {
+        txn->entries++;
+    }
+    txn->mods++;
+    return mm_insert(db, txn, &path, path.depth - 1, path.idx[path.depth - 1], node, sz);
+}
+
+/* takes key out, and the pages it leaves empty; DB_NOTFOUND if it isn't there */
+static int mm_del(mmdb *db, engine_txn *txn, const void *key, const uint32_t nkey)
+{
+    mmpage *p;
+    mmpath path;
+    bool exact;
+    int level, ret;
+
+    if ((ret = mm_find(db, txn->root, key, nkey, &path, &exact)) != 0)
+        return ret;
+    if (!exact)
+        return DB_NOTFOUND;
+    if ((ret = mm_write_path(db, txn, key, nkey, &path, &exact)) != 0)
+        return ret;
+
+    level = path.depth - 1;
+    p = path.pages[level];
+    if ((ret = mm_free_big(db, txn, LEAF(p, path.idx[level]))) != 0)
+        return ret;
+    mm_node_del(p, path.idx[level]);
+    txn->entries--;
+    txn->mods++;
+
+    while (path.pages[level]->nkeys == 0) {
+        if ((ret = mm_free(db, txn, path.pages[level]->pgno, 1)) != 0)
+            return ret;
+        if (level == 0) {
+            txn->root = 0;
+            txn->depth = 0;
+            return 0;
+        }
+        level--;
+        mm_node_del(path.pages[level], path.idx[level]);
+    }
+
+    /* a root with one child is left out */
+    for (p = MM_page(db, txn->root); (p->flags & P_BRANCH) && p->nkeys == 1; p = MM_page(db, txn->root)) {
+        if ((ret = mm_free(db, txn, p->pgno, 1)) != 0)
+            return ret;
+        txn->root = BRANCH(p, 0)->child;
+        txn->depth--;
+    }
+    return 0;
+}
+
+static int mmdb_txn_begin(const int part, engine_txn **txnp)
+{
+    mmdb *db = mdbs[part];
+    engine_txn *txn = &db->txn;
+
+    pthread_mutex_lock(&db->wlock);
+    mm_reclaim(db);
+    txn->db = db;
+    txn->txnid = db->snap.txnid + 1;
+    txn->root = db->snap.root;
+    txn->depth = db->snap.depth;
+    txn->entries = db->snap.entries;
+    txn->alloc.n = 0;
+    txn->freed.n = 0;
+    txn->mods = 0;
+    txn->nosync = false;
+    *txnp = txn;
+    return 0;
+}
+
+static int mmdb_txn_begin_nosync(const int part, engine_txn **txnp)
+{
+    mmdb_txn_begin(part, txnp);
+    (*txnp)->nosync = true;
+    return 0;
+}
+
+static void mmdb_txn_abort(engine_txn *txn)
+{
+    mmdb *db = txn->db;
+
+    if (txn->alloc.n > 0) {
+        qsort(txn->alloc.p, txn->alloc.n, sizeof(pgno_t), pgno_cmp);
+        /* out of memory loses the pages until the next start */
+        (void)pglist_merge(&db->free, txn->alloc.p, txn->alloc.n);
+    }
+    pthread_mutex_unlock(&db->wlock);
+}
+
+/* the meta page for snap, over the older of the two */
+static int mm_write_meta(mmdb *db, const mmsnap *snap, const pgno_t freelist, const uint32_t nfree)
+{
+    int idx = db->metas[0] <= db->metas[1] ? 0 : 1;
+    mmmeta meta;
+    int ret;
+
+    memset(&meta, 0, sizeof(meta));
+    meta.h.txnid = snap->txnid;
+    meta.h.pgno = idx;
+    meta.h.flags = P_META;
+    meta.magic = MMDB_MAGIC;
+    meta.version = MMDB_VERSION;
+    meta.psize = db->psize;
+    meta.root = snap->root;
+    meta.npages = db->npages;
+    meta.freelist = freelist;
+    meta.nfree = nfree;
+    meta.depth = snap->depth;
+    meta.entries = snap->entries;
+    meta.sum = hash(&meta, offsetof(mmmeta, sum), 0);
+    memcpy(MM_page(db, idx), &meta, sizeof(meta));
+    if ((ret = mm_msync(db, idx, 1)) != 0)
+        return ret;
+    db->metas[idx] = snap->txnid;
+    db->rescan = true;
+    return 0;
+}
+
+/* syncs the pages txn wrote, a run at a time */
+static int mm_sync_txn(mmdb *db, engine_txn *txn)
+{
+    uint32_t i, j;
+    int ret;
+
+    qsort(txn->alloc.p, txn->alloc.n, sizeof(pgno_t), pgno_cmp);
+    for (i = 0; i < txn->alloc.n; i = j) {
+        for (j = i + 1; j < txn->alloc.n && txn->alloc.p[j] == txn->alloc.p[j - 1] + 1; j++)
+            ;
+        if ((ret = mm_msync(db, txn->alloc.p[i], txn->alloc.p[j - 1] - txn->alloc.p[i] + 1)) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int mmdb_txn_commit(engine_txn *txn)
+{
+    mmdb *db = txn->db;
+    mmsnap snap;
+    uint32_t i;
+    int ret;
+
+    if (txn->mods == 0) {
+        mmdb_txn_abort(txn);
+        return 0;
+    }
+    if (mmplist_reserve(&db->pending, txn->freed.n) != 0) {
+        mmdb_txn_abort(txn);
+        return ENOMEM;
+    }
+
+    snap.root = txn->root;
+    snap.depth = txn->depth;
+    snap.txnid = txn->txnid;
+    snap.entries = txn->entries;
+    if (!bdb_settings.txn_nosync && !txn->nosync) {
+        if ((ret = mm_sync_txn(db, txn)) != 0 || (ret = mm_write_meta(db, &snap, 0, 0)) != 0) {
+            mmdb_txn_abort(txn);
+            return ret;
+        }
+    } else {
+        for (i = 0; i < txn->alloc.n; i++) {
+            if (txn->alloc.p[i] < db->dirty_lo)
+                db->dirty_lo = txn->alloc.p[i];
+            if (txn->alloc.p[i] >= db->dirty_hi)
+                db->dirty_hi = txn->alloc.p[i] + 1;
+        }
+    }
+    mm_publish(db, &snap);
+
+    for (i = 0; i < txn->freed.n; i++) {
+        txn->freed.p[i].txnid = txn->txnid;
+        db->pending.p[db->pending.n++] = txn->freed.p[i];
+    }
+    pthread_mutex_unlock(&db->wlock);
+    return 0;
+}
+
+static int mmdb_get(const int part, engine_txn *txn, const void *key, const u_int32_t nkey,
+                    void *buf, const u_int32_t ulen, u_int32_t *size, const int flags)
+{
+    mmdb *db = mdbs[part];
+    mmsnap snap;
+    mmpath path;
+    mmleaf *n;
+    bool exact;
+    int slot = 0, ret;
+
+    if (txn == NULL) {
+        slot = mm_read_begin(db, &snap);
+    } else {
+        snap.root = txn->root;
+    }
+    if ((ret = mm_find(db, snap.root, key, nkey, &path, &exact)) == 0 && !exact)
+        ret = DB_NOTFOUND;
+    if (ret == 0) {
+        n = LEAF(path.pages[path.depth - 1], path.idx[path.depth - 1]);
+        if (n->ndata > ulen && !(flags & ENGINE_PARTIAL)) {
+            *size = n->ndata;
+            ret = DB_BUFFER_SMALL;
+        } else {
+            *size = n->ndata < ulen ? n->ndata : ulen;
+            memcpy(buf, mm_node_data(db, n), *size);
+        }
+    }
+    if (txn == NULL)
+        mm_read_end(db, slot);
+    return ret;
+}
+
+static int mmdb_put(const int part, engine_txn *txn, const void *key, const u_int32_t nkey,
+                    const void *data, const u_int32_t size)
+{
+    engine_txn *t = txn;
+    int ret;
+
+    if (txn == NULL)
+        mmdb_txn_begin(part, &t);
+    ret = mm_put(t->db, t, key, nkey, data, size);
+    if (txn == NULL) {
+        if (ret == 0)
+            ret = mmdb_txn_commit(t);
+        else
+            mmdb_txn_abort(t);
+    }
+    return ret;
+}
+
+static int mmdb_del(const int part, engine_txn *txn, const void *key, const u_int32_t nkey)
+{
+    engine_txn *t = txn;
+    int ret;
+
+    if (txn == NULL)
+        mmdb_txn_begin(part, &t);
+    ret = mm_del(t->db, t, key, nkey);
+    if (txn == NULL) {
+        if (ret == 0)
+            ret = mmdb_txn_commit(t);
+        else
+            mmdb_txn_abort(t);
+    }
+    return ret;
+}
+
+static int mmdb_cursor(const int part, engine_txn *txn, const u_int32_t bulk, engine_cursor **cp)
+{
+    engine_cursor *c;
+    mmsnap snap;
+
+    /* records are read in place, there is nothing to read ahead */
+    if ((c = calloc(1, sizeof(engine_cursor))) == NULL)
+        return ENOMEM;
+    c->db = mdbs[part];
+    c->txn = txn;
+    if (txn == NULL) {
+        c->slot = mm_read_begin(c->db, &snap);
+        c->root = snap.root;
+    }
+    *cp = c;
+    return 0;
+}
+
+/* moves the cursor to the first record of the next leaf */
+static int mm_next_leaf(engine_cursor *c)
+{
+    mmpath *path = &c->path;
+    bool exact;
+    int level;
+
+    for (level = path->depth - 2; level >= 0; level--) {
+        if (path->idx[level] + 1 < path->pages[level]->nkeys) {
+            path->idx[level]++;
+            path->pages[level + 1] = MM_page(c->db, BRANCH(path->pages[level], path->idx[level])->child);
+            return mm_walk_down(c->db, NULL, path, level + 1, NULL, 0, &exact);
+        }
+    }
+    return DB_NOTFOUND;
+}
+
+/* places the cursor on key, or on the first record after it with after */
+static int mm_seek(engine_cursor *c, const void *key, const u_int32_t nkey, const bool range,
+                   const bool after)
+{
+    mmpath *path = &c->path;
+    bool exact;
+    int ret;
+
+    if ((ret = mm_find(c->db, c->txn != NULL ? c->txn->root : c->root, key, nkey, path, &exact)) != 0)
+        return ret;
+    if (path->depth == 0 || (!range && !exact))
+        return DB_NOTFOUND;
+    if (exact && after)
+        path->idx[path->depth - 1]++;
+    if (path->idx[path->depth - 1] >= path->pages[path->depth - 1]->nkeys)
+        return mm_next_leaf(c);
+    return 0;
+}
+
+static int mmdb_c_get(engine_cursor *c, const int move, const void *key, const u_int32_t nkey,
+                      const void **rkey, u_int32_t *rnkey, const void **rdata, u_int32_t *rndata)
+{
+    mmpath *path = &c->path;
+    bool exact;
+    mmleaf *n;
+    int ret;
+
+    switch (move) {
+    case ENGINE_SET:
+    case ENGINE_SET_RANGE:
+        ret = mm_seek(c, key, nkey, move == ENGINE_SET_RANGE, false);
+        break;
+    case ENGINE_NEXT:
+        if (c->on && c->txn != NULL && c->mods != c->txn->mods) {
+            /* the tree changed under it, go on from the key it was on */
+            ret = mm_seek(c, c->key, c->nkey, true, true);
+            break;
+        }
+        if (c->on) {
+            if (++path->idx[path->depth - 1] < path->pages[path->depth - 1]->nkeys)
+                ret = 0;
+            else
+                ret = mm_next_leaf(c);
+            break;
+        }
+        /* NEXT on a new cursor is FIRST */
+        /* fall through */
+    case ENGINE_FIRST:
+    default:
+        if ((ret = mm_find(c->db, c->txn != NULL ? c->txn->root : c->root, NULL, 0, path, &exact)) == 0
+            && path->depth == 0)
+            ret = DB_NOTFOUND;
+        break;
+    }
+    if (ret != 0)
+        return ret;
+
+    c->on = true;
+    n = LEAF(path->pages[path->depth - 1], path->idx[path->depth - 1]);
+    *rkey = LEAF_key(n);
+    *rnkey = n->nkey;
+    *rdata = mm_node_data(c->db, n);
+    *rndata = n->ndata;
+    if (c->txn != NULL) {
+        memcpy(c->key, LEAF_key(n), n->nkey);
+        c->nkey = n->nkey;
+        c->mods = c->txn->mods;
+    }
+    return 0;
+}
+
+static int mmdb_c_put(engine_cursor *c, const void *data, const u_int32_t size)
+{
+    if (c->txn == NULL || !c->on)
+        return EINVAL;
+    return mm_put(c->db, c->txn, c->key, c->nkey, data, size);
+}
+
+static int mmdb_c_del(engine_cursor *c)
+{
+    if (c->txn == NULL || !c->on)
+        return EINVAL;
+    return mm_del(c->db, c->txn, c->key, c->nkey);
+}
+
+static void mmdb_c_close(engine_cursor *c)
+{
+    if (c->txn == NULL)
+        mm_read_end(c->db, c->slot);
+    free(c);
+}
+
+/*
+ * Writes a meta page for the last commit of a partition, after the pages
+ * written since the last time; only -N leaves anything to do. The sync
+ * is done without the lock, metas[2] keeps the pages of the commit from
+ * being used again meanwhile. Adds the bytes synced to *bytes, and counts
+ * the meta pages written in *done.
+ */
+static int mm_checkpoint_one(mmdb *db, uint64_t *bytes, int *done)
+{
+    mmsnap snap;
+    pgno_t lo, hi;
+    int ret = 0;
+
+    pthread_mutex_lock(&db->wlock);
+    snap = db->snap;
+    lo = db->dirty_lo;
+    hi = db->dirty_hi;
+    if (snap.txnid == (db->metas[0] > db->metas[1] ? db->metas[0] : db->metas[1])) {
+        pthread_mutex_unlock(&db->wlock);
+        return 0;
+    }
+    db->metas[2] = snap.txnid;
+    db->dirty_lo = (pgno_t)-1;
+    db->dirty_hi = 0;
+    pthread_mutex_unlock(&db->wlock);
+
+    if (hi > lo) {
+        ret = mm_msync(db, lo, hi - lo);
+        *bytes += (uint64_t)(hi - lo) * db->psize;
+    }
+    pthread_mutex_lock(&db->wlock);
+    if (ret == 0 && (ret = mm_write_meta(db, &snap, 0, 0)) == 0)
+        (*done)++;
+    if (ret != 0) {
+        if (lo < db->dirty_lo)
+            db->dirty_lo = lo;
+        if (hi > db->dirty_hi)
+            db->dirty_hi = hi;
+    }
+    db->metas[2] = 0;
+    db->rescan = true;
+    pthread_mutex_unlock(&db->wlock);
+    return ret;
+}
+
+static int mm_checkpoint(const int part, uint64_t *bytes, int *done)
+{
+    int i, ret;
+
+    *bytes = 0;
+    *done = 0;
+    for (i = (part < 0 ? 0 : part); i < (part < 0 ? bdb_settings.db_parts : part + 1); i++) {
+        if ((ret = mm_checkpoint_one(mdbs[i], bytes, done)) != 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int mmdb_checkpoint(const int part)
+{
+    uint64_t bytes;
+    int done;
+
+    return mm_checkpoint(part, &bytes, &done);
+}
+
+/* with -N, a checkpoint every chkpoint_val seconds */
+static void *mmdb_chkpoint_thread(void *arg)
+{
+    time_t last = time(NULL);
+    uint64_t start, bytes;
+    int done, ret;
+
+    if (settings.verbose > 1)
+        engine_err(0, "checkpoint thread created: %lu, every %d seconds",
+                   (u_long)pthread_self(), bdb_settings.chkpoint_val);
+    while (!daemon_quit) {
+        sleep(MAINT_TICK);
+        if (time(NULL) - last < bdb_settings.chkpoint_val)
+            continue;
+        last = time(NULL);
+        start = latency_now();
+        if ((ret = mm_checkpoint(-1, &bytes, &done)) != 0) {
+            engine_err(ret, "checkpoint thread");
+            continue;
+        }
+        if (done == 0)
+            continue;
+        maint_stats.last_ckp_usec = latency_now() - start;
+        maint_stats.last_ckp_bytes = bytes;
+        maint_stats.checkpoints++;
+        if (settings.verbose > 1)
+            engine_err(0, "checkpoint thread: a checkpoint is done, %llu kbytes, %llu ms",
+                       (unsigned long long)(bytes / 1024),
+                       (unsigned long long)(maint_stats.last_ckp_usec / 1000));
+    }
+    return (NULL);
+}
+
+static int mm_meta_valid(mmdb *db, const mmmeta *m, const int idx, const off_t size)
+{
+    return m->magic == MMDB_MAGIC && m->version == MMDB_VERSION && m->h.pgno == idx
+        && m->h.flags == P_META && m->sum == hash(m, offsetof(mmmeta, sum), 0)
+        && m->psize >= MMDB_MIN_PAGE && m->psize <= MMDB_MAX_PAGE
+        && m->npages >= 2 && (off_t)m->npages * m->psize <= size && m->root < m->npages;
+}
+
+/* marks the pages the tree at pg is made of, EINVAL if it is not a tree */
+static int mm_mark(mmdb *db, uint8_t *used, const pgno_t pg, const int depth)
+{
+    mmpage *p;
+    mmleaf *n;
+    pgno_t ov, k;
+    unsigned int i;
+    int ret;
+
+#define MARK(pg) (used[(pg) / 8] |= 1 << ((pg) % 8))
+#define MARKED(pg) (used[(pg) / 8] & (1 << ((pg) % 8)))
+    if (pg < 2 || pg >= db->npages || depth >= MMDB_MAX_DEPTH || MARKED(pg))
+        return EINVAL;
+    MARK(pg);
+    p = MM_page(db, pg);
+    for (i = 0; i < p->nkeys; i++) {
+        if (p->flags & P_BRANCH) {
+            if ((ret = mm_mark(db, used, BRANCH(p, i)->child, depth + 1)) != 0)
+                return ret;
+        } else if ((n = LEAF(p, i))->flags & N_BIG) {
+            memcpy(&ov, LEAF_data(n), sizeof(ov));
+            if (ov < 2 || ov >= db->npages || ov + MM_page(db, ov)->npages > db->npages)
+                return EINVAL;
+            for (k = ov; k < ov + MM_page(db, ov)->npages; k++)
+                MARK(k);
+        }
+    }
+#undef MARK
+#undef MARKED
+    return 0;
+}
+
+/* the free pages: saved at a clean close, or what the tree doesn't use */
+static int mm_load_free(mmdb *db, const mmmeta *m, const off_t size)
+{
+    uint8_t *used;
+    pgno_t pg;
+    int ret;
+
+    if (m->freelist != 0 && (off_t)m->freelist * db->psize + (off_t)m->nfree * sizeof(pgno_t) <= size) {
+        if (pglist_reserve(&db->free, m->nfree) != 0)
+            return ENOMEM;
+        memcpy(db->free.p, MM_page(db, m->freelist), m->nfree * sizeof(pgno_t));
+        db->free.n = m->nfree;
+        qsort(db->free.p, db->free.n, sizeof(pgno_t), pgno_cmp);
+        return 0;
+    }
+
+    if ((used = calloc(db->npages / 8 + 1, 1)) == NULL)
+        return ENOMEM;
+    used[0] = 0x03;
+    ret = m->root != 0 ? mm_mark(db, used, m->root, 0) : 0;
+    for (pg = 2; ret == 0 && pg < db->npages; pg++) {
+        if (!(used[pg / 8] & (1 << (pg % 8))))
+            ret = pglist_add(&db->free, pg);
+    }
+    free(used);
+    return ret;
+}
+
+static mmdb *mm_open_one(const int part)
+{
+    char name[DB_PART_NAME_MAX], path[DB_PART_NAME_MAX * 2];
+    mmmeta *m0, *m1, *m;
+    struct stat st;
+    mmsnap snap;
+    mmdb *db;
+    uint32_t psize;
+    int ret;
+
+    bdb_part_file(part, name, sizeof(name));
+    if (name[0] == '/')
+        snprintf(path, sizeof(path), "%s", name);
+    else
+        snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, name);
+
+    if ((ret = posix_memalign((void **)&db, CACHE_LINE_SIZE, sizeof(mmdb))) != 0) {
+        fprintf(stderr, "mmdb open %s: %s\n", path, strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    memset(db, 0, sizeof(mmdb));
+    pthread_mutex_init(&db->wlock, NULL);
+    pthread_mutex_init(&db->ovf_lock, NULL);
+    db->dirty_lo = (pgno_t)-1;
+
+    if ((db->fd = open(path, O_RDWR | O_CREAT, 0640)) == -1
+        || flock(db->fd, LOCK_EX | LOCK_NB) != 0 || fstat(db->fd, &st) != 0) {
+        fprintf(stderr, "mmdb open %s: %s\n", path,
+                errno == EWOULDBLOCK ? "in use by another process" : strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if ((db->map = mmap(NULL, MMDB_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE,
+                        db->fd, 0)) == MAP_FAILED) {
+        fprintf(stderr, "mmdb mmap %s: %s\n", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    if (st.st_size == 0) {
+        /* a new file: an empty tree as of txnid 1 */
+        db->psize = bdb_settings.page_size;
+        db->fpages = 0;
+        db->npages = 2;
+        if ((ret = mm_grow(db, MMDB_GROW_PAGES)) != 0) {
+            fprintf(stderr, "mmdb create %s: %s\n", path, strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+        memset(&snap, 0, sizeof(snap));
+        snap.txnid = 1;
+        if ((ret = mm_write_meta(db, &snap, 0, 0)) != 0) {
+            fprintf(stderr, "mmdb create %s: %s\n", path, strerror(ret));
+            exit(EXIT_FAILURE);
+        }
+        st.st_size = (off_t)db->fpages * db->psize;
+    }
+
+    /* page 0 tells the page size, else look for page 1 with each */
+    m0 = (mmmeta *)db->map;
+    m1 = NULL;
+    if (st.st_size >= sizeof(mmmeta) && mm_meta_valid(db, m0, 0, st.st_size)) {
+        if (st.st_size >= 2 * (off_t)m0->psize)
+            m1 = (mmmeta *)(db->map + m0->psize);
+    } else {
+        m0 = NULL;
+        for (psize = MMDB_MIN_PAGE; psize <= MMDB_MAX_PAGE && m1 == NULL; psize *= 2) {
+            if (st.st_size >= 2 * (off_t)psize && mm_meta_valid(db, (mmmeta *)(db->map + psize), 1, st.st_size)
+                && ((mmmeta *)(db->map + psize))->psize == psize)
+                m1 = (mmmeta *)(db->map + psize);
+        }
+    }
+    if (m1 != NULL && (!mm_meta_valid(db, m1, 1, st.st_size) || (m0 != NULL && m1->psize != m0->psize)))
+        m1 = NULL;
+    if (m0 == NULL && m1 == NULL) {
+        fprintf(stderr, "mmdb open %s: not a file of the mmap engine\n", path);
+        exit(EXIT_FAILURE);
+    }
+    m = (m1 == NULL || (m0 != NULL && m0->h.txnid > m1->h.txnid)) ? m0 : m1;
+
+    db->psize = m->psize;
+    db->maxnode = ((db->psize - PAGEHDR) / 4 - sizeof(uint16_t)) & ~3;
+    db->fpages = st.st_size / db->psize;
+    db->npages = m->npages;
+    db->metas[0] = m0 != NULL ? m0->h.txnid : 0;
+    db->metas[1] = m1 != NULL ? m1->h.txnid : 0;
+    if ((db->scratch = malloc(db->psize)) == NULL || (ret = mm_load_free(db, m, st.st_size)) != 0) {
+        fprintf(stderr, "mmdb open %s: %s\n", path,
+                db->scratch == NULL ? strerror(ENOMEM) : ret == EINVAL ? "the tree is damaged" : strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+
+    /* a meta page without the free list, which new pages may overwrite now */
+    snap.root = m->root;
+    snap.depth = m->depth;
+    snap.txnid = m->h.txnid + 1;
+    snap.entries = m->entries;
+    if ((ret = mm_write_meta(db, &snap, 0, 0)) != 0) {
+        fprintf(stderr, "mmdb open %s: %s\n", path, strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+    db->snap = snap;
+    db->txn.db = db;
+    return db;
+}
+
+static void mmdb_open(void)
+{
+    int i;
+
+    if (bdb_settings.page_size < MMDB_MIN_PAGE || bdb_settings.page_size > MMDB_MAX_PAGE
+        || (bdb_settings.page_size & (bdb_settings.page_size - 1)) != 0) {
+        fprintf(stderr, "the mmap engine needs a page size that is a power of two from %d to %d\n",
+                MMDB_MIN_PAGE, MMDB_MAX_PAGE);
+        exit(EXIT_FAILURE);
+    }
+    if (mkdir(bdb_settings.env_home, 0750) != 0 && errno != EEXIST) {
+        fprintf(stderr, "mkdir %s: %s\n", bdb_settings.env_home, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    bdb_check_parts();
+    pthread_key_create(&mm_slot_key, NULL);
+    mm_syspage = sysconf(_SC_PAGESIZE);
+
+    for (i = 0; i < bdb_settings.db_parts; i++)
+        mdbs[i] = mm_open_one(i);
+    /* an old file keeps the page size it was made with */
+    bdb_settings.page_size = mdbs[0]->psize;
+    /* every commit does its own sync */
+    bdb_settings.gcommit_ops = 0;
+
+    if (bdb_settings.txn_nosync && bdb_settings.chkpoint_val > 0) {
+        if ((errno = pthread_create(&mmc_ptid, NULL, mmdb_chkpoint_thread, NULL)) != 0) {
+            fprintf(stderr, "failed spawning checkpoint thread: %s\n", strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+/*
+ * Saves the free pages past the end of the tree and writes a meta page
+ * pointing at them, so the next start need not look for them. The write
+ * lock stays taken; the map stays too, for readers still on their way.
+ */
+static void mmdb_close(void)
+{
+    uint64_t bytes = 0;
+    mmsnap snap;
+    pgno_t n;
+    uint32_t i;
+    int part, done = 0, ret;
+    mmdb *db;
+
+    for (part = 0; part < bdb_settings.db_parts; part++) {
+        if ((db = mdbs[part]) == NULL)
+            continue;
+        (void)mm_checkpoint_one(db, &bytes, &done);
+        pthread_mutex_lock(&db->wlock);
+        db->reclaim.n = 0;
+        ret = pglist_reserve(&db->reclaim, db->pending.n);
+        for (i = 0; ret == 0 && i < db->pending.n; i++)
+            db->reclaim.p[db->reclaim.n++] = db->pending.p[i].pgno;
+        if (ret == 0) {
+            qsort(db->reclaim.p, db->reclaim.n, sizeof(pgno_t), pgno_cmp);
+            ret = pglist_merge(&db->free, db->reclaim.p, db->reclaim.n);
+        }
+        n = (db->free.n * sizeof(pgno_t) + db->psize - 1) / db->psize;
+        if (ret == 0 && db->free.n > 0 && db->npages + n > db->fpages)
+            ret = mm_grow(db, db->npages + n);
+        if (ret == 0 && db->free.n > 0) {
+            memcpy(MM_page(db, db->npages), db->free.p, db->free.n * sizeof(pgno_t));
+            ret = mm_msync(db, db->npages, n);
+        }
+        snap = db->snap;
+        snap.txnid++;
+        if (ret == 0)
+            ret = mm_write_meta(db, &snap, db->free.n > 0 ? db->npages : 0, db->free.n);
+        if (ret != 0)
+            fprintf(stderr, "mmdb close of partition %d: %s\n", part, strerror(ret));
+        mdbs[part] = NULL;
+    }
+    fprintf(stderr, "mmdb close: OK\n");
+}
+
+static int mmdb_stats(const int part, char *buf)
+{
+    mmdb *db = mdbs[part];
+    mmsnap snap;
+    char *pos = buf;
+    pgno_t npages, nfree;
+
+    pthread_mutex_lock(&db->wlock);
+    snap = db->snap;
+    npages = db->npages;
+    nfree = db->free.n + db->pending.n;
+    pthread_mutex_unlock(&db->wlock);
+
+    pos += sprintf(pos, "STAT part%d_keys %llu\r\n", part, (unsigned long long)snap.entries);
+    pos += sprintf(pos, "STAT part%d_pages %u\r\n", part, npages);
+    pos += sprintf(pos, "STAT part%d_free_pages %u\r\n", part, nfree);
+    pos += sprintf(pos, "STAT part%d_txnid %llu\r\n", part, (unsigned long long)snap.txnid);
+    return pos - buf;
+}
+
+const struct engine mmdb_engine = {
+    "mmap",
+    mmdb_open,
+    mmdb_close,
+    mmdb_txn_begin,
+    mmdb_txn_begin_nosync,
+    mmdb_txn_commit,
+    mmdb_txn_abort,
+    mmdb_get,
+    mmdb_put,
+    mmdb_del,
+    mmdb_cursor,
+    mmdb_c_get,
+    mmdb_c_put,
+    mmdb_c_del,
+    mmdb_c_close,
+    mmdb_checkpoint,
+    mmdb_stats
+};
@@ -0,0 +1,99 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+/*
+ * Packet layout of the memcache binary protocol, as spoken by memcached
+ * 1.3 and later. Only the parts memcachedb implements are defined here.
+ * All multi-byte fields are in network byte order on the wire.
+ */
+#ifndef PROTOCOL_BINARY_H
+#define PROTOCOL_BINARY_H
+
+#define PROTOCOL_BINARY_REQ 0x80
+#define PROTOCOL_BINARY_RES 0x81
+
+typedef enum {
+    PROTOCOL_BINARY_RESPONSE_SUCCESS = 0x00,
+    PROTOCOL_BINARY_RESPONSE_KEY_ENOENT = 0x01,
+    PROTOCOL_BINARY_RESPONSE_KEY_EEXISTS = 0x02,
+    PROTOCOL_BINARY_RESPONSE_E2BIG = 0x03,
+    PROTOCOL_BINARY_RESPONSE_EINVAL = 0x04,
+    PROTOCOL_BINARY_RESPONSE_NOT_STORED = 0x05,
+    PROTOCOL_BINARY_RESPONSE_DELTA_BADVAL = 0x06,
+    PROTOCOL_BINARY_RESPONSE_UNKNOWN_COMMAND = 0x81,
+    PROTOCOL_BINARY_RESPONSE_ENOMEM = 0x82,
+    PROTOCOL_BINARY_RESPONSE_NOT_SUPPORTED = 0x83,
+    PROTOCOL_BINARY_RESPONSE_EINTERNAL = 0x84
+} protocol_binary_response_status;
+
+typedef enum {
+    PROTOCOL_BINARY_CMD_GET = 0x00,
+    PROTOCOL_BINARY_CMD_SET = 0x01,
+    PROTOCOL_BINARY_CMD_ADD = 0x02,
+    PROTOCOL_BINARY_CMD_REPLACE = 0x03,
+    PROTOCOL_BINARY_CMD_DELETE = 0x04,
+    PROTOCOL_BINARY_CMD_INCREMENT = 0x05,
+    PROTOCOL_BINARY_CMD_DECREMENT = 0x06,
+    PROTOCOL_BINARY_CMD_QUIT = 0x07,
+    PROTOCOL_BINARY_CMD_FLUSH = 0x08,
+    PROTOCOL_BINARY_CMD_GETQ = 0x09,
+    PROTOCOL_BINARY_CMD_NOOP = 0x0a,
+    PROTOCOL_BINARY_CMD_VERSION = 0x0b,
+    PROTOCOL_BINARY_CMD_GETK = 0x0c,
+    PROTOCOL_BINARY_CMD_GETKQ = 0x0d,
+    PROTOCOL_BINARY_CMD_APPEND = 0x0e,
+    PROTOCOL_BINARY_CMD_PREPEND = 0x0f,
+    PROTOCOL_BINARY_CMD_SETQ = 0x11,
+    PROTOCOL_BINARY_CMD_ADDQ = 0x12,
+    PROTOCOL_BINARY_CMD_REPLACEQ = 0x13,
+    PROTOCOL_BINARY_CMD_DELETEQ = 0x14,
+    PROTOCOL_BINARY_CMD_INCREMENTQ = 0x15,
+    PROTOCOL_BINARY_CMD_DECREMENTQ = 0x16,
+    PROTOCOL_BINARY_CMD_QUITQ = 0x17,
+    PROTOCOL_BINARY_CMD_FLUSHQ = 0x18,
+    PROTOCOL_BINARY_CMD_APPENDQ = 0x19,
+    PROTOCOL_BINARY_CMD_PREPENDQ = 0x1a
+} protocol_binary_command;
+
+/* the 24 byte header in front of every request */
+typedef union {
+    struct {
+        uint8_t magic;
+        uint8_t opcode;
+        uint16_t keylen;
+        uint8_t extlen;
+        uint8_t datatype;
+        uint16_t reserved;
+        uint32_t bodylen;
+        uint32_t opaque;
+        uint64_t cas;
+    } request;
+    uint8_t bytes[24];
+} protocol_binary_request_header;
+
+/* the 24 byte header in front of every response */
+typedef union {
+    struct {
+        uint8_t magic;
+        uint8_t opcode;
+        uint16_t keylen;
+        uint8_t extlen;
+        uint8_t datatype;
+        uint16_t status;
+        uint32_t bodylen;
+        uint32_t opaque;
+        uint64_t cas;
+    } response;
+    uint8_t bytes[24];
+} protocol_binary_response_header;
+
+#endif /* PROTOCOL_BINARY_H */
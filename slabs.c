@@ -0,0 +1,347 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  The source code of Memcachedb is most based on Memcached:
+ *
+ *      http://danga.com/memcached/
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ */
+
+/*
+ * Slabs memory allocation for item buffers, in the style of memcached.
+ *
+ * Buffers are handed out from size classes that grow geometrically by
+ * SLAB_FACTOR. Each class carves 1MB pages into equal chunks and keeps its
+ * free chunks in a shared pool. Every thread also keeps a small cache per
+ * class, refilled from and drained back to the shared pool in batches, so
+ * the common alloc/free pair takes no lock at all.
+ *
+ * Every chunk starts with a small header holding its class id, so a buffer
+ * can be freed without knowing how big it was asked to be. Requests above
+ * the largest class go to malloc() with the same header and class id 0.
+ */
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define POWER_SMALLEST      1
+#define POWER_LARGEST       64
+#define CHUNK_ALIGN_BYTES   8
+#define SLAB_CHUNK_MIN      64
+#define SLAB_FACTOR         1.25
+#define SLAB_PAGE_SIZE      (1024 * 1024)
+#define SLAB_CHUNK_MAX      (SLAB_PAGE_SIZE / 2)
+
+/* per-thread cache: max chunks held per class, and chunks moved at once */
+#define TCACHE_MAX          32
+#define TCACHE_BATCH        16
+
+typedef struct {
+    uint32_t clsid;         /* 0 for malloc()ed buffers */
+    uint32_t size;          /* requested size, only kept for malloc()ed ones */
+} slab_header;
+
+#define SLAB_HEADER_SIZE    ((sizeof(slab_header) + CHUNK_ALIGN_BYTES - 1) & ~(CHUNK_ALIGN_BYTES - 1))
+
+typedef struct {
+    size_t size;            /* size of each chunk, header included */
+    unsigned int perslab;   /* how many chunks per page */
+
+    void **slots;           /* list of free chunks in the shared pool */
+    unsigned int sl_curr;   /* number of chunks in slots */
+
+    unsigned int pages;     /* pages carved for this class */
+    uint64_t refills;       /* batches handed out to thread caches */
+    uint64_t drains;        /* batches given back by thread caches */
+
+    pthread_mutex_t lock;
+} slabclass_t;
+
+typedef struct {
+    void *chunks[POWER_LARGEST + 1][TCACHE_MAX];
+    int nchunks[POWER_LARGEST + 1];
+} slab_tcache;
+
+static slabclass_t slabclass[POWER_LARGEST + 1];
+static int power_largest;
+static pthread_key_t tcache_key;
+
+/* malloc()ed buffers above the largest class */
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t large_allocs;
+static uint64_t large_bytes;
+static uint64_t total_malloced;
+
+static void tcache_destroy(void *arg);
+
+/*
+ * Figures out which slab class is required to store an item of a given
+ * size, header included. Returns 0 if it is too big for any class.
+ */
+static unsigned int slabs_clsid(const size_t size) {
+    unsigned int res = POWER_SMALLEST;
+
+    if (size == 0)
+        return 0;
+    while (size > slabclass[res].size)
+        if (res++ == power_largest)     /* won't fit in the biggest slab */
+            return 0;
+    return res;
+}
+
+void slabs_init(void) {
+    int i = POWER_SMALLEST - 1;
+    size_t size = SLAB_CHUNK_MIN;
+
+    memset(slabclass, 0, sizeof(slabclass));
+
+    while (++i < POWER_LARGEST && size <= SLAB_CHUNK_MAX) {
+        /* Make sure items are always n-byte aligned */
+        if (size % CHUNK_ALIGN_BYTES)
+            size += CHUNK_ALIGN_BYTES - (size % CHUNK_ALIGN_BYTES);
+
+        slabclass[i].size = size;
+        slabclass[i].perslab = SLAB_PAGE_SIZE / size;
+        pthread_mutex_init(&slabclass[i].lock, NULL);
+        if (settings.verbose > 1) {
+            fprintf(stderr, "slab class %3d: chunk size %6u perslab %5u\n",
+                    i, (unsigned int)slabclass[i].size, slabclass[i].perslab);
+        }
+        size *= SLAB_FACTOR;
+    }
+    power_largest = i - 1;
+
+    if ((errno = pthread_key_create(&tcache_key, tcache_destroy)) != 0) {
+        perror("pthread_key_create()");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/*
+ * Carves a new page for a class. Call with the class lock held.
+ */
+static int do_slabs_newslab(slabclass_t *p) {
+    char *ptr;
+    unsigned int i;
+    void **new_slots;
+
+    if ((ptr = malloc(SLAB_PAGE_SIZE)) == NULL)
+        return -1;
+
+    /* the pool must be able to hold every chunk of the class at once */
+    new_slots = realloc(p->slots, sizeof(void *) * (p->pages + 1) * p->perslab);
+    if (new_slots == NULL) {
+        free(ptr);
+        return -1;
+    }
+    p->slots = new_slots;
+
+    for (i = 0; i < p->perslab; i++) {
+        p->slots[p->sl_curr++] = ptr + i * p->size;
+    }
+    p->pages++;
+
+    pthread_mutex_lock(&large_lock);
+    total_malloced += SLAB_PAGE_SIZE;
+    pthread_mutex_unlock(&large_lock);
+    return 0;
+}
+
+static slab_tcache *tcache_get(void) {
+    slab_tcache *tc = pthread_getspecific(tcache_key);
+
+    if (tc == NULL) {
+        tc = calloc(1, sizeof(slab_tcache));
+        if (tc == NULL)
+            return NULL;
+        if (pthread_setspecific(tcache_key, tc) != 0) {
+            free(tc);
+            return NULL;
+        }
+    }
+    return tc;
+}
+
+/*
+ * Moves up to n chunks from a thread cache back to the shared pool.
+ */
+static void tcache_drain(slab_tcache *tc, const unsigned int id, int n) {
+    slabclass_t *p = &slabclass[id];
+
+    pthread_mutex_lock(&p->lock);
+    while (n-- > 0 && tc->nchunks[id] > 0) {
+        p->slots[p->sl_curr++] = tc->chunks[id][--tc->nchunks[id]];
+    }
+    p->drains++;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* hands everything back when a thread goes away */
+static void tcache_destroy(void *arg) {
+    slab_tcache *tc = arg;
+    unsigned int id;
+
+    for (id = POWER_SMALLEST; id <= power_largest; id++) {
+        tcache_drain(tc, id, TCACHE_MAX);
+    }
+    free(tc);
+}
+
+/*
+ * Refills a thread cache with a batch of chunks from the shared pool,
+ * carving a new page if the pool is empty. Returns the number of chunks
+ * now in the cache.
+ */
+static int tcache_refill(slab_tcache *tc, const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+    int n = 0;
+
+    pthread_mutex_lock(&p->lock);
+    if (p->sl_curr == 0) {
+        do_slabs_newslab(p);
+    }
+    while (n < TCACHE_BATCH && p->sl_curr > 0) {
+        tc->chunks[id][tc->nchunks[id]++] = p->slots[--p->sl_curr];
+        n++;
+    }
+    p->refills++;
+    pthread_mutex_unlock(&p->lock);
+
+    return tc->nchunks[id];
+}
+
+static void *slabs_alloc_large(const size_t size) {
+    slab_header *h = malloc(SLAB_HEADER_SIZE + size);
+
+    if (h == NULL)
+        return NULL;
+    h->clsid = 0;
+    h->size = size;
+
+    pthread_mutex_lock(&large_lock);
+    large_allocs++;
+    large_bytes += size;
+    pthread_mutex_unlock(&large_lock);
+    return (char *)h + SLAB_HEADER_SIZE;
+}
+
+/*
+ * Allocates a buffer of at least size bytes. Returns NULL if we are out of
+ * memory.
+ */
+void *slabs_alloc(const size_t size) {
+    unsigned int id = slabs_clsid(size + SLAB_HEADER_SIZE);
+    slab_tcache *tc;
+    slab_header *h;
+
+    if (id == 0)
+        return slabs_alloc_large(size);
+
+    if ((tc = tcache_get()) == NULL)
+        return NULL;
+    if (tc->nchunks[id] == 0 && tcache_refill(tc, id) == 0)
+        return NULL;
+
+    h = tc->chunks[id][--tc->nchunks[id]];
+    h->clsid = id;
+    return (char *)h + SLAB_HEADER_SIZE;
+}
+
+/*
+ * Frees a buffer that came from slabs_alloc().
+ */
+void slabs_free(void *ptr) {
+    slab_header *h;
+    slab_tcache *tc;
+    unsigned int id;
+
+    if (ptr == NULL)
+        return;
+
+    h = (slab_header *)((char *)ptr - SLAB_HEADER_SIZE);
+    id = h->clsid;
+
+    if (id == 0) {
+        pthread_mutex_lock(&large_lock);
+        large_bytes -= h->size;
+        pthread_mutex_unlock(&large_lock);
+        free(h);
+        return;
+    }
+
+    tc = tcache_get();
+    if (tc == NULL) {
+        /* no cache for this thread, give it back to the shared pool */
+        slabclass_t *p = &slabclass[id];
+        pthread_mutex_lock(&p->lock);
+        p->slots[p->sl_curr++] = h;
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+
+    if (tc->nchunks[id] == TCACHE_MAX) {
+        tcache_drain(tc, id, TCACHE_BATCH);
+    }
+    tc->chunks[id][tc->nchunks[id]++] = h;
+}
+
+/*
+ * Writes the "stats slabs" report into a newly malloc()ed buffer. Returns
+ * NULL if out of memory; otherwise *buflen is the length of the report.
+ */
+char *slabs_stats(int *buflen) {
+    unsigned int i;
+    int total = 0;
+    char *buf = malloc(power_largest * 512 + 256);
+    char *pos = buf;
+
+    if (buf == NULL)
+        return NULL;
+
+    for (i = POWER_SMALLEST; i <= power_largest; i++) {
+        slabclass_t *p = &slabclass[i];
+        unsigned int chunks, free_chunks;
+        uint64_t refills, drains;
+
+        pthread_mutex_lock(&p->lock);
+        chunks = p->pages * p->perslab;
+        free_chunks = p->sl_curr;
+        refills = p->refills;
+        drains = p->drains;
+        pthread_mutex_unlock(&p->lock);
+
+        if (chunks == 0)
+            continue;
+        total++;
+        pos += sprintf(pos, "STAT %u:chunk_size %u\r\n", i, (unsigned int)p->size);
+        pos += sprintf(pos, "STAT %u:chunks_per_page %u\r\n", i, p->perslab);
+        pos += sprintf(pos, "STAT %u:total_pages %u\r\n", i, chunks / p->perslab);
+        pos += sprintf(pos, "STAT %u:total_chunks %u\r\n", i, chunks);
+        /* chunks held by thread caches count as used here */
+        pos += sprintf(pos, "STAT %u:used_chunks %u\r\n", i, chunks - free_chunks);
+        pos += sprintf(pos, "STAT %u:free_chunks %u\r\n", i, free_chunks);
+        pos += sprintf(pos, "STAT %u:refills %llu\r\n", i, (unsigned long long)refills);
+        pos += sprintf(pos, "STAT %u:drains %llu\r\n", i, (unsigned long long)drains);
+    }
+
+    pthread_mutex_lock(&large_lock);
+    pos += sprintf(pos, "STAT active_slabs %d\r\n", total);
+    pos += sprintf(pos, "STAT total_malloced %llu\r\n", (unsigned long long)total_malloced);
+    pos += sprintf(pos, "STAT large_allocs %llu\r\n", (unsigned long long)large_allocs);
+    pos += sprintf(pos, "STAT large_bytes %llu\r\n", (unsigned long long)large_bytes);
+    pthread_mutex_unlock(&large_lock);
+    pos += sprintf(pos, "END\r\n");
+
+    *buflen = pos - buf;
+    return buf;
+}
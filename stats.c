@@ -19,6 +19,191 @@
   
 #include "memcachedb.h"
 #include <db.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *latency_cmds[LAT_NCMDS] = { "get", "set", "delete", "incr", "rget" };
+static const char *latency_phases[LAT_NPHASES] = { "lock", "storage", "send" };
+static const char *job_kinds[JOB_NKINDS] = { "none", "db_compact", "db_archive", "db_checkpoint", "db_backup", "bulk_load" };
+
+/*
+ * Returns the time in microseconds, for the latency histograms.
+ */
+uint64_t latency_now(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int latency_bucket(const uint64_t us) {
+    int msb, b;
+
+    if (us < LAT_SUB_BUCKETS)
+        return (int)us;
+    msb = 63 - __builtin_clzll(us);
+    b = (msb - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS
+        + (int)((us >> (msb - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1));
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+/* the largest value that goes into bucket b */
+static uint64_t latency_bucket_max(const int b) {
+    if (b < LAT_SUB_BUCKETS)
+        return b;
+    return ((uint64_t)(LAT_SUB_BUCKETS + b % LAT_SUB_BUCKETS + 1)
+            << (b / LAT_SUB_BUCKETS - 1)) - 1;
+}
+
+/*
+ * Records the time since start, from latency_now(), in the histogram of a
+ * command's phase. ts belongs to the calling thread, so no lock is taken.
+ */
+void latency_record(struct thread_stats *ts, const int cmd, const int phase, const uint64_t start) {
+    uint64_t now = latency_now();
+    uint64_t us = now > start ? now - start : 0;
+    struct latency_hist *h = &ts->latency[cmd][phase];
+
+    h->count++;
+    h->total_us += us;
+    h->buckets[latency_bucket(us)]++;
+}
+
+void latency_clear(struct thread_stats *ts) {
+    memset(ts->latency, 0, sizeof(ts->latency));
+}
+
+/* the value below which a fraction p of the samples in h fall */
+static uint64_t latency_percentile(const struct latency_hist *h, const double p) {
+    uint64_t want = (uint64_t)(h->count * p + 0.5);
+    uint64_t seen = 0;
+    int b;
+
+    if (want == 0)
+        want = 1;
+    for (b = 0; b < LAT_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= want)
+            break;
+    }
+    return latency_bucket_max(b);
+}
+
+/*
+ * Writes the "stats latency" report, summed over all threads, into a newly
+ * malloc()ed buffer. Histograms without samples are left out. Returns NULL
+ * if out of memory; otherwise *buflen is the length of the report.
+ */
+char *stats_latency(int *buflen) {
+    struct thread_stats ts;
+    char *buf = malloc(LAT_NCMDS * LAT_NPHASES * 512 + 16);
+    char *pos = buf;
+    int i, j, b;
+
+    if (buf == NULL)
+        return NULL;
+
+    stats_aggregate(&ts);
+    for (i = 0; i < LAT_NCMDS; i++) {
+        for (j = 0; j < LAT_NPHASES; j++) {
+            struct latency_hist *h = &ts.latency[i][j];
+            const char *cmd = latency_cmds[i], *phase = latency_phases[j];
+
+            if (h->count == 0)
+                continue;
+            for (b = LAT_BUCKETS - 1; b > 0 && h->buckets[b] == 0; b--)
+                ;
+            pos += sprintf(pos, "STAT %s_%s_count %llu\r\n", cmd, phase, (unsigned long long)h->count);
+            pos += sprintf(pos, "STAT %s_%s_avg_us %llu\r\n", cmd, phase, (unsigned long long)(h->total_us / h->count));
+            pos += sprintf(pos, "STAT %s_%s_p50_us %llu\r\n", cmd, phase, (unsigned long long)latency_percentile(h, 0.50));
+            pos += sprintf(pos, "STAT %s_%s_p90_us %llu\r\n", cmd, phase, (unsigned long long)latency_percentile(h, 0.90));
+            pos += sprintf(pos, "STAT %s_%s_p99_us %llu\r\n", cmd, phase, (unsigned long long)latency_percentile(h, 0.99));
+            pos += sprintf(pos, "STAT %s_%s_p999_us %llu\r\n", cmd, phase, (unsigned long long)latency_percentile(h, 0.999));
+            pos += sprintf(pos, "STAT %s_%s_max_us %llu\r\n", cmd, phase, (unsigned long long)latency_bucket_max(b));
+        }
+    }
+    pos += sprintf(pos, "END\r\n");
+
+    *buflen = pos - buf;
+    return buf;
+}
+
+/* counts a value of bytes in a size histogram */
+void size_record(uint64_t *hist, const size_t bytes) {
+    int b = bytes <= 16 ? 0 : 64 - __builtin_clzll((uint64_t)bytes - 1) - 4;
+
+    hist[b < SIZE_BUCKETS ? b : SIZE_BUCKETS - 1]++;
+}
+
+void sizes_clear(struct thread_stats *ts) {
+    memset(ts->size_stored, 0, sizeof(ts->size_stored));
+    memset(ts->size_read, 0, sizeof(ts->size_read));
+}
+
+/*
+ * Writes the "stats sizes" report, summed over all threads, into a newly
+ * malloc()ed buffer: per bucket that isn't empty, the values stored and
+ * read of up to that many data bytes, "max" for the last bucket. Returns
+ * NULL if out of memory; otherwise *buflen is the length of the report.
+ */
+char *stats_sizes(int *buflen) {
+    struct thread_stats ts;
+    char *buf = malloc(SIZE_BUCKETS * 2 * 64 + 64);
+    char *pos = buf;
+    char max[32];
+    int b;
+
+    if (buf == NULL)
+        return NULL;
+
+    stats_aggregate(&ts);
+    pos += sprintf(pos, "STAT ibuffer_size %u\r\n", settings.item_buf_size);
+    for (b = 0; b < SIZE_BUCKETS; b++) {
+        if (b < SIZE_BUCKETS - 1)
+            sprintf(max, "%llu", 16ULL << b);
+        else
+            strcpy(max, "max");
+        if (ts.size_stored[b] > 0)
+            pos += sprintf(pos, "STAT stored_%s %llu\r\n", max, (unsigned long long)ts.size_stored[b]);
+        if (ts.size_read[b] > 0)
+            pos += sprintf(pos, "STAT read_%s %llu\r\n", max, (unsigned long long)ts.size_read[b]);
+    }
+    pos += sprintf(pos, "END\r\n");
+
+    *buflen = pos - buf;
+    return buf;
+}
+
+/*
+ * Writes the "stats partitions" report into a newly malloc()ed buffer:
+ * per partition its file, the reads and writes sent to it and what the
+ * engine has to say about it, its key count and its share of the cache
+ * for bdb. Returns NULL if out of memory; otherwise *buflen is the length
+ * of the report.
+ */
+char *stats_partitions(int *buflen) {
+    struct thread_stats ts;
+    char name[DB_PART_NAME_MAX];
+    char *buf = malloc(bdb_settings.db_parts * (DB_PART_NAME_MAX + 128 + ENGINE_STATS_MAX) + 16);
+    char *pos = buf;
+    int i;
+
+    if (buf == NULL)
+        return NULL;
+
+    stats_aggregate(&ts);
+    for (i = 0; i < bdb_settings.db_parts; i++) {
+        bdb_part_file(i, name, sizeof(name));
+        pos += sprintf(pos, "STAT part%d_file %s\r\n", i, name);
+        pos += engine->stats(i, pos);
+        pos += sprintf(pos, "STAT part%d_reads %llu\r\n", i, (unsigned long long)ts.part_reads[i]);
+        pos += sprintf(pos, "STAT part%d_writes %llu\r\n", i, (unsigned long long)ts.part_writes[i]);
+    }
+    pos += sprintf(pos, "END\r\n");
+
+    *buflen = pos - buf;
+    return buf;
+}
 
 void stats_bdb(char *temp){
     char *pos = temp;
@@ -27,33 +212,102 @@ void stats_bdb(char *temp){
     pos += sprintf(pos, "STAT db_ver %d.%d.%d\r\n", bdb_version.majver, 
                                                     bdb_version.minver, 
                                                     bdb_version.patch);
-    /* get page size */
-    if((ret = dbp->get_pagesize(dbp, &bdb_settings.page_size)) == 0){
+    pos += sprintf(pos, "STAT engine %s\r\n", engine->name);
+    /* get page size, the mmap engine has set it from its files */
+    if (engine != &bdb_engine
+        || (ret = dbps[0]->get_pagesize(dbps[0], &bdb_settings.page_size)) == 0){
         pos += sprintf(pos, "STAT page_size %u\r\n", bdb_settings.page_size);
     }
     
     /* get database type */
-    if((ret = dbp->get_type(dbp, &bdb_settings.db_type)) == 0){
+    if (engine != &bdb_engine
+        || (ret = dbps[0]->get_type(dbps[0], &bdb_settings.db_type)) == 0){
         if (bdb_settings.db_type == DB_BTREE){
             pos += sprintf(pos, "STAT db_type btree\r\n");
         }else if (bdb_settings.db_type == DB_HASH){
             pos += sprintf(pos, "STAT db_type hash\r\n");
         }
     }
+    pos += sprintf(pos, "STAT db_parts %d\r\n", bdb_settings.db_parts);
     pos += sprintf(pos, "STAT cache_size %u\r\n", bdb_settings.cache_size);
     pos += sprintf(pos, "STAT txn_lg_bsize %u\r\n", bdb_settings.txn_lg_bsize);
     pos += sprintf(pos, "STAT txn_nosync %d\r\n", bdb_settings.txn_nosync);
     pos += sprintf(pos, "STAT dldetect_val %d\r\n", bdb_settings.dldetect_val);
     pos += sprintf(pos, "STAT chkpoint_val %d\r\n", bdb_settings.chkpoint_val);
+    pos += sprintf(pos, "STAT chkpoint_kbyte %d\r\n", bdb_settings.chkpoint_kbyte);
     pos += sprintf(pos, "STAT memp_trickle_val %d\r\n", bdb_settings.memp_trickle_val);
     pos += sprintf(pos, "STAT memp_trickle_percent %d\r\n", bdb_settings.memp_trickle_percent);
+    pos += sprintf(pos, "STAT io_budget %d\r\n", bdb_settings.io_budget);
+    pos += sprintf(pos, "STAT chkpoint_count %llu\r\n", maint_stats.checkpoints);
+    pos += sprintf(pos, "STAT chkpoint_last_usec %llu\r\n", maint_stats.last_ckp_usec);
+    pos += sprintf(pos, "STAT chkpoint_last_bytes %llu\r\n", maint_stats.last_ckp_bytes);
+    pos += sprintf(pos, "STAT trickle_count %llu\r\n", maint_stats.trickles);
+    pos += sprintf(pos, "STAT trickle_pages %llu\r\n", maint_stats.trickle_pages);
+    pos += sprintf(pos, "STAT dirty_percent %d\r\n", maint_stats.dirty_percent);
+    pos += sprintf(pos, "STAT gcommit_ops %d\r\n", bdb_settings.gcommit_ops);
+    pos += sprintf(pos, "STAT gcommit_wait %d\r\n", bdb_settings.gcommit_wait);
+    pos += sprintf(pos, "STAT gcommit_batches %llu\r\n", gcommit_stats.batches);
+    pos += sprintf(pos, "STAT gcommit_writes %llu\r\n", gcommit_stats.writes);
+    pos += sprintf(pos, "STAT convert_running %d\r\n", convert_stats.running);
+    pos += sprintf(pos, "STAT convert_scanned %llu\r\n", convert_stats.scanned);
+    pos += sprintf(pos, "STAT convert_records %llu\r\n", convert_stats.converted);
+    pos += sprintf(pos, "STAT expire_rate %d\r\n", bdb_settings.expire_rate);
+    pos += sprintf(pos, "STAT expire_passes %llu\r\n", expire_stats.passes);
+    pos += sprintf(pos, "STAT expire_scanned %llu\r\n", expire_stats.scanned);
+    pos += sprintf(pos, "STAT expired_items %llu\r\n", expire_stats.items);
+    pos += sprintf(pos, "STAT expired_bytes %llu\r\n", expire_stats.bytes);
     pos += sprintf(pos, "END");
 }
 
-void stats_rep(char *temp){
+void stats_bdb_job(char *temp){
     char *pos = temp;
-    int ret;
+
+    pos += sprintf(pos, "STAT job_running %s\r\n", job_kinds[job_stats.running]);
+    pos += sprintf(pos, "STAT job_id %llu\r\n", job_stats.id);
+    pos += sprintf(pos, "STAT job_part %d\r\n", job_stats.part);
+    pos += sprintf(pos, "STAT job_queued %d\r\n", job_stats.queued);
+    pos += sprintf(pos, "STAT job_rate %d\r\n", job_stats.rate);
+    pos += sprintf(pos, "STAT job_done %llu\r\n", job_stats.done);
+    pos += sprintf(pos, "STAT job_cancelled %llu\r\n", job_stats.cancelled);
+    pos += sprintf(pos, "STAT job_failed %llu\r\n", job_stats.failed);
+    pos += sprintf(pos, "STAT job_last_error %d\r\n", job_stats.last_error);
+    pos += sprintf(pos, "STAT compact_pages_examined %llu\r\n", job_stats.pages_examined);
+    pos += sprintf(pos, "STAT compact_pages_freed %llu\r\n", job_stats.pages_freed);
+    pos += sprintf(pos, "STAT compact_pages_truncated %llu\r\n", job_stats.pages_truncated);
+    pos += sprintf(pos, "STAT backup_files %llu\r\n", job_stats.backup_files);
+    pos += sprintf(pos, "STAT backup_bytes %llu\r\n", job_stats.backup_bytes);
+    pos += sprintf(pos, "STAT load_records %llu\r\n", job_stats.load_records);
+    pos += sprintf(pos, "STAT load_bytes %llu\r\n", job_stats.load_bytes);
+    pos += sprintf(pos, "END");
+}
+
+/*
+ * The rep_ lines are ours: the role of this site, the LSN a client's
+ * rep_check_lsn token is compared with, the master's address and log end
+ * as of its last heartbeat, and the age of that heartbeat. The st_ lines
+ * are Berkeley DB's.
+ */
+char *stats_rep(int *buflen){
+    static const char *roles[] = { "master", "client", "unknown" };
+    struct thread_stats ts;
+    struct rep_heartbeat hb;
+    DB_LSN lsn;
+    char *buf = malloc(4096);
+    char *pos = buf;
     DB_REP_STAT *statp = NULL;
+
+    if (buf == NULL)
+        return NULL;
+
+    stats_aggregate(&ts);
+    bdb_rep_heartbeat(&hb);
+    pos += sprintf(pos, "STAT rep_role %s\r\n", roles[bdb_settings.rep_whoami]);
+    if (bdb_rep_lsn(&lsn) == 0)
+        pos += sprintf(pos, "STAT rep_lsn %u/%u\r\n", lsn.file, lsn.offset);
+    pos += sprintf(pos, "STAT rep_master %s\r\n", hb.master[0] != '\0' ? hb.master : "unknown");
+    pos += sprintf(pos, "STAT rep_master_lsn %u/%u\r\n", hb.lsn.file, hb.lsn.offset);
+    pos += sprintf(pos, "STAT rep_lag_seconds %d\r\n", bdb_rep_lag());
+    pos += sprintf(pos, "STAT rep_redirects %llu\r\n", (unsigned long long)ts.rep_redirects);
     if (env->rep_stat(env, &statp, 0) == 0){
         pos += sprintf(pos, "STAT st_bulk_fills %u\r\n", statp->st_bulk_fills);
         pos += sprintf(pos, "STAT st_bulk_overflows %u\r\n", statp->st_bulk_overflows);
@@ -119,7 +373,9 @@ void stats_rep(char *temp){
     if (statp != NULL)
         free(statp);
 
-    pos += sprintf(pos, "END");
+    pos += sprintf(pos, "END\r\n");
+    *buflen = pos - buf;
+    return buf;
 }
 
 void stats_repmgr(char *temp){
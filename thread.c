@@ -35,8 +35,15 @@
 
 #include <pthread.h>
 
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #define ITEMS_PER_ALLOC 64
 
+/* Number of item lock stripes, must be a power of two */
+#define ITEM_LOCK_COUNT 1024
+
 /* An item in the connection queue. */
 typedef struct conn_queue_item CQ_ITEM;
 struct conn_queue_item {
@@ -48,34 +55,40 @@ struct conn_queue_item {
     CQ_ITEM *next;
 };
 
-/* A connection queue. */
+/*
+ * A connection queue. Any thread pushes with a compare and swap, the
+ * owning thread takes everything at once, so no lock is needed and an
+ * item never comes back while someone is looking at it.
+ */
 typedef struct conn_queue CQ;
 struct conn_queue {
-    CQ_ITEM *head;
-    CQ_ITEM *tail;
-    pthread_mutex_t lock;
-    pthread_cond_t  cond;
+    CQ_ITEM *head;      /* newest first */
 };
 
 /* Lock for connection freelist */
 static pthread_mutex_t conn_lock;
 
-/* Lock for item buffer freelist */
-static pthread_mutex_t ibuffer_lock;
-
-/* Lock for bdb */
-static pthread_mutex_t bdb_lock;
-
-/* Lock for global stats */
-static pthread_mutex_t stats_lock;
+/*
+ * Locks for read-modify-write commands on items. A key always maps to the
+ * same stripe, so add/replace/append/prepend and incr/decr on one key stay
+ * atomic with each other while commands on different keys run in parallel.
+ * Berkeley DB does its own page locking underneath.
+ */
+static pthread_mutex_t item_locks[ITEM_LOCK_COUNT];
 
-/* Free list of CQ_ITEM structs */
+/*
+ * Free list of CQ_ITEM structs. Any thread frees onto cqi_freelist; the
+ * dispatching thread, the only one taking items, moves all of it to
+ * cqi_cache when that runs out.
+ */
 static CQ_ITEM *cqi_freelist;
-static pthread_mutex_t cqi_freelist_lock;
+static CQ_ITEM *cqi_cache;
 
 /*
- * Each libevent instance has a wakeup pipe, which other threads
- * can use to signal that they've put a new connection on its queue.
+ * Each libevent instance has a wakeup eventfd, or a pipe where there is
+ * none, which other threads use to signal that they've put work on one of
+ * its queues. Only a push onto an empty queue wakes the thread; a wakeup
+ * handles everything queued by then.
  */
 typedef struct {
     pthread_t thread_id;        /* unique ID of this thread */
@@ -84,10 +97,20 @@ typedef struct {
     int notify_receive_fd;      /* receiving end of notify pipe */
     int notify_send_fd;         /* sending end of notify pipe */
     CQ  new_conn_queue;         /* queue of new connections to handle */
+    conn *commit_done;          /* connections whose group commit finished,
+                                   pushed like new_conn_queue */
+    conn *listen_conn;          /* this thread's own listeners, with -j */
+    volatile int nconns;        /* client connections this thread owns */
+    volatile int pending;       /* queued connections not handled yet */
+    struct thread_stats stats;  /* counters only this thread writes */
 } LIBEVENT_THREAD;
 
 static LIBEVENT_THREAD *threads;
 
+/* the stats block of each thread, found without a search since the
+   storage paths look it up for every latency they record */
+static pthread_key_t stats_key;
+
 /*
  * Number of threads that have finished setting themselves up.
  */
@@ -102,79 +125,57 @@ static void thread_libevent_process(int fd, short which, void *arg);
  * Initializes a connection queue.
  */
 static void cq_init(CQ *cq) {
-    pthread_mutex_init(&cq->lock, NULL);
-    pthread_cond_init(&cq->cond, NULL);
     cq->head = NULL;
-    cq->tail = NULL;
 }
 
 /*
- * Waits for work on a connection queue.
+ * Adds an item to a connection queue. Returns true if the queue was
+ * empty, and its thread needs waking up.
  */
-static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
-
-    pthread_mutex_lock(&cq->lock);
-    while (NULL == cq->head)
-        pthread_cond_wait(&cq->cond, &cq->lock);
-    item = cq->head;
-    cq->head = item->next;
-    if (NULL == cq->head)
-        cq->tail = NULL;
-    pthread_mutex_unlock(&cq->lock);
+static bool cq_push(CQ *cq, CQ_ITEM *item) {
+    CQ_ITEM *head;
 
-    return item;
+    do {
+        head = cq->head;
+        item->next = head;
+    } while (!__sync_bool_compare_and_swap(&cq->head, head, item));
+    return head == NULL;
 }
 
 /*
- * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
- * Returns the item, or NULL if no item is available
+ * Takes all items off a connection queue, oldest first. Returns NULL if
+ * there are none.
  */
-static CQ_ITEM *cq_peek(CQ *cq) {
-    CQ_ITEM *item;
+static CQ_ITEM *cq_take_all(CQ *cq) {
+    CQ_ITEM *item, *next, *prev = NULL;
 
-    pthread_mutex_lock(&cq->lock);
-    item = cq->head;
-    if (NULL != item) {
-        cq->head = item->next;
-        if (NULL == cq->head)
-            cq->tail = NULL;
-    }
-    pthread_mutex_unlock(&cq->lock);
+    do {
+        item = cq->head;
+    } while (item != NULL && !__sync_bool_compare_and_swap(&cq->head, item, NULL));
 
-    return item;
-}
-
-/*
- * Adds an item to a connection queue.
- */
-static void cq_push(CQ *cq, CQ_ITEM *item) {
-    item->next = NULL;
-
-    pthread_mutex_lock(&cq->lock);
-    if (NULL == cq->tail)
-        cq->head = item;
-    else
-        cq->tail->next = item;
-    cq->tail = item;
-    pthread_cond_signal(&cq->cond);
-    pthread_mutex_unlock(&cq->lock);
+    for (; item != NULL; item = next) {
+        next = item->next;
+        item->next = prev;
+        prev = item;
+    }
+    return prev;
 }
 
 /*
- * Returns a fresh connection queue item.
+ * Returns a fresh connection queue item. Only the dispatching thread
+ * calls this.
  */
 static CQ_ITEM *cqi_new() {
-    CQ_ITEM *item = NULL;
-    pthread_mutex_lock(&cqi_freelist_lock);
-    if (cqi_freelist) {
-        item = cqi_freelist;
-        cqi_freelist = item->next;
+    CQ_ITEM *item;
+
+    if (NULL == cqi_cache) {
+        do {
+            item = cqi_freelist;
+        } while (item != NULL && !__sync_bool_compare_and_swap(&cqi_freelist, item, NULL));
+        cqi_cache = item;
     }
-    pthread_mutex_unlock(&cqi_freelist_lock);
 
-    if (NULL == item) {
+    if (NULL == cqi_cache) {
         int i;
 
         /* Allocate a bunch of items at once to reduce fragmentation */
@@ -184,18 +185,17 @@ static CQ_ITEM *cqi_new() {
 
         /*
          * Link together all the new items except the first one
-         * (which we'll return to the caller) for placement on
-         * the freelist.
+         * (which we'll return to the caller) for the cache.
          */
         for (i = 2; i < ITEMS_PER_ALLOC; i++)
             item[i - 1].next = &item[i];
-
-        pthread_mutex_lock(&cqi_freelist_lock);
-        item[ITEMS_PER_ALLOC - 1].next = cqi_freelist;
-        cqi_freelist = &item[1];
-        pthread_mutex_unlock(&cqi_freelist_lock);
+        item[ITEMS_PER_ALLOC - 1].next = NULL;
+        cqi_cache = &item[1];
+        return item;
     }
 
+    item = cqi_cache;
+    cqi_cache = item->next;
     return item;
 }
 
@@ -204,10 +204,12 @@ static CQ_ITEM *cqi_new() {
  * Frees a connection queue item (adds it to the freelist.)
  */
 static void cqi_free(CQ_ITEM *item) {
-    pthread_mutex_lock(&cqi_freelist_lock);
-    item->next = cqi_freelist;
-    cqi_freelist = item;
-    pthread_mutex_unlock(&cqi_freelist_lock);
+    CQ_ITEM *head;
+
+    do {
+        head = cqi_freelist;
+        item->next = head;
+    } while (!__sync_bool_compare_and_swap(&cqi_freelist, head, item));
 }
 
 
@@ -258,33 +260,6 @@ bool mt_conn_add_to_freelist(conn *c) {
     return result;
 }
 
-/*
- * Pulls a item buffer from the freelist, if one is available.
- */
-
-item *mt_item_from_freelist(void) {
-    item *it;
-    pthread_mutex_lock(&ibuffer_lock);
-    it = do_item_from_freelist();
-    pthread_mutex_unlock(&ibuffer_lock);
-    return it;
-}
-
-/*
- * Adds a item buffer to the freelist.
- *
- * Returns 0 on success, 1 if the buffer couldn't be added.
- */
-int mt_item_add_to_freelist(item *it){
-    int result;
-
-    pthread_mutex_lock(&ibuffer_lock);
-    result = do_item_add_to_freelist(it);
-    pthread_mutex_unlock(&ibuffer_lock);
-
-    return result;
-}
-
 
 /****************************** LIBEVENT THREADS *****************************/
 
@@ -311,6 +286,11 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     }
 
     cq_init(&me->new_conn_queue);
+
+    me->commit_done = NULL;
+    me->listen_conn = NULL;
+    me->nconns = 0;
+    me->pending = 0;
 }
 
 
@@ -323,6 +303,8 @@ static void *worker_libevent(void *arg) {
     /* Any per-thread setup can happen here; thread_init() will block until
      * all threads have finished initializing.
      */
+    me->thread_id = pthread_self();
+    pthread_setspecific(stats_key, &me->stats);
 
     pthread_mutex_lock(&init_lock);
     init_count++;
@@ -334,53 +316,144 @@ static void *worker_libevent(void *arg) {
 
 
 /*
- * Processes an incoming "handle a new connection" item. This is called when
- * input arrives on the libevent wakeup pipe.
+ * Sets up a connection handed to this thread, on the thread itself.
+ */
+static void thread_conn_new(LIBEVENT_THREAD *me, CQ_ITEM *item) {
+    conn *c;
+
+    c = conn_new(item->sfd, item->init_state, item->event_flags,
+                 item->read_buffer_size, item->is_udp, me->base);
+    if (c == NULL) {
+        if (item->is_udp || item->init_state == conn_listening) {
+            fprintf(stderr, "Can't listen for events on %s socket\n",
+                    item->is_udp ? "UDP" : "TCP");
+            exit(1);
+        } else {
+            if (settings.verbose > 0) {
+                fprintf(stderr, "Can't listen for events on fd %d\n",
+                    item->sfd);
+            }
+            close(item->sfd);
+        }
+        return;
+    }
+
+    c->thread = me;
+    if (item->init_state == conn_listening) {
+        c->next = me->listen_conn;
+        me->listen_conn = c;
+    } else if (!item->is_udp) {
+        __sync_fetch_and_add(&me->nconns, 1);
+    }
+}
+
+/*
+ * Handles everything queued for this thread: new connections, and the
+ * connections released by the group committer. This is called when the
+ * wakeup eventfd or pipe becomes readable.
  */
 static void thread_libevent_process(int fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
-    CQ_ITEM *item;
-    char buf[1];
+    CQ_ITEM *item, *next_item;
+    conn *c, *next;
+#ifdef HAVE_EVENTFD
+    uint64_t buf;
+#else
+    char buf[64];
+#endif
+    int n = 0;
 
-    if (read(fd, buf, 1) != 1)
+    /* reset the wakeup before looking at the queues, so that a push
+       racing with us wakes us again rather than getting lost */
+    if (read(fd, &buf, sizeof(buf)) <= 0) {
         if (settings.verbose > 0)
             fprintf(stderr, "Can't read from libevent pipe\n");
+        return;
+    }
 
-    item = cq_peek(&me->new_conn_queue);
-
-    if (NULL != item) {
-        conn *c = conn_new(item->sfd, item->init_state, item->event_flags,
-                           item->read_buffer_size, item->is_udp, me->base);
-        if (c == NULL) {
-            if (item->is_udp) {
-                fprintf(stderr, "Can't listen for events on UDP socket\n");
-                exit(1);
-            } else {
-                if (settings.verbose > 0) {
-                    fprintf(stderr, "Can't listen for events on fd %d\n",
-                        item->sfd);
-                }
-                close(item->sfd);
-            }
-        }
+    for (item = cq_take_all(&me->new_conn_queue); item != NULL; item = next_item) {
+        next_item = item->next;
+        thread_conn_new(me, item);
         cqi_free(item);
+        n++;
+    }
+
+    do {
+        c = me->commit_done;
+    } while (c != NULL && !__sync_bool_compare_and_swap(&me->commit_done, c, NULL));
+    for (; c != NULL; c = next) {
+        next = c->next;
+        conn_commit_done(c);
+        n++;
     }
+
+    __sync_fetch_and_sub(&me->pending, n);
 }
 
 /* Which thread we assigned a connection to most recently. */
 static int last_thread = -1;
 
 /*
- * Dispatches a new connection to another thread. This is only ever called
- * from the main thread, either during initialization (for UDP) or because
- * of an incoming connection.
+ * Wakes up a thread to handle its queues.
  */
-void dispatch_conn_new(int sfd, int init_state, int event_flags,
-                       int read_buffer_size, int is_udp) {
-    CQ_ITEM *item = cqi_new();
-    int thread = (last_thread + 1) % settings.num_threads;
+static void thread_notify(LIBEVENT_THREAD *me) {
+#ifdef HAVE_EVENTFD
+    uint64_t one = 1;
 
-    last_thread = thread;
+    if (write(me->notify_send_fd, &one, sizeof(one)) != sizeof(one)) {
+#else
+    if (write(me->notify_send_fd, "", 1) != 1) {
+#endif
+        perror("Writing to thread notify pipe");
+    }
+}
+
+/*
+ * Returns the thread calling, or NULL if it is not one of ours.
+ */
+static LIBEVENT_THREAD *thread_self(void) {
+    pthread_t self = pthread_self();
+    int i;
+
+    for (i = 0; i < settings.num_threads; i++) {
+        if (pthread_equal(threads[i].thread_id, self))
+            return &threads[i];
+    }
+    return NULL;
+}
+
+/*
+ * Picks the thread for a new connection: the one with the least work
+ * still waiting in its queues, so that a thread stuck on a slow database
+ * read is passed over, then the one with the fewest connections. Ties go
+ * round-robin. The counts are read without a lock; a stale one only costs
+ * a less than perfect pick.
+ */
+static int least_loaded_thread(void) {
+    int i, t, pending, nconns;
+    int best = -1, best_pending = 0, best_nconns = 0;
+
+    for (i = 1; i <= settings.num_threads; i++) {
+        t = (last_thread + i) % settings.num_threads;
+        pending = threads[t].pending;
+        nconns = threads[t].nconns;
+
+        if (best == -1 || pending < best_pending
+            || (pending == best_pending && nconns < best_nconns)) {
+            best = t;
+            best_pending = pending;
+            best_nconns = nconns;
+        }
+    }
+    return best;
+}
+
+/*
+ * Dispatches a new connection to the given thread.
+ */
+void dispatch_conn_to(int thread, int sfd, int init_state, int event_flags,
+                      int read_buffer_size, int is_udp) {
+    CQ_ITEM *item = cqi_new();
 
     item->sfd = sfd;
     item->init_state = init_state;
@@ -388,10 +461,62 @@ void dispatch_conn_new(int sfd, int init_state, int event_flags,
     item->read_buffer_size = read_buffer_size;
     item->is_udp = is_udp;
 
-    cq_push(&threads[thread].new_conn_queue, item);
-    if (write(threads[thread].notify_send_fd, "", 1) != 1) {
-        perror("Writing to thread notify pipe");
+    __sync_fetch_and_add(&threads[thread].pending, 1);
+    if (cq_push(&threads[thread].new_conn_queue, item))
+        thread_notify(&threads[thread]);
+}
+
+/*
+ * Dispatches a new connection to the least loaded thread. This is called
+ * from the main thread because of an incoming connection, or, with one
+ * listener per thread, from the thread that accepted it, which keeps it.
+ */
+void dispatch_conn_new(int sfd, int init_state, int event_flags,
+                       int read_buffer_size, int is_udp) {
+    LIBEVENT_THREAD *me;
+    CQ_ITEM item;
+
+    if (settings.reuseport && (me = thread_self()) != NULL) {
+        item.sfd = sfd;
+        item.init_state = init_state;
+        item.event_flags = event_flags;
+        item.read_buffer_size = read_buffer_size;
+        item.is_udp = is_udp;
+        thread_conn_new(me, &item);
+        return;
     }
+
+    last_thread = least_loaded_thread();
+    dispatch_conn_to(last_thread, sfd, init_state, event_flags,
+                     read_buffer_size, is_udp);
+}
+
+/*
+ * Takes a closed client connection off its thread's load.
+ */
+void dispatch_conn_closed(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+
+    if (me == NULL || c->udp || c->state == conn_listening)
+        return;
+    __sync_fetch_and_sub(&me->nconns, 1);
+}
+
+/*
+ * Hands a connection whose write is now durable back to the thread that
+ * owns it. Called from the group commit thread.
+ */
+void dispatch_commit_done(conn *c) {
+    LIBEVENT_THREAD *me = c->thread;
+    conn *head;
+
+    __sync_fetch_and_add(&me->pending, 1);
+    do {
+        head = me->commit_done;
+        c->next = head;
+    } while (!__sync_bool_compare_and_swap(&me->commit_done, head, c));
+    if (head == NULL)
+        thread_notify(me);
 }
 
 /*
@@ -401,15 +526,34 @@ int mt_is_listen_thread() {
     return pthread_self() == threads[0].thread_id;
 }
 
+/*
+ * Returns the listeners of the calling thread's own, with -j.
+ */
+conn *mt_thread_listen_conn() {
+    LIBEVENT_THREAD *me = thread_self();
+
+    return me != NULL ? me->listen_conn : NULL;
+}
+
+/*
+ * Returns the lock stripe that guards a key.
+ */
+static pthread_mutex_t *item_lock(const char *key, const size_t nkey) {
+    return &item_locks[hash(key, nkey, 0) & (ITEM_LOCK_COUNT - 1)];
+}
+
 /*
  * Does arithmetic on a numeric item value.
  */
 char *mt_add_delta(int incr, const int64_t delta, char *buf, char *key, size_t nkey) {
+    pthread_mutex_t *lock = item_lock(key, nkey);
+    uint64_t start = latency_now();
     char *ret;
 
-    pthread_mutex_lock(&bdb_lock);
+    pthread_mutex_lock(lock);
+    latency_record(mt_thread_stats(), LAT_INCR, LAT_LOCK, start);
     ret = do_add_delta(incr, delta, buf, key, nkey);
-    pthread_mutex_unlock(&bdb_lock);
+    pthread_mutex_unlock(lock);
     return ret;
 }
 
@@ -417,22 +561,126 @@ char *mt_add_delta(int incr, const int64_t delta, char *buf, char *key, size_t n
  * Stores an item in the bdb (high level, obeys set/add/replace semantics)
  */
 int mt_store_item(item *item, int comm) {
+    pthread_mutex_t *lock = item_lock(ITEM_key(item), item->nkey);
+    uint64_t start = latency_now();
     int ret;
 
-    pthread_mutex_lock(&bdb_lock);
+    pthread_mutex_lock(lock);
+    latency_record(mt_thread_stats(), LAT_SET, LAT_LOCK, start);
     ret = do_store_item(item, comm);
-    pthread_mutex_unlock(&bdb_lock);
+    pthread_mutex_unlock(lock);
     return ret;
 }
 
 /******************************* GLOBAL STATS ******************************/
 
-void mt_stats_lock() {
-    pthread_mutex_lock(&stats_lock);
+/*
+ * Counters for connections made before the worker threads start.
+ */
+static struct thread_stats startup_stats;
+
+/*
+ * The threads outside the workers that count something, group commit, the
+ * expiry sweeper, the job thread, counter flush and bulk and warm load,
+ * each get a block of their own the first time they ask. The blocks are
+ * kept on a list the aggregate walks; a thread that exits leaves its
+ * block, counts and all, to the next one that starts.
+ */
+typedef struct other_stats {
+    struct thread_stats stats;
+    struct other_stats *next;
+    bool in_use;
+} OTHER_STATS;
+
+static OTHER_STATS *other_stats;
+static pthread_mutex_t other_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t other_key;
+
+static void other_stats_release(void *arg) {
+    OTHER_STATS *os = arg;
+
+    pthread_mutex_lock(&other_stats_lock);
+    os->in_use = false;
+    pthread_mutex_unlock(&other_stats_lock);
+}
+
+static struct thread_stats *other_stats_get(void) {
+    OTHER_STATS *os;
+
+    pthread_mutex_lock(&other_stats_lock);
+    for (os = other_stats; os != NULL && os->in_use; os = os->next)
+        ;
+    if (os == NULL) {
+        if (posix_memalign((void **)&os, CACHE_LINE_SIZE, sizeof(OTHER_STATS)) != 0) {
+            pthread_mutex_unlock(&other_stats_lock);
+            perror("Can't allocate thread stats");
+            exit(1);
+        }
+        memset(os, 0, sizeof(OTHER_STATS));
+        os->next = other_stats;
+        other_stats = os;
+    }
+    os->in_use = true;
+    pthread_mutex_unlock(&other_stats_lock);
+
+    pthread_setspecific(stats_key, &os->stats);
+    pthread_setspecific(other_key, os);
+    return &os->stats;
+}
+
+/*
+ * Returns the stats block of the calling thread. Each thread owns its block
+ * and is the only writer, so counting needs no lock; each block sits on its
+ * own cache lines so the threads don't slow each other down either.
+ */
+struct thread_stats *mt_thread_stats() {
+    struct thread_stats *ts;
+
+    if (threads == NULL)
+        return &startup_stats;
+    ts = pthread_getspecific(stats_key);
+    return ts ? ts : other_stats_get();
+}
+
+static void stats_add(uint64_t *sum, struct thread_stats *ts) {
+    uint64_t *from = (uint64_t *)ts;
+    int j, n = sizeof(struct thread_stats) / sizeof(uint64_t);
+
+    for (j = 0; j < n; j++)
+        sum[j] += from[j];
+}
+
+/*
+ * Sums the stats blocks of all threads. The counters are read while the
+ * threads keep going, so the total is a snapshot, not an atomic one.
+ */
+void mt_stats_aggregate(struct thread_stats *out) {
+    OTHER_STATS *os;
+    int i;
+
+    *out = startup_stats;
+    for (i = 0; i < settings.num_threads; i++)
+        stats_add((uint64_t *)out, &threads[i].stats);
+    pthread_mutex_lock(&other_stats_lock);
+    for (os = other_stats; os != NULL; os = os->next)
+        stats_add((uint64_t *)out, &os->stats);
+    pthread_mutex_unlock(&other_stats_lock);
 }
 
-void mt_stats_unlock() {
-    pthread_mutex_unlock(&stats_lock);
+/*
+ * Resets the stats blocks of all threads with clear().
+ */
+void mt_stats_reset(void (*clear)(struct thread_stats *)) {
+    OTHER_STATS *os;
+    int i;
+
+    clear(&startup_stats);
+    for (i = 0; i < settings.num_threads; i++)
+        clear(&threads[i].stats);
+    pthread_mutex_lock(&other_stats_lock);
+    for (os = other_stats; os != NULL; os = os->next)
+        clear(&os->stats);
+    pthread_mutex_unlock(&other_stats_lock);
 }
 
 /*
@@ -444,27 +692,41 @@ void mt_stats_unlock() {
 void thread_init(int nthreads, struct event_base *main_base) {
     int         i;
 
-    pthread_mutex_init(&bdb_lock, NULL);
-    pthread_mutex_init(&ibuffer_lock, NULL);
+    for (i = 0; i < ITEM_LOCK_COUNT; i++) {
+        pthread_mutex_init(&item_locks[i], NULL);
+    }
     pthread_mutex_init(&conn_lock, NULL);
-    pthread_mutex_init(&stats_lock, NULL);
 
     pthread_mutex_init(&init_lock, NULL);
     pthread_cond_init(&init_cond, NULL);
 
-    pthread_mutex_init(&cqi_freelist_lock, NULL);
     cqi_freelist = NULL;
+    cqi_cache = NULL;
 
-    threads = malloc(sizeof(LIBEVENT_THREAD) * nthreads);
-    if (! threads) {
+    if (posix_memalign((void **)&threads, CACHE_LINE_SIZE,
+                       sizeof(LIBEVENT_THREAD) * nthreads) != 0) {
         perror("Can't allocate thread descriptors");
         exit(1);
     }
+    memset(threads, 0, sizeof(LIBEVENT_THREAD) * nthreads);
 
     threads[0].base = main_base;
     threads[0].thread_id = pthread_self();
+    pthread_key_create(&stats_key, NULL);
+    pthread_key_create(&other_key, other_stats_release);
+    pthread_setspecific(stats_key, &threads[0].stats);
 
     for (i = 0; i < nthreads; i++) {
+#ifdef HAVE_EVENTFD
+        int efd = eventfd(0, 0);
+        if (efd == -1) {
+            perror("Can't create notify eventfd");
+            exit(1);
+        }
+
+        threads[i].notify_receive_fd = efd;
+        threads[i].notify_send_fd = efd;
+#else
         int fds[2];
         if (pipe(fds)) {
             perror("Can't create notify pipe");
@@ -473,6 +735,7 @@ void thread_init(int nthreads, struct event_base *main_base) {
 
         threads[i].notify_receive_fd = fds[0];
         threads[i].notify_send_fd = fds[1];
+#endif
 
     setup_thread(&threads[i]);
     }
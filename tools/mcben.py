@@ -33,10 +33,18 @@ class MemcacheBenchCase(object):
   def run(self):
       print 'Benchmarking (be patient).....'
       for i in range(self.ben_cfg_['threads']):
+        if self.ben_cfg_['distinct']:
+          prefix = 'test%03d' % (i,)
+        else:
+          prefix = 'test'
         if self.ben_cfg_['command'] == 'SET':
-          thread = Setter(self.ben_cfg_['server'], self.ben_cfg_['requests'], self.ben_cfg_['length'])
+          thread = Setter(self.ben_cfg_['server'], self.ben_cfg_['requests'], self.ben_cfg_['length'], prefix)
         elif self.ben_cfg_['command'] == 'GET':
-          thread = Getter(self.ben_cfg_['server'], self.ben_cfg_['requests'], self.ben_cfg_['length'])
+          thread = Getter(self.ben_cfg_['server'], self.ben_cfg_['requests'], self.ben_cfg_['length'], prefix)
+        elif self.ben_cfg_['command'] == 'INCR':
+          thread = Incrementer(self.ben_cfg_['server'], self.ben_cfg_['requests'], self.ben_cfg_['length'], prefix)
+        elif self.ben_cfg_['command'] == 'APPEND':
+          thread = Appender(self.ben_cfg_['server'], self.ben_cfg_['requests'], self.ben_cfg_['length'], prefix)
         else:
           print 'unknown command'
           sys.exit(1)
@@ -83,17 +91,18 @@ class MemcacheBenchCase(object):
     print 'Total errors: %d' % total_errors
 
 class Setter(threading.Thread):
-  def __init__(self, server, requests, value_length):
+  def __init__(self, server, requests, value_length, prefix):
     self.mc_ = memcache.Client([server], debug=0)
     self.requests_ = requests
     self.value_length_ = value_length
+    self.prefix_ = prefix
     threading.Thread.__init__(self)
     
   def run(self):
     begin = time.time()
     errors = 0
     for i in range(self.requests_):
-      ret = self.mc_.set("test-%011d" % (i,), "*" * self.value_length_)
+      ret = self.mc_.set("%s-%011d" % (self.prefix_, i), "*" * self.value_length_)
       if not ret:
         errors = errors + 1
     end = time.time()
@@ -108,17 +117,18 @@ class Setter(threading.Thread):
     self.mc_.disconnect_all()
     
 class Getter(threading.Thread):
-  def __init__(self, server, requests, value_length):
+  def __init__(self, server, requests, value_length, prefix):
     self.mc_ = memcache.Client([server], debug=0)
     self.requests_ = requests
     self.value_length_ = value_length
+    self.prefix_ = prefix
     threading.Thread.__init__(self)
 
   def run(self):
     begin = time.time()
     errors = 0
     for i in range(self.requests_):
-      ret = self.mc_.get("test-%011d" % (i,))
+      ret = self.mc_.get("%s-%011d" % (self.prefix_, i))
       if ret == None or len(ret) != self.value_length_:
         errors = errors + 1;
     end = time.time()
@@ -131,15 +141,76 @@ class Getter(threading.Thread):
   def __del__(self):
     self.mc_.disconnect_all()
 
+class Incrementer(threading.Thread):
+  """read-modify-write load: incr over a small set of counters"""
+  def __init__(self, server, requests, value_length, prefix):
+    self.mc_ = memcache.Client([server], debug=0)
+    self.requests_ = requests
+    self.prefix_ = prefix
+    threading.Thread.__init__(self)
+
+  def run(self):
+    for i in range(100):
+      self.mc_.set("%s-cnt-%03d" % (self.prefix_, i), "0")
+    begin = time.time()
+    errors = 0
+    for i in range(self.requests_):
+      ret = self.mc_.incr("%s-cnt-%03d" % (self.prefix_, i % 100))
+      if ret == None:
+        errors = errors + 1
+    end = time.time()
+    ben_result_mutex.acquire()
+    ben_result.append((self.getName(), end - begin, errors))
+    ben_result_mutex.release()
+    print 'Thread name: %s; Time cost: %f seconds; Requests: %d; Errors: %d' % (self.getName(),
+          end - begin, self.requests_, errors)
+
+  def __del__(self):
+    self.mc_.disconnect_all()
+
+class Appender(threading.Thread):
+  """read-modify-write load: append to a small set of keys"""
+  def __init__(self, server, requests, value_length, prefix):
+    self.mc_ = memcache.Client([server], debug=0)
+    self.requests_ = requests
+    self.value_length_ = value_length
+    self.prefix_ = prefix
+    threading.Thread.__init__(self)
+
+  def run(self):
+    for i in range(100):
+      self.mc_.set("%s-app-%03d" % (self.prefix_, i), "*")
+    begin = time.time()
+    errors = 0
+    for i in range(self.requests_):
+      # restart the key once in a while so values don't grow without bound
+      if i % 10000 < 100:
+        ret = self.mc_.set("%s-app-%03d" % (self.prefix_, i % 100), "*")
+      else:
+        ret = self.mc_.append("%s-app-%03d" % (self.prefix_, i % 100), "*" * self.value_length_)
+      if not ret:
+        errors = errors + 1
+    end = time.time()
+    ben_result_mutex.acquire()
+    ben_result.append((self.getName(), end - begin, errors))
+    ben_result_mutex.release()
+    print 'Thread name: %s; Time cost: %f seconds; Requests: %d; Errors: %d' % (self.getName(),
+          end - begin, self.requests_, errors)
+
+  def __del__(self):
+    self.mc_.disconnect_all()
+
 def usage():
   print 'Usage: python mdbben.py [options]'
   print 'Options are:'
   print '  --server=<ip:port>, -s <ip:port>     Server that the suit connects to, default is \'127.0.0.1:21201\''
-  print '  --command=<command>, -c <command>    Operation that intends to run, \'SET\' or \'GET\', default is \'SET\''
+  print '  --command=<command>, -c <command>    Operation that intends to run, \'SET\', \'GET\', \'INCR\' or \'APPEND\','
+  print '                                       default is \'SET\''
   print '  --threads=<threads>, -t <threads>    Number of threads to run the benchmark, default is 4'
   print '  --requests=<requests>, -n <requests> Number of requests to perform, default is 100000 per thread'
   print '  --length=<length>, -l <length>'
   print '                                       Length of an object value, default is 100 btyes'
+  print '  --distinct, -d                       Every thread works on its own keys instead of a shared key set'
   print '  --help, -h                           Display usage information (this message)'
   print
 
@@ -148,10 +219,11 @@ def main(args):
              'command': 'SET',
              'threads': 4,
              'requests': 100000,
-             'length': 100}
+             'length': 100,
+             'distinct': False}
   try:
-    opts, args = getopt.getopt(sys.argv[1:], "s:c:t:n:l:h", 
-                 ["server=", "command=", "threads=", "requests=", "length=", "help"])
+    opts, args = getopt.getopt(sys.argv[1:], "s:c:t:n:l:dh", 
+                 ["server=", "command=", "threads=", "requests=", "length=", "distinct", "help"])
   except getopt.GetoptError, err:
     print str(err) 
     usage()
@@ -168,6 +240,8 @@ def main(args):
       ben_cfg["requests"] = int(a)
     elif o in ("-l", "--length"):
       ben_cfg["length"] = int(a)
+    elif o in ("-d", "--distinct"):
+      ben_cfg["distinct"] = True
     elif o in ("-h", "--help"):
       usage()
       sys.exit()
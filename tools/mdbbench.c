@@ -0,0 +1,1035 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+/*
+ * mdbbench, a load generator for memcachedb, built with "make bench".
+ *
+ * Each thread runs a libevent loop over its connections. A connection
+ * keeps -d requests in flight, sending a new one as each reply comes back,
+ * so the load follows what the server can do rather than what a client
+ * can push. A request is a get of -m keys or a set, -r of them gets; the
+ * keys are picked uniformly or, with -z, zipfian with the hottest ranks
+ * scattered over the key space; the values are -v bytes, or log-uniform
+ * between two sizes. ASCII, binary and UDP are spoken; over UDP each
+ * socket has one request in flight, and one with no reply in a second is
+ * counted as a timeout.
+ *
+ * With -L it stores every key once instead, the threads splitting the
+ * keys between them, and stops when done.
+ *
+ * The report is one "<name> <value>" line per figure, so that the reports
+ * of two builds can be compared line by line (tools/mdbbench.sh does).
+ * Latency is from the request going out to its reply being parsed, into
+ * HDR style histograms of about 3% resolution.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <event.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "protocol_binary.h"
+
+#define MAX_DEPTH 256
+
+#define MAX_MULTIGET 100
+
+#define MAX_KEY_LENGTH 250
+
+/* bytes of the frame header in front of every UDP datagram */
+#define UDP_HEADER_SIZE 8
+
+/* the most a request datagram may be, as the server reads them */
+#define UDP_MAX_REQUEST 8192
+
+#define UDP_TIMEOUT_MS 1000
+
+/*
+ * Latency histograms as in stats.c, with finer buckets: below LAT_SUB_BUCKETS
+ * microseconds one bucket per microsecond, then LAT_SUB_BUCKETS buckets per
+ * power of two.
+ */
+#define LAT_SUB_BITS 5
+#define LAT_SUB_BUCKETS (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (LAT_SUB_BUCKETS * 28)
+
+enum protocol { PROTO_ASCII, PROTO_BINARY, PROTO_UDP };
+
+static const char *protocol_names[] = { "ascii", "binary", "udp" };
+
+enum req_kind { REQ_GET, REQ_SET, REQ_NKINDS };
+
+static const char *req_names[REQ_NKINDS] = { "get", "set" };
+
+struct hist {
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t buckets[LAT_BUCKETS];
+};
+
+struct bench_stats {
+    uint64_t ops[REQ_NKINDS];
+    uint64_t get_keys;
+    uint64_t get_hits;
+    uint64_t errors;
+    uint64_t timeouts;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    struct hist lat[REQ_NKINDS];
+};
+
+static struct settings {
+    char *host;
+    char *port;
+    enum protocol proto;
+    int threads;
+    int conns;          /* per thread */
+    int depth;          /* requests in flight per connection */
+    int multiget;       /* keys per get */
+    uint64_t keys;
+    double zipf;        /* 0 for uniform */
+    double reads;       /* fraction of the requests that are gets */
+    int vmin, vmax;
+    int duration;       /* seconds measured */
+    int warmup;         /* seconds run before measuring */
+    bool load;
+    char *prefix;
+} settings;
+
+typedef struct worker worker;
+
+typedef struct {
+    worker *w;
+    int fd;
+    bool dead;
+    struct event rev, wev, tev;
+    bool wev_added;
+
+    char *wbuf;
+    size_t wsize, wlen, woff;
+    char *rbuf;
+    size_t rsize, rlen, rpos;
+
+    /* the requests in flight, oldest at head */
+    int head, inflight;
+    uint8_t kind[MAX_DEPTH];
+    uint8_t nkeys[MAX_DEPTH];
+    uint8_t hits[MAX_DEPTH];
+    uint64_t sent[MAX_DEPTH];
+
+    uint16_t udp_id, udp_seq;
+} conn;
+
+struct worker {
+    pthread_t tid;
+    struct event_base *base;
+    struct event stop_ev;
+    conn *conns;
+    int live;           /* connections not done */
+    uint64_t rng;
+    uint64_t next_key, end_key;   /* with -L */
+    struct bench_stats stats;
+};
+
+static struct addrinfo *server_ai;
+static char *values;
+static uint64_t measure_start, measure_end;
+
+/* the zipfian generator of Gray et al., "Quickly generating billion-record
+   synthetic databases", as YCSB uses it */
+static double zipf_zetan, zipf_eta, zipf_alpha, zipf_half;
+static uint64_t key_scatter;
+
+static uint64_t now_us(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static uint64_t rng_next(uint64_t *s) {
+    uint64_t x = *s;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *s = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double rng_double(uint64_t *s) {
+    return (rng_next(s) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+static void keys_init(void) {
+    uint64_t i;
+
+    /* rank r is key r * key_scatter mod keys, so that the hot keys don't
+       all sit next to each other on a few database pages */
+    key_scatter = 2654435761ULL % settings.keys;
+    if (key_scatter == 0)
+        key_scatter = 1;
+    while (gcd(key_scatter, settings.keys) != 1)
+        key_scatter++;
+
+    if (settings.zipf == 0)
+        return;
+    for (i = 1; i <= settings.keys; i++)
+        zipf_zetan += 1.0 / pow((double)i, settings.zipf);
+    zipf_half = 1.0 + pow(0.5, settings.zipf);
+    zipf_alpha = 1.0 / (1.0 - settings.zipf);
+    zipf_eta = (1.0 - pow(2.0 / settings.keys, 1.0 - settings.zipf)) / (1.0 - zipf_half / zipf_zetan);
+}
+
+static uint64_t key_pick(worker *w) {
+    uint64_t rank;
+    double u, uz;
+
+    if (settings.zipf == 0) {
+        rank = rng_next(&w->rng) % settings.keys;
+    } else {
+        u = rng_double(&w->rng);
+        uz = u * zipf_zetan;
+        if (uz < 1.0)
+            rank = 0;
+        else if (uz < zipf_half)
+            rank = 1;
+        else
+            rank = (uint64_t)(settings.keys * pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+        if (rank >= settings.keys)
+            rank = settings.keys - 1;
+    }
+    return rank * key_scatter % settings.keys;
+}
+
+static int value_size(worker *w) {
+    if (settings.vmin == settings.vmax)
+        return settings.vmin;
+    return (int)(settings.vmin * pow((double)settings.vmax / settings.vmin, rng_double(&w->rng)));
+}
+
+static int lat_bucket(const uint64_t us) {
+    int msb, b;
+
+    if (us < LAT_SUB_BUCKETS)
+        return (int)us;
+    msb = 63 - __builtin_clzll(us);
+    b = (msb - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS
+        + (int)((us >> (msb - LAT_SUB_BITS)) & (LAT_SUB_BUCKETS - 1));
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+static uint64_t lat_bucket_max(const int b) {
+    if (b < LAT_SUB_BUCKETS)
+        return b;
+    return ((uint64_t)(LAT_SUB_BUCKETS + b % LAT_SUB_BUCKETS + 1)
+            << (b / LAT_SUB_BUCKETS - 1)) - 1;
+}
+
+static uint64_t lat_percentile(const struct hist *h, const double p) {
+    uint64_t want = (uint64_t)(h->count * p + 0.5);
+    uint64_t seen = 0;
+    int b;
+
+    if (want == 0)
+        want = 1;
+    for (b = 0; b < LAT_BUCKETS - 1; b++) {
+        seen += h->buckets[b];
+        if (seen >= want)
+            break;
+    }
+    return lat_bucket_max(b);
+}
+
+static void hist_add(struct hist *to, const struct hist *from) {
+    int b;
+
+    to->count += from->count;
+    to->total_us += from->total_us;
+    for (b = 0; b < LAT_BUCKETS; b++)
+        to->buckets[b] += from->buckets[b];
+}
+
+/* room for n more bytes at the end of the write buffer */
+static char *wbuf_reserve(conn *c, const size_t n) {
+    if (c->woff > 0 && c->woff == c->wlen)
+        c->woff = c->wlen = 0;
+    if (c->wlen + n > c->wsize) {
+        size_t size = c->wsize * 2;
+        char *p;
+
+        while (size < c->wlen + n)
+            size *= 2;
+        if ((p = realloc(c->wbuf, size)) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        c->wbuf = p;
+        c->wsize = size;
+    }
+    return c->wbuf + c->wlen;
+}
+
+static int key_format(char *buf, const uint64_t k) {
+    return sprintf(buf, "%s%llu", settings.prefix, (unsigned long long)k);
+}
+
+static void bin_header(char *buf, const uint8_t opcode, const int nkey, const int extlen,
+                       const uint32_t bodylen) {
+    protocol_binary_request_header *h = (protocol_binary_request_header *)buf;
+
+    memset(h, 0, sizeof(*h));
+    h->request.magic = PROTOCOL_BINARY_REQ;
+    h->request.opcode = opcode;
+    h->request.keylen = htons(nkey);
+    h->request.extlen = extlen;
+    h->request.bodylen = htonl(bodylen);
+}
+
+/* appends a get of nkeys keys to the write buffer */
+static void add_get(conn *c, const int nkeys) {
+    char key[MAX_KEY_LENGTH + 1];
+    char *p;
+    int i, n;
+
+    if (settings.proto != PROTO_BINARY) {
+        p = wbuf_reserve(c, 4 + nkeys * (MAX_KEY_LENGTH + 1) + 2);
+        memcpy(p, "get", 3);
+        p += 3;
+        for (i = 0; i < nkeys; i++) {
+            *p++ = ' ';
+            p += key_format(p, key_pick(c->w));
+        }
+        memcpy(p, "\r\n", 2);
+        c->wlen = p + 2 - c->wbuf;
+        return;
+    }
+    /* one GET, or GETKQs, which say nothing of a miss, ended by a NOOP */
+    for (i = 0; i < nkeys; i++) {
+        n = key_format(key, key_pick(c->w));
+        p = wbuf_reserve(c, 24 + n);
+        bin_header(p, nkeys == 1 ? PROTOCOL_BINARY_CMD_GET : PROTOCOL_BINARY_CMD_GETKQ, n, 0, n);
+        memcpy(p + 24, key, n);
+        c->wlen += 24 + n;
+    }
+    if (nkeys > 1) {
+        p = wbuf_reserve(c, 24);
+        bin_header(p, PROTOCOL_BINARY_CMD_NOOP, 0, 0, 0);
+        c->wlen += 24;
+    }
+}
+
+static void add_set(conn *c, const uint64_t k) {
+    char key[MAX_KEY_LENGTH + 1];
+    int nkey = key_format(key, k);
+    int vlen = value_size(c->w);
+    char *p;
+
+    if (settings.proto != PROTO_BINARY) {
+        p = wbuf_reserve(c, nkey + vlen + 64);
+        p += sprintf(p, "set %s 0 0 %d\r\n", key, vlen);
+        memcpy(p, values, vlen);
+        memcpy(p + vlen, "\r\n", 2);
+        c->wlen = p + vlen + 2 - c->wbuf;
+        return;
+    }
+    p = wbuf_reserve(c, 24 + 8 + nkey + vlen);
+    bin_header(p, PROTOCOL_BINARY_CMD_SET, nkey, 8, 8 + nkey + vlen);
+    memset(p + 24, 0, 8);   /* flags and expiry */
+    memcpy(p + 32, key, nkey);
+    memcpy(p + 32 + nkey, values, vlen);
+    c->wlen += 24 + 8 + nkey + vlen;
+}
+
+static void conn_done(conn *c);
+static void conn_flush(conn *c);
+
+/* sends new requests until -d are in flight, or the keys run out with -L */
+static void conn_fill(conn *c) {
+    int slot, nkeys = 1;
+    enum req_kind kind;
+    size_t start;
+
+    while (c->inflight < settings.depth && !c->dead) {
+        if (settings.load) {
+            if (c->w->next_key >= c->w->end_key)
+                break;
+            kind = REQ_SET;
+        } else {
+            kind = rng_double(&c->w->rng) < settings.reads ? REQ_GET : REQ_SET;
+        }
+
+        start = c->wlen;
+        if (settings.proto == PROTO_UDP) {
+            /* the frame header: request id, sequence 0 of 1 datagram */
+            char *p = wbuf_reserve(c, UDP_HEADER_SIZE);
+            uint16_t hdr[4];
+
+            start = c->wlen;
+            hdr[0] = htons(++c->udp_id);
+            hdr[1] = 0;
+            hdr[2] = htons(1);
+            hdr[3] = 0;
+            memcpy(p, hdr, UDP_HEADER_SIZE);
+            c->wlen += UDP_HEADER_SIZE;
+            c->udp_seq = 0;
+            c->rlen = c->rpos = 0;
+        }
+        if (kind == REQ_GET) {
+            nkeys = settings.multiget;
+            add_get(c, nkeys);
+        } else {
+            add_set(c, settings.load ? c->w->next_key++ : key_pick(c->w));
+        }
+        if (settings.proto == PROTO_UDP && c->wlen - start > UDP_MAX_REQUEST) {
+            fprintf(stderr, "requests of %d bytes don't fit in one UDP datagram\n",
+                    (int)(c->wlen - start));
+            exit(EXIT_FAILURE);
+        }
+        c->w->stats.bytes_out += c->wlen - start;
+
+        slot = (c->head + c->inflight) % MAX_DEPTH;
+        c->kind[slot] = kind;
+        c->nkeys[slot] = nkeys;
+        c->hits[slot] = 0;
+        c->sent[slot] = now_us();
+        c->inflight++;
+        if (settings.proto == PROTO_UDP) {
+            struct timeval tv = { UDP_TIMEOUT_MS / 1000, (UDP_TIMEOUT_MS % 1000) * 1000 };
+
+            evtimer_add(&c->tev, &tv);
+        }
+    }
+    if (c->inflight == 0 && !c->dead) {
+        conn_done(c);
+        return;
+    }
+    conn_flush(c);
+}
+
+/* the oldest request in flight got its reply */
+static void req_done(conn *c, const bool error) {
+    struct bench_stats *st = &c->w->stats;
+    int slot = c->head;
+    enum req_kind kind = c->kind[slot];
+    uint64_t now = now_us();
+    uint64_t us = now > c->sent[slot] ? now - c->sent[slot] : 0;
+
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->inflight--;
+    if (settings.load || (c->sent[slot] >= measure_start && now <= measure_end)) {
+        st->ops[kind]++;
+        if (error)
+            st->errors++;
+        if (kind == REQ_GET) {
+            st->get_keys += c->nkeys[slot];
+            st->get_hits += c->hits[slot];
+        }
+        st->lat[kind].count++;
+        st->lat[kind].total_us += us;
+        st->lat[kind].buckets[lat_bucket(us)]++;
+    }
+}
+
+static char *find_crlf(char *p, const size_t n) {
+    char *e = memchr(p, '\n', n);
+
+    return (e != NULL && e > p && e[-1] == '\r') ? e - 1 : NULL;
+}
+
+/* parses the ASCII replies in the read buffer; false if one is garbled */
+static bool parse_ascii(conn *c) {
+    while (c->inflight > 0) {
+        char *line = c->rbuf + c->rpos;
+        size_t avail = c->rlen - c->rpos;
+        char *end = find_crlf(line, avail);
+        size_t nline;
+
+        if (end == NULL) {
+            if (memchr(line, '\n', avail) != NULL)
+                return false;
+            break;
+        }
+        nline = end - line + 2;
+        if (c->kind[c->head] == REQ_GET && nline > 6 && memcmp(line, "VALUE ", 6) == 0) {
+            unsigned int bytes;
+
+            *end = '\0';
+            if (sscanf(line, "VALUE %*s %*u %u", &bytes) != 1)
+                return false;
+            *end = '\r';
+            if (avail < nline + bytes + 2)
+                break;
+            c->hits[c->head]++;
+            c->rpos += nline + bytes + 2;
+            continue;
+        }
+        c->rpos += nline;
+        if (c->kind[c->head] == REQ_GET)
+            req_done(c, !(nline == 5 && memcmp(line, "END", 3) == 0));
+        else
+            req_done(c, !(nline == 8 && memcmp(line, "STORED", 6) == 0));
+    }
+    return true;
+}
+
+static bool parse_binary(conn *c) {
+    while (c->inflight > 0) {
+        protocol_binary_response_header h;
+        enum req_kind kind = c->kind[c->head];
+        bool multi = kind == REQ_GET && c->nkeys[c->head] > 1;
+        size_t avail = c->rlen - c->rpos;
+        uint32_t bodylen;
+        uint16_t status;
+
+        if (avail < sizeof(h))
+            break;
+        memcpy(&h, c->rbuf + c->rpos, sizeof(h));
+        if (h.response.magic != PROTOCOL_BINARY_RES)
+            return false;
+        bodylen = ntohl(h.response.bodylen);
+        status = ntohs(h.response.status);
+        if (avail < sizeof(h) + bodylen)
+            break;
+        c->rpos += sizeof(h) + bodylen;
+
+        if (multi && h.response.opcode == PROTOCOL_BINARY_CMD_GETKQ) {
+            if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS)
+                c->hits[c->head]++;
+            continue;
+        }
+        if (kind == REQ_GET && !multi && status == PROTOCOL_BINARY_RESPONSE_SUCCESS)
+            c->hits[c->head]++;
+        req_done(c, kind == REQ_GET ? status != PROTOCOL_BINARY_RESPONSE_SUCCESS
+                                      && status != PROTOCOL_BINARY_RESPONSE_KEY_ENOENT
+                                    : status != PROTOCOL_BINARY_RESPONSE_SUCCESS);
+    }
+    return true;
+}
+
+/* a connection is done: with -L out of keys, or the server went away */
+static void conn_done(conn *c) {
+    if (c->dead)
+        return;
+    c->dead = true;
+    event_del(&c->rev);
+    if (c->wev_added)
+        event_del(&c->wev);
+    if (settings.proto == PROTO_UDP)
+        evtimer_del(&c->tev);
+    close(c->fd);
+    if (--c->w->live == 0)
+        event_base_loopbreak(c->w->base);
+}
+
+static void conn_fail(conn *c, const char *what) {
+    /* the server may close before the run ends, say, but not after */
+    if (settings.load || now_us() < measure_end)
+        fprintf(stderr, "connection %d: %s\n", c->fd, what);
+    c->w->stats.errors += c->inflight;
+    c->inflight = 0;
+    conn_done(c);
+}
+
+static void conn_flush(conn *c) {
+    ssize_t n;
+
+    while (c->woff < c->wlen) {
+        if (settings.proto == PROTO_UDP) {
+            n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, 0);
+        } else {
+            n = write(c->fd, c->wbuf + c->woff, c->wlen - c->woff);
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!c->wev_added) {
+                    event_add(&c->wev, NULL);
+                    c->wev_added = true;
+                }
+                return;
+            }
+            conn_fail(c, strerror(errno));
+            return;
+        }
+        c->woff += n;
+    }
+    c->woff = c->wlen = 0;
+    if (c->wev_added) {
+        event_del(&c->wev);
+        c->wev_added = false;
+    }
+}
+
+static void write_handler(const int fd, const short which, void *arg) {
+    conn *c = arg;
+
+    c->wev_added = false;
+    conn_flush(c);
+}
+
+/* takes in one UDP datagram; false if it belongs to no request */
+static bool udp_receive(conn *c, const char *buf, const size_t n) {
+    uint16_t hdr[4];
+
+    if (n < UDP_HEADER_SIZE || c->inflight == 0)
+        return false;
+    memcpy(hdr, buf, UDP_HEADER_SIZE);
+    if (ntohs(hdr[0]) != c->udp_id)
+        return false;
+    if (ntohs(hdr[1]) != c->udp_seq) {
+        /* a datagram of the reply went missing */
+        c->w->stats.timeouts++;
+        c->head = (c->head + 1) % MAX_DEPTH;
+        c->inflight--;
+        return true;
+    }
+    c->udp_seq++;
+    memcpy(c->rbuf + c->rlen, buf + UDP_HEADER_SIZE, n - UDP_HEADER_SIZE);
+    c->rlen += n - UDP_HEADER_SIZE;
+    return true;
+}
+
+static void read_handler(const int fd, const short which, void *arg) {
+    conn *c = arg;
+    ssize_t n;
+    bool ok;
+
+    for (;;) {
+        if (c->rpos > 0) {
+            memmove(c->rbuf, c->rbuf + c->rpos, c->rlen - c->rpos);
+            c->rlen -= c->rpos;
+            c->rpos = 0;
+        }
+        if (c->rsize - c->rlen < 65536) {
+            char *p = realloc(c->rbuf, c->rsize * 2);
+
+            if (p == NULL) {
+                fprintf(stderr, "out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            c->rbuf = p;
+            c->rsize *= 2;
+        }
+        if (settings.proto == PROTO_UDP) {
+            char dgram[65536];
+
+            if ((n = recv(c->fd, dgram, sizeof(dgram), 0)) > 0) {
+                if (!udp_receive(c, dgram, n))
+                    continue;
+                c->w->stats.bytes_in += n;
+            }
+        } else {
+            n = read(c->fd, c->rbuf + c->rlen, c->rsize - c->rlen);
+            if (n > 0) {
+                c->rlen += n;
+                c->w->stats.bytes_in += n;
+            }
+        }
+        if (n == 0) {
+            conn_fail(c, "closed by the server");
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            conn_fail(c, strerror(errno));
+            return;
+        }
+    }
+
+    /* new requests go out only once all that came in is read, or one
+       connection could keep its thread to itself */
+    ok = settings.proto == PROTO_BINARY ? parse_binary(c) : parse_ascii(c);
+    if (!ok) {
+        conn_fail(c, "garbled reply");
+        return;
+    }
+    if (c->inflight < settings.depth) {
+        if (settings.proto == PROTO_UDP && c->inflight == 0)
+            evtimer_del(&c->tev);
+        conn_fill(c);
+    }
+}
+
+static void timeout_handler(const int fd, const short which, void *arg) {
+    conn *c = arg;
+
+    if (c->dead || c->inflight == 0)
+        return;
+    c->w->stats.timeouts++;
+    c->head = (c->head + 1) % MAX_DEPTH;
+    c->inflight--;
+    conn_fill(c);
+}
+
+static void stop_handler(const int fd, const short which, void *arg) {
+    worker *w = arg;
+
+    event_base_loopbreak(w->base);
+}
+
+static int conn_open(conn *c) {
+    int type = settings.proto == PROTO_UDP ? SOCK_DGRAM : SOCK_STREAM;
+    int flags = 1;
+    struct addrinfo *ai;
+
+    for (ai = server_ai; ai != NULL; ai = ai->ai_next) {
+        if (ai->ai_socktype != type)
+            continue;
+        if ((c->fd = socket(ai->ai_family, type, 0)) == -1)
+            continue;
+        if (connect(c->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(c->fd);
+    }
+    if (ai == NULL) {
+        fprintf(stderr, "can not connect to %s:%s: %s\n", settings.host, settings.port,
+                strerror(errno));
+        return -1;
+    }
+    if (type == SOCK_STREAM)
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+    if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("setting O_NONBLOCK");
+        return -1;
+    }
+
+    c->wsize = 16384;
+    c->rsize = 131072;
+    if ((c->wbuf = malloc(c->wsize)) == NULL || (c->rbuf = malloc(c->rsize)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return -1;
+    }
+    event_set(&c->rev, c->fd, EV_READ | EV_PERSIST, read_handler, c);
+    event_base_set(c->w->base, &c->rev);
+    event_set(&c->wev, c->fd, EV_WRITE, write_handler, c);
+    event_base_set(c->w->base, &c->wev);
+    evtimer_set(&c->tev, timeout_handler, c);
+    event_base_set(c->w->base, &c->tev);
+    return event_add(&c->rev, NULL);
+}
+
+static void *worker_main(void *arg) {
+    worker *w = arg;
+    int i;
+
+    for (i = 0; i < settings.conns; i++)
+        conn_fill(&w->conns[i]);
+    if (w->live > 0)
+        event_base_loop(w->base, 0);
+    return NULL;
+}
+
+static void usage(void) {
+    printf("mdbbench, a load generator for memcachedb\n");
+    printf("-s <host:port>  server, default is 127.0.0.1:21201\n"
+           "-P <protocol>   'ascii', 'binary' or 'udp', default is ascii\n"
+           "-t <num>        threads, default is 1\n"
+           "-c <num>        connections per thread, default is 16\n"
+           "-d <num>        requests in flight per connection, default is 1\n"
+           "-m <num>        keys per get, default is 1\n"
+           "-k <num>        keys, default is 100000\n"
+           "-z <theta>      zipfian key popularity, 0 < theta < 1 (0.99 is usual),\n"
+           "                default is 0, uniform\n"
+           "-r <fraction>   of the requests that are gets, the rest sets, default is 0.9\n"
+           "-v <num>        value size in bytes, or <min>-<max> for sizes spread\n"
+           "                log-uniformly between the two, default is 100\n"
+           "-D <num>        seconds to measure, default is 10\n"
+           "-W <num>        seconds to run before measuring, default is 0\n"
+           "-L              store every key once and stop, instead\n"
+           "-p <prefix>     of the keys, default is 'mdbbench:'\n"
+           "-h              print this help and exit\n");
+}
+
+static void report(const struct bench_stats *st, const double elapsed) {
+    struct hist all;
+    uint64_t ops = st->ops[REQ_GET] + st->ops[REQ_SET];
+    int k, b;
+
+    memset(&all, 0, sizeof(all));
+    printf("protocol %s\n", protocol_names[settings.proto]);
+    printf("threads %d\n", settings.threads);
+    printf("connections %d\n", settings.threads * settings.conns);
+    printf("depth %d\n", settings.depth);
+    printf("multiget %d\n", settings.multiget);
+    printf("keys %llu\n", (unsigned long long)settings.keys);
+    printf("zipf %.2f\n", settings.zipf);
+    printf("reads %.2f\n", settings.load ? 0.0 : settings.reads);
+    printf("value_bytes %d-%d\n", settings.vmin, settings.vmax);
+    printf("elapsed_sec %.3f\n", elapsed);
+    printf("ops %llu\n", (unsigned long long)ops);
+    printf("ops_per_sec %.0f\n", ops / elapsed);
+    printf("gets %llu\n", (unsigned long long)st->ops[REQ_GET]);
+    printf("get_keys_per_sec %.0f\n", st->get_keys / elapsed);
+    printf("get_hit_ratio %.4f\n", st->get_keys ? (double)st->get_hits / st->get_keys : 0.0);
+    printf("sets %llu\n", (unsigned long long)st->ops[REQ_SET]);
+    printf("errors %llu\n", (unsigned long long)st->errors);
+    printf("timeouts %llu\n", (unsigned long long)st->timeouts);
+    printf("mbytes_out_per_sec %.2f\n", st->bytes_out / elapsed / 1048576);
+    printf("mbytes_in_per_sec %.2f\n", st->bytes_in / elapsed / 1048576);
+    for (k = 0; k <= REQ_NKINDS; k++) {
+        const struct hist *h = k < REQ_NKINDS ? &st->lat[k] : &all;
+        const char *name = k < REQ_NKINDS ? req_names[k] : "all";
+
+        if (k < REQ_NKINDS)
+            hist_add(&all, h);
+        if (h->count == 0)
+            continue;
+        for (b = LAT_BUCKETS - 1; b > 0 && h->buckets[b] == 0; b--)
+            ;
+        printf("%s_avg_us %llu\n", name, (unsigned long long)(h->total_us / h->count));
+        printf("%s_p50_us %llu\n", name, (unsigned long long)lat_percentile(h, 0.50));
+        printf("%s_p99_us %llu\n", name, (unsigned long long)lat_percentile(h, 0.99));
+        printf("%s_p999_us %llu\n", name, (unsigned long long)lat_percentile(h, 0.999));
+        printf("%s_max_us %llu\n", name, (unsigned long long)lat_bucket_max(b));
+    }
+}
+
+int main(int argc, char **argv) {
+    struct bench_stats total;
+    struct addrinfo hints;
+    worker *workers;
+    uint64_t start, per;
+    char *colon;
+    int c, i, j, error;
+
+    settings.host = "127.0.0.1";
+    settings.port = "21201";
+    settings.proto = PROTO_ASCII;
+    settings.threads = 1;
+    settings.conns = 16;
+    settings.depth = 1;
+    settings.multiget = 1;
+    settings.keys = 100000;
+    settings.zipf = 0;
+    settings.reads = 0.9;
+    settings.vmin = settings.vmax = 100;
+    settings.duration = 10;
+    settings.warmup = 0;
+    settings.load = false;
+    settings.prefix = "mdbbench:";
+
+    while ((c = getopt(argc, argv, "s:P:t:c:d:m:k:z:r:v:D:W:Lp:h")) != -1) {
+        switch (c) {
+        case 's':
+            settings.host = strdup(optarg);
+            if ((colon = strrchr(settings.host, ':')) != NULL) {
+                *colon = '\0';
+                settings.port = colon + 1;
+            }
+            break;
+        case 'P':
+            for (i = 0; i < 3 && strcmp(optarg, protocol_names[i]) != 0; i++)
+                ;
+            if (i == 3) {
+                fprintf(stderr, "unknown protocol %s\n", optarg);
+                return 1;
+            }
+            settings.proto = i;
+            break;
+        case 't':
+            settings.threads = atoi(optarg);
+            break;
+        case 'c':
+            settings.conns = atoi(optarg);
+            break;
+        case 'd':
+            settings.depth = atoi(optarg);
+            break;
+        case 'm':
+            settings.multiget = atoi(optarg);
+            break;
+        case 'k':
+            settings.keys = strtoull(optarg, NULL, 10);
+            break;
+        case 'z':
+            settings.zipf = atof(optarg);
+            break;
+        case 'r':
+            settings.reads = atof(optarg);
+            break;
+        case 'v':
+            if (sscanf(optarg, "%d-%d", &settings.vmin, &settings.vmax) != 2)
+                settings.vmax = settings.vmin = atoi(optarg);
+            break;
+        case 'D':
+            settings.duration = atoi(optarg);
+            break;
+        case 'W':
+            settings.warmup = atoi(optarg);
+            break;
+        case 'L':
+            settings.load = true;
+            break;
+        case 'p':
+            settings.prefix = optarg;
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            return 1;
+        }
+    }
+
+    if (settings.threads < 1 || settings.conns < 1 || settings.duration < 1 || settings.warmup < 0) {
+        fprintf(stderr, "-t, -c and -D must be at least 1, -W at least 0\n");
+        return 1;
+    }
+    if (settings.depth < 1 || settings.depth > MAX_DEPTH) {
+        fprintf(stderr, "-d must be between 1 and %d\n", MAX_DEPTH);
+        return 1;
+    }
+    if (settings.multiget < 1 || settings.multiget > MAX_MULTIGET) {
+        fprintf(stderr, "-m must be between 1 and %d\n", MAX_MULTIGET);
+        return 1;
+    }
+    if (settings.keys < 1 || settings.keys > (1ULL << 31)) {
+        fprintf(stderr, "-k must be between 1 and %llu\n", 1ULL << 31);
+        return 1;
+    }
+    if (settings.zipf < 0 || settings.zipf >= 1) {
+        fprintf(stderr, "-z must be at least 0 and below 1\n");
+        return 1;
+    }
+    if (settings.reads < 0 || settings.reads > 1) {
+        fprintf(stderr, "-r must be between 0 and 1\n");
+        return 1;
+    }
+    if (settings.vmin < 1 || settings.vmax < settings.vmin || settings.vmax > 1024 * 1024) {
+        fprintf(stderr, "-v must be between 1 and 1048576 bytes, min first\n");
+        return 1;
+    }
+    if (strlen(settings.prefix) + 20 > MAX_KEY_LENGTH) {
+        fprintf(stderr, "the key prefix is too long\n");
+        return 1;
+    }
+    if (settings.proto == PROTO_UDP) {
+        /* one request in flight per socket, a reply has no other way back */
+        settings.depth = 1;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = settings.proto == PROTO_UDP ? SOCK_DGRAM : SOCK_STREAM;
+    if ((error = getaddrinfo(settings.host, settings.port, &hints, &server_ai)) != 0) {
+        fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+        return 1;
+    }
+
+    if ((values = malloc(settings.vmax)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    /* letters and digits, in no order that repeats soon */
+    for (i = 0; i < settings.vmax; i++)
+        values[i] = "etaoinshrdlucmfwypvbgkjqxz0123456789"[(i * 2654435761U >> 7) % 36];
+    keys_init();
+
+    workers = calloc(settings.threads, sizeof(worker));
+    if (workers == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    per = (settings.keys + settings.threads - 1) / settings.threads;
+    for (i = 0; i < settings.threads; i++) {
+        worker *w = &workers[i];
+
+        w->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        w->next_key = per * i < settings.keys ? per * i : settings.keys;
+        w->end_key = per * (i + 1) < settings.keys ? per * (i + 1) : settings.keys;
+        w->base = event_base_new();
+        if ((w->conns = calloc(settings.conns, sizeof(conn))) == NULL) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        for (j = 0; j < settings.conns; j++) {
+            w->conns[j].w = w;
+            if (conn_open(&w->conns[j]) != 0)
+                return 1;
+        }
+        w->live = settings.conns;
+    }
+
+    start = now_us();
+    measure_start = start + (uint64_t)settings.warmup * 1000000;
+    measure_end = settings.load ? UINT64_MAX : measure_start + (uint64_t)settings.duration * 1000000;
+    for (i = 0; i < settings.threads; i++) {
+        worker *w = &workers[i];
+
+        if (!settings.load) {
+            struct timeval tv = { settings.warmup + settings.duration, 0 };
+
+            evtimer_set(&w->stop_ev, stop_handler, w);
+            event_base_set(w->base, &w->stop_ev);
+            evtimer_add(&w->stop_ev, &tv);
+        }
+        if ((errno = pthread_create(&w->tid, NULL, worker_main, w)) != 0) {
+            fprintf(stderr, "can not create thread: %s\n", strerror(errno));
+            return 1;
+        }
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < settings.threads; i++) {
+        struct bench_stats *st = &workers[i].stats;
+
+        pthread_join(workers[i].tid, NULL);
+        for (j = 0; j < REQ_NKINDS; j++) {
+            total.ops[j] += st->ops[j];
+            hist_add(&total.lat[j], &st->lat[j]);
+        }
+        total.get_keys += st->get_keys;
+        total.get_hits += st->get_hits;
+        total.errors += st->errors;
+        total.timeouts += st->timeouts;
+        total.bytes_out += st->bytes_out;
+        total.bytes_in += st->bytes_in;
+    }
+    report(&total, settings.load ? (now_us() - start) / 1e6 : (double)settings.duration);
+    return total.errors > 0 ? 2 : 0;
+}
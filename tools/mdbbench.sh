@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# Copyright 2008 Steve Chu.  All rights reserved.
+#
+# Use and distribution licensed under the BSD license.  See
+# the LICENSE file for full text.
+#
+# Regression benchmark: runs mdbbench (see "make bench") against a fresh
+# memcachedb for each scenario and prints its report, every line prefixed
+# with the scenario, so that the output of two builds can be compared:
+#
+#   read        zipfian 10-key multigets, pipelined, 5% sets, hot cache
+#   cold        zipfian gets right after a restart with a small cache
+#   write       90% sets of 100B-2KB values, synced, with group commit
+#   replicated  half sets against a master with one replica
+#
+# Usage: sh mdbbench.sh [scenarios...] > results
+#        sh mdbbench.sh compare <old results> <new results>
+#
+# MDB, MDB_HOME, MDB_PORT, MDB_THREADS, MDB_OPTS (added to every server),
+# BENCH, KEYS and DURATION may be set in the environment.
+
+MDB=${MDB:-../memcachedb}
+MDB_HOME=${MDB_HOME:-/tmp/mdbbench}
+MDB_PORT=${MDB_PORT:-21299}
+MDB_THREADS=${MDB_THREADS:-4}
+BENCH=${BENCH:-./mdbbench}
+KEYS=${KEYS:-200000}
+DURATION=${DURATION:-10}
+
+if [ "$1" = "compare" ]; then
+    [ $# -eq 3 ] || { echo "usage: sh mdbbench.sh compare <old> <new>" >&2; exit 1; }
+    awk 'FNR == NR { old[$1] = $2; next }
+         ($1 in old) && $2 ~ /^[0-9.]+$/ && old[$1] ~ /^[0-9.]+$/ {
+             if (old[$1] == 0)
+                 printf "%-32s %12s %12s\n", $1, old[$1], $2
+             else
+                 printf "%-32s %12s %12s %+8.1f%%\n", $1, old[$1], $2, ($2 - old[$1]) * 100 / old[$1]
+         }' "$2" "$3"
+    exit 0
+fi
+
+SCENARIOS=${*:-"read cold write replicated"}
+[ -x "$BENCH" ] || { echo "no $BENCH, build it with make bench" >&2; exit 1; }
+
+# start_mdb <name> <port> [options...]: a server on the home <name>
+start_mdb() {
+    home="$MDB_HOME/$1"
+    port=$2
+    shift 2
+    mkdir -p "$home"
+    $MDB -p $port -H "$home" -t $MDB_THREADS -d -P "$home.pid" $MDB_OPTS "$@" || exit 1
+    sleep 2
+}
+
+stop_mdb() {
+    pid=`cat "$MDB_HOME/$1.pid"`
+    kill $pid
+    while kill -0 $pid 2>/dev/null; do
+        sleep 1
+    done
+}
+
+# bench <scenario> [mdbbench options...]: runs and prefixes the report
+bench() {
+    scenario=$1
+    shift
+    $BENCH -k $KEYS "$@" | sed "s/^/$scenario./"
+}
+
+load() {
+    $BENCH -s 127.0.0.1:$1 -k $KEYS -L -t 2 -c 8 -d 16 -v 100-2000 > /dev/null
+}
+
+for s in $SCENARIOS; do
+    rm -rf "$MDB_HOME"
+    mkdir -p "$MDB_HOME"
+    echo "==== $s" >&2
+    case $s in
+    read)
+        start_mdb read $MDB_PORT -N -m 256
+        load $MDB_PORT
+        bench read -s 127.0.0.1:$MDB_PORT -t 2 -c 16 -d 8 -m 10 -z 0.99 -r 0.95 \
+            -v 100-2000 -W 2 -D $DURATION
+        stop_mdb read
+        ;;
+    cold)
+        start_mdb cold $MDB_PORT -N -m 8
+        load $MDB_PORT
+        stop_mdb cold
+        start_mdb cold $MDB_PORT -N -m 8
+        bench cold -s 127.0.0.1:$MDB_PORT -t 2 -c 16 -z 0.99 -r 1 -D $DURATION
+        stop_mdb cold
+        ;;
+    write)
+        start_mdb write $MDB_PORT -m 64 -g 64 -G 2
+        bench write -s 127.0.0.1:$MDB_PORT -t 2 -c 32 -z 0.99 -r 0.1 -v 100-2000 \
+            -W 2 -D $DURATION
+        stop_mdb write
+        ;;
+    replicated)
+        master=127.0.0.1:`expr $MDB_PORT + 1000`
+        replica=127.0.0.1:`expr $MDB_PORT + 1001`
+        start_mdb master $MDB_PORT -N -R $master -O $replica -M
+        start_mdb replica `expr $MDB_PORT + 1` -N -R $replica -O $master -S
+        sleep 3
+        bench replicated -s 127.0.0.1:$MDB_PORT -t 2 -c 16 -z 0.99 -r 0.5 \
+            -v 100-2000 -W 2 -D $DURATION
+        stop_mdb replica
+        stop_mdb master
+        ;;
+    *)
+        echo "unknown scenario $s" >&2
+        exit 1
+        ;;
+    esac
+done
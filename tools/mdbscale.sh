@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# Copyright 2008 Steve Chu.  All rights reserved.
+#
+# Use and distribution licensed under the BSD license.  See
+# the LICENSE file for full text.
+#
+# Write scalability benchmark: starts a fresh memcachedb for every thread
+# count and runs mcben.py against it with one client thread per server
+# thread, so you can see how write throughput grows with '-t'.
+#
+# Usage: sh mdbscale.sh [SET|INCR|APPEND] [thread counts...]
+#
+# MDB, MDB_HOME, MDB_PORT and REQUESTS may be set in the environment.
+
+MDB=${MDB:-../memcachedb}
+MDB_HOME=${MDB_HOME:-/tmp/mdbscale}
+MDB_PORT=${MDB_PORT:-21299}
+REQUESTS=${REQUESTS:-20000}
+
+COMMAND=${1:-SET}
+[ $# -gt 0 ] && shift
+THREADS=${*:-"1 2 4 8 16"}
+
+for t in $THREADS; do
+    rm -rf "$MDB_HOME"
+    $MDB -p $MDB_PORT -H "$MDB_HOME" -t $t -N -d -P "$MDB_HOME.pid" || exit 1
+    sleep 2
+    echo "==== memcachedb -t $t, $COMMAND"
+    python mcben.py -s 127.0.0.1:$MDB_PORT -c $COMMAND -t $t -n $REQUESTS -d \
+        | grep -E "Thread number|Requests per second|Time cost per request"
+    kill `cat "$MDB_HOME.pid"`
+    sleep 3
+done
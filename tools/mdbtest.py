@@ -14,6 +14,13 @@
 """
 
 import unittest
+import os
+import shutil
+import socket
+import struct
+import tempfile
+import threading
+import time
 import memcache
 
 class MemcacheDBTestCase(unittest.TestCase):
@@ -36,6 +43,358 @@ class MemcacheDBTestCase(unittest.TestCase):
     self.assertEqual(self.mc.get_multi(["testkey1_mget", "testkey2_mget"]), 
                      {"testkey1_mget": "testvalue1_mget", "testkey2_mget": "testvalue2_mget"})
 		
+  def testWideMultiGetCmd(self):
+    keys = ["testkey%03d_wmget" % i for i in range(150)]
+    for k in keys[::2]:
+      self.assert_(self.mc.set(k, k))
+    for k in keys[1::2]:
+      self.mc.delete(k)
+    self.assertEqual(self.mc.get_multi(keys), dict((k, k) for k in keys[::2]))
+
+  def testRgetCmd(self):
+    keys = ["rget_testkey%02d" % i for i in range(10)]
+    for k in keys:
+      self.assert_(self.mc.set(k, k))
+    self.assertEqual(self.mc.rget(keys[2], keys[5]), [(k, k) for k in keys[2:6]])
+    self.assertEqual(self.mc.rget(keys[2], keys[5], 1, 1), [(k, k) for k in keys[3:5]])
+    self.assertEqual(self.mc.rget(keys[0], keys[9], 0, 0, 3), [(k, k) for k in keys[0:3]])
+
+  def testValueSizes(self):
+    # one value per allocator path: small chunk, big chunk, plain malloc
+    for size in (10, 100 * 1024, 800 * 1024):
+      self.assert_(self.mc.set("testkey_size", "x" * size))
+      self.assertEqual(self.mc.get("testkey_size"), "x" * size)
+
+  def binRequest(self, opcode, key="", value="", extras="", opaque=0):
+    return self.binCasRequest(opcode, key, value, extras, 0, opaque)
+
+  def binCasRequest(self, opcode, key, value, extras, cas, opaque=0):
+    return struct.pack("!BBHBBHIIQ", 0x80, opcode, len(key), len(extras), 0, 0,
+                       len(extras) + len(key) + len(value), opaque, cas) + extras + key + value
+
+  def binResponses(self, sock, count):
+    buf, res = "", []
+    while len(res) < count:
+      while len(buf) < 24 or len(buf) < 24 + struct.unpack("!I", buf[8:12])[0]:
+        data = sock.recv(65536)
+        self.assert_(data)
+        buf += data
+      magic, opcode, keylen, extlen, _, status, bodylen, opaque = \
+          struct.unpack("!BBHBBHII", buf[:16])
+      self.assertEqual(magic, 0x81)
+      body = buf[24:24 + bodylen]
+      res.append((opcode, status, opaque, body[extlen:extlen + keylen], body[extlen + keylen:], buf[16:24]))
+      buf = buf[24 + bodylen:]
+    return res
+
+  def testBinaryPipeline(self):
+    # quiet sets answer nothing, the noop flushes the whole batch
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    keys = ["testkey%02d_bin" % i for i in range(20)]
+    flags = struct.pack("!II", 0, 0)
+    req = "".join(self.binRequest(0x11, k, k, flags, i) for i, k in enumerate(keys))
+    sock.sendall(req + self.binRequest(0x0a, opaque=99))
+    self.assertEqual([r[:5] for r in self.binResponses(sock, 1)], [(0x0a, 0, 99, "", "")])
+    # quiet gets only answer hits; the misses stay silent
+    self.mc.delete("testkey_binmiss")
+    req = "".join(self.binRequest(0x0d, k, opaque=i) for i, k in enumerate(keys[:3]))
+    sock.sendall(req + self.binRequest(0x0d, "testkey_binmiss") + self.binRequest(0x0a, opaque=99))
+    res = self.binResponses(sock, 4)
+    self.assertEqual([(r[0], r[1], r[2], r[3]) for r in res],
+                     [(0x0d, 0, 0, keys[0]), (0x0d, 0, 1, keys[1]), (0x0d, 0, 2, keys[2]), (0x0a, 0, 99, "")])
+    self.assertEqual([r[4] for r in res[:3]], keys[:3])
+    self.assertEqual(self.mc.get(keys[5]), keys[5])
+    sock.close()
+
+  def testAsciiPipeline(self):
+    # replies of pipelined commands come back together, in order; stats
+    # is not batched and has the ones before it sent first
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    self.mc.delete("testkey_pipe2")
+    sock.sendall("set testkey_pipe1 0 0 1\r\n1\r\nget testkey_pipe1 testkey_pipe2\r\n"
+                 "incr testkey_pipe1 5\r\ndelete testkey_pipe2\r\nstats\r\n"
+                 "get testkey_pipe1\r\ndelete testkey_pipe1\r\n")
+    buf = ""
+    while not buf.endswith("DELETED\r\n"):
+      buf += sock.recv(65536)
+    self.assert_(buf.startswith("STORED\r\nVALUE testkey_pipe1 0 1\r\n1\r\nEND\r\n6\r\nNOT_FOUND\r\nSTAT pid "))
+    self.assert_(buf.endswith("END\r\nVALUE testkey_pipe1 0 1\r\n6\r\nEND\r\nDELETED\r\n"))
+    sock.close()
+
+  def testBinaryArithmetic(self):
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    self.mc.delete("testkey_binincr")
+    sock.sendall(self.binRequest(0x05, "testkey_binincr", extras=struct.pack("!QQI", 5, 10, 0)))
+    self.assertEqual(self.binResponses(sock, 1)[0][4], struct.pack("!Q", 10))
+    sock.sendall(self.binRequest(0x05, "testkey_binincr", extras=struct.pack("!QQI", 5, 10, 0)))
+    self.assertEqual(self.binResponses(sock, 1)[0][4], struct.pack("!Q", 15))
+    sock.sendall(self.binRequest(0x04, "testkey_binincr") + self.binRequest(0x00, "testkey_binincr"))
+    self.assertEqual([r[1] for r in self.binResponses(sock, 2)], [0, 1])
+    sock.close()
+
+  def testCasCmd(self):
+    self.assert_(self.mc.set("testkey_cas", "testvalue_cas"))
+    self.assertEqual(self.mc.gets("testkey_cas"), "testvalue_cas")
+    self.assert_(self.mc.cas("testkey_cas", "testvalue2_cas"))
+    # the cas from the first gets is stale now
+    self.assert_(not self.mc.cas("testkey_cas", "testvalue3_cas"))
+    self.assertEqual(self.mc.gets("testkey_cas"), "testvalue2_cas")
+    self.assert_(self.mc.cas("testkey_cas", "testvalue3_cas"))
+    self.assertEqual(self.mc.get("testkey_cas"), "testvalue3_cas")
+
+  def testExptime(self):
+    self.assert_(self.mc.set("testkey_exptime", "testvalue_exptime", 2))
+    self.assert_(self.mc.set("testkey_noexptime", "testvalue_noexptime"))
+    self.assertEqual(self.mc.get("testkey_exptime"), "testvalue_exptime")
+    time.sleep(3)
+    self.assertEqual(self.mc.get("testkey_exptime"), None)
+    self.assertEqual(self.mc.get("testkey_noexptime"), "testvalue_noexptime")
+    # gone for add too, long before the sweeper deletes it
+    self.assert_(self.mc.add("testkey_exptime", "testvalue2_exptime"))
+    self.assertEqual(self.mc.get("testkey_exptime"), "testvalue2_exptime")
+
+  def testBinaryCas(self):
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    flags = struct.pack("!II", 0, 0)
+    sock.sendall(self.binRequest(0x01, "testkey_bincas", "a", flags))
+    cas = struct.unpack("!Q", self.binResponses(sock, 1)[0][5])[0]
+    self.assert_(cas != 0)
+    sock.sendall(self.binCasRequest(0x01, "testkey_bincas", "b", flags, cas + 1))
+    self.assertEqual(self.binResponses(sock, 1)[0][1], 0x02)
+    sock.sendall(self.binCasRequest(0x01, "testkey_bincas", "b", flags, cas))
+    self.assertEqual(self.binResponses(sock, 1)[0][1], 0)
+    self.assertEqual(self.mc.get("testkey_bincas"), "b")
+    sock.close()
+
+  def testAddReplace(self):
+    # a binary add of a key that is there and a replace of one that is
+    # not say so; ASCII answers NOT_STORED for both
+    self.assert_(self.mc.set("testkey_addrep1", "a"))
+    self.mc.delete("testkey_addrep2")
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    flags = struct.pack("!II", 0, 0)
+    sock.sendall(self.binRequest(0x02, "testkey_addrep1", "b", flags) +
+                 self.binRequest(0x03, "testkey_addrep2", "b", flags))
+    self.assertEqual([r[1] for r in self.binResponses(sock, 2)], [0x02, 0x01])
+    sock.close()
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    sock.sendall("add testkey_addrep1 0 0 1\r\nb\r\nreplace testkey_addrep2 0 0 1\r\nb\r\n")
+    buf = ""
+    while buf.count("\r\n") < 2:
+      buf += sock.recv(64)
+    self.assertEqual(buf, "NOT_STORED\r\nNOT_STORED\r\n")
+    sock.close()
+    self.assertEqual(self.mc.get("testkey_addrep1"), "a")
+    self.assertEqual(self.mc.get("testkey_addrep2"), None)
+    self.mc.delete("testkey_addrep1")
+
+  def testBinaryTooBig(self):
+    # a set claiming a 4GB body is refused and its body skipped as it comes
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    extras, key = struct.pack("!II", 0, 0), "testkey_bintoobig"
+    self.mc.delete(key)
+    sock.sendall(struct.pack("!BBHBBHIIQ", 0x80, 0x01, len(key), len(extras), 0, 0,
+                             0xffffffff, 7, 0) + extras + key + "x" * 100)
+    self.assertEqual(self.binResponses(sock, 1)[0][:3], (0x01, 0x03, 7))
+    sock.close()
+    self.assertEqual(self.mc.get(key), None)
+    self.assert_(self.mc.set(key, "small"))
+    self.mc.delete(key)
+
+  def stats(self):
+    return self.mc.get_stats()[0][1]
+
+  def testStatsCounters(self):
+    self.assert_(self.mc.set("testkey_stats", "1"))
+    self.mc.delete("testkey_statsmiss")
+    before = self.stats()
+    self.assertEqual(self.mc.incr("testkey_stats", 2), 3)
+    # the bundled memcache.py can't parse NOT_FOUND, so go around it
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    sock.sendall("incr testkey_statsmiss 1\r\n")
+    self.assertEqual(sock.recv(64), "NOT_FOUND\r\n")
+    sock.close()
+    self.mc.delete("testkey_stats")
+    self.mc.delete("testkey_stats")
+    after = self.stats()
+    for name, delta in (("incr_hits", 1), ("incr_misses", 1), ("delete_hits", 1), ("delete_misses", 1)):
+      self.assertEqual(int(after[name]) - int(before[name]), delta)
+
+  def testHotcacheCas(self):
+    # gets and cas against readers filling the hot cache next to them, as
+    # with -y and -B mmap, where reads don't wait for a commit; a reader
+    # that cached the record from before a commit makes the cas fail for
+    # good
+    self.assert_(self.mc.set("testkey_hotcas", "0"))
+    done = []
+    def reader():
+      mc = memcache.Client(['127.0.0.1:21201'], debug=0)
+      while not done:
+        mc.get("testkey_hotcas")
+      mc.disconnect_all()
+    readers = [threading.Thread(target=reader) for i in range(6)]
+    for t in readers:
+      t.start()
+    try:
+      for i in range(1, 301):
+        self.assertEqual(self.mc.gets("testkey_hotcas"), str(i - 1))
+        self.assert_(self.mc.cas("testkey_hotcas", str(i)))
+    finally:
+      done.append(True)
+      for t in readers:
+        t.join()
+    self.assertEqual(self.mc.get("testkey_hotcas"), "300")
+
+  def testHotcache(self):
+    # checks the hits only when the server runs with -y
+    self.assert_(self.mc.set("testkey_hot", "testvalue1_hot"))
+    self.assertEqual(self.mc.get("testkey_hot"), "testvalue1_hot")
+    before = self.stats()
+    self.assertEqual(self.mc.get("testkey_hot"), "testvalue1_hot")
+    self.assertEqual(self.mc.get_multi(["testkey_hot"]), {"testkey_hot": "testvalue1_hot"})
+    after = self.stats()
+    if int(after["hotcache_limit_bytes"]) > 0:
+      self.assertEqual(int(after["hotcache_hits"]) - int(before["hotcache_hits"]), 2)
+    # writes and deletes drop the cached copy
+    self.assert_(self.mc.set("testkey_hot", "testvalue2_hot"))
+    self.assertEqual(self.mc.get("testkey_hot"), "testvalue2_hot")
+    self.assert_(self.mc.append("testkey_hot", "_more"))
+    self.assertEqual(self.mc.get("testkey_hot"), "testvalue2_hot_more")
+    self.mc.delete("testkey_hot")
+    self.assertEqual(self.mc.get("testkey_hot"), None)
+
+  def testBloomFilter(self):
+    # checks the counters only when the server runs with -F
+    after = self.stats()
+    for i in range(50):
+      if after["bloom_state"] in ("off", "ready"):
+        break
+      time.sleep(0.1)
+      after = self.stats()
+    before = after
+    missing = ["testkey_bloom_none%d" % i for i in range(10)]
+    for key in missing:
+      self.assertEqual(self.mc.get(key), None)
+    self.assertEqual(self.mc.get_multi(missing), {})
+    self.assert_(self.mc.add("testkey_bloom", "testvalue1_bloom"))
+    self.assertEqual(self.mc.get("testkey_bloom"), "testvalue1_bloom")
+    self.assertEqual(self.mc.get_multi(["testkey_bloom"] + missing), {"testkey_bloom": "testvalue1_bloom"})
+    self.mc.delete("testkey_bloom")
+    self.assertEqual(self.mc.get("testkey_bloom"), None)
+    self.assert_(self.mc.add("testkey_bloom", "testvalue2_bloom"))
+    self.assertEqual(self.mc.get("testkey_bloom"), "testvalue2_bloom")
+    after = self.stats()
+    if after["bloom_state"] == "ready":
+      looked = sum(int(after[n]) - int(before[n]) for n in ("bloom_negatives", "bloom_false_positives"))
+      self.assert_(looked >= 20)
+      self.assert_(int(after["bloom_negatives"]) > int(before["bloom_negatives"]))
+    self.mc.delete("testkey_bloom")
+
+  def testWriteBehindCounter(self):
+    # with -k the deltas add up in memory, reads and writes see them all the same
+    self.assert_(self.mc.set("testkey_wbcounter", "10"))
+    before = self.stats()
+    for i in range(100):
+      self.mc.incr("testkey_wbcounter", 2)
+    self.assertEqual(self.mc.decr("testkey_wbcounter", 5), 205)
+    self.assertEqual(self.mc.get("testkey_wbcounter"), "205")
+    self.assertEqual(self.mc.get_multi(["testkey_wbcounter"]), {"testkey_wbcounter": "205"})
+    self.assert_(self.mc.set("testkey_wbcounter", "1"))
+    self.assertEqual(self.mc.incr("testkey_wbcounter"), 2)
+    self.mc.delete("testkey_wbcounter")
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    sock.sendall("incr testkey_wbcounter 1\r\n")
+    self.assertEqual(sock.recv(64), "NOT_FOUND\r\n")
+    sock.close()
+    self.assertEqual(self.mc.get("testkey_wbcounter"), None)
+    after = self.stats()
+    if int(after["counter_interval"]) > 0:
+      self.assertEqual(int(after["counter_deltas"]) - int(before["counter_deltas"]), 102)
+
+  def testWarmStats(self):
+    # the keys of the last run are read back in the background, with -w
+    st = self.stats()
+    self.assert_(st["warm_state"] in ("off", "loading", "done"))
+    self.assert_(int(st["warm_loaded_keys"]) <= int(st["warm_load_keys"]))
+    if int(st["warm_keys"]) == 0:
+      self.assertEqual(st["warm_state"], "off")
+
+  def testCompression(self):
+    # checks the counters only when the server runs with -z
+    value = '{"id": 1, "name": "testvalue_compress", "tags": ["a", "b"]}' * 64
+    before = self.stats()
+    self.assert_(self.mc.set("testkey_compress", value))
+    self.assert_(self.mc.set("testkey_compress_raw", os.urandom(4096)))
+    self.assertEqual(self.mc.get("testkey_compress"), value)
+    self.assert_(self.mc.append("testkey_compress", "_more"))
+    self.assertEqual(self.mc.get("testkey_compress"), value + "_more")
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    sock.sendall("rget testkey_compress testkey_compress 0 0 1\r\n")
+    resp = ""
+    while not resp.endswith("END\r\n") and not resp.startswith("CLIENT_ERROR"):
+      resp += sock.recv(65536)
+    sock.close()
+    if resp != "CLIENT_ERROR rget needs a btree database\r\n":
+      self.assertEqual(resp, "VALUE testkey_compress 0 %d\r\n%s\r\nEND\r\n" % (len(value) + 5, value + "_more"))
+    after = self.stats()
+    if 0 < int(after["compress_min_bytes"]) <= 4096:
+      self.assertEqual(int(after["compressed_items"]) - int(before["compressed_items"]), 2)
+      self.assertEqual(int(after["compress_rejected"]) - int(before["compress_rejected"]), 1)
+      self.assert_(float(after["compress_ratio"]) > 1)
+    self.mc.delete("testkey_compress")
+    self.mc.delete("testkey_compress_raw")
+
+  def testStatsLatency(self):
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    sock.sendall("stats latency reset\r\n")
+    self.assertEqual(sock.recv(64), "RESET\r\n")
+    sock.close()
+    self.assert_(self.mc.set("testkey_latency", "testvalue_latency"))
+    self.assertEqual(self.mc.get("testkey_latency"), "testvalue_latency")
+    lat = self.mc.get_stats("latency")[0][1]
+    self.assertEqual(int(lat["set_storage_count"]), 1)
+    self.assertEqual(int(lat["get_storage_count"]), 1)
+    self.assert_(int(lat["get_storage_p50_us"]) <= int(lat["get_storage_max_us"]))
+
+  def testStatsSizes(self):
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    sock.sendall("stats sizes reset\r\n")
+    self.assertEqual(sock.recv(64), "RESET\r\n")
+    sock.close()
+    self.assert_(self.mc.set("testkey_sizes", "x" * 100))
+    self.assertEqual(self.mc.get("testkey_sizes"), "x" * 100)
+    self.assertEqual(self.mc.get("testkey_sizes"), "x" * 100)
+    sizes = self.mc.get_stats("sizes")[0][1]
+    self.assertEqual(int(sizes["stored_128"]), 1)
+    self.assertEqual(int(sizes["read_128"]), 2)
+    self.assert_("stored_64" not in sizes)
+
+  def testStatsHotkeys(self):
+    # checks the keys only when the server runs with -I
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    sock.sendall("stats hotkeys reset\r\n")
+    self.assertEqual(sock.recv(64), "RESET\r\n")
+    sock.close()
+    self.assert_(self.mc.set("testkey_hotkeys", "testvalue_hotkeys"))
+    for i in range(400):
+      self.mc.get("testkey_hotkeys")
+    hot = self.mc.get_stats("hotkeys")[0][1]
+    self.assertEqual(int(hot["hotkeys_sample"]), 16)
+    if int(hot["hotkeys_tracked"]) > 0:
+      self.assert_(int(hot["hotkeys_samples"]) > 0)
+      self.assert_(hot["testkey_hotkeys"].startswith("ops "))
+    else:
+      self.assertEqual(int(hot["hotkeys_samples"]), 0)
+
+  def testStatsPartitions(self):
+    def totals():
+      st = self.mc.get_stats("partitions")[0][1]
+      return [sum(int(v) for k, v in st.items() if k.endswith(c)) for c in ("_reads", "_writes")]
+    before = totals()
+    self.assert_(self.mc.set("testkey_part", "testvalue_part"))
+    self.assertEqual(self.mc.get("testkey_part"), "testvalue_part")
+    self.assertEqual([a - b for a, b in zip(totals(), before)], [1, 1])
+
   def testAddCmd(self):
     self.mc.delete("testkey_add")
     self.assert_(self.mc.add("testkey_add", "testvalue_add"))
@@ -72,12 +431,93 @@ class MemcacheDBTestCase(unittest.TestCase):
   def testDbCheckpointCmd(self):
 		self.assert_(self.mc.db_checkpoint())
 		
+  def jobStatus(self, sock):
+    sock.sendall("bdb_job status\r\n")
+    buf = ""
+    while not buf.endswith("END\r\n"):
+      buf += sock.recv(4096)
+    return dict(l.split(" ")[1:] for l in buf.split("\r\n") if l.startswith("STAT "))
+
+  def jobsDone(self, sock):
+    # the status once the job thread is idle, db_archive and db_checkpoint
+    # don't wait for theirs
+    for i in range(50):
+      st = self.jobStatus(sock)
+      if st["job_running"] == "none" and st["job_queued"] == "0":
+        break
+      time.sleep(0.1)
+    return st
+
+  def testDbCompactJob(self):
+    for i in range(200):
+      self.assert_(self.mc.set("testkey%03d_compact" % i, "x" * 100))
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    done = int(self.jobsDone(sock)["job_done"])
+    sock.sendall("db_compact\r\n")
+    self.assertEqual(sock.recv(64), "OK\r\n")
+    st = self.jobsDone(sock)
+    self.assertEqual(int(st["job_done"]), done + 1)
+    self.assert_(int(st["compact_pages_examined"]) > 0)
+    sock.sendall("bdb_job cancel\r\n")
+    self.assertEqual(sock.recv(64), "NOT_FOUND\r\n")
+    sock.close()
+
+  def testDbBackupJob(self):
+    self.assert_(self.mc.set("testkey_backup", "testvalue_backup"))
+    target = tempfile.mkdtemp(prefix="mdbtest_backup")
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    done = int(self.jobsDone(sock)["job_done"])
+    sock.sendall("db_backup %s\r\n" % target)
+    self.assertEqual(sock.recv(64), "OK\r\n")
+    st = self.jobsDone(sock)
+    self.assertEqual(int(st["job_done"]), done + 1)
+    self.assert_([f for _, _, files in os.walk(target) for f in files if f.startswith("data.db")])
+    self.assert_(int(st["backup_bytes"]) > 0)
+    sock.sendall("db_backup backups\r\n")
+    self.assertEqual(sock.recv(64), "CLIENT_ERROR bad command line format\r\n")
+    sock.close()
+    shutil.rmtree(target)
+
+  def testBulkLoadJob(self):
+    fd, path = tempfile.mkstemp(prefix="mdbtest_load")
+    for i in range(2000):
+      os.write(fd, "testkey_load%05d 0 0 12\r\ntestvalue_%02d\r\n" % (i, i % 100))
+    os.close(fd)
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    done = int(self.jobsDone(sock)["job_done"])
+    sock.sendall("bulk_load %s\r\n" % path)
+    self.assertEqual(sock.recv(64), "OK\r\n")
+    st = self.jobsDone(sock)
+    self.assertEqual(int(st["job_done"]), done + 1)
+    self.assertEqual(int(st["load_records"]), 2000)
+    self.assertEqual(self.mc.get("testkey_load01234"), "testvalue_34")
+    sock.sendall("bulk_load loads\r\n")
+    self.assertEqual(sock.recv(64), "CLIENT_ERROR bad command line format\r\n")
+    sock.close()
+    os.unlink(path)
+
+  def testDbConvertCmd(self):
+    self.assert_(self.mc.set("testkey_convert", "testvalue_convert"))
+    self.assert_(self.mc.db_convert())
+    self.assertEqual(self.mc.get("testkey_convert"), "testvalue_convert")
+
   def testRepSetPriorityCmd(self):
 		self.assert_(self.mc.rep_set_priority(200))
 		
   def testRepSetAckPolicy(self):
 		self.assert_(self.mc.rep_set_ack_policy(5))
 		
+  def testRepLsnToken(self):
+    # on the master, the token of a write it has taken checks out at once
+    self.assert_(self.mc.set("testkey_replsn", "testvalue_replsn"))
+    sock = socket.create_connection(("127.0.0.1", 21201))
+    sock.sendall("rep_lsn\r\n")
+    lsn = sock.recv(64)
+    self.assert_(lsn.startswith("LSN "))
+    sock.sendall("rep_check_lsn %s\r\n" % lsn.split()[1])
+    self.assertEqual(sock.recv(64), "OK\r\n")
+    sock.close()
+
 if __name__ == '__main__':
   suite = unittest.TestLoader().loadTestsFromTestCase(MemcacheDBTestCase)
   unittest.TextTestRunner(verbosity=2).run(suite)
\ No newline at end of file
@@ -21,7 +21,9 @@ Usage summary
 
 Command::
 
-  python mdbtop.py <config file>
+  python mdbtop.py <config file>          # overview
+  python mdbtop.py <config file> rep      # replication
+  python mdbtop.py <config file> latency  # latency since the last round
 
 Monitor config file example::
 
@@ -94,6 +96,7 @@ class Monitor:
         if stats_bdb != {}:
           print "[BDB] cache_size: %sMB    txn_lg_bsize: %sKB    txn_nosync: %s" % (int(stats_bdb['cache_size'])/(1024*1024), int(stats_bdb['txn_lg_bsize'])/1024, stats_bdb['txn_nosync'])
           print "      dldetect_val: %sms    chkpoint_val: %ss" % (int(stats_bdb['dldetect_val'])/1000, stats_bdb['chkpoint_val'])
+          print "      chkpoints: %s    last_chkpoint: %sms, %sKB    dirty: %s%%" % (stats_bdb['chkpoint_count'].strip(), int(stats_bdb['chkpoint_last_usec'])/1000, int(stats_bdb['chkpoint_last_bytes'])/1024, stats_bdb['dirty_percent'].strip())
 
         if stats_rep != {}:
           print "[REP] localhp:%s    priority: %s    bulk: %s" % (stats_rep['rep_localhp'], stats_rep['rep_priority'], stats_rep['rep_bulk'])
@@ -142,6 +145,43 @@ class Monitor:
       else:
         time.sleep(self.interval)
 
+  def top_latency(self):
+    print 
+    print 'mdbtop.py %s, %s' % (__version__, __author__)
+    print 
+    while True:
+      for mdb_client in self.mdb_clients:
+        data = mdb_client.get_stats('latency')
+        self.reset_latency(mdb_client)
+        if data == []:
+          continue
+        localhp, stats_lat = data[0]
+        print "=============================================================================="
+        print "[LAT] localhp: %s    (microseconds)" % localhp
+        print "%-8s %-8s %9s %8s %8s %8s %8s %8s" % ('cmd', 'phase', 'count', 'avg', 'p50', 'p99', 'p999', 'max')
+        for cmd in ('get', 'set', 'delete', 'incr', 'rget'):
+          for phase in ('lock', 'storage', 'send'):
+            prefix = "%s_%s_" % (cmd, phase)
+            if not stats_lat.has_key(prefix + 'count'):
+              continue
+            print "%-8s %-8s %9s %8s %8s %8s %8s %8s" % (cmd, phase,
+                  stats_lat[prefix + 'count'].strip(), stats_lat[prefix + 'avg_us'].strip(),
+                  stats_lat[prefix + 'p50_us'].strip(), stats_lat[prefix + 'p99_us'].strip(),
+                  stats_lat[prefix + 'p999_us'].strip(), stats_lat[prefix + 'max_us'].strip())
+        print
+
+      if self.interval == 0:
+        break
+      else:
+        time.sleep(self.interval)
+
+  def reset_latency(self, mdb_client):
+    # answered by RESET rather than STAT lines, so get_stats() won't do
+    for s in mdb_client.servers:
+      if s.connect():
+        s.send_cmd('stats latency reset')
+        s.readline()
+
   def close(self):
     for mdb_client in self.mdb_clients:
       mdb_client.disconnect_all()
@@ -159,6 +199,8 @@ if __name__ == "__main__":
     mon.top()
   elif len(sys.argv) == 3 and sys.argv[2] == 'rep':
     mon.top_rep()
+  elif len(sys.argv) == 3 and sys.argv[2] == 'latency':
+    mon.top_latency()
   else:
     print '\nUsage:'
     print 'python mdbtop.py <config file> <option>'
@@ -163,6 +163,7 @@ class Client(local):
         self.set_servers(servers)
         self.debug = debug
         self.stats = {}
+        self.cas_ids = {}
 
         # Allow users to modify pickling/unpickling behavior
         self.pickleProtocol = pickleProtocol
@@ -227,6 +228,13 @@ class Client(local):
             s.send_cmd('db_checkpoint')
             return(s.expect("OK") == "OK")
 
+    def db_convert(self):
+        'rewrite old records in the current format, in the background'
+        for s in self.servers:
+            if not s.connect(): continue
+            s.send_cmd('db_convert')
+            return(s.expect("OK") == "OK")
+
     def rep_set_priority(self, priority):
         'set priority of a replication site'
         for s in self.servers:
@@ -241,6 +249,25 @@ class Client(local):
             s.send_cmd('rep_set_ack_policy %d' % ack_policy)
             return(s.expect("OK") == "OK")
 
+    def rget(self, start, end, left_open=0, right_open=0, max=100):
+        'get up to max (key, value) pairs with keys between start and end, in key order'
+        items = []
+        for s in self.servers:
+            if not s.connect(): continue
+            try:
+                s.send_cmd('rget %s %s %d %d %d' % (start, end, left_open, right_open, max))
+                line = s.readline()
+                while line and line != 'END':
+                    rkey, flags, rlen = self._expectvalue(s, line)
+                    if rkey is None: break
+                    items.append((rkey, self._recv_value(s, flags, rlen)))
+                    line = s.readline()
+            except (_Error, socket.error), msg:
+                if type(msg) is types.TupleType: msg = msg[1]
+                s.mark_dead(msg)
+            return items
+        return items
+
 # patched by steve for memcachedb -- end
  
     def flush_all(self):
@@ -507,6 +534,18 @@ class Client(local):
         '''
         return self._set("set", key, val, time, min_compress_len)
 
+    def cas(self, key, val, time=0, min_compress_len=0):
+        '''Sets a key to a given value in the memcache if it hasn't been
+        altered since last fetched with L{gets}. Without an earlier
+        L{gets} of the key this is just a L{set}.
+
+        @return: Nonzero on success.
+        @rtype: int
+        '''
+        if key not in self.cas_ids:
+            return self._set("set", key, val, time, min_compress_len)
+        return self._set("cas", key, val, time, min_compress_len, self.cas_ids[key])
+
 
     def _map_and_prefix_keys(self, key_iterable, key_prefix):
         """Compute the mapping of server (_Host instance) -> list of keys to stuff onto that server, as well as the mapping of
@@ -670,7 +709,7 @@ class Client(local):
 
         return (flags, len(val), val)
 
-    def _set(self, cmd, key, val, time, min_compress_len = 0):
+    def _set(self, cmd, key, val, time, min_compress_len = 0, cas_id = None):
         check_key(key)
         server, key = self._get_server(key)
         if not server:
@@ -681,7 +720,10 @@ class Client(local):
         store_info = self._val_to_store_info(val, min_compress_len)
         if not store_info: return(0)
 
-        fullcmd = "%s %s %d %d %d\r\n%s" % (cmd, key, store_info[0], time, store_info[1], store_info[2])
+        if cas_id is None:
+            fullcmd = "%s %s %d %d %d\r\n%s" % (cmd, key, store_info[0], time, store_info[1], store_info[2])
+        else:
+            fullcmd = "%s %s %d %d %d %d\r\n%s" % (cmd, key, store_info[0], time, store_info[1], cas_id, store_info[2])
         try:
             server.send_cmd(fullcmd)
             return(server.expect("STORED") == "STORED")
@@ -715,6 +757,34 @@ class Client(local):
             return None
         return value
 
+    def gets(self, key):
+        '''Retrieves a key from the memcache, remembering its cas for a
+        later L{cas}.
+
+        @return: The value or None.
+        '''
+        check_key(key)
+        server, key = self._get_server(key)
+        if not server:
+            return None
+
+        self._statlog('gets')
+
+        try:
+            server.send_cmd("gets %s" % key)
+            rkey, flags, rlen, cas_id = self._expectvalue(server, get_cas=True)
+            if not rkey:
+                self.cas_ids.pop(key, None)
+                return None
+            value = self._recv_value(server, flags, rlen)
+            server.expect("END")
+        except (_Error, socket.error), msg:
+            if type(msg) is types.TupleType: msg = msg[1]
+            server.mark_dead(msg)
+            return None
+        self.cas_ids[key] = cas_id
+        return value
+
     def get_multi(self, keys, key_prefix=''):
         '''
         Retrieves multiple keys from the memcache doing just one query.
@@ -787,15 +857,20 @@ class Client(local):
                 server.mark_dead(msg)
         return retvals
 
-    def _expectvalue(self, server, line=None):
+    def _expectvalue(self, server, line=None, get_cas=False):
         if not line:
             line = server.readline()
 
         if line[:5] == 'VALUE':
+            if get_cas:
+                resp, rkey, flags, len, cas_id = line.split()
+                return (rkey, int(flags), int(len), int(cas_id))
             resp, rkey, flags, len = line.split()
             flags = int(flags)
             rlen = int(len)
             return (rkey, flags, rlen)
+        elif get_cas:
+            return (None, None, None, None)
         else:
             return (None, None, None)
 
@@ -0,0 +1,321 @@
+/*
+ *  MemcacheDB - A distributed key-value storage system designed for persistent:
+ *
+ *      http://memcachedb.googlecode.com
+ *
+ *  Copyright 2008 Steve Chu.  All rights reserved.
+ *
+ *  Use and distribution licensed under the BSD license.  See
+ *  the LICENSE file for full text.
+ *
+ *  Authors:
+ *      Steve Chu <stvchu@gmail.com>
+ *
+ */
+
+#include "memcachedb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Warm restart. Berkeley DB can't tell which pages its cache holds, so we
+ * remember what brought them there: a sample of the keys read from the
+ * database, one in WARM_SAMPLE, each in one of settings.warm_keys slots
+ * by key hash, the latest key to land in a slot replacing the one before.
+ * Keys read often are the likely ones to be found there. The slots are
+ * written to WARM_FILE in the env home every WARM_SAVE_INTERVAL seconds
+ * and at shutdown.
+ *
+ * After a restart a thread reads the keys of the file back while the
+ * server already answers requests, sorted by partition and key and
+ * through one cursor per partition, so that a btree is read from one end
+ * to the other and the bdb engine's bulk reads pick up the neighbours of
+ * each key on the way.
+ */
+
+#define WARM_FILE "mdb_warm.keys"
+
+#define WARM_MAGIC "mdbwarm 1\n"
+
+#define WARM_SAMPLE 16
+
+#define WARM_LOCKS 64
+
+#define WARM_SAVE_INTERVAL 60
+
+/* keys read back through a cursor before its snapshot is let go */
+#define WARM_BATCH 1000
+
+/* the bulk buffer of a cursor reading keys back, in database pages */
+#define WARM_BULK_PAGES 16
+
+typedef struct {
+    uint8_t nkey;
+    char key[KEY_MAX_LENGTH];
+} warm_slot;
+
+static warm_slot *slots = NULL;
+static pthread_mutex_t locks[WARM_LOCKS];
+static unsigned int ticks;      /* racy, it only picks the reads to sample */
+
+/* one save at a time, the periodic one or the one at shutdown */
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t warm_ptid;
+
+static struct warm_stats {
+    volatile int loading;       /* the keys of the file are being read back */
+    uint64_t total;             /* keys in the file at startup */
+    uint64_t loaded;            /* read back so far */
+    uint64_t saved;             /* keys in the last save */
+    time_t last_save;
+} warm_stats;
+
+void warm_init(void) {
+    int i;
+
+    if (settings.warm_keys == 0)
+        return;
+    slots = calloc(settings.warm_keys, sizeof(warm_slot));
+    if (slots == NULL) {
+        fprintf(stderr, "Failed to allocate the warm key slots\n");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < WARM_LOCKS; i++)
+        pthread_mutex_init(&locks[i], NULL);
+}
+
+static void warm_put(const char *key, const size_t nkey) {
+    uint32_t i = hash(key, nkey, 0x2545f491) % settings.warm_keys;
+    pthread_mutex_t *lock = &locks[i % WARM_LOCKS];
+
+    pthread_mutex_lock(lock);
+    slots[i].nkey = nkey;
+    memcpy(slots[i].key, key, nkey);
+    pthread_mutex_unlock(lock);
+}
+
+/* called for each key read from the database, keeps one in WARM_SAMPLE */
+void warm_touch(const char *key, const size_t nkey) {
+    if (slots == NULL || nkey == 0 || nkey > KEY_MAX_LENGTH)
+        return;
+    if (ticks++ % WARM_SAMPLE != 0)
+        return;
+    warm_put(key, nkey);
+}
+
+/*
+ * Writes the keys in the slots to WARM_FILE, through a new file renamed
+ * over it so that a crash leaves the last one whole.
+ */
+void warm_save(void) {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    warm_slot s;
+    uint64_t n = 0;
+    FILE *fp;
+    int fd, i, err = 0;
+
+    if (slots == NULL)
+        return;
+
+    pthread_mutex_lock(&save_lock);
+    snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, WARM_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0640)) == -1
+        || (fp = fdopen(fd, "w")) == NULL) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "warm save: %s: %s\n", tmp, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        pthread_mutex_unlock(&save_lock);
+        return;
+    }
+    fputs(WARM_MAGIC, fp);
+    for (i = 0; i < settings.warm_keys; i++) {
+        pthread_mutex_lock(&locks[i % WARM_LOCKS]);
+        memcpy(&s, &slots[i], sizeof(s));
+        pthread_mutex_unlock(&locks[i % WARM_LOCKS]);
+        if (s.nkey == 0)
+            continue;
+        fputc(s.nkey, fp);
+        fwrite(s.key, 1, s.nkey, fp);
+        n++;
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        err = errno;
+    if (fclose(fp) != 0 && err == 0)
+        err = errno;
+    if (err == 0 && rename(tmp, path) != 0)
+        err = errno;
+    if (err != 0) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "warm save: %s: %s\n", path, strerror(err));
+        unlink(tmp);
+    } else {
+        warm_stats.saved = n;
+        warm_stats.last_save = time(NULL);
+    }
+    pthread_mutex_unlock(&save_lock);
+}
+
+/* a key of the file, and the partition it lives in */
+typedef struct {
+    int part;
+    uint8_t nkey;
+    char *key;
+} warm_key;
+
+static int warm_key_cmp(const void *a, const void *b) {
+    const warm_key *ka = (const warm_key *)a;
+    const warm_key *kb = (const warm_key *)b;
+
+    if (ka->part != kb->part)
+        return ka->part < kb->part ? -1 : 1;
+    return item_key_cmp(ka->key, ka->nkey, kb->key, kb->nkey);
+}
+
+/*
+ * Reads WARM_FILE into *keys, pointing into *buf, both freed by the
+ * caller. Returns the number of keys, 0 if there is no file or it is not
+ * one of ours.
+ */
+static int warm_read(warm_key **keys, char **buf) {
+    char path[PATH_MAX];
+    char magic[sizeof(WARM_MAGIC)];
+    FILE *fp;
+    long size;
+    char *p, *end;
+    int n = 0;
+
+    *keys = NULL;
+    *buf = NULL;
+    snprintf(path, sizeof(path), "%s/%s", bdb_settings.env_home, WARM_FILE);
+    if ((fp = fopen(path, "r")) == NULL)
+        return 0;
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < (long)strlen(WARM_MAGIC)
+        || fseek(fp, 0, SEEK_SET) != 0
+        || fread(magic, 1, strlen(WARM_MAGIC), fp) != strlen(WARM_MAGIC)
+        || memcmp(magic, WARM_MAGIC, strlen(WARM_MAGIC)) != 0) {
+        fclose(fp);
+        return 0;
+    }
+    size -= strlen(WARM_MAGIC);
+    /* no more keys than one for every two bytes */
+    if ((*buf = malloc(size + 1)) == NULL
+        || (*keys = malloc(sizeof(warm_key) * (size / 2 + 1))) == NULL
+        || fread(*buf, 1, size, fp) != (size_t)size) {
+        fclose(fp);
+        free(*buf);
+        free(*keys);
+        *buf = NULL;
+        *keys = NULL;
+        return 0;
+    }
+    fclose(fp);
+
+    for (p = *buf, end = *buf + size; p < end && p + 1 + (uint8_t)*p <= end; p += 1 + (*keys)[n++].nkey) {
+        (*keys)[n].nkey = (uint8_t)*p;
+        (*keys)[n].key = p + 1;
+        (*keys)[n].part = db_part_index(p + 1, (uint8_t)*p);
+        if ((*keys)[n].nkey == 0 || (*keys)[n].nkey > KEY_MAX_LENGTH)
+            break;
+    }
+    return n;
+}
+
+/* reads back the keys of one partition, keys[0..n) */
+static void warm_load_part(const warm_key *keys, const int n) {
+    engine_cursor *cursor = NULL;
+    const void *rkey, *rdata;
+    u_int32_t rklen, rdlen;
+    int i, ret, move = bdb_settings.db_type == DB_BTREE ? ENGINE_SET_RANGE : ENGINE_SET;
+
+    for (i = 0; i < n && !daemon_quit; i++) {
+        if (cursor == NULL && (ret = engine->cursor(keys[i].part, NULL,
+                                                    bdb_settings.page_size * WARM_BULK_PAGES, &cursor)) != 0) {
+            engine_err(ret, "warm load");
+            return;
+        }
+        ret = engine->c_get(cursor, move, keys[i].key, keys[i].nkey, &rkey, &rklen, &rdata, &rdlen);
+        if (ret != 0 && ret != DB_NOTFOUND) {
+            engine_err(ret, "warm load");
+            break;
+        }
+        warm_put(keys[i].key, keys[i].nkey);
+        warm_stats.loaded++;
+        if ((i + 1) % WARM_BATCH == 0) {
+            engine->c_close(cursor);
+            cursor = NULL;
+        }
+    }
+    if (cursor != NULL)
+        engine->c_close(cursor);
+}
+
+static void *warm_thread(void *arg) {
+    warm_key *keys;
+    char *buf;
+    uint64_t started = latency_now();
+    int i, first, n;
+    time_t last;
+
+    if ((n = warm_read(&keys, &buf)) > 0) {
+        warm_stats.total = n;
+        qsort(keys, n, sizeof(warm_key), warm_key_cmp);
+        for (first = 0; first < n && !daemon_quit; first = i) {
+            for (i = first + 1; i < n && keys[i].part == keys[first].part; i++)
+                ;
+            warm_load_part(keys + first, i - first);
+        }
+        if (settings.verbose > 0)
+            fprintf(stderr, "warm load: %llu of %d keys read back in %llu ms\n",
+                    (unsigned long long)warm_stats.loaded, n,
+                    (unsigned long long)(latency_now() - started) / 1000);
+    }
+    free(keys);
+    free(buf);
+    warm_stats.loading = 0;
+
+    for (last = time(NULL); !daemon_quit; sleep(1)) {
+        if (time(NULL) - last >= WARM_SAVE_INTERVAL) {
+            warm_save();
+            last = time(NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Called once the databases are open: reads back the keys of the last
+ * run and then saves them every WARM_SAVE_INTERVAL, and once more at exit.
+ */
+void start_warm_thread(void) {
+    if (slots == NULL)
+        return;
+    warm_stats.loading = 1;
+    if ((errno = pthread_create(&warm_ptid, NULL, warm_thread, NULL)) != 0) {
+        fprintf(stderr, "failed spawning warm thread: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (0 != atexit(warm_save)) {
+        fprintf(stderr, "can not register the warm save");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* the state of the warm restart, for stats */
+const char *warm_state(uint64_t *total, uint64_t *loaded, uint64_t *saved, time_t *last_save) {
+    *total = warm_stats.total;
+    *loaded = warm_stats.loaded;
+    *saved = warm_stats.saved;
+    *last_save = warm_stats.last_save;
+    if (slots == NULL)
+        return "off";
+    return warm_stats.loading ? "loading" : "done";
+}